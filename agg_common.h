@@ -0,0 +1,282 @@
+#ifndef AGG_COMMON_H
+#define AGG_COMMON_H
+//
+// Latency aggregation keyed by container or path, one shard per thread
+//
+// Every worker thread owns an agg_shard: a fixed open-addressing table of
+// entries, each with its own counters and histograms (hist_common.h). Only
+// the owner inserts into or updates its shard, so the hot path never
+// writes a cache line another thread writes. Readers (metrics, control,
+// exit) merge all shards by key into an agg_view when they need numbers.
+//
+// Entries are never removed, so a key that comes back (a restarted
+// container, a re-added path) keeps its history. They come from a pool
+// (pool_common.h) of AGG_TABLE_SIZE set up with the shard, so a new key
+// never calls malloc on the hot path.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist_common.h"
+#include "pool_common.h"
+
+#define AGG_TABLE_SIZE 1024 // Must be a power of two, max keys per shard
+#define AGG_NAME_SIZE 64
+
+enum agg_direction {
+  AGG_OUT,
+  AGG_IN
+};
+
+struct agg_entry {
+  uint64_t key;
+  char name[AGG_NAME_SIZE];
+  uint64_t samples[2];
+  uint64_t discarded[2];
+  uint64_t expired[2]; // started but never finished within the timeout (wheel_common.h)
+  struct hist latency[2];
+};
+
+struct agg_shard {
+  struct agg_entry *slots[AGG_TABLE_SIZE];
+  uint64_t nkeys;
+  uint64_t overflow; // samples whose key did not fit
+  struct pool entries; // owner only
+} __attribute__((aligned(64)));
+
+// Merged copy of every shard, private to the reader
+struct agg_view {
+  int nentries;
+  struct agg_entry *entries;
+};
+
+// Key for a string name (FNV-1a)
+static inline uint64_t agg_key_str(const char *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static inline unsigned int agg_slot(uint64_t key)
+{
+  return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 40) & (AGG_TABLE_SIZE - 1);
+}
+
+static inline struct agg_shard *agg_shard_new(void)
+{
+  struct agg_shard *s;
+
+  if (posix_memalign((void **)&s, 64, sizeof(struct agg_shard))) {
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  if (pool_init(&s->entries, sizeof(struct agg_entry), AGG_TABLE_SIZE)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+static inline void agg_shard_free(struct agg_shard *s)
+{
+  pool_destroy(&s->entries);
+  free(s);
+}
+
+// Owner thread: find the entry for key, creating it as name if needed
+// Returns NULL (and counts the overflow) if the shard is full
+static inline struct agg_entry *agg_get(struct agg_shard *s, uint64_t key, const char *name)
+{
+  struct agg_entry *e;
+  unsigned int i = agg_slot(key);
+  unsigned int n;
+
+  for (n = 0; n < AGG_TABLE_SIZE; n++, i = (i + 1) & (AGG_TABLE_SIZE - 1)) {
+    e = s->slots[i];
+    if (e == NULL) {
+      e = (struct agg_entry *)pool_get(&s->entries);
+      if (e == NULL) {
+        break;
+      }
+      e->key = key;
+      for (n = 0; n < AGG_NAME_SIZE - 1 && name[n]; n++) {
+        e->name[n] = name[n];
+      }
+      // Publish only once filled in, readers may be walking the table
+      __atomic_store_n(&s->slots[i], e, __ATOMIC_RELEASE);
+      stat_add(&s->nkeys, 1);
+      return e;
+    }
+    if (e->key == key) {
+      return e;
+    }
+  }
+  stat_add(&s->overflow, 1);
+  return NULL;
+}
+
+// Owner thread: find the entry for key without creating it
+static inline struct agg_entry *agg_find(struct agg_shard *s, uint64_t key)
+{
+  struct agg_entry *e;
+  unsigned int i = agg_slot(key);
+  unsigned int n;
+
+  for (n = 0; n < AGG_TABLE_SIZE; n++, i = (i + 1) & (AGG_TABLE_SIZE - 1)) {
+    e = s->slots[i];
+    if (e == NULL || e->key == key) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// A sample kept 1 in weight (sample_common.h) counts once in samples and
+// weight times in the histogram, so its quantiles and count estimate all packets
+static inline void agg_add_n(struct agg_entry *e, int dir, uint64_t ns, uint64_t weight)
+{
+  stat_add(&e->samples[dir], 1);
+  hist_add_n(&e->latency[dir], ns, weight);
+}
+
+static inline void agg_add(struct agg_entry *e, int dir, uint64_t ns)
+{
+  agg_add_n(e, dir, ns, 1);
+}
+
+// Owner only: count samples already binned into a private histogram,
+// e.g. the latencies added to a kernel histogram since it was last read
+static inline void agg_add_hist(struct agg_entry *e, int dir, const struct hist *h)
+{
+  struct hist *into = &e->latency[dir];
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (h->counts[i]) {
+      stat_add(&into->counts[i], h->counts[i]);
+    }
+  }
+  stat_add(&into->count, h->count);
+  stat_add(&into->sum, h->sum);
+  if (h->max > stat_read(&into->max)) {
+    __atomic_store_n(&into->max, h->max, __ATOMIC_RELAXED);
+  }
+  stat_add(&e->samples[dir], h->count);
+}
+
+static inline void agg_discard_n(struct agg_entry *e, int dir, uint64_t n)
+{
+  stat_add(&e->discarded[dir], n);
+}
+
+static inline void agg_discard(struct agg_entry *e, int dir)
+{
+  agg_discard_n(e, dir, 1);
+}
+
+static inline void agg_expire(struct agg_entry *e, int dir)
+{
+  stat_add(&e->expired[dir], 1);
+}
+
+// Reader: snapshot and merge all shards by key
+// Returns 0 on success, nonzero if out of memory
+static inline int agg_view_build(struct agg_view *v, struct agg_shard *const *shards, int nshards)
+{
+  struct agg_entry *e;
+  struct agg_entry *m;
+  struct agg_entry *snap;
+  int *index;
+  uint64_t cap = 0;
+  unsigned int i;
+  unsigned int j;
+  int s;
+  int d;
+
+  for (s = 0; s < nshards; s++) {
+    cap += stat_read(&shards[s]->nkeys);
+  }
+  if (cap > AGG_TABLE_SIZE) {
+    cap = AGG_TABLE_SIZE;
+  }
+
+  v->nentries = 0;
+  v->entries = (struct agg_entry *)calloc(cap ? cap : 1, sizeof(struct agg_entry));
+  index = (int *)calloc(2 * AGG_TABLE_SIZE, sizeof(int));
+  snap = (struct agg_entry *)malloc(sizeof(struct agg_entry));
+  if (v->entries == NULL || index == NULL || snap == NULL) {
+    free(v->entries);
+    free(index);
+    free(snap);
+    v->entries = NULL;
+    return -1;
+  }
+
+  for (s = 0; s < nshards; s++) {
+    for (i = 0; i < AGG_TABLE_SIZE; i++) {
+      e = __atomic_load_n(&shards[s]->slots[i], __ATOMIC_ACQUIRE);
+      if (e == NULL) {
+        continue;
+      }
+      // Find or add the merged entry for this key
+      j = agg_slot(e->key) & (2 * AGG_TABLE_SIZE - 1);
+      while (index[j] && v->entries[index[j] - 1].key != e->key) {
+        j = (j + 1) & (2 * AGG_TABLE_SIZE - 1);
+      }
+      if (index[j]) {
+        m = &v->entries[index[j] - 1];
+      } else {
+        if ((uint64_t)v->nentries == cap) {
+          continue;
+        }
+        m = &v->entries[v->nentries++];
+        index[j] = v->nentries;
+        m->key = e->key;
+        memcpy(m->name, e->name, AGG_NAME_SIZE);
+      }
+      for (d = 0; d < 2; d++) {
+        m->samples[d] += stat_read(&e->samples[d]);
+        m->discarded[d] += stat_read(&e->discarded[d]);
+        m->expired[d] += stat_read(&e->expired[d]);
+        hist_snapshot(&e->latency[d], &snap->latency[d]);
+        hist_merge(&m->latency[d], &snap->latency[d]);
+      }
+    }
+  }
+
+  free(index);
+  free(snap);
+  return 0;
+}
+
+// Sum of every entry in a view, e.g. for overall totals
+static inline void agg_view_total(const struct agg_view *v, struct agg_entry *total)
+{
+  int i;
+  int d;
+
+  memset(total, 0, sizeof(*total));
+  for (i = 0; i < v->nentries; i++) {
+    for (d = 0; d < 2; d++) {
+      total->samples[d] += v->entries[i].samples[d];
+      total->discarded[d] += v->entries[i].discarded[d];
+      total->expired[d] += v->entries[i].expired[d];
+      hist_merge(&total->latency[d], &v->entries[i].latency[d]);
+    }
+  }
+}
+
+static inline void agg_view_free(struct agg_view *v)
+{
+  free(v->entries);
+  v->entries = NULL;
+  v->nentries = 0;
+}
+
+#endif
@@ -0,0 +1,435 @@
+//
+// Microbenchmarks for the libpcap and syscall-trace tools
+//
+// Usage: bench [-n events] [-c concurrency] [-p paths] [-r rounds] [-f text|csv] [-Z] [name...]
+//
+// Covers the parsers (parse_trace_event, parse_packet_event,
+// get_packet_event reading a pcap file and the batch decoder behind them),
+// iface_diff's matchers (pcap_callback one packet at a time, echo_batch as
+// live captures feed it, flow_pcap_callback and the structures behind
+// them) and
+// the event-time join of the root latency tool, all fed by the synthetic
+// generator in bench_common.c. Names given after the options select
+// benchmarks by substring.
+//
+// Single-threaded on purpose: the numbers are per-core costs to compare
+// across changes, not throughput of a whole capture.
+//
+
+#include "bench_common.c"
+
+// Pull in iface_diff's callbacks and tables without its main()
+#define main iface_diff_main
+#include "iface_diff.c"
+#undef main
+
+#include "ftrace_common.c"
+#include "join_common.c"
+
+// Split a generated trace into NUL-terminated lines in place
+// Returns the number of lines, their starts in *lines (malloc'd)
+uint64_t split_lines(char *buf, char ***lines)
+{
+  uint64_t n = 0;
+  uint64_t i;
+  char *p;
+
+  for (p = buf; *p; p++) {
+    n += *p == '\n';
+  }
+  *lines = (char **)malloc(sizeof(char *) * (n ? n : 1));
+  if (*lines == NULL) {
+    return 0;
+  }
+  for (i = 0, p = buf; i < n; i++) {
+    (*lines)[i] = p;
+    p = strchr(p, '\n');
+    *p++ = '\0';
+  }
+  return n;
+}
+
+// Convert generated frames to what libpcap hands the callbacks
+void frame_headers(const struct bench_frame *frames, struct pcap_pkthdr *hdrs, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    hdrs[i].ts.tv_sec = frames[i].ts.tv_sec;
+    hdrs[i].ts.tv_usec = frames[i].ts.tv_nsec / 1000;
+    hdrs[i].caplen = frames[i].len;
+    hdrs[i].len = frames[i].len;
+  }
+}
+
+// Save frames as a microsecond pcap file for get_packet_event
+// Returns 0 on success, nonzero on error
+int write_pcap_file(const char *path, const struct pcap_pkthdr *hdrs,
+                    const struct bench_frame *frames, int n)
+{
+  struct {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+  } file_hdr = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, DLT_EN10MB };
+  struct {
+    uint32_t sec;
+    uint32_t usec;
+    uint32_t caplen;
+    uint32_t len;
+  } rec_hdr;
+  FILE *fp;
+  int i;
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  fwrite(&file_hdr, sizeof(file_hdr), 1, fp);
+  for (i = 0; i < n; i++) {
+    rec_hdr.sec = hdrs[i].ts.tv_sec;
+    rec_hdr.usec = hdrs[i].ts.tv_usec;
+    rec_hdr.caplen = hdrs[i].caplen;
+    rec_hdr.len = hdrs[i].len;
+    fwrite(&rec_hdr, sizeof(rec_hdr), 1, fp);
+    fwrite(frames[i].data, frames[i].len, 1, fp);
+  }
+  return fclose(fp);
+}
+
+// Empty the matching tables for a new round
+void reset_shard(struct shard *shard, int flow)
+{
+  if (flow) {
+    flow_table_init(&shard->flow_table, 0);
+  } else {
+    echo_event_table_init(shard);
+  }
+  shard->echo_finished = 0;
+}
+
+// Set up both captures of one path the way iface_diff's main does
+void setup_caps(struct dev_cap *caps, struct shard *shard,
+                struct writer_stream **streams, int flow)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    memset(&caps[i], 0, sizeof(caps[i]));
+    caps[i].dev_id = i;
+    caps[i].dev_name = i == 0 ? "dev1" : "dev2";
+    caps[i].shard = shard;
+    caps[i].out = streams[i];
+    caps[i].agg = agg_shard_new();
+    caps[i].handler = flow ? flow_pcap_callback : pcap_callback;
+    caps[i].batch = flow ? NULL : decode_batch_new();
+  }
+}
+
+void free_caps(struct dev_cap *caps)
+{
+  agg_shard_free(caps[0].agg);
+  agg_shard_free(caps[1].agg);
+  free(caps[0].batch);
+  free(caps[1].batch);
+}
+
+void discard_sample(const struct join_sample *sample)
+{
+  (void)sample;
+}
+
+void bench_usage()
+{
+  fprintf(stdout, "Usage: bench [-n events] [-c concurrency] [-p paths] [-r rounds]\n");
+  fprintf(stdout, "             [-f text|csv] [-Z] [name...]\n");
+  fprintf(stdout, "  -n <n>  events generated per benchmark (default %d)\n", BENCH_DEFAULT_EVENTS);
+  fprintf(stdout, "  -c <n>  packets in flight at once, their events interleave (default 1)\n");
+  fprintf(stdout, "  -p <n>  containers the packets are spread over (default 1)\n");
+  fprintf(stdout, "  -r <n>  rounds per benchmark, the best one is reported (default %d)\n", BENCH_DEFAULT_ROUNDS);
+  fprintf(stdout, "  -f <f>  output as an aligned table (text, default) or csv\n");
+  fprintf(stdout, "  -Z      fail if a benchmark allocates after its first round\n");
+  fprintf(stdout, "  name    run only the benchmarks whose names contain one of these\n");
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench_opts opts;
+  struct bench_gen gen;
+  struct bench_run r;
+  struct bench_frame *echo_frames;
+  struct bench_frame *tcp_frames;
+  struct pcap_pkthdr *echo_hdrs;
+  struct pcap_pkthdr *tcp_hdrs;
+  struct flow_key *keys;
+  struct timespec *key_ts;
+  struct trace_event tevt;
+  struct packet_event pevt;
+  struct timespec delta;
+  struct dev_cap caps[2];
+  struct writer_stream *streams[3];
+  struct shard *shard;
+  struct join_state *join;
+  struct join_event jevt;
+  struct writer_record rec;
+  struct hist *hist;
+  struct agg_shard *agg;
+  struct agg_entry *e;
+  struct decode_batch *batch;
+  char pcap_path[] = "/tmp/bench_XXXXXX";
+  char errbuf[PCAP_ERRBUF_SIZE];
+  char **lines;
+  char *trace;
+  size_t trace_len;
+  uint64_t nlines;
+  uint64_t n;
+  uint64_t i;
+  pcap_t *hdl;
+  int nframes;
+  int first_dev;
+  int null_fd;
+  int fd;
+
+  if (bench_parse_args(argc, argv, &opts)) {
+    bench_usage();
+    return 1;
+  }
+  nframes = opts.events > 0x7fffffff ? 0x7fffffff : (int)opts.events;
+
+  // Generate everything up front
+  bench_gen_init(&gen, opts.concurrency, opts.npaths);
+  trace = bench_gen_syscall_trace(&gen, opts.events, &trace_len);
+  echo_frames = (struct bench_frame *)malloc(sizeof(struct bench_frame) * nframes);
+  tcp_frames = (struct bench_frame *)malloc(sizeof(struct bench_frame) * nframes);
+  echo_hdrs = (struct pcap_pkthdr *)malloc(sizeof(struct pcap_pkthdr) * nframes);
+  tcp_hdrs = (struct pcap_pkthdr *)malloc(sizeof(struct pcap_pkthdr) * nframes);
+  keys = (struct flow_key *)malloc(sizeof(struct flow_key) * nframes);
+  key_ts = (struct timespec *)malloc(sizeof(struct timespec) * nframes);
+  shard = (struct shard *)malloc(sizeof(struct shard));
+  join = (struct join_state *)malloc(sizeof(struct join_state));
+  hist = (struct hist *)malloc(sizeof(struct hist));
+  batch = decode_batch_new();
+  if (trace == NULL || echo_frames == NULL || tcp_frames == NULL || echo_hdrs == NULL
+   || tcp_hdrs == NULL || keys == NULL || key_ts == NULL || shard == NULL
+   || join == NULL || hist == NULL || batch == NULL) {
+    fprintf(stderr, "Failed to allocate %d events\n", nframes);
+    return 1;
+  }
+  nlines = split_lines(trace, &lines);
+  bench_gen_echo_frames(&gen, echo_frames, nframes);
+  bench_gen_tcp_frames(&gen, tcp_frames, nframes);
+  frame_headers(echo_frames, echo_hdrs, nframes);
+  frame_headers(tcp_frames, tcp_hdrs, nframes);
+  for (i = 0; i < (uint64_t)nframes; i++) {
+    flow_fingerprint(tcp_frames[i].data, tcp_frames[i].len, 0, &keys[i]);
+    key_ts[i] = tcp_frames[i].ts;
+  }
+
+  // Results go through the writer as they do in iface_diff, just to nowhere
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0 || writer_start(&writer, null_fd, WRITER_FORMAT_BINARY)) {
+    return 1;
+  }
+  for (i = 0; i < 3; i++) {
+    streams[i] = writer_stream_open(&writer, WRITER_STREAM_RECORDS);
+  }
+
+  bench_header(&opts);
+
+  if (bench_selected(&opts, "parse_trace_event")) {
+    for (bench_begin(&r, &opts, "parse_trace_event"); bench_round(&r); bench_end_round(&r, nlines)) {
+      for (i = 0; i < nlines; i++) {
+        parse_trace_event(lines[i], &tevt);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "parse_packet_event")) {
+    for (bench_begin(&r, &opts, "parse_packet_event"); bench_round(&r); bench_end_round(&r, nframes)) {
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        parse_packet_event(batch, &echo_hdrs[i], echo_frames[i].data, 0, &pevt);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "decode_batch")) {
+    for (bench_begin(&r, &opts, "decode_batch"); bench_round(&r); bench_end_round(&r, nframes)) {
+      batch->n = 0;
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        if (decode_batch_add(batch, &echo_hdrs[i], echo_frames[i].data, 0)) {
+          decode_batch_run(batch);
+          batch->n = 0;
+        }
+      }
+      decode_batch_run(batch);
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "get_packet_event")) {
+    fd = mkstemp(pcap_path);
+    if (fd < 0 || write_pcap_file(pcap_path, echo_hdrs, echo_frames, nframes)) {
+      fprintf(stderr, "Failed to write '%s'\n", pcap_path);
+      return 1;
+    }
+    close(fd);
+    hdl = pcap_open_offline(pcap_path, errbuf);
+    if (hdl == NULL) {
+      fprintf(stderr, "Failed to open '%s': %s\n", pcap_path, errbuf);
+      return 1;
+    }
+    for (bench_begin(&r, &opts, "get_packet_event"); bench_round(&r); bench_end_round(&r, n)) {
+      // Rewind to the first record, reopening the file would allocate
+      fseek(pcap_file(hdl), sizeof(struct pcap_file_header), SEEK_SET);
+      for (n = 0; get_packet_event(hdl, batch, &pevt); n++) {
+      }
+    }
+    pcap_close(hdl);
+    unlink(pcap_path);
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "pcap_callback")) {
+    setup_caps(caps, shard, streams, 0);
+    for (bench_begin(&r, &opts, "pcap_callback"); bench_round(&r); bench_end_round(&r, nframes)) {
+      reset_shard(shard, 0);
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        pcap_callback((u_char *)&caps[echo_frames[i].dev], &echo_hdrs[i], echo_frames[i].data);
+      }
+    }
+    free_caps(caps);
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "echo_batch")) {
+    setup_caps(caps, shard, streams, 0);
+    for (bench_begin(&r, &opts, "echo_batch"); bench_round(&r); bench_end_round(&r, nframes)) {
+      reset_shard(shard, 0);
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        echo_batch_callback((u_char *)&caps[echo_frames[i].dev], &echo_hdrs[i], echo_frames[i].data);
+      }
+      echo_batch_flush(&caps[0]);
+      echo_batch_flush(&caps[1]);
+    }
+    free_caps(caps);
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "flow_pcap_callback")) {
+    setup_caps(caps, shard, streams, 1);
+    for (bench_begin(&r, &opts, "flow_pcap_callback"); bench_round(&r); bench_end_round(&r, nframes)) {
+      reset_shard(shard, 1);
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        flow_pcap_callback((u_char *)&caps[tcp_frames[i].dev], &tcp_hdrs[i], tcp_frames[i].data);
+      }
+    }
+    free_caps(caps);
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "flow_fingerprint")) {
+    for (bench_begin(&r, &opts, "flow_fingerprint"); bench_round(&r); bench_end_round(&r, nframes)) {
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        flow_fingerprint(tcp_frames[i].data, tcp_frames[i].len, 0, &keys[i]);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "flow_table_match")) {
+    for (bench_begin(&r, &opts, "flow_table_match"); bench_round(&r); bench_end_round(&r, nframes)) {
+      flow_table_init(&shard->flow_table, 0);
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        flow_table_match(&shard->flow_table, keys[i].fp, tcp_frames[i].dev, &key_ts[i],
+                         &delta, &first_dev);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "join")) {
+    // Syscall lines and echo frames from the same pings, fed in turn
+    for (bench_begin(&r, &opts, "join"); bench_round(&r); bench_end_round(&r, nlines + nframes)) {
+      join_init(join, null_fd, &(struct timeval){ 0, 0 }, 0, discard_sample);
+      for (i = 0; i < nlines || i < (uint64_t)nframes; i++) {
+        if (i < nlines) {
+          parse_trace_event(lines[i], &tevt);
+          if (tevt.type == EVENT_TYPE_ENTER_SENDTO || tevt.type == EVENT_TYPE_EXIT_RECVMSG) {
+            jevt.ts = join_tv_usec(&tevt.ts);
+            jevt.type = tevt.type;
+            jevt.seq = 0;
+            join_push(join, JOIN_SOURCE_TRACE, &jevt);
+          }
+        }
+        if (i < (uint64_t)nframes && echo_frames[i].dev == 0) {
+          join_pcap_callback((u_char *)join, &echo_hdrs[i], echo_frames[i].data);
+        }
+      }
+      join_flush(join);
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "writer_append")) {
+    memset(&rec, 0, sizeof(rec));
+    for (bench_begin(&r, &opts, "writer_append"); bench_round(&r); bench_end_round(&r, nframes)) {
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        rec.ts_ns = i;
+        writer_append(streams[2], &rec);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "hist_add")) {
+    for (bench_begin(&r, &opts, "hist_add"); bench_round(&r); bench_end_round(&r, nframes)) {
+      hist_init(hist);
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        hist_add(hist, key_ts[i].tv_nsec & 0xfffff);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "agg_add")) {
+    // Per-container aggregation as iface_diff does it, keyed by address;
+    // keys are new in the first round only, as on a long-running node
+    agg = agg_shard_new();
+    if (agg == NULL) {
+      return 1;
+    }
+    for (bench_begin(&r, &opts, "agg_add"); bench_round(&r); bench_end_round(&r, nframes)) {
+      for (i = 0; i < (uint64_t)nframes; i++) {
+        e = agg_find(agg, keys[i].src.s_addr);
+        if (e == NULL) {
+          e = agg_get(agg, keys[i].src.s_addr, "bench");
+        }
+        agg_add(e, AGG_OUT, key_ts[i].tv_nsec & 0xfffff);
+      }
+    }
+    agg_shard_free(agg);
+    bench_report(&r);
+  }
+
+  writer_stop(&writer);
+  close(null_fd);
+  free(lines);
+  free(trace);
+  free(echo_frames);
+  free(tcp_frames);
+  free(echo_hdrs);
+  free(tcp_hdrs);
+  free(keys);
+  free(key_ts);
+  free(shard);
+  free(join);
+  free(hist);
+  free(batch);
+  return bench_alloc_failures != 0;
+}
@@ -0,0 +1,553 @@
+//
+// Microbenchmark harness and synthetic event generator
+//
+// The generator produces the same input the tools read in production:
+// net:* lines as they come out of trace_pipe, syscall lines for the root
+// latency tool, and ethernet frames for icmp echo and tcp traffic seen on
+// both sides of a container path. concurrency is how many packets are in
+// flight at once (their events interleave), npaths how many containers the
+// packets are spread over.
+//
+// Inputs are generated before timing starts. Each benchmark runs a number
+// of rounds and reports the best one as events/s, ns/event and allocations
+// per event. Allocations are counted by linking with
+//   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
+// and only see calls made from the tools' own code, not from inside libc.
+// The first round warms up tables and pools; with -Z a benchmark that
+// still allocates in a later round fails the run.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+
+#define BENCH_FRAME_SIZE 128
+#define BENCH_LINE_SIZE 320
+#define BENCH_DEFAULT_EVENTS 1000000
+#define BENCH_DEFAULT_ROUNDS 5
+
+enum bench_format {
+  BENCH_FORMAT_TEXT,
+  BENCH_FORMAT_CSV
+};
+
+// Counted by the --wrap'd allocators below
+uint64_t bench_allocs = 0;
+
+// Benchmarks that allocated after their first round
+int bench_alloc_failures = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size)
+{
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_posix_memalign(ptr, align, size);
+}
+
+struct bench_opts {
+  uint64_t events;
+  int concurrency;
+  int npaths;
+  int rounds;
+  enum bench_format format;
+  char **only; // benchmark names to run, all if NULL
+  int nonly;
+  int zero_allocs; // -Z: fail if the steady state allocates
+};
+
+// One benchmark in progress
+struct bench_run {
+  const char *name;
+  const struct bench_opts *opts;
+  int round;
+  uint64_t start_ns;
+  uint64_t start_allocs;
+  uint64_t best_ns;
+  uint64_t best_allocs;
+  uint64_t steady_allocs; // in rounds after the first
+  uint64_t events;
+};
+
+struct bench_gen {
+  int concurrency;
+  int npaths;
+  uint64_t ts_ns;
+  uint32_t seq;
+  uint32_t rng;
+};
+
+// A frame as captured on one of the two devices of a path
+struct bench_frame {
+  struct timespec ts;
+  int dev; // 0 is the container side (dev1), 1 the uplink side (dev2)
+  unsigned int len;
+  unsigned char data[BENCH_FRAME_SIZE];
+};
+
+static inline uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_opts_init(struct bench_opts *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->events = BENCH_DEFAULT_EVENTS;
+  opts->concurrency = 1;
+  opts->npaths = 1;
+  opts->rounds = BENCH_DEFAULT_ROUNDS;
+  opts->format = BENCH_FORMAT_TEXT;
+}
+
+// Nonzero if the named benchmark was asked for
+int bench_selected(const struct bench_opts *opts, const char *name)
+{
+  int i;
+
+  if (opts->nonly == 0) {
+    return 1;
+  }
+  for (i = 0; i < opts->nonly; i++) {
+    if (strstr(name, opts->only[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void bench_header(const struct bench_opts *opts)
+{
+  if (opts->format == BENCH_FORMAT_CSV) {
+    fprintf(stdout, "name,events,concurrency,paths,ns_per_event,events_per_sec,allocs_per_event\n");
+  } else {
+    fprintf(stdout, "# %llu events, concurrency %d, %d paths, best of %d rounds\n",
+        (unsigned long long)opts->events, opts->concurrency, opts->npaths, opts->rounds);
+    fprintf(stdout, "%-28s %12s %14s %10s %12s\n",
+        "benchmark", "events", "events/s", "ns/event", "allocs/event");
+  }
+}
+
+// Start a benchmark: for (bench_begin(&r, ...); bench_round(&r); bench_end_round(&r, n)) { ... }
+void bench_begin(struct bench_run *r, const struct bench_opts *opts, const char *name)
+{
+  memset(r, 0, sizeof(*r));
+  r->name = name;
+  r->opts = opts;
+  r->best_ns = ~0ULL;
+}
+
+// Nonzero while there are rounds left to run; starts the clock
+int bench_round(struct bench_run *r)
+{
+  if (r->round == r->opts->rounds) {
+    return 0;
+  }
+  r->start_allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+  r->start_ns = bench_now_ns();
+  return 1;
+}
+
+// Stop the clock on a round that handled events
+void bench_end_round(struct bench_run *r, uint64_t events)
+{
+  uint64_t ns = bench_now_ns() - r->start_ns;
+  uint64_t allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - r->start_allocs;
+
+  if (ns < r->best_ns) {
+    r->best_ns = ns;
+    r->best_allocs = allocs;
+    r->events = events;
+  }
+  if (r->round > 0) {
+    r->steady_allocs += allocs;
+  }
+  r->round++;
+}
+
+void bench_report(const struct bench_run *r)
+{
+  double ns_per = r->events ? (double)r->best_ns / r->events : 0.0;
+  double per_sec = r->best_ns ? r->events * 1e9 / r->best_ns : 0.0;
+  double allocs_per = r->events ? (double)r->best_allocs / r->events : 0.0;
+
+  if (r->opts->format == BENCH_FORMAT_CSV) {
+    fprintf(stdout, "%s,%llu,%d,%d,%.2f,%.0f,%.4f\n", r->name,
+        (unsigned long long)r->events, r->opts->concurrency, r->opts->npaths,
+        ns_per, per_sec, allocs_per);
+  } else {
+    fprintf(stdout, "%-28s %12llu %14.0f %10.1f %12.4f\n", r->name,
+        (unsigned long long)r->events, per_sec, ns_per, allocs_per);
+  }
+  if (r->opts->zero_allocs && r->steady_allocs) {
+    fprintf(stderr, "%s: %llu allocations after the first round\n", r->name,
+        (unsigned long long)r->steady_allocs);
+    bench_alloc_failures++;
+  }
+  fflush(stdout);
+}
+
+void bench_gen_init(struct bench_gen *g, int concurrency, int npaths)
+{
+  g->concurrency = concurrency > 0 ? concurrency : 1;
+  g->npaths = npaths > 0 ? npaths : 1;
+  g->ts_ns = 5396106434000ULL; // some time after boot
+  g->seq = 1;
+  g->rng = 0x2545f491;
+}
+
+// Small xorshift, enough to spread delays and cpus
+static inline uint32_t bench_gen_rand(struct bench_gen *g)
+{
+  g->rng ^= g->rng << 13;
+  g->rng ^= g->rng >> 17;
+  g->rng ^= g->rng << 5;
+  return g->rng;
+}
+
+// One trace_pipe line, in the kernel's layout
+static size_t bench_gen_line(struct bench_gen *g, char *buf, size_t len, const char *comm,
+                             const char *event, const char *args)
+{
+  uint32_t r = bench_gen_rand(g);
+  int n;
+
+  g->ts_ns += 1000 + r % 4000;
+  n = snprintf(buf, len, "%16s-%-7u [%03u] %s %5llu.%06llu: %s: %s\n",
+      comm, 1000 + r % 30000, (r >> 8) % 8, (r & 0x100) ? "..s1" : "....",
+      (unsigned long long)(g->ts_ns / 1000000000ULL),
+      (unsigned long long)(g->ts_ns / 1000 % 1000000ULL), event, args);
+  return n < 0 || (size_t)n >= len ? 0 : (size_t)n;
+}
+
+// net:* events for packets through container paths, as the ftrace latency
+// tool traces them (see ftrace/libdiscover.c discover_write_config):
+//   inbound:  netif_receive_skb on eth0 -> net_dev_start_xmit on vethN
+//   outbound: netif_rx on vethN -> net_dev_start_xmit on eth0
+// Packets are generated concurrency at a time, so with concurrency > 1
+// the events of different skbs interleave as they do under load.
+// Returns a malloc'd buffer of about nevents lines, its length in *len
+char *bench_gen_net_trace(struct bench_gen *g, uint64_t nevents, size_t *len)
+{
+  char args[BENCH_LINE_SIZE];
+  char *buf;
+  size_t cap = nevents * BENCH_LINE_SIZE + BENCH_LINE_SIZE;
+  size_t off = 0;
+  uint64_t skb;
+  uint64_t n = 0;
+  uint32_t first;
+  int stage;
+  int i;
+
+  buf = (char *)malloc(cap);
+  if (buf == NULL) {
+    return NULL;
+  }
+  while (n < nevents) {
+    first = g->seq;
+    for (stage = 0; stage < 4; stage++) {
+      for (i = 0; i < g->concurrency && n < nevents; i++, n++) {
+        skb = 0xffff9a4c00000000ULL + (uint64_t)(first + i) * 0x100 + (stage >= 2 ? 0x80 : 0);
+        switch (stage) {
+          case 0:
+            snprintf(args, sizeof(args), "dev=eth0 skbaddr=%016llx len=84",
+                (unsigned long long)skb);
+            off += bench_gen_line(g, buf + off, cap - off, "<idle>", "netif_receive_skb", args);
+            break;
+          case 1:
+            snprintf(args, sizeof(args), "dev=veth%d queue_mapping=0 skbaddr=%016llx vlan_tagged=0 "
+                "vlan_proto=0x0000 vlan_tci=0x0000 protocol=0x0800 ip_summed=0 len=84 "
+                "data_len=0 network_offset=14 transport_offset_valid=1 transport_offset=34 "
+                "tx_flags=0 gso_size=0 gso_segs=0 gso_type=0x0",
+                (first + i) % g->npaths, (unsigned long long)skb);
+            off += bench_gen_line(g, buf + off, cap - off, "<idle>", "net_dev_start_xmit", args);
+            break;
+          case 2:
+            snprintf(args, sizeof(args), "dev=veth%d skbaddr=%016llx len=84",
+                (first + i) % g->npaths, (unsigned long long)skb);
+            off += bench_gen_line(g, buf + off, cap - off, "ping", "netif_rx", args);
+            break;
+          case 3:
+            snprintf(args, sizeof(args), "dev=eth0 queue_mapping=0 skbaddr=%016llx vlan_tagged=0 "
+                "vlan_proto=0x0000 vlan_tci=0x0000 protocol=0x0800 ip_summed=0 len=98 "
+                "data_len=0 network_offset=14 transport_offset_valid=1 transport_offset=34 "
+                "tx_flags=0 gso_size=0 gso_segs=0 gso_type=0x0",
+                (unsigned long long)skb);
+            off += bench_gen_line(g, buf + off, cap - off, "<idle>", "net_dev_start_xmit", args);
+            break;
+        }
+      }
+    }
+    g->seq += g->concurrency;
+  }
+  buf[off] = '\0';
+  *len = off;
+  return buf;
+}
+
+// Syscall events of ping, as the root latency tool traces them:
+// sendto enter/exit, then recvmsg enter/exit, concurrency pings at a time
+// Returns a malloc'd buffer of about nevents lines, its length in *len
+char *bench_gen_syscall_trace(struct bench_gen *g, uint64_t nevents, size_t *len)
+{
+  static const char *events[4][2] = {
+    { "sys_sendto", "fd: 3, buff: 5616e0a1c4a0, len: 40, flags: 800, addr: 5616e0a1a2c0, addr_len: 10" },
+    { "sys_sendto", "" },
+    { "sys_recvmsg", "fd: 3, msg: 7ffd3a4e1b50, flags: 0" },
+    { "sys_recvmsg", "" },
+  };
+  char args[BENCH_LINE_SIZE];
+  char *buf;
+  size_t cap = nevents * BENCH_LINE_SIZE + BENCH_LINE_SIZE;
+  size_t off = 0;
+  uint64_t n = 0;
+  uint32_t r;
+  int stage;
+  int i;
+  int m;
+
+  buf = (char *)malloc(cap);
+  if (buf == NULL) {
+    return NULL;
+  }
+  while (n < nevents) {
+    for (stage = 0; stage < 4; stage++) {
+      for (i = 0; i < g->concurrency && n < nevents; i++, n++) {
+        r = bench_gen_rand(g);
+        g->ts_ns += 1000 + r % 4000;
+        // Exits have no argument list, just the return value
+        if (stage & 1) {
+          snprintf(args, sizeof(args), "%s -> 0x%x", events[stage][0], stage == 1 ? 40 : 84);
+        } else {
+          snprintf(args, sizeof(args), "%s(%s)", events[stage][0], events[stage][1]);
+        }
+        m = snprintf(buf + off, cap - off, "%16s-%-7u [%03u] .... %5llu.%06llu: %s\n",
+            "ping", 2000 + i, (r >> 8) % 8,
+            (unsigned long long)(g->ts_ns / 1000000000ULL),
+            (unsigned long long)(g->ts_ns / 1000 % 1000000ULL), args);
+        if (m > 0 && (size_t)m < cap - off) {
+          off += m;
+        }
+      }
+    }
+    g->seq += g->concurrency;
+  }
+  buf[off] = '\0';
+  *len = off;
+  return buf;
+}
+
+static uint16_t bench_ip_sum(const void *data, size_t len)
+{
+  const uint16_t *p = (const uint16_t *)data;
+  uint32_t sum = 0;
+
+  for (; len > 1; len -= 2) {
+    sum += *p++;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+// Fill in ethernet and ipv4 headers; returns the offset of the l4 header
+static unsigned int bench_gen_ip(unsigned char *data, int proto, struct in_addr src,
+                                 struct in_addr dst, uint16_t id, uint8_t ttl, uint16_t l4_len)
+{
+  struct ether_header *eth = (struct ether_header *)data;
+  struct ip *ip = (struct ip *)(data + sizeof(struct ether_header));
+
+  memset(data, 0, sizeof(struct ether_header) + sizeof(struct ip));
+  memcpy(eth->ether_dhost, "\x02\x42\xac\x11\x00\x01", ETH_ALEN);
+  memcpy(eth->ether_shost, "\x02\x42\xac\x11\x00\x02", ETH_ALEN);
+  eth->ether_type = htons(ETHERTYPE_IP);
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_len = htons(sizeof(struct ip) + l4_len);
+  ip->ip_id = htons(id);
+  ip->ip_off = htons(IP_DF);
+  ip->ip_ttl = ttl;
+  ip->ip_p = proto;
+  ip->ip_src = src;
+  ip->ip_dst = dst;
+  ip->ip_sum = bench_ip_sum(ip, sizeof(struct ip));
+  return sizeof(struct ether_header) + sizeof(struct ip);
+}
+
+// Address of the container a packet belongs to
+static inline struct in_addr bench_gen_container(const struct bench_gen *g, uint32_t n)
+{
+  struct in_addr a;
+  a.s_addr = htonl(0xac110002 + n % g->npaths); // 172.17.0.2 and up
+  return a;
+}
+
+static inline void bench_ts_add(struct timespec *ts, uint64_t base, uint64_t ns)
+{
+  ts->tv_sec = (base + ns) / 1000000000ULL;
+  ts->tv_nsec = (base + ns) % 1000000000ULL;
+}
+
+// icmp echoes from containers to a remote host, seen on both devices:
+// request on dev1 then dev2, reply on dev2 then dev1
+// Fills up to max frames, returns how many
+int bench_gen_echo_frames(struct bench_gen *g, struct bench_frame *frames, int max)
+{
+  struct in_addr remote;
+  struct bench_frame *f;
+  struct icmp *icmp;
+  uint32_t first;
+  unsigned int off;
+  int stage;
+  int n = 0;
+  int i;
+
+  remote.s_addr = htonl(0x0a0a0102); // 10.10.1.2
+  while (n < max) {
+    first = g->seq;
+    for (stage = 0; stage < 4; stage++) {
+      for (i = 0; i < g->concurrency && n < max; i++, n++) {
+        f = &frames[n];
+        f->dev = stage == 0 || stage == 3 ? 0 : 1;
+        g->ts_ns += 500 + bench_gen_rand(g) % 2000;
+        bench_ts_add(&f->ts, g->ts_ns, 0);
+        if (stage < 2) {
+          off = bench_gen_ip(f->data, IPPROTO_ICMP, bench_gen_container(g, first + i), remote,
+              first + i, stage == 0 ? 64 : 63, 8 + 56);
+        } else {
+          off = bench_gen_ip(f->data, IPPROTO_ICMP, remote, bench_gen_container(g, first + i),
+              first + i + 0x8000, stage == 2 ? 60 : 59, 8 + 56);
+        }
+        icmp = (struct icmp *)(f->data + off);
+        memset(icmp, 0, 8 + 56);
+        icmp->icmp_type = stage < 2 ? ICMP_ECHO : ICMP_ECHOREPLY;
+        icmp->icmp_id = htons(1000 + i);
+        icmp->icmp_seq = htons((first + i) & 0xffff);
+        icmp->icmp_cksum = bench_ip_sum(icmp, 8 + 56);
+        f->len = off + 8 + 56;
+      }
+    }
+    g->seq += g->concurrency;
+  }
+  return n;
+}
+
+// tcp segments from containers, each seen on dev1 and then dev2 (forwarded,
+// so the ttl drops by one), concurrency segments in flight at a time
+// Fills up to max frames, returns how many
+int bench_gen_tcp_frames(struct bench_gen *g, struct bench_frame *frames, int max)
+{
+  struct in_addr remote;
+  struct bench_frame *f;
+  struct tcphdr *tcp;
+  char payload[32];
+  uint32_t first;
+  unsigned int off;
+  int plen;
+  int stage;
+  int n = 0;
+  int i;
+
+  remote.s_addr = htonl(0x0a0a0102);
+  while (n < max) {
+    first = g->seq;
+    for (stage = 0; stage < 2; stage++) {
+      for (i = 0; i < g->concurrency && n < max; i++, n++) {
+        f = &frames[n];
+        f->dev = stage;
+        g->ts_ns += 500 + bench_gen_rand(g) % 2000;
+        bench_ts_add(&f->ts, g->ts_ns, 0);
+        plen = snprintf(payload, sizeof(payload), "GET /%u HTTP/1.1\r\n", first + i);
+        off = bench_gen_ip(f->data, IPPROTO_TCP, bench_gen_container(g, first + i), remote,
+            first + i, 64 - stage, sizeof(struct tcphdr) + plen);
+        tcp = (struct tcphdr *)(f->data + off);
+        memset(tcp, 0, sizeof(*tcp));
+        tcp->th_sport = htons(40000 + i);
+        tcp->th_dport = htons(80);
+        tcp->th_seq = htonl((first + i) * 100);
+        tcp->th_off = 5;
+        tcp->th_flags = TH_PUSH | TH_ACK;
+        tcp->th_win = htons(1000);
+        memcpy(f->data + off + sizeof(*tcp), payload, plen);
+        f->len = off + sizeof(*tcp) + plen;
+      }
+    }
+    g->seq += g->concurrency;
+  }
+  return n;
+}
+
+// Shared command line: -n events -c concurrency -p paths -r rounds -f text|csv [name...]
+// Returns 0 on success, nonzero on a bad option
+int bench_parse_args(int argc, char *argv[], struct bench_opts *opts)
+{
+  int opt;
+
+  bench_opts_init(opts);
+  while ((opt = getopt(argc, argv, "n:c:p:r:f:Z")) != -1) {
+    switch (opt) {
+      case 'n':
+        opts->events = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        opts->concurrency = atoi(optarg);
+        break;
+      case 'p':
+        opts->npaths = atoi(optarg);
+        break;
+      case 'r':
+        opts->rounds = atoi(optarg);
+        break;
+      case 'f':
+        if (!strcmp(optarg, "csv")) {
+          opts->format = BENCH_FORMAT_CSV;
+        } else if (strcmp(optarg, "text")) {
+          return -1;
+        }
+        break;
+      case 'Z':
+        opts->zero_allocs = 1;
+        break;
+      default:
+        return -1;
+    }
+  }
+  opts->only = &argv[optind];
+  opts->nonly = argc - optind;
+  if (opts->events == 0 || opts->concurrency < 1 || opts->npaths < 1 || opts->rounds < 1) {
+    return -1;
+  }
+  return 0;
+}
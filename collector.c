@@ -0,0 +1,425 @@
+//
+// Merge latency summaries from many monitors
+//
+// iface_diff and ftrace/latency started with -U send a summary of what
+// they measured every few seconds (summary_common.c). The collector adds
+// them up per key, a path, container or address, and over the fleet, and
+// prints their percentiles every report interval and once more, since
+// the start, on SIGINT. The histograms merge exactly, so a fleet-wide
+// percentile has the same 6.25% bound as one monitor's.
+//
+// What the monitors send doesn't grow with their packet rate, only with
+// their keys and how spread out their latencies are, so one collector
+// keeps up with many of them.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "summary_common.c"
+#include "metrics_common.c"
+
+#define COLLECTOR_MAX_AGENTS 256
+#define COLLECTOR_READ_SIZE 0x10000
+#define COLLECTOR_DEFAULT_SECS 10
+
+struct agent_conn {
+  int fd;
+  char host[SUMMARY_HOST_SIZE]; // empty until its first summary
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static volatile int running = 1;
+
+// Everything received, owned by the main thread, read by the metrics thread
+static struct agg_shard *totals;
+static uint64_t nagents;
+static uint64_t nsummaries;
+static uint64_t nbytes;
+static uint64_t nrejected;
+
+void do_exit()
+{
+  running = 0;
+}
+
+void usage()
+{
+  fprintf(stdout, "Usage: collector [-i secs] [-M port|path] <port|path>\n");
+  fprintf(stdout, "  Takes summaries from iface_diff -U and latency -U on a tcp port or unix socket path\n");
+  fprintf(stdout, "  -i <secs>    print merged percentiles every secs seconds (default %d)\n",
+          COLLECTOR_DEFAULT_SECS);
+  fprintf(stdout, "  -M <addr>    serve Prometheus metrics on a tcp port or unix socket path\n");
+}
+
+// Add one direction of a summary to a total, with the same owner-only
+// atomics as agg_add so the metrics thread's snapshots never tear
+static void total_add_slot(struct agg_entry *e, int d, const struct window_slot *slot)
+{
+  struct hist *h = &e->latency[d];
+  int i;
+
+  stat_add(&e->samples[d], slot->samples);
+  stat_add(&e->discarded[d], slot->discarded);
+  stat_add(&e->expired[d], slot->expired);
+  for (i = 0; i < slot->nbuckets; i++) {
+    stat_add(&h->counts[slot->buckets[i].bucket], slot->buckets[i].count);
+  }
+  stat_add(&h->count, slot->count);
+  stat_add(&h->sum, slot->sum);
+  if (slot->max > stat_read(&h->max)) {
+    __atomic_store_n(&h->max, slot->max, __ATOMIC_RELAXED);
+  }
+}
+
+// Add one key's summary to its total
+static void apply_summary(const struct summary_header *h, const char *name,
+                          const struct window_slot *slots, void *arg)
+{
+  struct agg_entry *e = agg_get(totals, agg_key_str(name), name);
+  int d;
+
+  (void)h;
+  (void)arg;
+  if (e == NULL) {
+    return;
+  }
+  for (d = 0; d < 2; d++) {
+    total_add_slot(e, d, &slots[d]);
+  }
+}
+
+static void drop_agent(struct agent_conn *c)
+{
+  if (c->host[0]) {
+    fprintf(stderr, "Agent %s went away\n", c->host);
+  }
+  close(c->fd);
+  free(c->buf);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+  stat_add(&nagents, -1);
+}
+
+// Read what the agent sent and apply every whole frame
+// Returns 0 on success, nonzero if the agent is gone or sent garbage
+static int read_agent(struct agent_conn *c)
+{
+  struct summary_header h;
+  unsigned char *grown;
+  size_t off = 0;
+  uint32_t flen;
+  ssize_t n;
+
+  if (c->cap - c->len < COLLECTOR_READ_SIZE) {
+    grown = (unsigned char *)realloc(c->buf, c->cap + COLLECTOR_READ_SIZE);
+    if (grown == NULL) {
+      return -1;
+    }
+    c->buf = grown;
+    c->cap += COLLECTOR_READ_SIZE;
+  }
+  n = read(c->fd, c->buf + c->len, c->cap - c->len);
+  if (n < 0 && errno == EINTR) {
+    return 0;
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  c->len += n;
+
+  while (c->len - off >= 4) {
+    flen = c->buf[off] | c->buf[off + 1] << 8 | c->buf[off + 2] << 16 | (uint32_t)c->buf[off + 3] << 24;
+    if (flen > SUMMARY_FRAME_MAX) {
+      fprintf(stderr, "Agent %s sent a %u byte summary, dropping it\n", c->host[0] ? c->host : "?", flen);
+      return -1;
+    }
+    if (c->len - off - 4 < flen) {
+      break;
+    }
+    if (summary_decode(c->buf + off + 4, flen, &h, apply_summary, NULL)) {
+      fprintf(stderr, "Agent %s sent a malformed summary, dropping it\n", c->host[0] ? c->host : "?");
+      stat_add(&nrejected, 1);
+      return -1;
+    }
+    if (c->host[0] == '\0') {
+      snprintf(c->host, sizeof(c->host), "%s", h.host);
+      fprintf(stderr, "Agent %s connected\n", c->host);
+    }
+    stat_add(&nsummaries, 1);
+    stat_add(&nbytes, flen + 4);
+    off += flen + 4;
+  }
+  memmove(c->buf, c->buf + off, c->len - off);
+  c->len -= off;
+  return 0;
+}
+
+// The entry for key in v, NULL if there is none
+static const struct agg_entry *view_find(const struct agg_view *v, uint64_t key)
+{
+  int i;
+
+  // A few hundred keys every few seconds
+  for (i = 0; i < v->nentries; i++) {
+    if (v->entries[i].key == key) {
+      return &v->entries[i];
+    }
+  }
+  return NULL;
+}
+
+static void print_entry(const char *name, const struct agg_entry *e)
+{
+  static const char *dirs[2] = { "out", "in" };
+  int d;
+
+  fprintf(stdout, "%s", name);
+  for (d = 0; d < 2; d++) {
+    fprintf(stdout, " %s n=%llu discarded=%llu expired=%llu p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f",
+            dirs[d], (unsigned long long)e->samples[d], (unsigned long long)e->discarded[d],
+            (unsigned long long)e->expired[d],
+            hist_quantile(&e->latency[d], 0.5) / 1000.0,
+            hist_quantile(&e->latency[d], 0.9) / 1000.0,
+            hist_quantile(&e->latency[d], 0.99) / 1000.0,
+            hist_quantile(&e->latency[d], 0.999) / 1000.0,
+            e->latency[d].max / 1000.0);
+  }
+  fprintf(stdout, "\n");
+}
+
+// Print what came in since prev, in microseconds, or everything if prev is
+// empty, then make prev the view now
+static void report(struct agg_view *prev, double secs, uint64_t summaries, uint64_t bytes)
+{
+  struct agg_view cur;
+  struct agg_view delta;
+  struct agg_entry *total;
+  const struct agg_entry *last;
+  struct window_slot slot;
+  int i;
+  int d;
+
+  if (agg_view_build(&cur, &totals, 1)) {
+    fprintf(stderr, "Failed to build report\n");
+    return;
+  }
+  delta.nentries = cur.nentries;
+  delta.entries = (struct agg_entry *)calloc(cur.nentries ? cur.nentries : 1, sizeof(struct agg_entry));
+  total = (struct agg_entry *)malloc(sizeof(struct agg_entry));
+  if (delta.entries == NULL || total == NULL) {
+    fprintf(stderr, "Failed to build report\n");
+    free(total);
+    agg_view_free(&delta);
+    agg_view_free(&cur);
+    return;
+  }
+  // What each key added, with a max that belongs to the interval
+  for (i = 0; i < cur.nentries; i++) {
+    last = view_find(prev, cur.entries[i].key);
+    if (last == NULL) {
+      last = &window_zero;
+    }
+    delta.entries[i].key = cur.entries[i].key;
+    memcpy(delta.entries[i].name, cur.entries[i].name, AGG_NAME_SIZE);
+    for (d = 0; d < 2; d++) {
+      if (window_slot_fill(&slot, &cur.entries[i], last, d) == 0) {
+        window_slot_apply(&delta.entries[i], d, &slot, 1);
+        delta.entries[i].latency[d].max = slot.max;
+      }
+      window_slot_clear(&slot);
+    }
+  }
+
+  fprintf(stdout, "agents=%llu summaries=%llu bytes/s=%.0f\n", (unsigned long long)stat_read(&nagents),
+          (unsigned long long)summaries, secs > 0 ? bytes / secs : 0.0);
+  agg_view_total(&delta, total);
+  print_entry("fleet", total);
+  for (i = 0; i < delta.nentries; i++) {
+    if (delta.entries[i].samples[0] || delta.entries[i].samples[1]) {
+      print_entry(delta.entries[i].name, &delta.entries[i]);
+    }
+  }
+  fflush(stdout);
+  free(total);
+  agg_view_free(&delta);
+
+  agg_view_free(prev);
+  *prev = cur;
+}
+
+// Metrics thread: snapshot the totals
+void collect_metrics(struct metrics_buf *out, void *arg)
+{
+  static const char *dirs[2] = { "out", "in" };
+  struct agg_view view;
+  struct agg_entry *total;
+  char labels[160];
+  int i;
+  int d;
+
+  (void)arg;
+  metrics_family(out, "collector_agents", "gauge", "Monitors connected");
+  metrics_value(out, "collector_agents", "", stat_read(&nagents));
+  metrics_family(out, "collector_summaries_total", "counter", "Summaries merged");
+  metrics_value(out, "collector_summaries_total", "", stat_read(&nsummaries));
+  metrics_family(out, "collector_rejected_total", "counter", "Malformed summaries dropped");
+  metrics_value(out, "collector_rejected_total", "", stat_read(&nrejected));
+  metrics_family(out, "collector_received_bytes_total", "counter", "Bytes of summaries merged");
+  metrics_value(out, "collector_received_bytes_total", "", stat_read(&nbytes));
+
+  if (agg_view_build(&view, &totals, 1)) {
+    return;
+  }
+  total = (struct agg_entry *)malloc(sizeof(struct agg_entry));
+  if (total == NULL) {
+    agg_view_free(&view);
+    return;
+  }
+  agg_view_total(&view, total);
+  metrics_family(out, "collector_fleet_seconds", "histogram", "Latency over every monitor");
+  for (d = 0; d < 2; d++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[d]);
+    metrics_hist(out, "collector_fleet_seconds", labels, &total->latency[d]);
+  }
+  metrics_family(out, "collector_key_seconds", "histogram", "Latency per path, container or address");
+  for (i = 0; i < view.nentries; i++) {
+    for (d = 0; d < 2; d++) {
+      snprintf(labels, sizeof(labels), "key=\"%s\",direction=\"%s\"", view.entries[i].name, dirs[d]);
+      metrics_hist(out, "collector_key_seconds", labels, &view.entries[i].latency[d]);
+    }
+  }
+  free(total);
+  agg_view_free(&view);
+}
+
+int main(int argc, char *argv[])
+{
+  struct pollfd pfds[COLLECTOR_MAX_AGENTS + 1];
+  struct agent_conn conns[COLLECTOR_MAX_AGENTS];
+  struct metrics_server metrics;
+  struct agg_view prev = { 0, NULL };
+  struct agg_view none = { 0, NULL };
+  const char *metrics_addr = NULL;
+  unsigned int secs = COLLECTOR_DEFAULT_SECS;
+  uint64_t last_ns;
+  uint64_t now;
+  uint64_t summaries = 0;
+  uint64_t bytes = 0;
+  char *end;
+  int listen_fd;
+  int fd;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "i:M:")) != -1) {
+    switch (opt) {
+      case 'i':
+        secs = strtoul(optarg, &end, 10);
+        if (*end != '\0' || secs == 0) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'M':
+        metrics_addr = optarg;
+        break;
+      default:
+        usage();
+        exit(1);
+    }
+  }
+  if (argc - optind != 1) {
+    usage();
+    exit(1);
+  }
+
+  signal(SIGINT, do_exit);
+  signal(SIGTERM, do_exit);
+
+  totals = agg_shard_new();
+  if (totals == NULL) {
+    fprintf(stderr, "Failed to allocate totals\n");
+    exit(1);
+  }
+  listen_fd = summary_listen(argv[optind]);
+  if (listen_fd < 0) {
+    exit(1);
+  }
+  if (metrics_addr && metrics_start(&metrics, metrics_addr, collect_metrics, NULL)) {
+    exit(1);
+  }
+  for (i = 0; i < COLLECTOR_MAX_AGENTS; i++) {
+    conns[i].fd = -1;
+  }
+
+  last_ns = summary_now();
+  while (running) {
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    for (i = 0; i < COLLECTOR_MAX_AGENTS; i++) {
+      pfds[i + 1].fd = conns[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+    if (poll(pfds, COLLECTOR_MAX_AGENTS + 1, SUMMARY_POLL_MS * 5) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      fd = accept(listen_fd, NULL, NULL);
+      for (i = 0; fd >= 0 && i < COLLECTOR_MAX_AGENTS && conns[i].fd >= 0; i++) {
+      }
+      if (fd >= 0 && i == COLLECTOR_MAX_AGENTS) {
+        fprintf(stderr, "Too many agents, refusing one\n");
+        close(fd);
+      } else if (fd >= 0) {
+        memset(&conns[i], 0, sizeof(conns[i]));
+        conns[i].fd = fd;
+        stat_add(&nagents, 1);
+      }
+    }
+    for (i = 0; i < COLLECTOR_MAX_AGENTS; i++) {
+      if (conns[i].fd >= 0 && pfds[i + 1].revents && read_agent(&conns[i])) {
+        drop_agent(&conns[i]);
+      }
+    }
+
+    now = summary_now();
+    // Quiet intervals print nothing
+    if (now - last_ns >= secs * 1000000000ULL && stat_read(&nsummaries) == summaries) {
+      last_ns = now;
+    } else if (now - last_ns >= secs * 1000000000ULL) {
+      report(&prev, (now - last_ns) / 1e9, stat_read(&nsummaries) - summaries, stat_read(&nbytes) - bytes);
+      summaries = stat_read(&nsummaries);
+      bytes = stat_read(&nbytes);
+      last_ns = now;
+    }
+  }
+
+  fprintf(stdout, "total:\n");
+  report(&none, 0, stat_read(&nsummaries), 0);
+  fprintf(stdout, "received %llu bytes\n", (unsigned long long)stat_read(&nbytes));
+
+  if (metrics_addr) {
+    metrics_stop(&metrics);
+  }
+  for (i = 0; i < COLLECTOR_MAX_AGENTS; i++) {
+    if (conns[i].fd >= 0) {
+      close(conns[i].fd);
+      free(conns[i].buf);
+    }
+  }
+  close(listen_fd);
+  agg_view_free(&prev);
+  agg_view_free(&none);
+  agg_shard_free(totals);
+  return 0;
+}
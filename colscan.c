@@ -0,0 +1,203 @@
+//
+// Query results saved in the column format
+//
+// Reads a file written with -f column by iface_diff or latency and prints
+// the records matching a time range, a kind and a latency floor as text,
+// csv or binary, like the tool that saved them would have. Blocks whose
+// summaries show nothing can match are skipped without being decoded, so
+// looking at a few seconds or at the slow samples of a long run only
+// decodes the blocks that have them.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "writer_common.c"
+
+struct colscan_query {
+  uint64_t ts_from;
+  uint64_t ts_to;
+  uint32_t kinds; // 1 << kind for every kind wanted
+  int64_t min_ns;
+};
+
+void usage()
+{
+  fprintf(stdout, "Usage: colscan [-f text|csv|binary] [-t from,to] [-k kind]... [-l usecs] <file>\n");
+  fprintf(stdout, "  -t <from>,<to>  only records with time stamps in this range, in seconds;\n");
+  fprintf(stdout, "                  either end may be left out\n");
+  fprintf(stdout, "  -k <kind>       only echo, flow, send or recv records (repeatable)\n");
+  fprintf(stdout, "  -l <usecs>      only records with a latency of at least usecs\n");
+}
+
+// Parse "from,to" in seconds into ns
+// Returns 0 on success, nonzero on error
+static int parse_range(const char *arg, uint64_t *from, uint64_t *to)
+{
+  const char *comma = strchr(arg, ',');
+  char *end;
+  double v;
+
+  if (comma == NULL) {
+    return -1;
+  }
+  if (comma != arg) {
+    v = strtod(arg, &end);
+    if (end != comma || v < 0) {
+      return -1;
+    }
+    *from = (uint64_t)(v * 1e9);
+  }
+  if (comma[1] != '\0') {
+    v = strtod(comma + 1, &end);
+    if (*end != '\0' || v < 0) {
+      return -1;
+    }
+    *to = (uint64_t)(v * 1e9);
+  }
+  return 0;
+}
+
+static int block_may_match(const struct column_header *h, const struct colscan_query *q)
+{
+  if (h->ts_max < q->ts_from || h->ts_min > q->ts_to || !(h->kinds & q->kinds)) {
+    return 0;
+  }
+  return h->value_max[0] >= q->min_ns || h->value_max[1] >= q->min_ns;
+}
+
+static int record_matches(const struct writer_record *r, const struct colscan_query *q)
+{
+  if (r->ts_ns < q->ts_from || r->ts_ns > q->ts_to || !(q->kinds & (1U << (r->kind & 31)))) {
+    return 0;
+  }
+  return r->value_ns[0] >= q->min_ns || r->value_ns[1] >= q->min_ns;
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *kind_names[] = { "echo", "flow", "send", "recv" };
+  struct colscan_query q = { 0, UINT64_MAX, 0, INT64_MIN };
+  struct writer_record *recs;
+  struct column_header h;
+  struct writer writer;
+  struct writer_stream *out;
+  int out_format = WRITER_FORMAT_TEXT;
+  unsigned long long nblocks = 0;
+  unsigned long long skipped = 0;
+  unsigned long long nrecords = 0;
+  unsigned long long matched = 0;
+  FILE *fp;
+  int ret;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "f:t:k:l:")) != -1) {
+    switch (opt) {
+      case 'f':
+        out_format = writer_format_parse(optarg);
+        if (out_format < 0 || out_format == WRITER_FORMAT_COLUMN) {
+          fprintf(stderr, "Unknown format '%s'\n", optarg);
+          usage();
+          return 1;
+        }
+        break;
+      case 't':
+        if (parse_range(optarg, &q.ts_from, &q.ts_to)) {
+          fprintf(stderr, "Invalid time range '%s'\n", optarg);
+          usage();
+          return 1;
+        }
+        break;
+      case 'k':
+        for (i = 0; i < 4 && strcmp(optarg, kind_names[i]); i++) {
+        }
+        if (i == 4) {
+          fprintf(stderr, "Unknown kind '%s'\n", optarg);
+          usage();
+          return 1;
+        }
+        q.kinds |= 1U << i;
+        break;
+      case 'l':
+        q.min_ns = (int64_t)(atof(optarg) * 1000);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    return 1;
+  }
+  if (q.kinds == 0) {
+    q.kinds = ~0U;
+  }
+
+  fp = fopen(argv[optind], "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", argv[optind]);
+    return 1;
+  }
+  if (column_read_magic(fp)) {
+    fprintf(stderr, "'%s' is not a column file\n", argv[optind]);
+    fclose(fp);
+    return 1;
+  }
+  recs = (struct writer_record *)malloc(COLUMN_BLOCK_RECORDS * sizeof(*recs));
+  if (recs == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    fclose(fp);
+    return 1;
+  }
+
+  if (writer_start(&writer, STDOUT_FILENO, (enum writer_format)out_format)) {
+    free(recs);
+    fclose(fp);
+    return 1;
+  }
+  out = writer_stream_open(&writer, WRITER_STREAM_RECORDS);
+  if (out == NULL) {
+    fprintf(stderr, "Failed to open output stream\n");
+    writer_stop(&writer);
+    free(recs);
+    fclose(fp);
+    return 1;
+  }
+
+  while ((ret = column_read_header(fp, &h)) > 0) {
+    nblocks++;
+    if (!block_may_match(&h, &q)) {
+      skipped++;
+      if (column_skip_block(fp, &h)) {
+        ret = -1;
+        break;
+      }
+      continue;
+    }
+    if (column_read_block(fp, &h, recs)) {
+      ret = -1;
+      break;
+    }
+    nrecords += h.nrecords;
+    for (i = 0; i < (int)h.nrecords; i++) {
+      if (record_matches(&recs[i], &q)) {
+        writer_append_wait(out, &recs[i]);
+        matched++;
+      }
+    }
+  }
+  writer_stop(&writer);
+  if (ret < 0) {
+    fprintf(stderr, "Malformed block %llu in '%s'\n", nblocks, argv[optind]);
+  }
+  fprintf(stderr, "%llu blocks, %llu skipped, %llu records decoded, %llu matched\n",
+          nblocks, skipped, nrecords, matched);
+
+  free(recs);
+  fclose(fp);
+  return ret < 0;
+}
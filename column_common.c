@@ -0,0 +1,471 @@
+//
+// Columnar blocks of result records
+//
+// The column output format keeps results in blocks of up to
+// COLUMN_BLOCK_RECORDS records. Each field is stored as its own column,
+// encoded in whichever of these is smallest for the block:
+//   const   one value for every record (addresses of path latencies)
+//   runs    value and run length pairs (kinds, flags, sampling rates)
+//   dict    the distinct values, then an index per record (path ids,
+//           container or flow addresses)
+//   delta   the first value, then differences (time stamps, echo seqs)
+// Values are zigzag varints, divided by 1000 first when every value of
+// the column is whole microseconds, as they are for ftrace samples.
+// Per-packet results usually take 4-8 bytes per record this way, about a
+// tenth of their text form.
+//
+// Every block starts with a fixed-size header holding its length, its
+// record count, the kinds in it and the min and max of its time stamps
+// and latencies, so a reader after a time range or slow samples skips
+// whole blocks without decoding them.
+//
+// File: COLUMN_MAGIC, then blocks: a struct column_header and its columns.
+// Like the binary format, integers in headers are in host byte order.
+//
+// Requires the writer_record definitions of writer_common.c.
+//
+
+#define COLUMN_MAGIC "LATCOL01"
+#define COLUMN_BLOCK_MAGIC 0x4b4c4243 // "CBLK"
+#define COLUMN_BLOCK_RECORDS 4096
+#define COLUMN_DICT_MAX 1024 // distinct values a dict column can have
+#define COLUMN_DICT_SLOTS (2 * COLUMN_DICT_MAX) // Must be a power of two
+#define COLUMN_MAX_BYTES 12 // mode, scale and varints of a const column
+
+enum column_field {
+  COLUMN_TS,
+  COLUMN_KIND,
+  COLUMN_KEY,
+  COLUMN_VALUE0,
+  COLUMN_VALUE1,
+  COLUMN_ADDR0,
+  COLUMN_ADDR1,
+  COLUMN_PORT0,
+  COLUMN_PORT1,
+  COLUMN_PROTO,
+  COLUMN_FLAGS,
+  COLUMN_SHIFT,
+  COLUMN_NFIELDS
+};
+
+enum column_mode {
+  COLUMN_CONST,
+  COLUMN_RUNS,
+  COLUMN_DICT,
+  COLUMN_DELTA
+};
+
+struct column_header {
+  uint32_t magic;
+  uint32_t bytes; // of the columns that follow
+  uint32_t nrecords;
+  uint32_t kinds; // 1 << kind for every kind in the block
+  uint64_t ts_min;
+  uint64_t ts_max;
+  int64_t value_min[2];
+  int64_t value_max[2];
+};
+
+// A block being filled by the writer thread, and room to encode it
+struct column_block {
+  struct writer_record recs[COLUMN_BLOCK_RECORDS];
+  int n;
+  uint64_t started_ns; // monotonic time of its first record
+  int64_t values[COLUMN_BLOCK_RECORDS];
+  // Worst case per value is an index or delta of 10 bytes
+  unsigned char buf[COLUMN_NFIELDS * (COLUMN_MAX_BYTES + 10 * (COLUMN_BLOCK_RECORDS + COLUMN_DICT_MAX))];
+};
+
+static inline uint64_t column_zigzag(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t column_unzigzag(uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline size_t column_put_varint(unsigned char *p, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+static inline size_t column_varint_size(uint64_t v)
+{
+  size_t n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+// Returns the bytes used, 0 if the varint runs past end
+static inline size_t column_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+  size_t n = 0;
+  int shift = 0;
+
+  *v = 0;
+  while (p + n < end && shift < 64) {
+    *v |= (uint64_t)(p[n] & 0x7f) << shift;
+    if (!(p[n++] & 0x80)) {
+      return n;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+// One field of every record in the block
+static int64_t column_field_value(const struct writer_record *r, int field)
+{
+  switch (field) {
+    case COLUMN_TS: return (int64_t)r->ts_ns;
+    case COLUMN_KIND: return r->kind;
+    case COLUMN_KEY: return r->key;
+    case COLUMN_VALUE0: return r->value_ns[0];
+    case COLUMN_VALUE1: return r->value_ns[1];
+    case COLUMN_ADDR0: return r->addr[0];
+    case COLUMN_ADDR1: return r->addr[1];
+    case COLUMN_PORT0: return r->port[0];
+    case COLUMN_PORT1: return r->port[1];
+    case COLUMN_PROTO: return r->proto;
+    case COLUMN_FLAGS: return r->flags;
+    default: return r->sample_shift;
+  }
+}
+
+static void column_set_field(struct writer_record *r, int field, int64_t v)
+{
+  switch (field) {
+    case COLUMN_TS: r->ts_ns = (uint64_t)v; break;
+    case COLUMN_KIND: r->kind = (uint32_t)v; break;
+    case COLUMN_KEY: r->key = (uint32_t)v; break;
+    case COLUMN_VALUE0: r->value_ns[0] = v; break;
+    case COLUMN_VALUE1: r->value_ns[1] = v; break;
+    case COLUMN_ADDR0: r->addr[0] = (uint32_t)v; break;
+    case COLUMN_ADDR1: r->addr[1] = (uint32_t)v; break;
+    case COLUMN_PORT0: r->port[0] = (uint16_t)v; break;
+    case COLUMN_PORT1: r->port[1] = (uint16_t)v; break;
+    case COLUMN_PROTO: r->proto = (uint8_t)v; break;
+    case COLUMN_FLAGS: r->flags = (uint8_t)v; break;
+    default: r->sample_shift = (uint8_t)v; break;
+  }
+}
+
+// Index of v in a dict being built, adding it if new
+// Returns -1 if the dict is full
+static int column_dict_index(int64_t *dict, int *ndict, int *slots, int64_t v)
+{
+  unsigned int i = (unsigned int)((column_zigzag(v) * 0x9e3779b97f4a7c15ULL) >> 40) & (COLUMN_DICT_SLOTS - 1);
+
+  while (slots[i] >= 0) {
+    if (dict[slots[i]] == v) {
+      return slots[i];
+    }
+    i = (i + 1) & (COLUMN_DICT_SLOTS - 1);
+  }
+  if (*ndict == COLUMN_DICT_MAX) {
+    return -1;
+  }
+  dict[*ndict] = v;
+  slots[i] = (*ndict)++;
+  return slots[i];
+}
+
+// Encode n values (already scaled) in the given mode
+// Returns the bytes written
+static size_t column_encode_mode(unsigned char *p, const int64_t *v, int n, int mode,
+                                 const int64_t *dict, int ndict, const uint16_t *idx)
+{
+  size_t off = 0;
+  int run;
+  int i;
+
+  switch (mode) {
+    case COLUMN_CONST:
+      off += column_put_varint(p + off, column_zigzag(v[0]));
+      break;
+    case COLUMN_RUNS:
+      for (i = 0; i < n; i += run) {
+        for (run = 1; i + run < n && v[i + run] == v[i]; run++) {
+        }
+        off += column_put_varint(p + off, column_zigzag(v[i]));
+        off += column_put_varint(p + off, run);
+      }
+      break;
+    case COLUMN_DICT:
+      off += column_put_varint(p + off, ndict);
+      for (i = 0; i < ndict; i++) {
+        off += column_put_varint(p + off, column_zigzag(dict[i]));
+      }
+      for (i = 0; i < n; i++) {
+        off += column_put_varint(p + off, idx[i]);
+      }
+      break;
+    default:
+      off += column_put_varint(p + off, column_zigzag(v[0]));
+      for (i = 1; i < n; i++) {
+        off += column_put_varint(p + off, column_zigzag(v[i] - v[i - 1]));
+      }
+      break;
+  }
+  return off;
+}
+
+// Encode one column of the block into p, picking its smallest encoding
+// Returns the bytes written
+static size_t column_encode(struct column_block *b, int field, unsigned char *p)
+{
+  int64_t *v = b->values;
+  int64_t dict[COLUMN_DICT_MAX];
+  int slots[COLUMN_DICT_SLOTS];
+  uint16_t idx[COLUMN_BLOCK_RECORDS];
+  size_t size[4] = { 0, 0, 0, 0 };
+  int64_t scale = 1000;
+  int ndict = 0;
+  int mode = COLUMN_CONST;
+  int same = 1;
+  int i;
+  int m;
+
+  for (i = 0; i < b->n; i++) {
+    v[i] = column_field_value(&b->recs[i], field);
+    same &= v[i] == v[0];
+    if (v[i] % 1000) {
+      scale = 1;
+    }
+  }
+  if (scale != 1) {
+    for (i = 0; i < b->n; i++) {
+      v[i] /= scale;
+    }
+  }
+
+  if (!same) {
+    memset(slots, -1, sizeof(slots));
+    size[COLUMN_CONST] = SIZE_MAX;
+    size[COLUMN_DELTA] = column_varint_size(column_zigzag(v[0]));
+    size[COLUMN_RUNS] = 0;
+    for (i = 0; i < b->n; i++) {
+      if (i > 0) {
+        size[COLUMN_DELTA] += column_varint_size(column_zigzag(v[i] - v[i - 1]));
+      }
+      if (i == 0 || v[i] != v[i - 1]) {
+        size[COLUMN_RUNS] += column_varint_size(column_zigzag(v[i])) + 1;
+      }
+      if (size[COLUMN_DICT] != SIZE_MAX) {
+        m = column_dict_index(dict, &ndict, slots, v[i]);
+        if (m < 0) {
+          size[COLUMN_DICT] = SIZE_MAX;
+        } else {
+          idx[i] = (uint16_t)m;
+          size[COLUMN_DICT] += column_varint_size(m);
+        }
+      }
+    }
+    if (size[COLUMN_DICT] != SIZE_MAX) {
+      size[COLUMN_DICT] += column_varint_size(ndict);
+      for (i = 0; i < ndict; i++) {
+        size[COLUMN_DICT] += column_varint_size(column_zigzag(dict[i]));
+      }
+    }
+    mode = COLUMN_DELTA;
+    for (m = COLUMN_RUNS; m <= COLUMN_DICT; m++) {
+      if (size[m] < size[mode]) {
+        mode = m;
+      }
+    }
+  }
+
+  p[0] = (unsigned char)mode;
+  p[1] = scale != 1;
+  return 2 + column_encode_mode(p + 2, v, b->n, mode, dict, ndict, idx);
+}
+
+// Encode the block's records behind a header in b->buf
+// Returns the bytes to write, header included
+static size_t column_block_encode(struct column_block *b)
+{
+  struct column_header h;
+  size_t off = sizeof(h);
+  int dir;
+  int i;
+  int f;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = COLUMN_BLOCK_MAGIC;
+  h.nrecords = b->n;
+  h.ts_min = UINT64_MAX;
+  for (dir = 0; dir < 2; dir++) {
+    h.value_min[dir] = INT64_MAX;
+    h.value_max[dir] = INT64_MIN;
+  }
+  for (i = 0; i < b->n; i++) {
+    h.kinds |= 1U << (b->recs[i].kind & 31);
+    if (b->recs[i].ts_ns < h.ts_min) {
+      h.ts_min = b->recs[i].ts_ns;
+    }
+    if (b->recs[i].ts_ns > h.ts_max) {
+      h.ts_max = b->recs[i].ts_ns;
+    }
+    for (dir = 0; dir < 2; dir++) {
+      if (b->recs[i].value_ns[dir] < h.value_min[dir]) {
+        h.value_min[dir] = b->recs[i].value_ns[dir];
+      }
+      if (b->recs[i].value_ns[dir] > h.value_max[dir]) {
+        h.value_max[dir] = b->recs[i].value_ns[dir];
+      }
+    }
+  }
+  for (f = 0; f < COLUMN_NFIELDS; f++) {
+    off += column_encode(b, f, b->buf + off);
+  }
+  h.bytes = off - sizeof(h);
+  memcpy(b->buf, &h, sizeof(h));
+  b->n = 0;
+  return off;
+}
+
+// Decode one column of n records from p into recs
+// Returns the bytes used, 0 if the column is malformed
+static size_t column_decode(const unsigned char *p, const unsigned char *end, int field,
+                            struct writer_record *recs, int n)
+{
+  const unsigned char *start = p;
+  int64_t dict[COLUMN_DICT_MAX];
+  uint64_t u;
+  uint64_t run;
+  uint64_t ndict;
+  int64_t scale;
+  int64_t v = 0;
+  int mode;
+  size_t k;
+  int i;
+
+  if (end - p < 2) {
+    return 0;
+  }
+  mode = p[0];
+  scale = p[1] ? 1000 : 1;
+  p += 2;
+
+#define COLUMN_GET(x) do { k = column_get_varint(p, end, &(x)); if (k == 0) return 0; p += k; } while (0)
+  switch (mode) {
+    case COLUMN_CONST:
+      COLUMN_GET(u);
+      for (i = 0; i < n; i++) {
+        column_set_field(&recs[i], field, column_unzigzag(u) * scale);
+      }
+      break;
+    case COLUMN_RUNS:
+      for (i = 0; i < n; ) {
+        COLUMN_GET(u);
+        COLUMN_GET(run);
+        if (run == 0 || run > (uint64_t)(n - i)) {
+          return 0;
+        }
+        for (; run > 0; run--, i++) {
+          column_set_field(&recs[i], field, column_unzigzag(u) * scale);
+        }
+      }
+      break;
+    case COLUMN_DICT:
+      COLUMN_GET(ndict);
+      if (ndict > COLUMN_DICT_MAX) {
+        return 0;
+      }
+      for (k = 0; k < ndict; ) {
+        COLUMN_GET(u);
+        dict[k++] = column_unzigzag(u);
+      }
+      for (i = 0; i < n; i++) {
+        COLUMN_GET(u);
+        if (u >= ndict) {
+          return 0;
+        }
+        column_set_field(&recs[i], field, dict[u] * scale);
+      }
+      break;
+    case COLUMN_DELTA:
+      for (i = 0; i < n; i++) {
+        COLUMN_GET(u);
+        v += column_unzigzag(u);
+        column_set_field(&recs[i], field, v * scale);
+      }
+      break;
+    default:
+      return 0;
+  }
+#undef COLUMN_GET
+  return p - start;
+}
+
+// Check a file's magic
+// Returns 0 if it is a column file, nonzero otherwise
+int column_read_magic(FILE *fp)
+{
+  char magic[8];
+
+  return fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, COLUMN_MAGIC, 8);
+}
+
+// Read the next block's header
+// Returns 1 if there is one, 0 at the end of the file, -1 if it is malformed
+int column_read_header(FILE *fp, struct column_header *h)
+{
+  size_t n = fread(h, 1, sizeof(*h), fp);
+
+  if (n == 0) {
+    return 0;
+  }
+  if (n != sizeof(*h) || h->magic != COLUMN_BLOCK_MAGIC || h->nrecords > COLUMN_BLOCK_RECORDS) {
+    return -1;
+  }
+  return 1;
+}
+
+// Skip the columns of the block whose header was just read
+// Returns 0 on success, nonzero on error
+int column_skip_block(FILE *fp, const struct column_header *h)
+{
+  return fseeko(fp, h->bytes, SEEK_CUR);
+}
+
+// Read and decode the columns of the block whose header was just read
+// into recs, which has room for COLUMN_BLOCK_RECORDS
+// Returns 0 on success, nonzero if the block is malformed
+int column_read_block(FILE *fp, const struct column_header *h, struct writer_record *recs)
+{
+  unsigned char *buf;
+  size_t off = 0;
+  size_t n;
+  int f;
+
+  buf = (unsigned char *)malloc(h->bytes ? h->bytes : 1);
+  if (buf == NULL || fread(buf, 1, h->bytes, fp) != h->bytes) {
+    free(buf);
+    return -1;
+  }
+  memset(recs, 0, h->nrecords * sizeof(*recs));
+  for (f = 0; f < COLUMN_NFIELDS; f++) {
+    n = column_decode(buf + off, buf + h->bytes, f, recs, h->nrecords);
+    if (n == 0) {
+      free(buf);
+      return -1;
+    }
+    off += n;
+  }
+  free(buf);
+  return 0;
+}
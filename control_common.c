@@ -0,0 +1,224 @@
+//
+// Line-oriented control socket for long-running monitors
+//
+// A control thread listens on a Unix socket path. Each line a client sends
+// is one command, handed to the tool's handler; the reply is whatever the
+// handler printed followed by a final "ok" or "error" line, e.g.
+//
+//   $ echo 'add host 10.0.0.2' | socat - UNIX-CONNECT:/run/iface_diff.sock
+//   ok
+//
+// Clients are served one at a time, which keeps handlers simple: a handler
+// only has to guard the state it shares with the capture/trace threads.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_BACKLOG 4
+#define CONTROL_LINE_BUFFER 1024
+#define CONTROL_REPLY_BUFFER 0x4000
+#define CONTROL_POLL_MS 500
+
+struct control_reply {
+  char buf[CONTROL_REPLY_BUFFER];
+  size_t len;
+};
+
+struct control_server {
+  int fd;
+  char path[108];
+  // Returns 0 if the command succeeded, nonzero otherwise
+  int (*handle)(char *line, struct control_reply *reply, void *arg);
+  void *arg;
+  pthread_t thread;
+  volatile int running;
+};
+
+void control_printf(struct control_reply *r, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  if (r->len >= sizeof(r->buf)) {
+    return;
+  }
+  va_start(ap, fmt);
+  n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+  va_end(ap);
+  if (n > 0) {
+    r->len += n;
+    if (r->len > sizeof(r->buf) - 1) {
+      r->len = sizeof(r->buf) - 1;
+    }
+  }
+}
+
+// Split off the first word of a command line.
+// Returns the rest of the line (never NULL), with leading blanks skipped.
+char *control_next_word(char *line, char **word)
+{
+  line += strspn(line, " \t");
+  *word = line;
+  line += strcspn(line, " \t");
+  if (*line != '\0') {
+    *line++ = '\0';
+  }
+  return line + strspn(line, " \t");
+}
+
+// A client that hangs up before its reply mustn't kill the daemon with SIGPIPE
+static int control_write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void control_serve(struct control_server *cs, int conn)
+{
+  struct control_reply *reply;
+  char line_buf[CONTROL_LINE_BUFFER];
+  size_t line_len = 0;
+  struct pollfd pfd;
+  ssize_t nbytes;
+  char *line;
+  char *nl;
+  int ret;
+
+  reply = (struct control_reply *)malloc(sizeof(struct control_reply));
+  if (reply == NULL) {
+    return;
+  }
+
+  pfd.fd = conn;
+  pfd.events = POLLIN;
+  while (cs->running) {
+    if (poll(&pfd, 1, CONTROL_POLL_MS) <= 0) {
+      continue;
+    }
+    nbytes = read(conn, line_buf + line_len, sizeof(line_buf) - line_len - 1);
+    if (nbytes <= 0) {
+      break;
+    }
+    line_len += nbytes;
+    line_buf[line_len] = '\0';
+
+    line = line_buf;
+    while ((nl = strchr(line, '\n')) != NULL) {
+      *nl = '\0';
+      if (nl > line && nl[-1] == '\r') {
+        nl[-1] = '\0';
+      }
+      if (line[strspn(line, " \t")] != '\0') {
+        reply->len = 0;
+        ret = cs->handle(line, reply, cs->arg);
+        control_printf(reply, ret ? "error\n" : "ok\n");
+        if (control_write_all(conn, reply->buf, reply->len)) {
+          free(reply);
+          return;
+        }
+      }
+      line = nl + 1;
+    }
+
+    // Keep a partial line; drop one too long to ever finish
+    line_len -= line - line_buf;
+    if (line_len == sizeof(line_buf) - 1) {
+      line_len = 0;
+    }
+    memmove(line_buf, line, line_len);
+  }
+  free(reply);
+}
+
+static void *control_thread(void *arg)
+{
+  struct control_server *cs = (struct control_server *)arg;
+  struct pollfd pfd;
+  int conn;
+
+  pfd.fd = cs->fd;
+  pfd.events = POLLIN;
+  while (cs->running) {
+    if (poll(&pfd, 1, CONTROL_POLL_MS) <= 0) {
+      continue;
+    }
+    conn = accept(cs->fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    control_serve(cs, conn);
+    close(conn);
+  }
+  return NULL;
+}
+
+// Start accepting commands on the Unix socket at path
+// Returns 0 on success, nonzero on error
+int control_start(struct control_server *cs, const char *path,
+                  int (*handle)(char *, struct control_reply *, void *), void *arg)
+{
+  struct sockaddr_un sun;
+
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    fprintf(stderr, "Control socket path too long: %s\n", path);
+    return -1;
+  }
+  cs->handle = handle;
+  cs->arg = arg;
+
+  cs->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (cs->fd < 0) {
+    perror("control socket");
+    return -1;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  unlink(path);
+  if (bind(cs->fd, (struct sockaddr *)&sun, sizeof(sun))) {
+    fprintf(stderr, "Failed to bind control socket %s: %s\n", path, strerror(errno));
+    close(cs->fd);
+    return -1;
+  }
+  if (listen(cs->fd, CONTROL_BACKLOG)) {
+    perror("control listen");
+    close(cs->fd);
+    return -1;
+  }
+  strcpy(cs->path, path);
+
+  cs->running = 1;
+  if (pthread_create(&cs->thread, NULL, control_thread, cs)) {
+    fprintf(stderr, "Failed to start control thread\n");
+    close(cs->fd);
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
+
+void control_stop(struct control_server *cs)
+{
+  cs->running = 0;
+  pthread_join(cs->thread, NULL);
+  close(cs->fd);
+  unlink(cs->path);
+}
@@ -0,0 +1,283 @@
+//
+// Build tight capture filters from the set of monitored targets
+//
+// Targets are written one per line (on the command line, in a targets
+// file or later over a control socket) as:
+//
+//   host <ipv4>                                  traffic to or from an address
+//   icmp-id <id>                                 icmp echo with the given identifier
+//   flow <tcp|udp> <ipv4>:<port> <ipv4>:<port>   one 5-tuple, either direction
+//
+// The set is turned into a pcap filter expression and compiled by libpcap
+// into a classic BPF program, so anything outside the set is dropped in the
+// kernel and never copied to user space.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define FILTER_MAX_TARGETS 64
+#define FILTER_TEXT_SIZE 8192
+
+enum filter_target_type {
+  FILTER_TARGET_HOST,
+  FILTER_TARGET_ICMP_ID,
+  FILTER_TARGET_FLOW
+};
+
+struct filter_target {
+  enum filter_target_type type;
+  uint8_t proto;
+  struct in_addr addr[2];
+  uint16_t port[2];
+  uint16_t echo_id;
+};
+
+struct filter_set {
+  int ntargets;
+  struct filter_target targets[FILTER_MAX_TARGETS];
+};
+
+void filter_set_init(struct filter_set *fs)
+{
+  fs->ntargets = 0;
+}
+
+// Parse "<ipv4>:<port>"
+// Returns 0 on success, nonzero on error
+static int filter_parse_endpoint(char *str, struct in_addr *addr, uint16_t *port)
+{
+  char *colon = strchr(str, ':');
+  char *end;
+  unsigned long val;
+
+  if (colon == NULL) {
+    return -1;
+  }
+  *colon = '\0';
+  if (!inet_pton(AF_INET, str, addr)) {
+    return -1;
+  }
+  val = strtoul(colon + 1, &end, 10);
+  if (*end != '\0' || val > 0xffff) {
+    return -1;
+  }
+  *port = val;
+  return 0;
+}
+
+// Parse a target line into t
+// Returns 0 on success, nonzero on syntax error
+int filter_target_parse(const char *line, struct filter_target *t)
+{
+  char buf[256];
+  char *words[4];
+  char *save = NULL;
+  char *end;
+  unsigned long val;
+  int nwords = 0;
+  char *w;
+
+  strncpy(buf, line, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+
+  for (w = strtok_r(buf, " \t\n", &save);
+       w != NULL && nwords < 4;
+       w = strtok_r(NULL, " \t\n", &save)) {
+    words[nwords++] = w;
+  }
+  if (nwords == 0) {
+    return -1;
+  }
+
+  memset(t, 0, sizeof(*t));
+
+  if (!strcmp(words[0], "host") && nwords == 2) {
+    t->type = FILTER_TARGET_HOST;
+    return !inet_pton(AF_INET, words[1], &t->addr[0]);
+  }
+
+  if (!strcmp(words[0], "icmp-id") && nwords == 2) {
+    t->type = FILTER_TARGET_ICMP_ID;
+    val = strtoul(words[1], &end, 0);
+    if (*end != '\0' || val > 0xffff) {
+      return -1;
+    }
+    t->echo_id = val;
+    return 0;
+  }
+
+  if (!strcmp(words[0], "flow") && nwords == 4) {
+    t->type = FILTER_TARGET_FLOW;
+    if (!strcmp(words[1], "tcp")) {
+      t->proto = IPPROTO_TCP;
+    } else if (!strcmp(words[1], "udp")) {
+      t->proto = IPPROTO_UDP;
+    } else {
+      return -1;
+    }
+    if (filter_parse_endpoint(words[2], &t->addr[0], &t->port[0])
+     || filter_parse_endpoint(words[3], &t->addr[1], &t->port[1])) {
+      return -1;
+    }
+    return 0;
+  }
+
+  return -1;
+}
+
+static int filter_target_equal(const struct filter_target *a, const struct filter_target *b)
+{
+  return a->type == b->type
+      && a->proto == b->proto
+      && a->addr[0].s_addr == b->addr[0].s_addr
+      && a->addr[1].s_addr == b->addr[1].s_addr
+      && a->port[0] == b->port[0]
+      && a->port[1] == b->port[1]
+      && a->echo_id == b->echo_id;
+}
+
+// Add a target to the set, ignoring duplicates
+// Returns 0 on success, nonzero if the set is full
+int filter_set_add(struct filter_set *fs, const struct filter_target *t)
+{
+  int i;
+  for (i = 0; i < fs->ntargets; i++) {
+    if (filter_target_equal(&fs->targets[i], t)) {
+      return 0;
+    }
+  }
+  if (fs->ntargets == FILTER_MAX_TARGETS) {
+    return -1;
+  }
+  fs->targets[fs->ntargets++] = *t;
+  return 0;
+}
+
+// Remove a target from the set
+// Returns 0 if it was found, nonzero otherwise
+int filter_set_del(struct filter_set *fs, const struct filter_target *t)
+{
+  int i;
+  for (i = 0; i < fs->ntargets; i++) {
+    if (filter_target_equal(&fs->targets[i], t)) {
+      fs->targets[i] = fs->targets[--fs->ntargets];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Read targets from a file, one per line, '#' starts a comment
+// Returns the number of targets read or -1 if the file can't be opened
+int filter_set_load(struct filter_set *fs, const char *path)
+{
+  FILE *fp;
+  char line[256];
+  struct filter_target t;
+  int n = 0;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open targets file '%s'\n", path);
+    return -1;
+  }
+  filter_set_init(fs);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0') {
+      continue;
+    }
+    if (filter_target_parse(line, &t)) {
+      fprintf(stderr, "Ignoring bad target: %s", line);
+      continue;
+    }
+    if (filter_set_add(fs, &t)) {
+      fprintf(stderr, "Too many targets, ignoring: %s", line);
+      continue;
+    }
+    n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+// Write a target back out in the syntax filter_target_parse reads
+int filter_target_format(const struct filter_target *t, char *buf, size_t len)
+{
+  char a[INET_ADDRSTRLEN];
+  char b[INET_ADDRSTRLEN];
+
+  switch (t->type) {
+    case FILTER_TARGET_HOST:
+      inet_ntop(AF_INET, &t->addr[0], a, sizeof(a));
+      return snprintf(buf, len, "host %s", a);
+    case FILTER_TARGET_ICMP_ID:
+      return snprintf(buf, len, "icmp-id %u", t->echo_id);
+    case FILTER_TARGET_FLOW:
+      inet_ntop(AF_INET, &t->addr[0], a, sizeof(a));
+      inet_ntop(AF_INET, &t->addr[1], b, sizeof(b));
+      return snprintf(buf, len, "flow %s %s:%u %s:%u",
+          t->proto == IPPROTO_TCP ? "tcp" : "udp",
+          a, t->port[0], b, t->port[1]);
+  }
+  return 0;
+}
+
+// Write the filter expression for one target into buf
+static int filter_target_text(const struct filter_target *t, char *buf, size_t len)
+{
+  char a[INET_ADDRSTRLEN];
+  char b[INET_ADDRSTRLEN];
+
+  switch (t->type) {
+    case FILTER_TARGET_HOST:
+      inet_ntop(AF_INET, &t->addr[0], a, sizeof(a));
+      return snprintf(buf, len, "host %s", a);
+    case FILTER_TARGET_ICMP_ID:
+      return snprintf(buf, len, "((icmp and icmp[4:2] == %u) or (icmp6 and icmp6[4:2] == %u))",
+          t->echo_id, t->echo_id);
+    case FILTER_TARGET_FLOW:
+      inet_ntop(AF_INET, &t->addr[0], a, sizeof(a));
+      inet_ntop(AF_INET, &t->addr[1], b, sizeof(b));
+      return snprintf(buf, len,
+          "(%s and host %s and host %s and port %u and port %u)",
+          t->proto == IPPROTO_TCP ? "tcp" : "udp",
+          a, b, t->port[0], t->port[1]);
+  }
+  return 0;
+}
+
+// Build the full filter: the base protocol expression narrowed to the targets.
+// With no targets this is just the base expression.
+// Returns 0 on success, nonzero if the expression does not fit in buf.
+int filter_set_text(const struct filter_set *fs, const char *base, char *buf, size_t len)
+{
+  size_t off;
+  int i;
+
+  off = snprintf(buf, len, "(%s)", base);
+  if (off >= len) {
+    return -1;
+  }
+  if (fs->ntargets == 0) {
+    return 0;
+  }
+
+  off += snprintf(buf + off, len - off, " and (");
+  for (i = 0; i < fs->ntargets && off < len; i++) {
+    if (i > 0) {
+      off += snprintf(buf + off, len - off, " or ");
+    }
+    if (off < len) {
+      off += filter_target_text(&fs->targets[i], buf + off, len - off);
+    }
+  }
+  if (off < len) {
+    off += snprintf(buf + off, len - off, ")");
+  }
+  return off >= len;
+}
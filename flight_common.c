@@ -0,0 +1,309 @@
+//
+// Flight recorder: recent raw events, dumped around outliers
+//
+// Every hot thread owns a flight_recorder and copies each event it handles
+// into it, time stamp and all. The recorder is a pair of byte rings: the
+// active one is overwritten oldest first, so it always holds about the last
+// FLIGHT_RING_SIZE bytes of events. Copying one line is the whole
+// steady-state cost; there is no lock and nothing is shared.
+//
+// When a sample is an outlier, its owner arms a dump of a time window
+// around it. Once an event past the end of the window has been recorded,
+// the active ring is frozen and handed to the dumper thread, and recording
+// goes on in the spare ring. Nothing is copied on the hot path. The dumper
+// writes the events in the window to a file in the dump directory and
+// gives the ring back.
+//
+// Outliers inside an armed window are in its dump already. Outliers while a
+// ring is out for dumping (there is no spare then) or within
+// FLIGHT_HOLDOFF_NSEC of trace time after the last window are counted as
+// suppressed, so a burst of them gives one dump rather than a flood. The fresh ring also
+// starts empty, so a dump right after another may hold less before its
+// outlier than asked for. The rings are sized in bytes rather than time,
+// so at a high event rate they may span less than the window too. The
+// first line of every dump says what window was asked for and from when
+// it really has events.
+//
+// Requires hist_common.h for stat_add.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FLIGHT_RING_SIZE (8 << 20) // Bytes per ring, two per recorder
+#define FLIGHT_SEGMENT_SIZE (64 << 10) // Records never cross one, must divide the ring
+#define FLIGHT_LABEL_SIZE 320
+#define FLIGHT_PATH_SIZE 512
+#define FLIGHT_MAX_RECORDERS 64
+#define FLIGHT_IDLE_NSEC 10000000
+#define FLIGHT_HOLDOFF_NSEC 1000000000ULL // between the end of a window and the next
+#define FLIGHT_PAD UINT32_MAX // header len of the padding at the end of a segment
+
+enum flight_state {
+  FLIGHT_FREE, // the spare ring is the owner's
+  FLIGHT_DUMPING // the spare ring is frozen, waiting for or being dumped
+};
+
+struct flight_header {
+  uint64_t ts_ns;
+  uint32_t len;
+  uint32_t pad;
+};
+
+// Only the owner writes a ring and it never reads it back, so keeping an
+// event costs a copy into memory written just before. Records are packed
+// into segments; the segment head is in is being overwritten, the ones
+// after it hold the oldest whole records.
+struct flight_ring {
+  char *buf;
+  uint64_t head; // next byte written, counting from the start
+};
+
+struct flight_recorder {
+  int id;
+  struct flight_ring rings[2];
+  int active;
+  // Armed dump, owner only
+  int armed;
+  uint64_t from_ns;
+  uint64_t to_ns;
+  uint64_t holdoff_ns; // no new window before this
+  char label[FLIGHT_LABEL_SIZE];
+  // Handed to the dumper with the frozen ring
+  int state;
+  uint64_t dump_from_ns;
+  uint64_t dump_to_ns;
+  char dump_label[FLIGHT_LABEL_SIZE];
+  uint64_t triggers; // outliers seen
+  uint64_t suppressed; // outliers not dumped, a dump was in progress
+};
+
+struct flight_dumper {
+  char dir[FLIGHT_PATH_SIZE];
+  char prefix[64];
+  struct flight_recorder *recs[FLIGHT_MAX_RECORDERS];
+  int nrecs;
+  pthread_t thread;
+  volatile int running;
+  unsigned int seq;
+  uint64_t dumps;
+  uint64_t failed;
+};
+
+static inline uint32_t flight_rec_size(uint32_t len)
+{
+  return sizeof(struct flight_header) + ((len + 15) & ~15U);
+}
+
+// Returns 0 on success, nonzero if out of memory
+int flight_recorder_init(struct flight_recorder *fr, int id)
+{
+  memset(fr, 0, sizeof(*fr));
+  fr->id = id;
+  fr->rings[0].buf = (char *)malloc(FLIGHT_RING_SIZE);
+  fr->rings[1].buf = (char *)malloc(FLIGHT_RING_SIZE);
+  if (fr->rings[0].buf == NULL || fr->rings[1].buf == NULL) {
+    free(fr->rings[0].buf);
+    free(fr->rings[1].buf);
+    fr->rings[0].buf = fr->rings[1].buf = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void flight_recorder_free(struct flight_recorder *fr)
+{
+  free(fr->rings[0].buf);
+  free(fr->rings[1].buf);
+  fr->rings[0].buf = fr->rings[1].buf = NULL;
+}
+
+// Hand the active ring to the dumper and go on in the spare one
+static inline void flight_freeze(struct flight_recorder *fr)
+{
+  fr->dump_from_ns = fr->from_ns;
+  fr->dump_to_ns = fr->to_ns;
+  memcpy(fr->dump_label, fr->label, sizeof(fr->label));
+  fr->armed = 0;
+  fr->active ^= 1;
+  fr->rings[fr->active].head = 0;
+  __atomic_store_n(&fr->state, FLIGHT_DUMPING, __ATOMIC_RELEASE);
+}
+
+// Owner: keep one event, freezing the ring if it ends an armed window
+static inline void flight_record(struct flight_recorder *fr, uint64_t ts_ns, const char *data, uint32_t len)
+{
+  struct flight_ring *r = &fr->rings[fr->active];
+  struct flight_header *h;
+  uint32_t size = flight_rec_size(len);
+  uint64_t left;
+
+  if (r->buf == NULL || size > FLIGHT_SEGMENT_SIZE) {
+    return;
+  }
+  if (fr->armed && ts_ns > fr->to_ns) {
+    flight_freeze(fr);
+    r = &fr->rings[fr->active];
+  }
+  left = FLIGHT_SEGMENT_SIZE - r->head % FLIGHT_SEGMENT_SIZE;
+  if (left < size) {
+    // Pad out the segment, the next one starts with a record
+    ((struct flight_header *)(r->buf + r->head % FLIGHT_RING_SIZE))->len = FLIGHT_PAD;
+    r->head += left;
+  }
+  h = (struct flight_header *)(r->buf + r->head % FLIGHT_RING_SIZE);
+  h->ts_ns = ts_ns;
+  h->len = len;
+  memcpy(h + 1, data, len);
+  r->head += size;
+}
+
+// Owner: an outlier at now_ns; dump the events from from_ns to to_ns
+// once they are recorded
+// Returns the dump's label to fill in if this armed a new one, else NULL
+static inline char *flight_trigger(struct flight_recorder *fr, uint64_t now_ns, uint64_t from_ns,
+                                   uint64_t to_ns)
+{
+  stat_add(&fr->triggers, 1);
+  if (fr->armed) {
+    return NULL;
+  }
+  if (fr->rings[0].buf == NULL || now_ns < fr->holdoff_ns
+   || __atomic_load_n(&fr->state, __ATOMIC_ACQUIRE) != FLIGHT_FREE) {
+    stat_add(&fr->suppressed, 1);
+    return NULL;
+  }
+  fr->armed = 1;
+  fr->from_ns = from_ns;
+  fr->to_ns = to_ns;
+  fr->holdoff_ns = to_ns + FLIGHT_HOLDOFF_NSEC;
+  return fr->label;
+}
+
+// Owner, when it stops: freeze a window still waiting for its end
+static inline void flight_flush(struct flight_recorder *fr)
+{
+  if (fr->armed) {
+    flight_freeze(fr);
+  }
+}
+
+// Dumper: write the frozen ring's window to a new file
+// Returns 0 on success, nonzero on error
+static int flight_dump(struct flight_dumper *d, struct flight_recorder *fr)
+{
+  struct flight_ring *r = &fr->rings[fr->active ^ 1];
+  struct flight_header *h;
+  char path[FLIGHT_PATH_SIZE + 128];
+  uint64_t first = 0;
+  uint64_t start = 0;
+  uint64_t seg;
+  uint64_t pos;
+  uint64_t n = 0;
+  FILE *fp;
+
+  // The oldest whole segment: the first boundary at or after where the
+  // ring's bytes begin, which is head's own segment once it is full
+  if (r->head > FLIGHT_RING_SIZE) {
+    start = r->head - FLIGHT_RING_SIZE + FLIGHT_SEGMENT_SIZE - 1;
+    start -= start % FLIGHT_SEGMENT_SIZE;
+  }
+  if (start < r->head) {
+    first = ((struct flight_header *)(r->buf + start % FLIGHT_RING_SIZE))->ts_ns;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s-%u-%d.trace", d->dir, d->prefix, d->seq++, fr->id);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to create flight recorder dump '%s'\n", path);
+    return -1;
+  }
+  fprintf(fp, "# flight recorder: %s\n", fr->dump_label);
+  fprintf(fp, "# window %llu.%06llu-%llu.%06llu, events from %llu.%06llu\n",
+          (unsigned long long)(fr->dump_from_ns / 1000000000ULL),
+          (unsigned long long)(fr->dump_from_ns % 1000000000ULL / 1000),
+          (unsigned long long)(fr->dump_to_ns / 1000000000ULL),
+          (unsigned long long)(fr->dump_to_ns % 1000000000ULL / 1000),
+          (unsigned long long)(first / 1000000000ULL),
+          (unsigned long long)(first % 1000000000ULL / 1000));
+  for (seg = start; seg < r->head; seg += FLIGHT_SEGMENT_SIZE) {
+    for (pos = seg; pos < r->head && pos < seg + FLIGHT_SEGMENT_SIZE; pos += flight_rec_size(h->len)) {
+      h = (struct flight_header *)(r->buf + pos % FLIGHT_RING_SIZE);
+      if (h->len == FLIGHT_PAD) {
+        break;
+      }
+      if (h->ts_ns >= fr->dump_from_ns && h->ts_ns <= fr->dump_to_ns) {
+        fwrite(h + 1, 1, h->len, fp);
+        fputc('\n', fp);
+        n++;
+      }
+    }
+  }
+  if (fclose(fp)) {
+    fprintf(stderr, "Failed to write flight recorder dump '%s'\n", path);
+    return -1;
+  }
+  fprintf(stderr, "Flight recorder: %s, %llu events in %s\n", fr->dump_label, (unsigned long long)n, path);
+  return 0;
+}
+
+// Dump every frozen ring, returning them to their owners
+static void flight_dump_all(struct flight_dumper *d)
+{
+  int i;
+
+  for (i = 0; i < d->nrecs; i++) {
+    if (__atomic_load_n(&d->recs[i]->state, __ATOMIC_ACQUIRE) != FLIGHT_DUMPING) {
+      continue;
+    }
+    if (flight_dump(d, d->recs[i])) {
+      d->failed++;
+    } else {
+      d->dumps++;
+    }
+    __atomic_store_n(&d->recs[i]->state, FLIGHT_FREE, __ATOMIC_RELEASE);
+  }
+}
+
+static void *flight_thread(void *arg)
+{
+  struct flight_dumper *d = (struct flight_dumper *)arg;
+  struct timespec idle = { 0, FLIGHT_IDLE_NSEC };
+
+  while (d->running) {
+    flight_dump_all(d);
+    nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+// Start the dumper for recs, writing <dir>/<prefix>-<n>-<recorder id>.trace
+// Returns 0 on success, nonzero on error
+int flight_start(struct flight_dumper *d, const char *dir, const char *prefix,
+                 struct flight_recorder **recs, int nrecs)
+{
+  memset(d, 0, sizeof(*d));
+  snprintf(d->dir, sizeof(d->dir), "%s", dir);
+  snprintf(d->prefix, sizeof(d->prefix), "%s", prefix);
+  d->nrecs = nrecs < FLIGHT_MAX_RECORDERS ? nrecs : FLIGHT_MAX_RECORDERS;
+  memcpy(d->recs, recs, d->nrecs * sizeof(*recs));
+  d->running = 1;
+  if (pthread_create(&d->thread, NULL, flight_thread, d)) {
+    fprintf(stderr, "Failed to start flight recorder thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Stop the dumper once the recorders' owners have stopped and flushed,
+// writing what they left frozen
+void flight_stop(struct flight_dumper *d)
+{
+  d->running = 0;
+  pthread_join(d->thread, NULL);
+  flight_dump_all(d);
+}
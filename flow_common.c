@@ -0,0 +1,331 @@
+//
+// Packet identity fingerprints for matching arbitrary TCP/UDP packets
+// across two capture points.
+//
+// Each packet is reduced to a 64-bit fingerprint built from fields that
+// survive forwarding through a bridge/veth pair: IP id, total length,
+// protocol, TCP seq/ack (or UDP length) and a prefix of the payload.
+// Addresses and ports are mixed in too unless the path rewrites them (NAT).
+// TTL and checksums are deliberately left out since routing changes them.
+// Frames may carry up to two vlan tags (decode_link in decode_common.c,
+// which the includer pulls in first); only IPv4 packets are fingerprinted,
+// as results and the sampling key (the IP id) are IPv4 only.
+//
+// Fingerprints live in a fixed-size window of buckets. An entry that
+// has not been matched within the table's window (FLOW_WINDOW_NSEC unless
+// set) is considered stale, counted as expired and reused, so memory is
+// bounded no matter how many packets go unmatched. Every lookup checks
+// the few ways of its bucket, and lookups also sweep the table along in
+// capture time, all of it once a window, so an entry whose bucket is
+// never used again is still counted within two windows of its packet.
+//
+// The table isn't on a timing wheel (wheel_common.h) like the echo and
+// skb state: both devices' capture threads use it under per-bucket locks,
+// and a wheel has a single owner, so every packet would take one lock
+// for the whole table. The sweep takes a bucket lock at a time and is
+// skipped by a thread that finds the other one sweeping.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "time_common.h"
+
+#define FLOW_PAYLOAD_PREFIX 16
+#define FLOW_BUCKET_COUNT 4096 // Must be a power of two
+#define FLOW_BUCKET_WAYS 4
+#define FLOW_WINDOW_NSEC 1000000000
+
+// Snap length needed to see the fingerprinted fields behind two vlan tags
+// and maximal headers
+#define FLOW_CAPLEN (sizeof(struct ether_header) + 8 + 60 + 60 + FLOW_PAYLOAD_PREFIX)
+
+// Fields pulled out of a packet while fingerprinting
+struct flow_key {
+  uint64_t fp;
+  uint8_t proto;
+  struct in_addr src;
+  struct in_addr dst;
+  uint16_t sport;
+  uint16_t dport;
+  uint16_t ip_id; // host order, same on both devices (see sample_common.h)
+};
+
+struct flow_entry {
+  uint64_t fp;
+  struct timespec ts;
+  int dev_id;
+  int used;
+};
+
+struct flow_bucket {
+  pthread_mutex_t lock;
+  struct flow_entry ways[FLOW_BUCKET_WAYS];
+};
+
+struct flow_table {
+  struct flow_bucket buckets[FLOW_BUCKET_COUNT];
+  int ignore_addrs;
+  int64_t window_ns;
+  pthread_mutex_t sweep_lock; // tried, never waited for
+  uint64_t sweep_ns; // capture time the sweep has caught up with, 0 before the first packet
+  unsigned int sweep_next; // next bucket to sweep
+  unsigned long long matched;
+  unsigned long long evicted; // still in the window, but pushed out by newer packets
+  unsigned long long expired; // out of the window unmatched
+};
+
+// 64-bit FNV-1a, folded in a few bytes at a time
+static inline uint64_t flow_hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+void flow_table_init(struct flow_table *tbl, int ignore_addrs)
+{
+  int i;
+  for (i = 0; i < FLOW_BUCKET_COUNT; i++) {
+    pthread_mutex_init(&tbl->buckets[i].lock, NULL);
+    memset(tbl->buckets[i].ways, 0, sizeof(tbl->buckets[i].ways));
+  }
+  tbl->ignore_addrs = ignore_addrs;
+  tbl->window_ns = FLOW_WINDOW_NSEC;
+  pthread_mutex_init(&tbl->sweep_lock, NULL);
+  tbl->sweep_ns = 0;
+  tbl->sweep_next = 0;
+  tbl->matched = 0;
+  tbl->evicted = 0;
+  tbl->expired = 0;
+}
+
+// Fingerprint an ethernet frame
+// Returns nonzero if the frame was a TCP or UDP packet we could fingerprint
+int flow_fingerprint(const u_char *data, unsigned int caplen,
+                     int ignore_addrs, struct flow_key *key)
+{
+  const struct ip *ip_hdr;
+  const struct tcphdr *tcp_hdr;
+  const struct udphdr *udp_hdr;
+  const u_char *payload;
+  const u_char *end = data + caplen;
+  unsigned int l3_off;
+  unsigned int ip_hlen;
+  unsigned int l4_hlen;
+  unsigned int prefix;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint16_t type;
+  uint16_t vlan;
+
+  if (caplen < sizeof(struct ether_header) + 4) {
+    return 0;
+  }
+  l3_off = decode_link(data, &type, &vlan);
+  if (type != ETHERTYPE_IP || l3_off + sizeof(struct ip) > caplen) {
+    return 0;
+  }
+
+  ip_hdr = (const struct ip *)(data + l3_off);
+  ip_hlen = ip_hdr->ip_hl * 4;
+  if (ip_hlen < sizeof(struct ip)
+   || (const u_char *)ip_hdr + ip_hlen > end) {
+    return 0;
+  }
+
+  key->proto = ip_hdr->ip_p;
+  key->src = ip_hdr->ip_src;
+  key->dst = ip_hdr->ip_dst;
+  key->ip_id = ntohs(ip_hdr->ip_id);
+
+  h = flow_hash_bytes(h, &ip_hdr->ip_id, sizeof(ip_hdr->ip_id));
+  h = flow_hash_bytes(h, &ip_hdr->ip_len, sizeof(ip_hdr->ip_len));
+  h = flow_hash_bytes(h, &ip_hdr->ip_p, sizeof(ip_hdr->ip_p));
+  if (!ignore_addrs) {
+    h = flow_hash_bytes(h, &ip_hdr->ip_src, sizeof(ip_hdr->ip_src));
+    h = flow_hash_bytes(h, &ip_hdr->ip_dst, sizeof(ip_hdr->ip_dst));
+  }
+
+  switch (ip_hdr->ip_p) {
+    case IPPROTO_TCP:
+      tcp_hdr = (const struct tcphdr *)((const u_char *)ip_hdr + ip_hlen);
+      if ((const u_char *)tcp_hdr + sizeof(struct tcphdr) > end) {
+        return 0;
+      }
+      l4_hlen = tcp_hdr->th_off * 4;
+      key->sport = ntohs(tcp_hdr->th_sport);
+      key->dport = ntohs(tcp_hdr->th_dport);
+      h = flow_hash_bytes(h, &tcp_hdr->th_seq, sizeof(tcp_hdr->th_seq));
+      h = flow_hash_bytes(h, &tcp_hdr->th_ack, sizeof(tcp_hdr->th_ack));
+      break;
+    case IPPROTO_UDP:
+      udp_hdr = (const struct udphdr *)((const u_char *)ip_hdr + ip_hlen);
+      if ((const u_char *)udp_hdr + sizeof(struct udphdr) > end) {
+        return 0;
+      }
+      l4_hlen = sizeof(struct udphdr);
+      key->sport = ntohs(udp_hdr->uh_sport);
+      key->dport = ntohs(udp_hdr->uh_dport);
+      h = flow_hash_bytes(h, &udp_hdr->uh_ulen, sizeof(udp_hdr->uh_ulen));
+      break;
+    default:
+      return 0;
+  }
+
+  if (!ignore_addrs) {
+    h = flow_hash_bytes(h, &key->sport, sizeof(key->sport));
+    h = flow_hash_bytes(h, &key->dport, sizeof(key->dport));
+  }
+
+  // Mix in whatever part of the payload prefix made it into the capture
+  payload = (const u_char *)ip_hdr + ip_hlen + l4_hlen;
+  if (payload < end) {
+    prefix = end - payload;
+    if (prefix > FLOW_PAYLOAD_PREFIX) {
+      prefix = FLOW_PAYLOAD_PREFIX;
+    }
+    h = flow_hash_bytes(h, payload, prefix);
+  }
+
+  key->fp = h;
+  return 1;
+}
+
+// Drop e if it is older than the window at ts, counting it as expired
+// Caller holds e's bucket lock
+static inline void flow_entry_expire(struct flow_table *tbl, struct flow_entry *e,
+                                     const struct timespec *ts)
+{
+  struct timespec age;
+
+  if (!e->used) {
+    return;
+  }
+  age = *ts;
+  tssub(&age, &e->ts);
+  if (age.tv_sec >= 0
+   && age.tv_sec * 1000000000LL + age.tv_nsec > tbl->window_ns) {
+    // Stale: the other side never showed up
+    e->used = 0;
+    __sync_fetch_and_add(&tbl->expired, 1);
+  }
+}
+
+// Expire stale entries in as many buckets as capture time has moved on
+// since the last sweep, all of them once a window
+static void flow_table_sweep(struct flow_table *tbl, const struct timespec *ts)
+{
+  struct flow_bucket *b;
+  uint64_t now = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+  uint64_t step = tbl->window_ns / FLOW_BUCKET_COUNT + 1;
+  uint64_t n;
+  int i;
+
+  // Most packets come less than a step after the last sweep
+  n = __atomic_load_n(&tbl->sweep_ns, __ATOMIC_RELAXED);
+  if (n != 0 && now >= n && now - n < step) {
+    return;
+  }
+  if (pthread_mutex_trylock(&tbl->sweep_lock)) {
+    return;
+  }
+  if (tbl->sweep_ns == 0 || now < tbl->sweep_ns) {
+    // First packet, or the other device's packets ran a little ahead
+    if (tbl->sweep_ns == 0) {
+      __atomic_store_n(&tbl->sweep_ns, now, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tbl->sweep_lock);
+    return;
+  }
+  n = (now - tbl->sweep_ns) / step;
+  if (n >= FLOW_BUCKET_COUNT) {
+    // A long gap: one pass is enough, and the sweep starts over from now
+    n = FLOW_BUCKET_COUNT;
+    __atomic_store_n(&tbl->sweep_ns, now, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&tbl->sweep_ns, tbl->sweep_ns + n * step, __ATOMIC_RELAXED);
+  }
+  for (; n > 0; n--) {
+    b = &tbl->buckets[tbl->sweep_next];
+    tbl->sweep_next = (tbl->sweep_next + 1) & (FLOW_BUCKET_COUNT - 1);
+    pthread_mutex_lock(&b->lock);
+    for (i = 0; i < FLOW_BUCKET_WAYS; i++) {
+      flow_entry_expire(tbl, &b->ways[i], ts);
+    }
+    pthread_mutex_unlock(&b->lock);
+  }
+  pthread_mutex_unlock(&tbl->sweep_lock);
+}
+
+// Look for the other half of this fingerprint in the window.
+// If found, writes the latency (ts - earlier ts) into delta and the device
+// that saw the packet first into first_dev, then returns nonzero.
+// Otherwise records the fingerprint and returns zero.
+int flow_table_match(struct flow_table *tbl, uint64_t fp, int dev_id,
+                     const struct timespec *ts,
+                     struct timespec *delta, int *first_dev)
+{
+  struct flow_bucket *b = &tbl->buckets[fp & (FLOW_BUCKET_COUNT - 1)];
+  struct flow_entry *e;
+  struct flow_entry *victim = NULL;
+  int i;
+  int found = 0;
+
+  flow_table_sweep(tbl, ts);
+
+  pthread_mutex_lock(&b->lock);
+  for (i = 0; i < FLOW_BUCKET_WAYS; i++) {
+    e = &b->ways[i];
+    flow_entry_expire(tbl, e, ts);
+    if (e->used && e->fp == fp && e->dev_id != dev_id) {
+      // Capture threads can deliver the two halves out of order,
+      // so go by the time stamps rather than arrival here
+      if (tsbefore(ts, &e->ts)) {
+        *delta = e->ts;
+        tssub(delta, ts);
+        *first_dev = dev_id;
+      } else {
+        *delta = *ts;
+        tssub(delta, &e->ts);
+        *first_dev = e->dev_id;
+      }
+      e->used = 0;
+      found = 1;
+      __sync_fetch_and_add(&tbl->matched, 1);
+      break;
+    }
+    if (!e->used && victim == NULL) {
+      victim = e;
+    }
+  }
+
+  if (!found) {
+    if (victim == NULL) {
+      // Bucket full of live entries: recycle the oldest
+      victim = &b->ways[0];
+      for (i = 1; i < FLOW_BUCKET_WAYS; i++) {
+        if (tsbefore(&b->ways[i].ts, &victim->ts)) {
+          victim = &b->ways[i];
+        }
+      }
+      __sync_fetch_and_add(&tbl->evicted, 1);
+    }
+    victim->fp = fp;
+    victim->ts = *ts;
+    victim->dev_id = dev_id;
+    victim->used = 1;
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  return found;
+}
@@ -0,0 +1,260 @@
+//
+// Microbenchmarks for the ftrace latency tool
+//
+// Usage: bench [-n events] [-c concurrency] [-p paths] [-r rounds] [-f text|csv] [-Z] [name...]
+//
+// Feeds net:* lines from the synthetic generator (../bench_common.c)
+// through trace_event_parse_str, through the per-path matching of
+// latency.c, and through a whole worker read loop over a file, which adds
+// the read() calls and line splitting. -p sets how many container paths
+// are configured (and how many veths the packets are spread over).
+//
+// path_churn adds and removes a container path per event, as -A does
+// while containers come and go, after the -p paths are set up.
+//
+// inflight_loss feeds only the events at the start of each path, as if
+// every packet were lost on the way: each skb waits in the in-flight
+// table until its timeout (BENCH_TIMEOUT_MS of trace time) expires it.
+//
+// read_trace_flight is read_trace with the flight recorder (-F) keeping
+// every event, at a threshold no sample reaches: its steady-state cost.
+//
+
+#include "../bench_common.c"
+
+// Pull in the worker and matching code without latency's main()
+#define main latency_main
+#include "latency.c"
+#undef main
+
+#define BENCH_TIMEOUT_MS 5 // a few thousand generated events
+
+void bench_usage()
+{
+  fprintf(stdout, "Usage: bench [-n events] [-c concurrency] [-p paths] [-r rounds]\n");
+  fprintf(stdout, "             [-f text|csv] [-Z] [name...]\n");
+  fprintf(stdout, "  -n <n>  events generated per benchmark (default %d)\n", BENCH_DEFAULT_EVENTS);
+  fprintf(stdout, "  -c <n>  skbs in flight at once, their events interleave (default 1)\n");
+  fprintf(stdout, "  -p <n>  container paths configured, veth0 to vethN-1 (default 1)\n");
+  fprintf(stdout, "  -r <n>  rounds per benchmark, the best one is reported (default %d)\n", BENCH_DEFAULT_ROUNDS);
+  fprintf(stdout, "  -f <f>  output as an aligned table (text, default) or csv\n");
+  fprintf(stdout, "  -Z      fail if a benchmark allocates after its first round\n");
+  fprintf(stdout, "  name    run only the benchmarks whose names contain one of these\n");
+}
+
+// Configure one path per generated veth, as discovery would
+// Returns 0 on success, nonzero on error
+int add_bench_paths(int npaths)
+{
+  struct discover_path dp;
+  struct latency_path *p;
+  int i;
+
+  for (i = 0; i < npaths; i++) {
+    memset(&dp, 0, sizeof(dp));
+    snprintf(dp.host_dev, sizeof(dp.host_dev), "veth%d", i);
+    strcpy(dp.uplink, "eth0");
+    p = path_from_discovery(&dp, dp.host_dev);
+    if (p == NULL || add_path(p)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench_opts opts;
+  struct bench_gen gen;
+  struct bench_run r;
+  struct trace_event evt;
+  struct worker *w;
+  struct discover_path dp;
+  struct latency_path *path;
+  char trace_path[] = "/tmp/bench_XXXXXX";
+  char **lines;
+  char *trace;
+  char *copy;
+  char *p;
+  size_t trace_len;
+  uint64_t nlines = 0;
+  uint64_t nstarts;
+  uint64_t nchurn;
+  time_t span;
+  time_t offset;
+  uint64_t i;
+  int null_fd;
+  int j;
+
+  if (bench_parse_args(argc, argv, &opts)) {
+    bench_usage();
+    return 1;
+  }
+  if (opts.npaths > MAX_PATHS) {
+    fprintf(stderr, "At most %d paths\n", MAX_PATHS);
+    return 1;
+  }
+
+  bench_gen_init(&gen, opts.concurrency, opts.npaths);
+  trace = bench_gen_net_trace(&gen, opts.events, &trace_len);
+  copy = (char *)malloc(trace_len + 1);
+  if (trace == NULL || copy == NULL) {
+    fprintf(stderr, "Failed to generate %llu events\n", (unsigned long long)opts.events);
+    return 1;
+  }
+
+  // NUL-terminated lines for calling the parser directly
+  memcpy(copy, trace, trace_len + 1);
+  for (p = copy; *p; p++) {
+    nlines += *p == '\n';
+  }
+  lines = (char **)malloc(sizeof(char *) * (nlines ? nlines : 1));
+  if (lines == NULL) {
+    return 1;
+  }
+  for (i = 0, p = copy; i < nlines; i++) {
+    lines[i] = p;
+    p = strchr(p, '\n');
+    *p++ = '\0';
+  }
+
+  // One worker, set up as latency's main does but reading a file
+  nworkers = 1;
+  if (posix_memalign((void **)&workers, 64, sizeof(struct worker))) {
+    return 1;
+  }
+  memset(workers, 0, sizeof(struct worker));
+  w = &workers[0];
+  w->cpu = -1;
+  w->seen_gen = WORKER_IDLE;
+  w->shard = agg_shard_new();
+  if (w->shard == NULL || path_pool_init()
+   || pool_init(&w->inflight_pool, sizeof(struct inflight), INFLIGHT_MAX)) {
+    return 1;
+  }
+  wheel_init(&w->wheel);
+  default_timeout_ns = BENCH_TIMEOUT_MS * 1000000ULL;
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0 || writer_start(&writer, null_fd, WRITER_FORMAT_BINARY)) {
+    return 1;
+  }
+  w->out = writer_stream_open(&writer, WRITER_STREAM_RECORDS);
+  if (add_bench_paths(opts.npaths)) {
+    fprintf(stderr, "Failed to add paths\n");
+    return 1;
+  }
+
+  w->fd = mkstemp(trace_path);
+  if (w->fd < 0 || write(w->fd, trace, trace_len) != (ssize_t)trace_len) {
+    fprintf(stderr, "Failed to write '%s'\n", trace_path);
+    return 1;
+  }
+  unlink(trace_path);
+
+  // Each churn builds a config and publishes twice, far slower than an event
+  nchurn = opts.events / 100 ? opts.events / 100 : 1;
+
+  bench_header(&opts);
+
+  if (bench_selected(&opts, "trace_event_parse_str")) {
+    for (bench_begin(&r, &opts, "trace_event_parse_str"); bench_round(&r); bench_end_round(&r, nlines)) {
+      for (i = 0; i < nlines; i++) {
+        trace_event_parse_str(lines[i], &evt);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "handle_path_event")) {
+    // Parsing included, as in the worker; subtract trace_event_parse_str for matching alone
+    for (bench_begin(&r, &opts, "handle_path_event"); bench_round(&r); bench_end_round(&r, nlines)) {
+      for (i = 0; i < nlines; i++) {
+        trace_event_parse_str(lines[i], &evt);
+        handle_event(w, cur_table, &evt);
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "inflight_loss")) {
+    // Every round runs later in trace time than the one before, as a live
+    // trace would, so the previous round's skbs expire instead of matching
+    trace_event_parse_str(lines[nlines - 1], &evt);
+    span = evt.ts.tv_sec + 1;
+    offset = 0;
+    nstarts = 0;
+    for (i = 0; i < nlines; i++) {
+      nstarts += strstr(lines[i], "netif_receive_skb") || strstr(lines[i], "netif_rx");
+    }
+    for (bench_begin(&r, &opts, "inflight_loss"); bench_round(&r); bench_end_round(&r, nstarts)) {
+      for (i = 0; i < nlines; i++) {
+        trace_event_parse_str(lines[i], &evt);
+        if (!strncmp(evt.func_name, "netif_", 6)) {
+          evt.ts.tv_sec += offset;
+          handle_event(w, cur_table, &evt);
+        }
+      }
+      offset += span;
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "read_trace")) {
+    for (bench_begin(&r, &opts, "read_trace"); bench_round(&r); bench_end_round(&r, nlines)) {
+      lseek(w->fd, 0, SEEK_SET);
+      w->line_len = 0;
+      while (!read_trace(w, cur_table)) {
+      }
+    }
+    bench_report(&r);
+  }
+
+  if (bench_selected(&opts, "read_trace_flight")) {
+    if (flight_recorder_init(&w->flight, 0)) {
+      return 1;
+    }
+    flight_on = 1;
+    flight_ns = 3600 * 1000000000ULL;
+    for (bench_begin(&r, &opts, "read_trace_flight"); bench_round(&r); bench_end_round(&r, nlines)) {
+      lseek(w->fd, 0, SEEK_SET);
+      w->line_len = 0;
+      while (!read_trace(w, cur_table)) {
+      }
+    }
+    bench_report(&r);
+    flight_on = 0;
+    flight_recorder_free(&w->flight);
+  }
+
+  if (bench_selected(&opts, "path_churn")) {
+    memset(&dp, 0, sizeof(dp));
+    strcpy(dp.host_dev, "vethchurn");
+    strcpy(dp.uplink, "eth0");
+    for (bench_begin(&r, &opts, "path_churn"); bench_round(&r); bench_end_round(&r, nchurn)) {
+      for (i = 0; i < nchurn; i++) {
+        path = path_from_discovery(&dp, dp.host_dev);
+        if (path == NULL || add_path(path)) {
+          fprintf(stderr, "Failed to add path\n");
+          return 1;
+        }
+        del_path(dp.host_dev, 0);
+      }
+    }
+    bench_report(&r);
+  }
+
+  writer_stop(&writer);
+  close(null_fd);
+  close(w->fd);
+  for (j = 0; j < npaths; j++) {
+    free_path(paths[j]);
+  }
+  pool_destroy(&path_pool);
+  pool_destroy(&w->inflight_pool);
+  agg_shard_free(w->shard);
+  free(workers);
+  free(lines);
+  free(copy);
+  free(trace);
+  return bench_alloc_failures != 0;
+}
@@ -0,0 +1,140 @@
+//
+// Print latency configs for a container's network paths
+//
+// Usage: discover [-d dir] <pid>
+//        discover -w
+//
+// With a pid, every veth in the pid's network namespace is resolved to
+// its host-side peer, bridge and uplink and printed as a latency.conf
+// (or written to <dir>/<host veth>.conf with -d).
+//
+// With -w, bridged veths are printed as they come and go, which is what
+// latency -A does internally.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include "libdiscover.h"
+
+static volatile int running = 1;
+
+void
+usage()
+{
+  fprintf(stdout, "Usage: discover [-d dir] <pid>\n");
+  fprintf(stdout, "       discover -w\n");
+  fprintf(stdout, "  -d <dir>  write one <host veth>.conf per path into dir\n");
+  fprintf(stdout, "  -w        watch bridged veths being added and removed\n");
+}
+
+void
+do_exit()
+{
+  running = 0;
+}
+
+void
+print_link_event(const struct discover_link *link, int added, void *arg)
+{
+  struct discover_link bridge;
+
+  if (strcmp(link->kind, "veth")) {
+    return;
+  }
+  if (!added) {
+    fprintf(stdout, "del %s\n", link->name);
+  } else if (link->master && !discover_link_get(link->master, &bridge)) {
+    fprintf(stdout, "add %s bridge %s\n", link->name, bridge.name);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  struct discover_path paths[DISCOVER_MAX_PATHS];
+  const char *dir = NULL;
+  char file[PATH_MAX];
+  FILE *fp;
+  int watch = 0;
+  int netns;
+  int npaths;
+  int opt;
+  int fd;
+  int i;
+
+  while ((opt = getopt(argc, argv, "d:w")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'w':
+        watch = 1;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (watch) {
+    fd = discover_watch_open();
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open netlink socket\n");
+      return 1;
+    }
+    signal(SIGINT, do_exit);
+    discover_links(print_link_event, NULL);
+    while (running) {
+      if (discover_watch_read(fd, print_link_event, NULL)) {
+        fprintf(stderr, "Lost link events, resyncing\n");
+        discover_links(print_link_event, NULL);
+      }
+    }
+    close(fd);
+    return 0;
+  }
+
+  if (argc - optind != 1) {
+    usage();
+    return 1;
+  }
+
+  netns = discover_netns_open(atoi(argv[optind]));
+  if (netns < 0) {
+    fprintf(stderr, "Failed to open netns of pid %s\n", argv[optind]);
+    return 1;
+  }
+  npaths = discover_container(netns, paths, DISCOVER_MAX_PATHS);
+  close(netns);
+  if (npaths <= 0) {
+    fprintf(stderr, "No veth paths found for pid %s\n", argv[optind]);
+    return 1;
+  }
+
+  for (i = 0; i < npaths; i++) {
+    if (dir) {
+      snprintf(file, sizeof(file), "%s/%s.conf", dir, paths[i].host_dev);
+      fp = fopen(file, "w");
+      if (fp == NULL) {
+        fprintf(stderr, "Failed to open '%s'\n", file);
+        return 1;
+      }
+      discover_write_config(fp, &paths[i]);
+      fclose(fp);
+      fprintf(stdout, "%s\n", file);
+    } else {
+      // No colon, so latency's config parser skips this line
+      fprintf(stdout, "# %s is %s on the host, bridge %s, uplink %s\n",
+          paths[i].container_dev, paths[i].host_dev,
+          paths[i].bridge[0] ? paths[i].bridge : "none", paths[i].uplink);
+      discover_write_config(stdout, &paths[i]);
+    }
+  }
+  return 0;
+}
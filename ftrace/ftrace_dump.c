@@ -6,12 +6,16 @@
 
 #include "libftrace.h"
 #include "../time_common.h"
+#include "../writer_common.c"
 
 #define TRACING_FS_PATH "/sys/kernel/debug/tracing"
 #define TRACE_BUFFER_SIZE 0x1000
 
 static volatile int running = 1;
 
+// Lines are copied to a writer thread so reading the pipe never waits on stdout
+struct writer writer;
+
 void usage()
 {
   fprintf(stdout, "Usage: ftrace_dump\n");
@@ -32,6 +36,8 @@ int main(int argc, char *argv[])
   struct trace_event *evt;
   struct timeval start_send_time;
   struct timeval finish_send_time;
+  struct writer_stream *out;
+  unsigned long long dropped;
 
   signal(SIGINT, do_exit);
 
@@ -42,13 +48,24 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (writer_start(&writer, STDOUT_FILENO, WRITER_FORMAT_TEXT)) {
+    release_trace_pipe(tp, TRACING_FS_PATH);
+    return 1;
+  }
+  out = writer_stream_open(&writer, WRITER_STREAM_BYTES);
+
   while (running) {
     if (fgets(buf, TRACE_BUFFER_SIZE, tp) != NULL) {
-      fprintf(stdout, "%s", buf);
+      writer_append_bytes(out, buf, strlen(buf));
     }
   }
 
   release_trace_pipe(tp, TRACING_FS_PATH);
 
+  dropped = writer_stop(&writer);
+  if (dropped) {
+    fprintf(stderr, "Warning: dropped %llu bytes of trace, output could not keep up\n", dropped);
+  }
+
   fprintf(stdout, "Done.\n");
 }
@@ -21,7 +21,125 @@
 //   out_outer_dev:  The wire-facing device as named in the kernel
 //   out_outer_func: The event signifying sending of a packet from the kernel boundary
 //
-// These fields should all be filled in in a conf file which is pointed to by the only argument
+// These fields should all be filled in in a conf file; each conf file given
+// as an argument is one path, and all paths are traced at once. An optional
+// timeout_ms field says how long an skb may take along the path before it
+// counts as lost (see below).
+//
+// With -C <socket> the monitor runs as a daemon: paths and pids can be
+// attached and detached over the control socket (../control_common.c)
+// without restarting, so the trace pipe, writer and stats stay up:
+//
+//   add-path <conf file>   start measuring a path (absolute file path)
+//   del-path <conf file>   stop measuring it
+//   add-container <pid>    measure every veth of the container the pid is in
+//   del-container <pid>
+//   add-pid <pid>          only trace events from these pids
+//   del-pid <pid>
+//   list                   show paths and pids
+//
+// set_event and set_event_pid are updated in place, one entry at a time.
+// Paths come from a pool sized for MAX_PATHS at startup (../pool_common.h)
+// and path tables are double buffered, so adding and removing paths as
+// containers come and go never grows the heap.
+//
+// Container paths are found through rtnetlink (libdiscover): the host-side
+// veth peer of each container interface, its bridge and the uplink. A
+// link watcher drops paths whose veth disappears, and with -A also adds a
+// path for every veth enslaved to a bridge, so short-lived containers are
+// followed without any commands at all.
+//
+// Samples are handed to a writer thread (../writer_common.c) so the trace
+// loop never blocks on output; -o and -f pick the destination and format.
+//
+// Events are read by worker threads: one on the shared trace_pipe, or with
+// -P one per CPU on per_cpu/cpuN/trace_pipe. Each worker keeps its own
+// matching state and aggregates per path into its own shard
+// (../agg_common.h), so there is no lock or shared write per event. The
+// path list is published to workers as an immutable table that is swapped
+// on every change; a retired table is freed once every worker has moved on.
+//
+// With -P an skb whose end is traced on another CPU than its start (RPS,
+// XPS, a softirq elsewhere) isn't in that CPU's in-flight table. Such an
+// end is left in a small table shared by the workers, and when the start
+// times out its worker looks there first: an end found between the start
+// and the deadline settles it as crossed, its latency added to the path's
+// histogram but not output per packet, instead of counting it lost. An
+// end whose worker is more than the timeout behind, or that was pushed
+// out of the table, still counts the skb as expired.
+//
+// With -M <port|path> the running counts and latency histograms, overall
+// and per path, are also served in Prometheus text format
+// (../metrics_common.c). The metrics thread merges the shards on read.
+//
+// The main thread also merges them once a second into rolling windows
+// (../window_common.h), so the metrics and the control socket's stats
+// command can show each path over the last 1 s, 10 s, 60 s or 10 min, not
+// only since the start. Workers don't take part in this.
+//
+// Each worker also accounts for its own time (../stage_common.h): reads,
+// lines parsed, lines matched against the paths (which includes output)
+// and samples output, with sampled per item costs and the lag between an
+// event's trace time stamp and its handling. The metrics add the writer's
+// queue and the kernel ring buffers' fill and overruns, and -S <secs>
+// prints the stage costs to stderr periodically.
+//
+// With -G <lag ms>[,<cpu %>] a governor (../sample_common.h) checks ring
+// buffer overruns, dropped results, the workers' lag and CPU time once a
+// second. Under overload it keeps only skbs whose address has the k slot
+// bits above SAMPLE_SKB_BIT set, 1 in 2^k, with a filter on the net
+// events so the kernel drops the rest before they reach a ring. Both
+// ends of a path see the same skb, so they keep or drop it together.
+// Latencies are weighted by 2^k and results say what rate they were kept at.
+//
+// An skb seen at the start of a path waits in its worker's in-flight table
+// for the end of the path, keyed by the skb address and the device and
+// event it started at, so paths sharing an uplink share the entry. Each
+// entry has a timer on the worker's wheel (../wheel_common.h), run on
+// trace time: if the end doesn't show up within the path's timeout
+// (timeout_ms in its config, -E for the default) the skb counts as
+// expired, a loss, and its address can't be matched against the next skb
+// the kernel puts there. A loss is charged to a path only if no other
+// path starts at the same point; the totals count them all. The table
+// and its entries are fixed in size, so memory stays bounded however
+// many packets are lost.
+//
+// With -K the latencies are measured in the kernel instead and no event
+// is copied out at all: each direction of a path is compiled by libftrace
+// into hist triggers on its start and end events and a synthetic event
+// carrying the difference, whose histogram the main thread reads once a
+// second and adds to the totals. There are no per-packet results then,
+// and an skb whose end never shows up just has its start time stamp
+// overwritten when the kernel reuses its address, so nothing expires.
+// The start and end maps never let go of an address, though, and hold
+// TRACE_HIST_KEYS of them; once full, new skbs are dropped untimed. Every
+// KERNEL_MAP_CHECK_SECS the main thread reads how full they are and, at
+// half full or on any drop, empties a leg's maps by reinstalling its
+// start and end triggers. Skbs in flight then go untimed. The drops are
+// exported, by map, as latency_kernel_map_dropped_total.
+//
+// With -F <us>|p<N> each worker also keeps its last events, as read, in a
+// flight recorder (../flight_common.c). A sample of at least us, or above
+// percentile N of its path's last minute in the rolling windows, dumps the
+// events from a while before its skb started to a while after it ended to
+// a file in -D <dir>. The dump is a trace that -r reads back.
+//
+// With -U <addr>[,<secs>] a summary of what each path added, its counts
+// and the histogram buckets that changed, is sent every secs seconds to a
+// collector (../collector.c) on a unix socket path or at host:port, which
+// merges those of every monitor (../summary_common.c).
+//
+// With -r <file> a recording of the trace pipe (e.g. ftrace_dump output)
+// is analyzed instead. It is cut at line boundaries into CHUNK_SIZE
+// chunks which -j workers (default one per CPU) correlate at the same
+// time, each from an empty in-flight table. The main thread then merges
+// the chunks in file order: ends whose start wasn't in their chunk are
+// matched against the skbs still in flight after the chunks before it,
+// which expire or are lost to a reused address at the same events as
+// they would reading the file in one go. So the results are those of
+// -j 1 (one chunk) as long as time stamps don't go back across a chunk
+// boundary and the in-flight table never fills; a warning says if they
+// did. Per-packet results come out grouped by chunk.
 //
 
 #include <unistd.h>
@@ -29,34 +147,281 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "libftrace.h"
+#include "libdiscover.h"
 #include "../time_common.h"
+#include "../writer_common.c"
+#include "../metrics_common.c"
+#include "../control_common.c"
+#include "../agg_common.h"
+#include "../stage_common.h"
+#include "../sample_common.h"
+#include "../pool_common.h"
+#include "../wheel_common.h"
+#include "../window_common.h"
+#include "../flight_common.c"
+#include "../summary_common.c"
 
 #define TRACING_FS_PATH "/sys/kernel/debug/tracing"
 #define CONFIG_LINE_BUFFER 1024
-#define TRACE_BUFFER_SIZE 0x1000
-#define SKBADDR_BUFFER_SIZE 256
+#define CONFIG_FIELD_SIZE 64 // device or event name
+#define TRACE_BUFFER_SIZE 0x10000
 #define TRACE_CLOCK "local"
+#define MAX_PATHS 64
+#define MAX_PIDS 256
+#define MAX_WORKERS WRITER_MAX_STREAMS
+#define PATH_NAME_SIZE 256
+#define EVENT_LIST_SIZE (MAX_PATHS * 4 * 64)
+#define WORKER_IDLE (~0U) // seen_gen of a worker not holding a path table
+#define SAMPLE_EVENTS "net" // subsystem of the traced events, see trace_event_parse_str
+#define INFLIGHT_MAX 4096 // skbs between the start and end of a path, per worker
+#define INFLIGHT_BUCKETS 1024 // Must be a power of two
+#define PER_CPU_POLL_MS 20 // -P readers look at their pipe at least this often
+#define CROSSED_SIZE 4096 // -P ends waiting for their start's worker, must be a power of two
+#define CROSSED_LOCKS 64 // Must be a power of two
+#define DEFAULT_TIMEOUT_MS 100
+#define CHUNK_SIZE (16 << 20) // bytes of a recording per worker at a time
+#define KEY_SET_MIN 1024 // Must be a power of two
+#define FLIGHT_CONTEXT_MS 100 // events dumped before and after an outlier
+#define FLIGHT_MIN_ABOVE 10 // samples a path needs above a -F quantile for it to count
+#define KERNEL_MAP_CHECK_SECS 10 // -K looks at how full the start and end maps are this often
+
+// Worker pipeline stages, see stage_common.h
+enum worker_stage {
+  STAGE_READ,   // one read() of the pipe
+  STAGE_PARSE,  // one line
+  STAGE_MATCH,  // one event through every path, output included
+  STAGE_OUTPUT, // one sample to the writer and the shard
+  NSTAGES
+};
+
+static const char *const stage_names[NSTAGES] = { "read", "parse", "match", "output" };
 
 static volatile int running = 1;
 
-char *in_outer_dev = NULL;
-char *in_outer_func = NULL;
-char *in_inner_dev = NULL;
-char *in_inner_func = NULL;
+// Matching state of one path in one worker
+struct path_match {
+  struct agg_entry *agg; // this path in the worker's shard, once it has a sample
+} __attribute__((aligned(64)));
+
+// An skb seen at a start point, waiting for the end of its path
+struct inflight {
+  struct inflight *next; // in its bucket
+  struct wheel_timer timer;
+  uint64_t skbaddr;
+  uint64_t start_key; // device and event it was seen at
+  uint64_t event; // the worker's event number when it was seen
+  uint64_t deadline_ns;
+  struct timeval start;
+  struct agg_entry *agg; // path charged if it expires, NULL if several paths start here
+  int dir;
+};
+
+// -P: an end that found no start on its CPU, 0 if free
+struct crossed_end {
+  uint64_t skbaddr;
+  uint64_t ts_ns;
+};
+
+// Keys of the skbs started in a chunk of a recording, open addressing
+struct key_set {
+  uint64_t (*keys)[2]; // start key and skb address, both 0 if free
+  size_t mask;
+  size_t n;
+};
+
+// One measured path, read from one config file
+struct latency_path {
+  char name[PATH_NAME_SIZE];
+  uint64_t key; // aggregation key, from the name
+
+  char in_outer_dev[CONFIG_FIELD_SIZE];
+  char in_outer_func[CONFIG_FIELD_SIZE];
+  char in_inner_dev[CONFIG_FIELD_SIZE];
+  char in_inner_func[CONFIG_FIELD_SIZE];
+
+  char out_inner_dev[CONFIG_FIELD_SIZE];
+  char out_inner_func[CONFIG_FIELD_SIZE];
+  char out_outer_dev[CONFIG_FIELD_SIZE];
+  char out_outer_func[CONFIG_FIELD_SIZE];
+
+  uint64_t timeout_ns; // give up on an skb's end after this long
+  int discovered; // through a host veth found by libdiscover, dropped when it's gone
+  uint64_t start_key[2]; // in-flight keys of the send and recv start points
+  unsigned int hist_id; // names its kernel histograms with -K
+  uint64_t flight_ns[2]; // outlier threshold by direction with -F p<q>, set by the main thread
+
+  struct path_match *match; // one per worker, in the same pool object
+  struct kernel_leg *kernel; // by direction with -K, in the same pool object
+};
+
+// The end of a path seen in a chunk of a recording for an skb the chunk
+// didn't start, which may have started in an earlier chunk
+struct orphan {
+  struct latency_path *p;
+  int dir;
+  uint64_t start_key;
+  uint64_t skbaddr;
+  struct timeval ts;
+  uint64_t now; // the worker's wheel tick after the event
+};
+
+// What has been counted of one direction's kernel histogram (-K)
+struct kernel_leg {
+  struct hist seen;
+  uint64_t discarded;
+  unsigned long long dropped;
+  unsigned long long map_dropped[2]; // start and end maps, since the last reset
+};
+
+// Pool objects: a path followed by its per-worker matching state and,
+// with -K, its kernel legs
+#define PATH_OBJECT_MATCH ((sizeof(struct latency_path) + 63) & ~(size_t)63)
+#define PATH_OBJECT_KERNEL (PATH_OBJECT_MATCH + nworkers * sizeof(struct path_match))
+
+// What the workers see of the path list; never changed once published
+struct path_table {
+  int npaths;
+  struct latency_path *paths[MAX_PATHS];
+};
+
+// One trace pipe reader
+struct worker {
+  int id;
+  int cpu; // -1 for the shared trace_pipe
+  int fd;
+  struct writer_stream *out;
+  struct agg_shard *shard;
+  uint64_t events;
+  unsigned int seen_gen; // table generation in use, or WORKER_IDLE
+  pthread_t thread;
+  struct stage_set stages;
+  unsigned int sample_shift; // rate of the batch being handled
+  uint64_t event; // events handled, owner only
+  struct wheel wheel; // in-flight deadlines, on trace time
+  struct pool inflight_pool;
+  struct inflight *inflight[INFLIGHT_BUCKETS];
+  uint64_t expired[2]; // in-flight skbs timed out, by direction
+  uint64_t untracked; // skbs not timed because the in-flight table was full
+  uint64_t crossed[2]; // -P: in-flight skbs whose end another CPU saw, by direction
+  uint64_t cpu_ns; // thread CPU time at the last governor run, main thread only
+  struct flight_recorder flight; // with -F
+  // Reading a recording (-r): the chunk, and what correlating it alone
+  // leaves for merge_chunk
+  off_t chunk_start;
+  off_t chunk_end;
+  uint64_t chunk_first_ns; // time stamp of its first event
+  struct key_set started;
+  struct orphan *orphans;
+  size_t norphans;
+  size_t orphans_size;
+  int chunk_failed; // out of memory or a read error
+  size_t line_len;
+  char line_buf[TRACE_BUFFER_SIZE];
+} __attribute__((aligned(64)));
+
+// Paths and pids being traced. Changes are made under the lock and then
+// published to the workers with publish_paths().
+struct latency_path *paths[MAX_PATHS];
+int npaths = 0;
+int pids[MAX_PIDS];
+int npids = 0;
+int tracing = 0; // set once tracefs is set up, so changes are pushed to it
+int auto_paths = 0; // add a path for every bridged veth
+uint64_t default_timeout_ns = DEFAULT_TIMEOUT_MS * 1000000ULL;
+pthread_mutex_t paths_lock = PTHREAD_MUTEX_INITIALIZER;
 
-char *out_inner_dev = NULL;
-char *out_inner_func = NULL;
-char *out_outer_dev = NULL;
-char *out_outer_func = NULL;
+// Latency histograms in the kernel (-K). There are no workers then;
+// workers[0]'s shard is written under paths_lock instead.
+int kernel_hist = 0;
+unsigned int next_hist_id = 0;
+uint64_t kernel_dropped = 0; // latencies the kernel had no room for
+uint64_t kernel_map_dropped[2]; // skbs the start and end maps had no room for
+uint64_t kernel_resets = 0; // legs whose maps were emptied
+unsigned int kernel_polls = 0;
+struct hist kernel_scratch[2]; // under paths_lock
 
-char *ftrace_set_events = NULL;
+// Ends -P workers saw without a start, by skb address, the latest kept
+int per_cpu = 0;
+struct crossed_end crossed_ends[CROSSED_SIZE];
+pthread_mutex_t crossed_locks[CROSSED_LOCKS];
+
+// Flight recorder (-F): an outlier is a latency of at least flight_ns,
+// or with flight_q above that quantile of its path's last minute
+int flight_on = 0;
+uint64_t flight_ns = 0;
+double flight_q = 0;
+uint64_t flight_context_ns = FLIGHT_CONTEXT_MS * 1000000ULL;
+const char *flight_dir = ".";
+struct flight_dumper flight;
+
+// Reading a recording (-r): skbs still in flight after the chunks merged
+// so far, main thread only
+int offline = 0;
+struct pool carry_pool;
+struct inflight *carry[INFLIGHT_BUCKETS];
+
+// Paths removed from the list but maybe still in a worker's table
+struct latency_path *retired[MAX_PATHS];
+int nretired = 0;
+
+// Paths not yet added, measured and retired all come from here
+struct pool path_pool;
+pthread_mutex_t path_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The one in use and the one before it, which workers may still hold
+struct path_table tables[2];
+struct path_table *cur_table = NULL;
+unsigned int table_gen = 0;
+
+struct worker *workers;
+int nworkers = 1;
+
+struct writer writer;
+
+// Sampling under overload (-G), the rate is 1 when off
+struct sample_gov gov;
+int governed = 0;
+
+// Rolling views of the shards, ticked by the main thread
+struct window_set windows;
 
 void
 usage()
 {
-  fprintf(stdout, "Usage: latency <configuration file>\n");
+  fprintf(stdout, "Usage: latency [-o file] [-f text|csv|binary|column] [-M port|path] [-C socket] [-A] [-P]\n");
+  fprintf(stdout, "               [-S secs] [-G lag_ms[,cpu_pct]] [-E ms] [-K] [-F us|pN[,ms] [-D dir]]\n");
+  fprintf(stdout, "               [-U addr[,secs]] [-r trace [-j n]] <configuration file>...\n");
+  fprintf(stdout, "  -C <socket>  accept add-path/del-path/add-container/del-container/\n");
+  fprintf(stdout, "               add-pid/del-pid/list/stats commands\n");
+  fprintf(stdout, "  -A           measure every veth enslaved to a bridge as it appears\n");
+  fprintf(stdout, "  -P           one reader per CPU buffer; an skb whose ends are traced on\n");
+  fprintf(stdout, "               different CPUs is timed when its start times out, not output\n");
+  fprintf(stdout, "  -S <secs>    print pipeline stage costs to stderr every secs seconds\n");
+  fprintf(stdout, "  -G <lag>[,<cpu>]  sample skbs when behind by more than lag ms (p99), when\n");
+  fprintf(stdout, "               a reader uses more than cpu%% (default 50) or events are lost\n");
+  fprintf(stdout, "  -E <ms>      count an skb lost if its path's end doesn't see it within ms,\n");
+  fprintf(stdout, "               for paths without timeout_ms (default %d)\n", DEFAULT_TIMEOUT_MS);
+  fprintf(stdout, "  -K           measure in the kernel with hist triggers, reading only the\n");
+  fprintf(stdout, "               histograms; no per-packet output, not with -P or -G\n");
+  fprintf(stdout, "  -F <us>|p<N>[,<ms>]  keep the last events in memory and dump those from ms\n");
+  fprintf(stdout, "               (default %d) before an skb to ms after it when its latency is at\n", FLIGHT_CONTEXT_MS);
+  fprintf(stdout, "               least us, or above percentile N of its path's last minute\n");
+  fprintf(stdout, "  -D <dir>     write -F dumps to dir (default .), readable with -r\n");
+  fprintf(stdout, "  -U <addr>[,<secs>]  send a summary every secs seconds (default %d) to the\n",
+          SUMMARY_DEFAULT_SECS);
+  fprintf(stdout, "               collector on a unix socket path or at host:port\n");
+  fprintf(stdout, "  -r <file>    analyze a recorded trace (ftrace_dump output) instead\n");
+  fprintf(stdout, "  -j <n>       with -r, correlate chunks of it on n threads (default: CPUs)\n");
+  fprintf(stdout, "  configuration files are optional with -C or -A\n");
 }
 
 void
@@ -65,24 +430,106 @@ do_exit()
   running = 0;
 }
 
-// Parse the given config file and set globals
-// Returns 0 on success, nonzero on error
+// Parse -F <us>|p<quantile>[,<ms>]
+// Returns 0 on success, nonzero if malformed
 int
-parse_config_file(const char *filepath)
+flight_parse(const char *arg)
+{
+  char *end;
+  double v;
+
+  if (arg[0] == 'p') {
+    v = strtod(arg + 1, &end);
+    if (end == arg + 1 || v <= 0 || v >= 100) {
+      return -1;
+    }
+    flight_q = v / 100;
+  } else {
+    v = strtod(arg, &end);
+    if (end == arg || v <= 0) {
+      return -1;
+    }
+    flight_ns = (uint64_t)(v * 1000);
+  }
+  if (*end == ',') {
+    v = strtod(end + 1, &end);
+    if (v < 0) {
+      return -1;
+    }
+    flight_context_ns = (uint64_t)(v * 1000000);
+  }
+  return *end != '\0';
+}
+
+// Size the path pool for nworkers, before any path is parsed
+// Returns 0 on success, nonzero if out of memory
+int
+path_pool_init()
+{
+  // Every path may be measured while as many are retired and a few parsed
+  return pool_init(&path_pool, PATH_OBJECT_KERNEL + (kernel_hist ? 2 * sizeof(struct kernel_leg) : 0),
+                   2 * MAX_PATHS + 8);
+}
+
+// A zeroed path, or NULL if the pool is used up
+struct latency_path *
+new_path()
+{
+  struct latency_path *p;
+
+  pthread_mutex_lock(&path_pool_lock);
+  p = (struct latency_path *)pool_get(&path_pool);
+  pthread_mutex_unlock(&path_pool_lock);
+  if (p != NULL) {
+    p->match = (struct path_match *)((char *)p + PATH_OBJECT_MATCH);
+    if (kernel_hist) {
+      p->kernel = (struct kernel_leg *)((char *)p + PATH_OBJECT_KERNEL);
+    }
+  }
+  return p;
+}
+
+void
+free_path(struct latency_path *p)
+{
+  pthread_mutex_lock(&path_pool_lock);
+  pool_put(&path_pool, p);
+  pthread_mutex_unlock(&path_pool_lock);
+}
+
+// In-flight key of the skbs seen by event func on dev
+uint64_t
+start_point_key(const char *dev, const char *func)
+{
+  char buf[2 * CONFIG_FIELD_SIZE];
+
+  snprintf(buf, sizeof(buf), "%s %s", dev, func);
+  return agg_key_str(buf);
+}
+
+// Parse a config from fp into a new path called name
+// Returns NULL on error
+struct latency_path *
+parse_config(FILE *fp, const char *name)
 {
-  FILE *fp = NULL;
   char buf[CONFIG_LINE_BUFFER];
   char *bufp = NULL,
        *bufp2 = NULL;
   int len;
-  char **target = NULL;
+  char *target = NULL;
   unsigned char complete = 0;
+  long timeout_ms;
+  struct latency_path *p;
 
-  fp = fopen(filepath, "r");
-  if (!fp) {
-    fprintf(stderr, "Failed to open config file '%s'\n", filepath);
-    return -1;
+  p = new_path();
+  if (p == NULL) {
+    fprintf(stderr, "Too many paths for config '%s'\n", name);
+    return NULL;
   }
+  strncpy(p->name, name, PATH_NAME_SIZE - 1);
+  p->key = agg_key_str(p->name);
+  p->timeout_ns = default_timeout_ns;
+  p->discovered = 0;
 
   while (fgets(buf, CONFIG_LINE_BUFFER, fp) != NULL) {
     bufp = buf;
@@ -91,30 +538,44 @@ parse_config_file(const char *filepath)
     }
     if (*bufp == ':') {
       len = bufp - buf;
+      target = NULL;
       if (!strncmp("in_outer_dev", buf, len)) {
-        target = &in_outer_dev;
+        target = p->in_outer_dev;
         complete |= 1;
       } else if (!strncmp("in_outer_func", buf, len)) {
-        target = &in_outer_func;
+        target = p->in_outer_func;
         complete |= 1 << 1;
       } else if (!strncmp("in_inner_dev", buf, len)) {
-        target = &in_inner_dev;
+        target = p->in_inner_dev;
         complete |= 1 << 2;
       } else if (!strncmp("in_inner_func", buf, len)) {
-        target = &in_inner_func;
+        target = p->in_inner_func;
         complete |= 1 << 3;
       } else if (!strncmp("out_inner_dev", buf, len)) {
-        target = &out_inner_dev;
+        target = p->out_inner_dev;
         complete |= 1 << 4;
       } else if (!strncmp("out_inner_func", buf, len)) {
-        target = &out_inner_func;
+        target = p->out_inner_func;
         complete |= 1 << 5;
       } else if (!strncmp("out_outer_dev", buf, len)) {
-        target = &out_outer_dev;
+        target = p->out_outer_dev;
         complete |= 1 << 6;
       } else if (!strncmp("out_outer_func", buf, len)) {
-        target = &out_outer_func;
+        target = p->out_outer_func;
         complete |= 1 << 7;
+      } else if (!strncmp("timeout_ms", buf, len)) {
+        timeout_ms = atol(bufp + 1);
+        if (timeout_ms <= 0) {
+          fprintf(stderr, "Bad timeout_ms in config '%s'\n", name);
+          free_path(p);
+          return NULL;
+        }
+        p->timeout_ns = timeout_ms * 1000000ULL;
+        continue;
+      }
+      if (target == NULL) {
+        // Unknown key, ignore the line
+        continue;
       }
 
       bufp++;
@@ -125,179 +586,2416 @@ parse_config_file(const char *filepath)
       }
 
       len = bufp2 - bufp;
-
-      *target = (char *)malloc(sizeof(char) * (len + 1));
-      strncpy(*target, bufp, len);
-      (*target)[len] = '\0';
+      if (len >= CONFIG_FIELD_SIZE) {
+        fprintf(stderr, "Value too long in config '%s'\n", name);
+        free_path(p);
+        return NULL;
+      }
+      memcpy(target, bufp, len);
+      target[len] = '\0';
     }
     // Otherwise syntax error, ignore the line
   }
 
   if (complete != 0xff) {
-    fprintf(stderr, "Incomplete config file\n");
-    return -2;
-  }
-
-  len = strlen(in_outer_func)
-      + strlen(in_inner_func)
-      + strlen(out_inner_func)
-      + strlen(out_outer_func)
-      + 4; // add 4: three spaces plus on \0
-  ftrace_set_events = (char *)malloc(len);
-  *ftrace_set_events = '\0';
-  strcat(ftrace_set_events, in_outer_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, in_inner_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, out_inner_func);
-  strcat(ftrace_set_events, " ");
-  strcat(ftrace_set_events, out_outer_func);
+    fprintf(stderr, "Incomplete config '%s'\n", name);
+    free_path(p);
+    return NULL;
+  }
+  p->start_key[AGG_OUT] = start_point_key(p->out_inner_dev, p->out_inner_func);
+  p->start_key[AGG_IN] = start_point_key(p->in_outer_dev, p->in_outer_func);
+
+  return p;
+}
+
+// Parse the given config file into a new path named after the file
+// Returns NULL on error
+struct latency_path *
+parse_config_file(const char *filepath)
+{
+  struct latency_path *p;
+  FILE *fp;
+
+  fp = fopen(filepath, "r");
+  if (!fp) {
+    fprintf(stderr, "Failed to open config file '%s'\n", filepath);
+    return NULL;
+  }
+  p = parse_config(fp, filepath);
+  fclose(fp);
+  return p;
+}
+
+// Build a path from a discovered container path
+// Returns NULL on error
+struct latency_path *
+path_from_discovery(const struct discover_path *dp, const char *name)
+{
+  char buf[CONFIG_LINE_BUFFER];
+  struct latency_path *p;
+  FILE *fp;
+
+  fp = fmemopen(buf, sizeof(buf), "w+");
+  if (fp == NULL) {
+    return NULL;
+  }
+  discover_write_config(fp, dp);
+  rewind(fp);
+  p = parse_config(fp, name);
+  fclose(fp);
+  if (p != NULL) {
+    p->discovered = 1;
+  }
+  return p;
+}
 
+// Nonzero if any path other than except traces the given event
+// Caller holds paths_lock
+int
+event_in_use(const char *event, const struct latency_path *except)
+{
+  int i;
+  for (i = 0; i < npaths; i++) {
+    if (paths[i] == except) {
+      continue;
+    }
+    if (!strcmp(paths[i]->in_outer_func, event)
+     || !strcmp(paths[i]->in_inner_func, event)
+     || !strcmp(paths[i]->out_inner_func, event)
+     || !strcmp(paths[i]->out_outer_func, event)) {
+      return 1;
+    }
+  }
   return 0;
 }
 
+// Space-separated list of every event any path needs, for the initial set_event
+// Caller holds paths_lock
 void
-print_stats(long long unsigned int send_sum,
-                 unsigned int send_num,
-                 long long unsigned int recv_sum,
-                 unsigned int recv_num)
+build_event_list(char *buf, size_t len)
 {
-  long long unsigned int send_mean;
-  long long unsigned int recv_mean;
+  const char *funcs[4];
+  size_t off = 0;
+  int i;
+  int j;
 
-  if (send_num) {
-    send_mean = send_sum / send_num;
-  } else {
-    send_mean = 0;
+  buf[0] = '\0';
+  for (i = 0; i < npaths; i++) {
+    funcs[0] = paths[i]->in_outer_func;
+    funcs[1] = paths[i]->in_inner_func;
+    funcs[2] = paths[i]->out_inner_func;
+    funcs[3] = paths[i]->out_outer_func;
+    for (j = 0; j < 4 && off < len; j++) {
+      off += snprintf(buf + off, len - off, "%s%s", off ? " " : "", funcs[j]);
+    }
   }
+}
 
-  if (recv_num) {
-    recv_mean = recv_sum / recv_num;
+void
+print_path(FILE *fp, const struct latency_path *p)
+{
+  fprintf(fp, "path: %s\n", p->name);
+  fprintf(fp, "  in_outer_dev:   %s\n", p->in_outer_dev);
+  fprintf(fp, "  in_outer_func:  %s\n", p->in_outer_func);
+  fprintf(fp, "  in_inner_dev:   %s\n", p->in_inner_dev);
+  fprintf(fp, "  in_inner_func:  %s\n", p->in_inner_func);
+  fprintf(fp, "  out_inner_dev:  %s\n", p->out_inner_dev);
+  fprintf(fp, "  out_inner_func: %s\n", p->out_inner_func);
+  fprintf(fp, "  out_outer_dev:  %s\n", p->out_outer_dev);
+  fprintf(fp, "  out_outer_func: %s\n", p->out_outer_func);
+  fprintf(fp, "  timeout_ms:     %llu\n", (unsigned long long)(p->timeout_ns / 1000000));
+}
+
+// This path in the worker's shard, NULL if the shard is full
+static inline struct agg_entry *
+path_agg(struct worker *w, struct latency_path *p, struct path_match *m)
+{
+  if (m->agg == NULL) {
+    m->agg = agg_get(w->shard, p->key, p->name);
+  }
+  return m->agg;
+}
+
+// Kernel leg of path p for dir (-K), named after the process and the path
+// so that neither another monitor nor a re-added path clashes with it
+// Returns 0 on success, nonzero if a name is too long
+int
+kernel_leg_compile(const struct latency_path *p, int dir, struct trace_hist_latency *l)
+{
+  char name[TRACE_HIST_NAME_SIZE];
+
+  snprintf(name, sizeof(name), "latency_%d_%u_%s", (int)getpid(), p->hist_id,
+           dir == AGG_OUT ? "send" : "recv");
+  if (dir == AGG_OUT) {
+    return !trace_hist_latency_compile(l, name, p->out_inner_func, p->out_inner_dev,
+                                       p->out_outer_func, p->out_outer_dev);
+  }
+  return !trace_hist_latency_compile(l, name, p->in_outer_func, p->in_outer_dev,
+                                     p->in_inner_func, p->in_inner_dev);
+}
+
+// Install both directions of p's kernel histograms
+// Caller holds paths_lock
+// Returns 0 on success, nonzero on error
+int
+kernel_path_install(struct latency_path *p)
+{
+  struct trace_hist_latency l;
+
+  memset(p->kernel, 0, 2 * sizeof(struct kernel_leg));
+  if (kernel_leg_compile(p, AGG_OUT, &l) || !trace_hist_latency_install(TRACING_FS_PATH, &l)) {
+    fprintf(stderr, "%s: failed to install the send histogram\n", p->name);
+    return -1;
+  }
+  if (kernel_leg_compile(p, AGG_IN, &l) || !trace_hist_latency_install(TRACING_FS_PATH, &l)) {
+    fprintf(stderr, "%s: failed to install the recv histogram\n", p->name);
+    kernel_leg_compile(p, AGG_OUT, &l);
+    trace_hist_latency_remove(TRACING_FS_PATH, &l);
+    return -1;
+  }
+  return 0;
+}
+
+// One kernel histogram being read into a private one
+struct kernel_read {
+  struct hist *h;
+  uint64_t discarded;
+};
+
+void
+kernel_read_latency(unsigned long long usecs, unsigned long long count, void *arg)
+{
+  struct kernel_read *r = (struct kernel_read *)arg;
+
+  // Same cut as for samples from the trace pipe, see handle_path_event
+  if (usecs >= 1000) {
+    r->discarded += count;
   } else {
-    recv_mean = 0;
+    hist_add_n(r->h, usecs * 1000, count);
   }
+}
 
-  fprintf(stdout, "\nLatency stats:\n");
-  fprintf(stdout, "send mean: %f ms\n", (float)send_mean / 1000.0);
-  fprintf(stdout, "recv mean: %f ms\n", (float)recv_mean / 1000.0);
-  fprintf(stdout, "rtt  mean: %f ms\n",
-      (float)(send_mean + recv_mean) / 1000.0);
+// Add what p's kernel histograms counted since they were last read to
+// workers[0]'s shard
+// Caller holds paths_lock
+void
+kernel_path_poll(struct latency_path *p)
+{
+  struct trace_hist_latency l;
+  struct kernel_leg *leg;
+  struct kernel_read r;
+  struct hist *cur = &kernel_scratch[0];
+  struct hist *delta = &kernel_scratch[1];
+  struct agg_entry *e;
+  unsigned long long dropped;
+  int dir;
+
+  for (dir = 0; dir < 2; dir++) {
+    leg = &p->kernel[dir];
+    hist_init(cur);
+    r.h = cur;
+    r.discarded = 0;
+    if (kernel_leg_compile(p, dir, &l)
+     || !trace_hist_latency_read(TRACING_FS_PATH, &l, kernel_read_latency, &r, &dropped)) {
+      continue;
+    }
+    *delta = *cur;
+    hist_sub(delta, &leg->seen);
+    leg->seen = *cur;
+    e = path_agg(&workers[0], p, &p->match[0]);
+    if (e != NULL) {
+      agg_add_hist(e, dir, delta);
+      agg_discard_n(e, dir, r.discarded - leg->discarded);
+    }
+    leg->discarded = r.discarded;
+    stat_add(&kernel_dropped, dropped - leg->dropped);
+    leg->dropped = dropped;
+  }
 }
 
-int main(int argc, char *argv[])
+// Empty the start and end maps of p's legs if they are half full or have
+// dropped skbs, see trace_hist_latency_maps
+// Caller holds paths_lock
+void
+kernel_path_check(struct latency_path *p)
 {
-  FILE *tp = NULL;
-  int nbytes = 0;
+  struct trace_hist_latency l;
+  struct trace_hist_maps m;
+  struct kernel_leg *leg;
+  unsigned long long grew;
+  int reset;
+  int dir;
+  int i;
 
-  char buf[TRACE_BUFFER_SIZE];
-  struct trace_event evt;
+  for (dir = 0; dir < 2; dir++) {
+    leg = &p->kernel[dir];
+    if (kernel_leg_compile(p, dir, &l) || !trace_hist_latency_maps(TRACING_FS_PATH, &l, &m)) {
+      continue;
+    }
+    reset = 0;
+    for (i = 0; i < 2; i++) {
+      // Counts restart when the triggers are added again elsewhere
+      grew = m.dropped[i] >= leg->map_dropped[i] ? m.dropped[i] - leg->map_dropped[i] : m.dropped[i];
+      stat_add(&kernel_map_dropped[i], grew);
+      leg->map_dropped[i] = m.dropped[i];
+      reset |= grew > 0 || m.entries[i] >= TRACE_HIST_KEYS / 2;
+    }
+    if (!reset) {
+      continue;
+    }
+    if (!trace_hist_latency_reset(TRACING_FS_PATH, &l)) {
+      fprintf(stderr, "%s: failed to reset kernel histogram %s\n", p->name, l.synth);
+      continue;
+    }
+    leg->map_dropped[0] = leg->map_dropped[1] = 0;
+    stat_add(&kernel_resets, 1);
+  }
+}
 
-  char send_skbaddr[SKBADDR_BUFFER_SIZE];
-  struct timeval start_send_time;
-  struct timeval finish_send_time;
-  long long unsigned int send_sum = 0;
-  unsigned int send_num = 0;
+// Read p's kernel histograms one last time and remove them
+// Caller holds paths_lock
+void
+kernel_path_remove(struct latency_path *p)
+{
+  struct trace_hist_latency l;
+  int dir;
 
-  char recv_skbaddr[SKBADDR_BUFFER_SIZE];
-  struct timeval start_recv_time;
-  struct timeval finish_recv_time;
-  long long unsigned int recv_sum = 0;
-  unsigned int recv_num = 0;
+  kernel_path_poll(p);
+  for (dir = 0; dir < 2; dir++) {
+    if (!kernel_leg_compile(p, dir, &l) && !trace_hist_latency_remove(TRACING_FS_PATH, &l)) {
+      fprintf(stderr, "%s: failed to remove kernel histogram %s\n", p->name, l.synth);
+    }
+  }
+}
 
-  if (argc != 2) {
-    usage();
-    return 1;
+// Main thread, once a second with -K
+void
+kernel_poll()
+{
+  int check = ++kernel_polls % KERNEL_MAP_CHECK_SECS == 0;
+  int i;
+
+  pthread_mutex_lock(&paths_lock);
+  for (i = 0; i < npaths; i++) {
+    kernel_path_poll(paths[i]);
+    if (check) {
+      kernel_path_check(paths[i]);
+    }
   }
+  pthread_mutex_unlock(&paths_lock);
+}
 
-  parse_config_file(argv[1]);
+// Swap in a table of the current paths for the workers, then free the
+// old table and retired paths once no worker can still be using them
+// Caller holds paths_lock
+void
+publish_paths()
+{
+  struct path_table *tbl;
+  unsigned int gen;
+  unsigned int seen;
+  int i;
 
-  fprintf(stdout, "in_outer_dev:   %s\n", in_outer_dev);
-  fprintf(stdout, "in_outer_func:  %s\n", in_outer_func);
-  fprintf(stdout, "in_inner_dev:   %s\n", in_inner_dev);
-  fprintf(stdout, "in_inner_func:  %s\n", in_inner_func);
-  fprintf(stdout, "out_inner_dev:  %s\n", out_inner_dev);
-  fprintf(stdout, "out_inner_func: %s\n", out_inner_func);
-  fprintf(stdout, "out_outer_dev:  %s\n", out_outer_dev);
-  fprintf(stdout, "out_outer_func: %s\n", out_outer_func);
-  fprintf(stdout, "events: %s\n", ftrace_set_events);
+  // Once every worker has moved on from the current table below, the
+  // one before it is free to fill for the next change
+  tbl = cur_table == &tables[0] ? &tables[1] : &tables[0];
+  tbl->npaths = npaths;
+  memcpy(tbl->paths, paths, npaths * sizeof(paths[0]));
+  __atomic_store_n(&cur_table, tbl, __ATOMIC_SEQ_CST);
+  gen = __atomic_add_fetch(&table_gen, 1, __ATOMIC_SEQ_CST);
 
-  fprintf(stdout, "trace_clock: %s", TRACE_CLOCK);
-  
-  signal(SIGINT, do_exit);
+  for (i = 0; i < nworkers; i++) {
+    for (;;) {
+      seen = __atomic_load_n(&workers[i].seen_gen, __ATOMIC_SEQ_CST);
+      if (seen == WORKER_IDLE || seen == gen) {
+        break;
+      }
+      usleep(100);
+    }
+  }
 
-  tp = get_trace_pipe(TRACING_FS_PATH, ftrace_set_events, NULL, TRACE_CLOCK);
+  for (i = 0; i < nretired; i++) {
+    free_path(retired[i]);
+  }
+  nretired = 0;
+}
 
-  if (!tp) {
-    fprintf(stderr, "Failed to open trace pipe\n");
-    return 1;
+// Start measuring a new path, enabling any events it adds
+// Returns 0 on success, nonzero on error
+int
+add_path(struct latency_path *p)
+{
+  const char *funcs[4];
+  int i;
+
+  funcs[0] = p->in_outer_func;
+  funcs[1] = p->in_inner_func;
+  funcs[2] = p->out_inner_func;
+  funcs[3] = p->out_outer_func;
+
+  pthread_mutex_lock(&paths_lock);
+  for (i = 0; i < npaths; i++) {
+    if (!strcmp(paths[i]->name, p->name)) {
+      pthread_mutex_unlock(&paths_lock);
+      return -1;
+    }
+  }
+  if (npaths == MAX_PATHS) {
+    pthread_mutex_unlock(&paths_lock);
+    return -1;
+  }
+  p->hist_id = next_hist_id++;
+  if (tracing && kernel_hist) {
+    if (kernel_path_install(p)) {
+      pthread_mutex_unlock(&paths_lock);
+      return -1;
+    }
+  } else if (tracing) {
+    for (i = 0; i < 4; i++) {
+      if (!event_in_use(funcs[i], NULL)) {
+        trace_event_enable(TRACING_FS_PATH, funcs[i]);
+      }
+    }
   }
+  paths[npaths++] = p;
+  publish_paths();
+  pthread_mutex_unlock(&paths_lock);
+  return 0;
+}
 
-  while (running) {
-    // Read the next line from the trace pipe
-    if (fgets(buf, TRACE_BUFFER_SIZE, tp) != NULL && running) {
-      // If there's data, parse it
-      trace_event_parse_str(buf, &evt);
-      // Handle events
-      if (!strncmp(in_outer_func, evt.func_name, evt.func_name_len)
-       && !strncmp(in_outer_dev, evt.dev, evt.dev_len)) {
-        // Got a inbound event on outer dev
-        memcpy(recv_skbaddr, evt.skbaddr, evt.skbaddr_len);
-        recv_skbaddr[evt.skbaddr_len] = '\0';
-        start_recv_time = evt.ts;
-      } else
-      if (!strncmp(in_inner_func, evt.func_name, evt.func_name_len)
-       && !strncmp(in_inner_dev, evt.dev, evt.dev_len)
-       && !strncmp(recv_skbaddr, evt.skbaddr, evt.skbaddr_len)) {
-        // Got a inbound event on inner dev and the skbaddr matches
-        finish_recv_time = evt.ts;
-        tvsub(&finish_recv_time, &start_recv_time);
-        if (finish_recv_time.tv_usec < 1000) {
-          fprintf(stdout, "recv latency: %lu.%06lu\n",
-                  finish_recv_time.tv_sec,
-                  finish_recv_time.tv_usec);
-          recv_sum += finish_recv_time.tv_sec * 1000000
-                    + finish_recv_time.tv_usec;
-          recv_num++;
-        } else {
-          fprintf(stdout, "discarded recv: %lu.%06lu\n",
-                  finish_recv_time.tv_sec,
-                  finish_recv_time.tv_usec);
-        }
+// Drop paths[i], disabling events nothing else needs
+// Caller holds paths_lock and publishes the change
+void
+remove_path(int i)
+{
+  struct latency_path *p = paths[i];
+  const char *funcs[4];
+  int j;
 
-      } else
-      if (!strncmp(out_inner_func, evt.func_name, evt.func_name_len)
-       && !strncmp(out_inner_dev, evt.dev, evt.dev_len)) {
-        // Got a outbound event on inner dev
-        memcpy(send_skbaddr, evt.skbaddr, evt.skbaddr_len);
-        send_skbaddr[evt.skbaddr_len] = '\0';
-        start_send_time = evt.ts;
-      } else
-      if (!strncmp(out_outer_func, evt.func_name, evt.func_name_len)
-       && !strncmp(out_outer_dev, evt.dev, evt.dev_len)
-       && !strncmp(send_skbaddr, evt.skbaddr, evt.skbaddr_len)) {
-        // Got a outbound event on outer dev and the skbaddr matches
-        finish_send_time = evt.ts;
-        tvsub(&finish_send_time, &start_send_time);
-        if (finish_send_time.tv_usec < 1000) {
-          fprintf(stdout, "send latency: %lu.%06lu\n",
-                  finish_send_time.tv_sec,
-                  finish_send_time.tv_usec);
-          send_sum += finish_send_time.tv_sec * 1000000
-                    + finish_send_time.tv_usec;
-          send_num++;
-        } else {
-          fprintf(stdout, "discarded send: %lu.%06lu\n",
-                  finish_send_time.tv_sec,
-                  finish_send_time.tv_usec);
-        }
-      
+  paths[i] = paths[--npaths];
+  if (tracing && kernel_hist) {
+    kernel_path_remove(p);
+  } else if (tracing) {
+    funcs[0] = p->in_outer_func;
+    funcs[1] = p->in_inner_func;
+    funcs[2] = p->out_inner_func;
+    funcs[3] = p->out_outer_func;
+    for (j = 0; j < 4; j++) {
+      if (!event_in_use(funcs[j], NULL)) {
+        trace_event_disable(TRACING_FS_PATH, funcs[j]);
       }
     }
   }
+  retired[nretired++] = p;
+}
+
+// Stop measuring the named path, or with prefix set every path whose name starts with it
+// Returns the number of paths removed
+int
+del_path(const char *name, int prefix)
+{
+  size_t len = strlen(name);
+  int n = 0;
+  int i;
+
+  pthread_mutex_lock(&paths_lock);
+  for (i = npaths - 1; i >= 0; i--) {
+    if (prefix ? !strncmp(paths[i]->name, name, len) : !strcmp(paths[i]->name, name)) {
+      remove_path(i);
+      n++;
+    }
+  }
+  if (n) {
+    publish_paths();
+  }
+  pthread_mutex_unlock(&paths_lock);
+  return n;
+}
+
+// Stop measuring every path through the given host device
+void
+del_paths_on_dev(const char *dev)
+{
+  int n = 0;
+  int i;
+
+  pthread_mutex_lock(&paths_lock);
+  for (i = npaths - 1; i >= 0; i--) {
+    if (!strcmp(paths[i]->in_inner_dev, dev) || !strcmp(paths[i]->out_inner_dev, dev)) {
+      fprintf(stdout, "%s: %s is gone, removing path\n", paths[i]->name, dev);
+      remove_path(i);
+      n++;
+    }
+  }
+  if (n) {
+    publish_paths();
+  }
+  pthread_mutex_unlock(&paths_lock);
+}
+
+// Nonzero if some path already goes through the given host device
+int
+path_on_dev(const char *dev)
+{
+  int found = 0;
+  int i;
+
+  pthread_mutex_lock(&paths_lock);
+  for (i = 0; i < npaths && !found; i++) {
+    found = !strcmp(paths[i]->in_inner_dev, dev) || !strcmp(paths[i]->out_inner_dev, dev);
+  }
+  pthread_mutex_unlock(&paths_lock);
+  return found;
+}
+
+// Add a path for every veth of a container not already measured
+// Returns the number of paths added, or -1 if no veths were found
+int
+add_container(int pid)
+{
+  struct discover_path dps[DISCOVER_MAX_PATHS];
+  struct latency_path *p;
+  char name[PATH_NAME_SIZE];
+  int netns;
+  int ndps;
+  int n = 0;
+  int i;
+
+  netns = discover_netns_open(pid);
+  if (netns < 0) {
+    return -1;
+  }
+  ndps = discover_container(netns, dps, DISCOVER_MAX_PATHS);
+  close(netns);
+  for (i = 0; i < ndps; i++) {
+    if (path_on_dev(dps[i].host_dev)) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "container:%d:%s", pid, dps[i].host_dev);
+    p = path_from_discovery(&dps[i], name);
+    if (p == NULL) {
+      continue;
+    }
+    if (add_path(p)) {
+      free_path(p);
+      continue;
+    }
+    n++;
+  }
+  return ndps <= 0 ? -1 : n;
+}
+
+// A pid argument, all digits
+// Returns the pid, or -1 if str isn't one
+int
+parse_pid(const char *str)
+{
+  char *end;
+  long pid;
+
+  errno = 0;
+  pid = strtol(str, &end, 10);
+  if (errno || end == str || *end != '\0' || pid <= 0 || pid > INT_MAX) {
+    return -1;
+  }
+  return (int)pid;
+}
 
-  release_trace_pipe(tp, TRACING_FS_PATH);
+// Rewrite set_event_pid from the pid list
+// Caller holds paths_lock
+void
+write_pids()
+{
+  char buf[MAX_PIDS * 12];
+  size_t off = 0;
+  int i;
 
-  print_stats(send_sum, send_num, recv_sum, recv_num);
+  buf[0] = '\0';
+  for (i = 0; i < npids; i++) {
+    off += snprintf(buf + off, sizeof(buf) - off, "%s%d", i ? " " : "", pids[i]);
+  }
+  trace_pids_set(TRACING_FS_PATH, buf);
+}
+
+// Link watcher: drop paths whose device is deleted and, with -A,
+// add a path for every veth enslaved to a bridge
+void
+handle_link_event(const struct discover_link *link, int added, void *arg)
+{
+  struct discover_path dp;
+  struct discover_link bridge;
+  struct latency_path *p;
+  char name[PATH_NAME_SIZE];
+
+  (void)arg;
+  if (!added) {
+    del_paths_on_dev(link->name);
+    return;
+  }
+  // RTM_NEWLINK also reports changes, so most of these are already known
+  if (!auto_paths || strcmp(link->kind, "veth") || !link->master
+   || path_on_dev(link->name)
+   || discover_link_get(link->master, &bridge)) {
+    return;
+  }
+  memset(&dp, 0, sizeof(dp));
+  strcpy(dp.host_dev, link->name);
+  strcpy(dp.bridge, bridge.name);
+  if (discover_uplink(dp.uplink)) {
+    return;
+  }
+  snprintf(name, sizeof(name), "veth:%s", link->name);
+  p = path_from_discovery(&dp, name);
+  if (p == NULL) {
+    return;
+  }
+  if (add_path(p)) {
+    free_path(p);
+    return;
+  }
+  fprintf(stdout, "%s: added path through bridge %s to %s\n", name, dp.bridge, dp.uplink);
+}
+
+// Link names a resync found
+struct link_names {
+  char (*names)[IFNAMSIZ];
+  int n;
+  int cap;
+};
+
+// Link watcher resync: note the link, then handle it as if just added
+void
+resync_link(const struct discover_link *link, int added, void *arg)
+{
+  struct link_names *seen = (struct link_names *)arg;
+  char (*grown)[IFNAMSIZ];
+
+  if (seen->n == seen->cap) {
+    grown = (char (*)[IFNAMSIZ])realloc(seen->names, (seen->cap ? seen->cap * 2 : 256) * IFNAMSIZ);
+    if (grown == NULL) {
+      // Without the whole list no path can be known to be gone
+      seen->cap = -1;
+    } else {
+      seen->names = grown;
+      seen->cap = seen->cap ? seen->cap * 2 : 256;
+    }
+  }
+  if (seen->n < seen->cap) {
+    memcpy(seen->names[seen->n++], link->name, IFNAMSIZ);
+  }
+  handle_link_event(link, added, NULL);
+}
+
+// Link watcher, after events were lost: add paths for links that came
+// meanwhile and drop the discovered paths whose host veth went
+void
+resync_links(void)
+{
+  struct link_names seen = { NULL, 0, 0 };
+  int n = 0;
+  int i;
+  int j;
+
+  if (discover_links(resync_link, &seen) || seen.cap < 0) {
+    free(seen.names);
+    return;
+  }
+  pthread_mutex_lock(&paths_lock);
+  for (i = npaths - 1; i >= 0; i--) {
+    if (!paths[i]->discovered) {
+      // Its devices may be in another netns, never in the dump
+      continue;
+    }
+    for (j = 0; j < seen.n && strcmp(seen.names[j], paths[i]->in_inner_dev); j++) {
+    }
+    if (j == seen.n) {
+      fprintf(stdout, "%s: %s is gone, removing path\n", paths[i]->name, paths[i]->in_inner_dev);
+      remove_path(i);
+      n++;
+    }
+  }
+  if (n) {
+    publish_paths();
+  }
+  pthread_mutex_unlock(&paths_lock);
+  free(seen.names);
+}
+
+void *
+watch_links(void *arg)
+{
+  struct pollfd pfd;
+
+  pfd.fd = *(int *)arg;
+  pfd.events = POLLIN;
+  while (running) {
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+    if (discover_watch_read(pfd.fd, handle_link_event, NULL)) {
+      // Events were lost (ENOBUFS): both adds and deletes may be missing
+      resync_links();
+    }
+  }
+  return NULL;
+}
+
+// The latency from which a sample of p is an outlier (-F), 0 if not known yet
+static inline uint64_t
+flight_threshold(const struct latency_path *p, int dir)
+{
+  return flight_q ? __atomic_load_n(&p->flight_ns[dir], __ATOMIC_RELAXED) : flight_ns;
+}
+
+// Dump the events around an outlier: from before its skb started to a
+// while after it finished
+void
+flight_outlier(struct worker *w, const struct latency_path *p, int dir, uint64_t end_ns, uint64_t latency_ns)
+{
+  uint64_t start_ns = end_ns - latency_ns;
+  char *label;
+
+  label = flight_trigger(&w->flight, end_ns, start_ns > flight_context_ns ? start_ns - flight_context_ns : 0,
+                         end_ns + flight_context_ns);
+  if (label != NULL) {
+    snprintf(label, FLIGHT_LABEL_SIZE, "%s %s %.1f us at %llu.%06llu", p->name,
+             dir == AGG_OUT ? "send" : "recv", latency_ns / 1000.0,
+             (unsigned long long)(end_ns / 1000000000ULL),
+             (unsigned long long)(end_ns % 1000000000ULL / 1000));
+  }
+}
+
+// Queue one latency sample for the writer thread and count it in the
+// worker's shard under the path's key
+void
+report_latency(struct worker *w, struct latency_path *p, struct path_match *m,
+               enum writer_kind kind, struct timeval *ts, struct timeval *latency,
+               int discarded)
+{
+  struct writer_record rec;
+  int dir = kind == WRITER_KIND_SEND ? AGG_OUT : AGG_IN;
+  uint64_t start = stage_sample(&w->stages) ? stage_now() : 0;
+  uint64_t threshold;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.ts_ns = ts->tv_sec * 1000000000ULL + ts->tv_usec * 1000ULL;
+  rec.kind = kind;
+  rec.key = (uint32_t)p->key;
+  rec.value_ns[0] = latency->tv_sec * 1000000000LL + latency->tv_usec * 1000LL;
+  rec.flags = WRITER_FLAG_USEC;
+  if (discarded) {
+    rec.flags |= WRITER_FLAG_DISCARDED;
+  }
+  rec.sample_shift = w->sample_shift;
+  if (offline) {
+    writer_append_wait(w->out, &rec);
+  } else {
+    writer_append(w->out, &rec);
+  }
+
+  if (flight_on) {
+    threshold = flight_threshold(p, dir);
+    if (threshold && rec.value_ns[0] > 0 && (uint64_t)rec.value_ns[0] >= threshold) {
+      flight_outlier(w, p, dir, rec.ts_ns, rec.value_ns[0]);
+    }
+  }
+
+  if (path_agg(w, p, m) == NULL) {
+    // Shard full, counted as overflow
+  } else if (discarded) {
+    agg_discard(m->agg, dir);
+  } else {
+    agg_add_n(m->agg, dir, rec.value_ns[0] > 0 ? rec.value_ns[0] : 0, 1ULL << w->sample_shift);
+  }
+
+  stage_count(&w->stages, STAGE_OUTPUT, 1);
+  if (start) {
+    stage_time(&w->stages, STAGE_OUTPUT, start);
+  }
+}
+
+static inline unsigned int
+inflight_bucket(uint64_t start_key, uint64_t skbaddr)
+{
+  return (unsigned int)(((start_key ^ skbaddr) * 0x9e3779b97f4a7c15ULL) >> 40) & (INFLIGHT_BUCKETS - 1);
+}
+
+// The link to the skb seen at start_key in an in-flight table, or to the
+// NULL ending its bucket if there is none
+static inline struct inflight **
+inflight_find(struct inflight **table, uint64_t start_key, uint64_t skbaddr)
+{
+  struct inflight **link = &table[inflight_bucket(start_key, skbaddr)];
+
+  while (*link != NULL && ((*link)->skbaddr != skbaddr || (*link)->start_key != start_key)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Worker: the link to the in-flight skb seen at start_key
+static inline struct inflight **
+inflight_link(struct worker *w, uint64_t start_key, uint64_t skbaddr)
+{
+  return inflight_find(w->inflight, start_key, skbaddr);
+}
+
+static inline size_t
+key_set_slot(const struct key_set *s, uint64_t start_key, uint64_t skbaddr)
+{
+  return (size_t)(((start_key ^ skbaddr) * 0x9e3779b97f4a7c15ULL) >> 20) & s->mask;
+}
+
+static inline int
+key_set_has(const struct key_set *s, uint64_t start_key, uint64_t skbaddr)
+{
+  size_t i;
+
+  if (s->keys == NULL) {
+    return 0;
+  }
+  for (i = key_set_slot(s, start_key, skbaddr); s->keys[i][0] || s->keys[i][1]; i = (i + 1) & s->mask) {
+    if (s->keys[i][0] == start_key && s->keys[i][1] == skbaddr) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns 0 on success, nonzero if out of memory
+int
+key_set_add(struct key_set *s, uint64_t start_key, uint64_t skbaddr)
+{
+  uint64_t (*old)[2] = s->keys;
+  size_t size = s->keys ? (s->mask + 1) * 2 : KEY_SET_MIN;
+  size_t i;
+
+  // Keep it at most half full
+  if (s->keys == NULL || (s->n + 1) * 2 > s->mask + 1) {
+    s->keys = (uint64_t (*)[2])calloc(size, sizeof(s->keys[0]));
+    if (s->keys == NULL) {
+      s->keys = old;
+      return -1;
+    }
+    s->mask = size - 1;
+    s->n = 0;
+    for (i = 0; old != NULL && i < size / 2; i++) {
+      if (old[i][0] || old[i][1]) {
+        key_set_add(s, old[i][0], old[i][1]);
+      }
+    }
+    free(old);
+  }
+  for (i = key_set_slot(s, start_key, skbaddr); s->keys[i][0] || s->keys[i][1]; i = (i + 1) & s->mask) {
+    if (s->keys[i][0] == start_key && s->keys[i][1] == skbaddr) {
+      return 0;
+    }
+  }
+  s->keys[i][0] = start_key;
+  s->keys[i][1] = skbaddr;
+  s->n++;
+  return 0;
+}
+
+void
+key_set_clear(struct key_set *s)
+{
+  if (s->keys != NULL) {
+    memset(s->keys, 0, (s->mask + 1) * sizeof(s->keys[0]));
+  }
+  s->n = 0;
+}
+
+// Worker reading a recording: an end with no start in the chunk
+void
+orphan_add(struct worker *w, struct latency_path *p, int dir, uint64_t skbaddr,
+           const struct timeval *ts)
+{
+  struct orphan *o;
+  size_t size;
+
+  if (w->norphans == w->orphans_size) {
+    size = w->orphans_size ? w->orphans_size * 2 : 1024;
+    o = (struct orphan *)realloc(w->orphans, size * sizeof(struct orphan));
+    if (o == NULL) {
+      w->chunk_failed = 1;
+      return;
+    }
+    w->orphans = o;
+    w->orphans_size = size;
+  }
+  o = &w->orphans[w->norphans++];
+  o->p = p;
+  o->dir = dir;
+  o->start_key = p->start_key[dir];
+  o->skbaddr = skbaddr;
+  o->ts = *ts;
+  o->now = w->wheel.now;
+}
+
+// Worker: drop the in-flight skb at link
+static inline void
+inflight_free(struct worker *w, struct inflight **link)
+{
+  struct inflight *f = *link;
+
+  *link = f->next;
+  wheel_del(&w->wheel, &f->timer);
+  pool_put(&w->inflight_pool, f);
+}
+
+// Worker: an in-flight skb's end never showed up, count it lost
+static inline void
+inflight_lost(struct worker *w, struct inflight **link)
+{
+  stat_add(&w->expired[(*link)->dir], 1);
+  if ((*link)->agg != NULL) {
+    agg_expire((*link)->agg, (*link)->dir);
+  }
+  inflight_free(w, link);
+}
+
+static inline size_t
+crossed_slot(uint64_t skbaddr)
+{
+  return (size_t)((skbaddr * 0x9e3779b97f4a7c15ULL) >> 20) & (CROSSED_SIZE - 1);
+}
+
+// -P worker: an end with no start on this CPU, for the worker that has it
+void
+crossed_put(uint64_t skbaddr, const struct timeval *ts)
+{
+  size_t i = crossed_slot(skbaddr);
+  pthread_mutex_t *lock = &crossed_locks[i & (CROSSED_LOCKS - 1)];
+
+  pthread_mutex_lock(lock);
+  crossed_ends[i].skbaddr = skbaddr;
+  crossed_ends[i].ts_ns = ts->tv_sec * 1000000000ULL + ts->tv_usec * 1000ULL;
+  pthread_mutex_unlock(lock);
+}
+
+// -P worker: take the end another CPU saw for an skb started at start_ns
+// Returns its time stamp, 0 if there is none up to deadline_ns
+uint64_t
+crossed_take(uint64_t skbaddr, uint64_t start_ns, uint64_t deadline_ns)
+{
+  size_t i = crossed_slot(skbaddr);
+  pthread_mutex_t *lock = &crossed_locks[i & (CROSSED_LOCKS - 1)];
+  uint64_t ts_ns = 0;
+
+  pthread_mutex_lock(lock);
+  if (crossed_ends[i].skbaddr == skbaddr && crossed_ends[i].ts_ns >= start_ns
+   && crossed_ends[i].ts_ns <= deadline_ns) {
+    ts_ns = crossed_ends[i].ts_ns;
+    crossed_ends[i].skbaddr = 0;
+  }
+  pthread_mutex_unlock(lock);
+  return ts_ns;
+}
+
+// Worker: the in-flight skb at link won't see its end on this CPU, as of
+// trace time until_ns; with -P it may have on another, else it is lost
+void
+inflight_settle(struct worker *w, struct inflight **link, uint64_t until_ns)
+{
+  struct inflight *f = *link;
+  uint64_t start_ns = f->start.tv_sec * 1000000000ULL + f->start.tv_usec * 1000ULL;
+  uint64_t end_ns = per_cpu ? crossed_take(f->skbaddr, start_ns, until_ns) : 0;
+
+  if (end_ns == 0) {
+    inflight_lost(w, link);
+    return;
+  }
+  // Its end was on another CPU: a latency, only too late to output
+  stat_add(&w->crossed[f->dir], 1);
+  if (f->agg == NULL) {
+    // Several paths start here, no single one to charge
+  } else if (end_ns - start_ns >= 1000000) {
+    agg_discard(f->agg, f->dir);
+  } else {
+    agg_add_n(f->agg, f->dir, end_ns - start_ns, 1ULL << w->sample_shift);
+  }
+  inflight_free(w, link);
+}
+
+// Wheel callback: an skb's timeout passed
+void
+inflight_expire(struct wheel_timer *t, void *arg)
+{
+  struct worker *w = (struct worker *)arg;
+  struct inflight *f = wheel_entry(t, struct inflight, timer);
+
+  inflight_settle(w, inflight_link(w, f->start_key, f->skbaddr), f->deadline_ns);
+}
+
+// Worker: an skb was seen at path p's start point for dir
+void
+inflight_start(struct worker *w, struct latency_path *p, struct path_match *m, int dir,
+               uint64_t skbaddr, const struct timeval *ts)
+{
+  struct inflight **link = inflight_link(w, p->start_key[dir], skbaddr);
+  struct inflight *f = *link;
+  uint64_t deadline = ts->tv_sec * 1000000000ULL + ts->tv_usec * 1000ULL + p->timeout_ns;
+
+  if (offline && key_set_add(&w->started, p->start_key[dir], skbaddr)) {
+    w->chunk_failed = 1;
+  }
+  if (f != NULL && f->event == w->event) {
+    // Another path starting at the same point saw this event: wait as
+    // long as the most patient one, and charge a loss to no single path
+    f->agg = NULL;
+    if (deadline > f->deadline_ns) {
+      f->deadline_ns = deadline;
+      wheel_add(&w->wheel, &f->timer, deadline);
+    }
+    return;
+  }
+  if (f != NULL) {
+    // The kernel freed the skb and reused its address before it reached the
+    // end, here at least
+    inflight_settle(w, link, ts->tv_sec * 1000000000ULL + ts->tv_usec * 1000ULL);
+  }
+
+  f = (struct inflight *)pool_get(&w->inflight_pool);
+  if (f == NULL) {
+    stat_add(&w->untracked, 1);
+    return;
+  }
+  f->skbaddr = skbaddr;
+  f->start_key = p->start_key[dir];
+  f->event = w->event;
+  f->deadline_ns = deadline;
+  f->start = *ts;
+  f->agg = path_agg(w, p, m);
+  f->dir = dir;
+  link = &w->inflight[inflight_bucket(f->start_key, skbaddr)];
+  f->next = *link;
+  *link = f;
+  wheel_add(&w->wheel, &f->timer, deadline);
+}
+
+// Worker: an skb reached the end of path p for dir
+// Returns nonzero if it was in flight, and then its latency
+int
+inflight_finish(struct worker *w, struct latency_path *p, int dir,
+                uint64_t skbaddr, const struct timeval *ts, struct timeval *latency)
+{
+  struct inflight **link = inflight_link(w, p->start_key[dir], skbaddr);
+
+  if (*link == NULL) {
+    // The start may be in an earlier chunk of a recording, unless this
+    // chunk has started the skb since, which loses any earlier start
+    if (offline && !key_set_has(&w->started, p->start_key[dir], skbaddr)) {
+      orphan_add(w, p, dir, skbaddr, ts);
+    } else if (per_cpu) {
+      // Or on another CPU's
+      crossed_put(skbaddr, ts);
+    }
+    return 0;
+  }
+  *latency = *ts;
+  tvsub(latency, &(*link)->start);
+  inflight_free(w, link);
+  return 1;
+}
+
+// Run one trace event through one path's matching
+void
+handle_path_event(struct worker *w, struct latency_path *p, struct trace_event *evt,
+                  uint64_t skbaddr)
+{
+  struct path_match *m = &p->match[w->id];
+  struct timeval latency;
+
+  if (!strncmp(p->in_outer_func, evt->func_name, evt->func_name_len)
+   && !strncmp(p->in_outer_dev, evt->dev, evt->dev_len)) {
+    // Got a inbound event on outer dev
+    inflight_start(w, p, m, AGG_IN, skbaddr, &evt->ts);
+  } else
+  if (!strncmp(p->in_inner_func, evt->func_name, evt->func_name_len)
+   && !strncmp(p->in_inner_dev, evt->dev, evt->dev_len)
+   && inflight_finish(w, p, AGG_IN, skbaddr, &evt->ts, &latency)) {
+    // Got a inbound event on inner dev for an skb in flight
+    report_latency(w, p, m, WRITER_KIND_RECV, &evt->ts, &latency,
+                   latency.tv_sec > 0 || latency.tv_usec >= 1000);
+  } else
+  if (!strncmp(p->out_inner_func, evt->func_name, evt->func_name_len)
+   && !strncmp(p->out_inner_dev, evt->dev, evt->dev_len)) {
+    // Got a outbound event on inner dev
+    inflight_start(w, p, m, AGG_OUT, skbaddr, &evt->ts);
+  } else
+  if (!strncmp(p->out_outer_func, evt->func_name, evt->func_name_len)
+   && !strncmp(p->out_outer_dev, evt->dev, evt->dev_len)
+   && inflight_finish(w, p, AGG_OUT, skbaddr, &evt->ts, &latency)) {
+    // Got a outbound event on outer dev for an skb in flight
+    report_latency(w, p, m, WRITER_KIND_SEND, &evt->ts, &latency,
+                   latency.tv_sec > 0 || latency.tv_usec >= 1000);
+  }
+}
+
+// The skbaddr field's hex digits, as strtoull would read them but without
+// its locale and overflow handling
+static inline uint64_t
+skbaddr_parse(const char *s, int len)
+{
+  uint64_t v = 0;
+  unsigned int d;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    d = (unsigned char)s[i];
+    if (d - '0' < 10) {
+      d -= '0';
+    } else if ((d | 0x20) - 'a' < 6) {
+      d = (d | 0x20) - 'a' + 10;
+    } else {
+      break;
+    }
+    v = v << 4 | d;
+  }
+  return v;
+}
+
+// Run one parsed trace event through every path it might belong to,
+// expiring what its time stamp says is overdue first
+void
+handle_event(struct worker *w, const struct path_table *tbl, struct trace_event *evt)
+{
+  uint64_t skbaddr;
+  int i;
+
+  if (evt->skbaddr == NULL) {
+    return;
+  }
+  skbaddr = skbaddr_parse(evt->skbaddr, evt->skbaddr_len);
+  // Unless sampled out: the event filter may predate a rate change
+  if (w->sample_shift && !sample_keep_skb(skbaddr, w->sample_shift)) {
+    return;
+  }
+  if (w->event++ == 0) {
+    w->chunk_first_ns = evt->ts.tv_sec * 1000000000ULL + evt->ts.tv_usec * 1000ULL;
+  }
+  wheel_advance(&w->wheel, evt->ts.tv_sec * 1000000000ULL + evt->ts.tv_usec * 1000ULL,
+                inflight_expire, w);
+  for (i = 0; tbl && i < tbl->npaths; i++) {
+    handle_path_event(w, tbl->paths[i], evt, skbaddr);
+  }
+}
+
+// Handle every full line in the worker's buffer, keeping a partial one
+// for the next read
+void
+handle_lines(struct worker *w, const struct path_table *tbl)
+{
+  struct trace_event evt;
+  uint64_t start;
+  uint64_t nlines = 0;
+  char *line;
+  char *nl;
+
+  line = w->line_buf;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    start = stage_sample(&w->stages) ? stage_now() : 0;
+    trace_event_parse_str(line, &evt);
+    if (flight_on && (evt.ts.tv_sec || evt.ts.tv_usec)) {
+      flight_record(&w->flight, evt.ts.tv_sec * 1000000000ULL + evt.ts.tv_usec * 1000ULL,
+                    line, nl - line);
+    }
+    if (start) {
+      start = stage_time(&w->stages, STAGE_PARSE, start);
+      // The "local" trace clock and CLOCK_MONOTONIC both count from boot
+      // and agree to within their drift, close enough for lag; a
+      // recording's events are as late as it is old
+      if (!offline) {
+        stage_lag(&w->stages, start - (evt.ts.tv_sec * 1000000000LL + evt.ts.tv_usec * 1000LL));
+      }
+    }
+    handle_event(w, tbl, &evt);
+    if (start) {
+      stage_time(&w->stages, STAGE_MATCH, start);
+    }
+    nlines++;
+    line = nl + 1;
+  }
+  stat_add(&w->events, nlines);
+  stage_count(&w->stages, STAGE_PARSE, nlines);
+  stage_count(&w->stages, STAGE_MATCH, nlines);
+
+  // Keep a partial line for the next read, or drop one that can't fit
+  w->line_len = w->line_buf + w->line_len - line;
+  if (w->line_len == sizeof(w->line_buf) - 1) {
+    w->line_len = 0;
+  }
+  memmove(w->line_buf, line, w->line_len);
+}
+
+// Read what is available on the worker's pipe and handle every full line
+// Returns 0 on success, nonzero if the pipe is closed or broken
+int
+read_trace(struct worker *w, const struct path_table *tbl)
+{
+  uint64_t start;
+  ssize_t n;
+
+  start = stage_sample(&w->stages) ? stage_now() : 0;
+  n = read(w->fd, w->line_buf + w->line_len, sizeof(w->line_buf) - 1 - w->line_len);
+  stage_count(&w->stages, STAGE_READ, 1);
+  if (start) {
+    stage_time(&w->stages, STAGE_READ, start);
+  }
+  if (n < 0) {
+    return errno != EAGAIN && errno != EINTR;
+  }
+  if (n == 0) {
+    return 1;
+  }
+  w->line_len += n;
+  w->line_buf[w->line_len] = '\0';
+  w->sample_shift = sample_shift(&gov);
+  handle_lines(w, tbl);
+  return 0;
+}
+
+void *
+trace_worker(void *arg)
+{
+  struct worker *w = (struct worker *)arg;
+  struct path_table *tbl;
+  struct pollfd pfd;
+  unsigned int gen;
+
+  pfd.fd = w->fd;
+  pfd.events = POLLIN;
+  while (running) {
+    // Hold no table while waiting, so path changes never wait on an idle pipe
+    __atomic_store_n(&w->seen_gen, WORKER_IDLE, __ATOMIC_SEQ_CST);
+    // Some kernels never wake a poll on a per-CPU pipe: read it anyway, often
+    if (poll(&pfd, 1, w->cpu < 0 ? 500 : PER_CPU_POLL_MS) < 0 || (w->cpu < 0 && !(pfd.revents & POLLIN))) {
+      continue;
+    }
+    gen = __atomic_load_n(&table_gen, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&w->seen_gen, gen, __ATOMIC_SEQ_CST);
+    tbl = __atomic_load_n(&cur_table, __ATOMIC_SEQ_CST);
+    if (read_trace(w, tbl)) {
+      fprintf(stderr, "Trace pipe closed (cpu %d)\n", w->cpu);
+      break;
+    }
+  }
+  __atomic_store_n(&w->seen_gen, WORKER_IDLE, __ATOMIC_SEQ_CST);
+  if (flight_on) {
+    flight_flush(&w->flight);
+  }
+  return NULL;
+}
+
+// Correlate one chunk of a recording on its own, from an empty in-flight
+// table, leaving what it can't settle alone for merge_chunk
+void *
+chunk_worker(void *arg)
+{
+  struct worker *w = (struct worker *)arg;
+  const struct path_table *tbl = __atomic_load_n(&cur_table, __ATOMIC_SEQ_CST);
+  off_t off = w->chunk_start;
+  uint64_t start;
+  size_t len;
+  ssize_t n;
+
+  w->line_len = 0;
+  w->event = 0;
+  while (off < w->chunk_end && running && !w->chunk_failed) {
+    len = sizeof(w->line_buf) - 1 - w->line_len;
+    if ((off_t)len > w->chunk_end - off) {
+      len = w->chunk_end - off;
+    }
+    start = stage_sample(&w->stages) ? stage_now() : 0;
+    n = pread(w->fd, w->line_buf + w->line_len, len, off);
+    stage_count(&w->stages, STAGE_READ, 1);
+    if (start) {
+      stage_time(&w->stages, STAGE_READ, start);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      w->chunk_failed = 1;
+      break;
+    }
+    off += n;
+    w->line_len += n;
+    w->line_buf[w->line_len] = '\0';
+    handle_lines(w, tbl);
+  }
+  // The last line of the file may have no newline
+  if (w->line_len > 0 && !w->chunk_failed) {
+    w->line_buf[w->line_len++] = '\n';
+    w->line_buf[w->line_len] = '\0';
+    handle_lines(w, tbl);
+  }
+  return NULL;
+}
+
+// Offset just past the first newline at or after off - 1, or size if none
+off_t
+chunk_boundary(int fd, off_t off, off_t size)
+{
+  char buf[4096];
+  char *nl;
+  ssize_t n;
+
+  if (off >= size) {
+    return size;
+  }
+  off--;
+  while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+    nl = (char *)memchr(buf, '\n', n);
+    if (nl != NULL) {
+      return off + (nl - buf) + 1;
+    }
+    off += n;
+  }
+  return size;
+}
+
+void
+carry_free(struct inflight **link)
+{
+  struct inflight *f = *link;
+
+  *link = f->next;
+  pool_put(&carry_pool, f);
+}
+
+// A carried skb's end never showed up, count it lost for the chunk's worker
+void
+carry_lost(struct worker *w, struct inflight **link)
+{
+  stat_add(&w->expired[(*link)->dir], 1);
+  if ((*link)->agg != NULL) {
+    agg_expire((*link)->agg, (*link)->dir);
+  }
+  carry_free(link);
+}
+
+// Main thread, for each chunk in file order once its worker is done:
+// settle the skbs in flight before the chunk against it, as its events
+// would have one after the other, then carry what is still in flight at
+// its end on to the next chunk
+void
+merge_chunk(struct worker *w)
+{
+  struct inflight **link;
+  struct inflight *f;
+  struct inflight *c;
+  struct orphan *o;
+  struct timeval latency;
+  size_t i;
+
+  // An end matches an earlier start unless the wheel passed its deadline
+  // first. Ends after the chunk started the skb again aren't orphans.
+  for (i = 0; i < w->norphans; i++) {
+    o = &w->orphans[i];
+    link = inflight_find(carry, o->start_key, o->skbaddr);
+    if (*link == NULL) {
+      continue;
+    }
+    if (o->now > (*link)->timer.expires) {
+      carry_lost(w, link);
+      continue;
+    }
+    latency = o->ts;
+    tvsub(&latency, &(*link)->start);
+    report_latency(w, o->p, &o->p->match[w->id],
+                   o->dir == AGG_OUT ? WRITER_KIND_SEND : WRITER_KIND_RECV, &o->ts, &latency,
+                   latency.tv_sec > 0 || latency.tv_usec >= 1000);
+    carry_free(link);
+  }
+
+  // The rest expired during the chunk or lost their address to an skb it started
+  for (i = 0; i < INFLIGHT_BUCKETS; i++) {
+    link = &carry[i];
+    while (*link != NULL) {
+      f = *link;
+      if (w->wheel.now > f->timer.expires || key_set_has(&w->started, f->start_key, f->skbaddr)) {
+        carry_lost(w, link);
+      } else {
+        link = &f->next;
+      }
+    }
+  }
+
+  // None of what the chunk left in flight can be carried already
+  for (i = 0; i < INFLIGHT_BUCKETS; i++) {
+    while ((f = w->inflight[i]) != NULL) {
+      c = (struct inflight *)pool_get(&carry_pool);
+      if (c == NULL) {
+        stat_add(&w->untracked, 1);
+      } else {
+        *c = *f;
+        c->timer.next = NULL;
+        c->timer.pprev = NULL;
+        link = &carry[inflight_bucket(c->start_key, c->skbaddr)];
+        c->next = *link;
+        *link = c;
+      }
+      inflight_free(w, &w->inflight[i]);
+    }
+  }
+
+  wheel_init(&w->wheel);
+  key_set_clear(&w->started);
+  w->norphans = 0;
+}
+
+// Analyze a recording with every worker, a chunk each at a time
+// Returns 0 on success, nonzero on error
+int
+analyze_recording(const char *file)
+{
+  struct stat st;
+  off_t off = 0;
+  uint64_t last_now = 0;
+  unsigned long long backwards = 0;
+  unsigned long long untracked = 0;
+  int ret = 0;
+  int fd;
+  int n;
+  int i;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "Failed to open recording '%s'\n", file);
+    return -1;
+  }
+  if (pool_init(&carry_pool, sizeof(struct inflight), INFLIGHT_MAX)) {
+    close(fd);
+    return -1;
+  }
+
+  while (off < st.st_size && running && !ret) {
+    for (n = 0; n < nworkers && off < st.st_size; n++) {
+      workers[n].fd = fd;
+      workers[n].chunk_start = off;
+      // One worker reads the file in one go, as reading it live would
+      off = nworkers == 1 ? st.st_size : chunk_boundary(fd, off + CHUNK_SIZE, st.st_size);
+      workers[n].chunk_end = off;
+      pthread_create(&workers[n].thread, NULL, chunk_worker, &workers[n]);
+    }
+    for (i = 0; i < n; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+    for (i = 0; i < n && !ret; i++) {
+      if (workers[i].chunk_failed) {
+        fprintf(stderr, "Failed to read or correlate recording '%s'\n", file);
+        ret = -1;
+        break;
+      }
+      // The wheel would have been further along than a fresh one
+      if (workers[i].event && (workers[i].chunk_first_ns >> WHEEL_TICK_SHIFT) + 1 < last_now) {
+        backwards++;
+      }
+      if (workers[i].wheel.now > last_now) {
+        last_now = workers[i].wheel.now;
+      }
+      merge_chunk(&workers[i]);
+    }
+  }
+
+  for (i = 0; i < nworkers; i++) {
+    workers[i].fd = -1;
+    untracked += workers[i].untracked;
+    free(workers[i].started.keys);
+    workers[i].started.keys = NULL;
+    free(workers[i].orphans);
+    workers[i].orphans = NULL;
+  }
+  if (nworkers > 1 && (backwards || untracked)) {
+    fprintf(stderr, "Warning: %llu chunks start back in time and %llu skbs weren't tracked,\n"
+                    "results may differ from reading with -j 1\n", backwards, untracked);
+  }
+  pool_destroy(&carry_pool);
+  close(fd);
+  return ret;
+}
+
+// Merge every worker's shard
+// Returns 0 on success, nonzero if out of memory
+int
+build_view(struct agg_view *v)
+{
+  struct agg_shard *shards[MAX_WORKERS];
+  int i;
+
+  for (i = 0; i < nworkers; i++) {
+    shards[i] = workers[i].shard;
+  }
+  return agg_view_build(v, shards, nworkers);
+}
+
+// Summary thread: the same, for the collector
+int
+build_summary_view(struct agg_view *v, void *arg)
+{
+  (void)arg;
+  return build_view(v);
+}
+
+// Merge every worker's stage costs into a zeroed set
+// Returns 0 on success, nonzero if out of memory
+int
+build_stages(struct stage_set *set)
+{
+  struct hist *snap;
+  int i;
+
+  snap = (struct hist *)malloc(sizeof(struct hist));
+  if (snap == NULL) {
+    return -1;
+  }
+  for (i = 0; i < nworkers; i++) {
+    stage_set_merge(set, &workers[i].stages, snap);
+  }
+  free(snap);
+  return 0;
+}
+
+// Main thread, after ticking the windows: an outlier for -F p<q> is
+// above that quantile of its path's last minute, once enough samples are
+void
+flight_update_thresholds()
+{
+  struct agg_view view;
+  const struct hist *h;
+  int dir;
+  int i;
+  int j;
+
+  if (window_view_build(&windows, WINDOW_1M, &view)) {
+    return;
+  }
+  pthread_mutex_lock(&paths_lock);
+  for (i = 0; i < npaths; i++) {
+    for (j = 0; j < view.nentries && view.entries[j].key != paths[i]->key; j++) {
+    }
+    for (dir = 0; dir < 2; dir++) {
+      h = j < view.nentries ? &view.entries[j].latency[dir] : NULL;
+      __atomic_store_n(&paths[i]->flight_ns[dir],
+                       h && h->count * (1 - flight_q) >= FLIGHT_MIN_ABOVE ? hist_quantile(h, flight_q) : 0,
+                       __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&paths_lock);
+  agg_view_free(&view);
+}
+
+// Main thread, once a second: sample more or less of the skbs, see -G
+void
+govern_sampling(uint64_t interval_ns)
+{
+  struct stage_set *stages;
+  unsigned long long entries;
+  unsigned long long overrun;
+  char filter[512];
+  uint64_t lost = writer_dropped(&writer);
+  uint64_t lag = 0;
+  uint64_t cpu_ns;
+  double cpu = 0;
+  long ncpus;
+  int i;
+
+  ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  for (i = 0; i < ncpus; i++) {
+    if (trace_buffer_stats(TRACING_FS_PATH, i, &entries, &overrun)) {
+      lost += overrun;
+    }
+  }
+  for (i = 0; i < nworkers; i++) {
+    cpu_ns = sample_thread_cpu_ns(workers[i].thread);
+    if (cpu_ns > workers[i].cpu_ns && (double)(cpu_ns - workers[i].cpu_ns) / interval_ns > cpu) {
+      cpu = (double)(cpu_ns - workers[i].cpu_ns) / interval_ns;
+    }
+    workers[i].cpu_ns = cpu_ns;
+  }
+
+  stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+  if (stages != NULL && !build_stages(stages)) {
+    lag = sample_gov_lag(&gov, &stages->lag);
+  }
+  free(stages);
+
+  if (!sample_gov_update(&gov, lost, lag, cpu)) {
+    return;
+  }
+  fprintf(stderr, "Sampling 1 in %u skbs (lost %llu, lag p99 %.1f us, cpu %.0f%%)\n",
+          1U << sample_shift(&gov), (unsigned long long)lost, lag / 1000.0, cpu * 100);
+  // If the kernel won't take the filter, the workers still sample
+  if (sample_skb_filter(sample_shift(&gov), filter, sizeof(filter))
+   || !trace_filter_set(TRACING_FS_PATH, SAMPLE_EVENTS, filter)) {
+    fprintf(stderr, "Failed to set the %s event filter\n", SAMPLE_EVENTS);
+  }
+}
+
+// One line of per-path percentiles, in microseconds
+void
+format_path_stats(const struct agg_entry *e, char *buf, size_t len)
+{
+  static const char *names[2] = { "send", "recv" };
+  size_t off;
+  int dir;
+
+  off = snprintf(buf, len, "%s", e->name);
+  for (dir = 0; dir < 2 && off < len; dir++) {
+    off += snprintf(buf + off, len - off, " %s n=%llu expired=%llu p50=%.1f p90=%.1f p99=%.1f max=%.1f",
+                    names[dir], (unsigned long long)e->samples[dir],
+                    (unsigned long long)e->expired[dir],
+                    hist_quantile(&e->latency[dir], 0.5) / 1000.0,
+                    hist_quantile(&e->latency[dir], 0.9) / 1000.0,
+                    hist_quantile(&e->latency[dir], 0.99) / 1000.0,
+                    e->latency[dir].max / 1000.0);
+  }
+}
+
+// Control thread: apply one command
+int
+handle_command(char *line, struct control_reply *reply, void *arg)
+{
+  struct latency_path *p;
+  struct agg_view view;
+  char name[PATH_NAME_SIZE];
+  char line_buf[CONFIG_LINE_BUFFER];
+  char *cmd;
+  char *rest;
+  int pid;
+  int ret = 0;
+  int i;
+
+  (void)arg;
+  rest = control_next_word(line, &cmd);
+
+  if (!strcmp(cmd, "add-path")) {
+    if (rest[0] != '/') {
+      control_printf(reply, "config path must be absolute\n");
+      return -1;
+    }
+    p = parse_config_file(rest);
+    if (p == NULL) {
+      control_printf(reply, "failed to read config '%s'\n", rest);
+      return -1;
+    }
+    if (add_path(p)) {
+      control_printf(reply, "path '%s' already added or too many paths\n", rest);
+      free_path(p);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!strcmp(cmd, "del-path")) {
+    if (!del_path(rest, 0)) {
+      control_printf(reply, "no path '%s'\n", rest);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!strcmp(cmd, "add-container") || !strcmp(cmd, "del-container")) {
+    pid = parse_pid(rest);
+    if (pid < 0) {
+      control_printf(reply, "bad pid '%s'\n", rest);
+      return -1;
+    }
+    if (cmd[0] == 'a') {
+      ret = add_container(pid);
+      if (ret < 0) {
+        control_printf(reply, "no veth paths found for pid %d\n", pid);
+        return -1;
+      }
+      control_printf(reply, "added %d path%s\n", ret, ret == 1 ? "" : "s");
+      return 0;
+    }
+    snprintf(name, sizeof(name), "container:%d:", pid);
+    if (!del_path(name, 1)) {
+      control_printf(reply, "no paths for pid %d\n", pid);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!strcmp(cmd, "add-pid") || !strcmp(cmd, "del-pid")) {
+    pid = parse_pid(rest);
+    if (pid < 0) {
+      control_printf(reply, "bad pid '%s'\n", rest);
+      return -1;
+    }
+    pthread_mutex_lock(&paths_lock);
+    for (i = 0; i < npids && pids[i] != pid; i++) {
+    }
+    if (cmd[0] == 'a') {
+      if (i < npids) {
+        // Already traced
+      } else if (npids == MAX_PIDS) {
+        control_printf(reply, "too many pids\n");
+        ret = -1;
+      } else {
+        // Write the pid as parsed, never the rest of the line
+        snprintf(name, sizeof(name), "%d", pid);
+        if (tracing && !trace_pid_add(TRACING_FS_PATH, name)) {
+          control_printf(reply, "failed to add pid %d to set_event_pid\n", pid);
+          ret = -1;
+        } else {
+          pids[npids++] = pid;
+        }
+      }
+    } else {
+      if (i == npids) {
+        control_printf(reply, "pid %d not traced\n", pid);
+        ret = -1;
+      } else {
+        // tracefs can't drop a single pid, so rewrite the list
+        pids[i] = pids[--npids];
+        if (tracing) {
+          write_pids();
+        }
+      }
+    }
+    pthread_mutex_unlock(&paths_lock);
+    return ret;
+  }
+
+  if (!strcmp(cmd, "list")) {
+    pthread_mutex_lock(&paths_lock);
+    for (i = 0; i < npaths; i++) {
+      control_printf(reply, "path %s\n", paths[i]->name);
+    }
+    for (i = 0; i < npids; i++) {
+      control_printf(reply, "pid %d\n", pids[i]);
+    }
+    pthread_mutex_unlock(&paths_lock);
+    return 0;
+  }
+
+  if (!strcmp(cmd, "stats")) {
+    // "stats" is since the start, "stats 10s" over the last 10 s
+    for (i = 0; i < NWINDOWS && strcmp(rest, window_names[i]); i++) {
+    }
+    if (rest[0] && i == NWINDOWS) {
+      control_printf(reply, "windows: 1s, 10s, 60s, 10m\n");
+      return -1;
+    }
+    if (rest[0] ? window_view_build(&windows, (enum window_span)i, &view) : build_view(&view)) {
+      control_printf(reply, "out of memory\n");
+      return -1;
+    }
+    for (i = 0; i < view.nentries; i++) {
+      format_path_stats(&view.entries[i], line_buf, sizeof(line_buf));
+      control_printf(reply, "%s\n", line_buf);
+    }
+    agg_view_free(&view);
+    return 0;
+  }
+
+  control_printf(reply, "commands: add-path <file>, del-path <file>, "
+                        "add-container <pid>, del-container <pid>, "
+                        "add-pid <pid>, del-pid <pid>, list, stats [1s|10s|60s|10m]\n");
+  return strcmp(cmd, "help") != 0;
+}
+
+// Path names are file paths or generated, keep them out of label syntax
+void
+metrics_path_name(const struct agg_entry *e, char name[AGG_NAME_SIZE])
+{
+  int j;
+
+  for (j = 0; e->name[j]; j++) {
+    name[j] = e->name[j] == '"' || e->name[j] == '\\' ? '_' : e->name[j];
+  }
+  name[j] = '\0';
+}
+
+// Metrics thread: merge the workers' shards
+void
+collect_metrics(struct metrics_buf *out, void *arg)
+{
+  static const char *dirs[2] = { "send", "recv" };
+  static const double quantiles[3] = { 0.5, 0.9, 0.99 };
+  struct agg_view view;
+  struct agg_view wviews[NWINDOWS];
+  struct agg_entry *total;
+  const struct hist *hist;
+  struct stage_set *stages;
+  unsigned long long overflow = 0;
+  unsigned long long expired[2] = { 0, 0 };
+  unsigned long long crossed[2] = { 0, 0 };
+  unsigned long long untracked = 0;
+  unsigned long long flight_triggers = 0;
+  unsigned long long flight_suppressed = 0;
+  unsigned long long entries[2];
+  char labels[PATH_NAME_SIZE + 64];
+  long ncpus;
+  char name[AGG_NAME_SIZE];
+  int dir;
+  int w;
+  int q;
+  int i;
+
+  (void)arg;
+  metrics_family(out, "latency_trace_events_total", "counter", "Events read from the trace pipe");
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i].cpu < 0) {
+      metrics_value(out, "latency_trace_events_total", "", stat_read(&workers[i].events));
+    } else {
+      snprintf(labels, sizeof(labels), "cpu=\"%d\"", workers[i].cpu);
+      metrics_value(out, "latency_trace_events_total", labels, stat_read(&workers[i].events));
+    }
+    overflow += stat_read(&workers[i].shard->overflow);
+    expired[AGG_OUT] += stat_read(&workers[i].expired[AGG_OUT]);
+    expired[AGG_IN] += stat_read(&workers[i].expired[AGG_IN]);
+    crossed[AGG_OUT] += stat_read(&workers[i].crossed[AGG_OUT]);
+    crossed[AGG_IN] += stat_read(&workers[i].crossed[AGG_IN]);
+    untracked += stat_read(&workers[i].untracked);
+  }
+
+  metrics_family(out, "latency_paths", "gauge", "Paths being measured");
+  metrics_value(out, "latency_paths", "", __atomic_load_n(&npaths, __ATOMIC_RELAXED));
+
+  metrics_family(out, "latency_output_dropped_total", "counter", "Results dropped because the writer could not keep up");
+  metrics_value(out, "latency_output_dropped_total", "", writer_dropped(&writer));
+
+  metrics_family(out, "latency_agg_overflow_total", "counter", "Samples not aggregated because a shard was full");
+  metrics_value(out, "latency_agg_overflow_total", "", overflow);
+
+  metrics_family(out, "latency_output_queued_bytes", "gauge", "Results waiting for the writer thread");
+  metrics_value(out, "latency_output_queued_bytes", "", writer_queued(&writer));
+
+  metrics_family(out, "latency_sample_every", "gauge", "Skbs per skb measured, 1 unless sampling under overload");
+  metrics_value(out, "latency_sample_every", "", 1ULL << sample_shift(&gov));
+
+  // Events the kernel has buffered but no worker has read yet
+  ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  metrics_family(out, "latency_trace_buffer_entries", "gauge", "Events waiting in each cpu's ring buffer");
+  for (i = 0; i < ncpus; i++) {
+    if (trace_buffer_stats(TRACING_FS_PATH, i, &entries[0], &entries[1])) {
+      snprintf(labels, sizeof(labels), "cpu=\"%d\"", i);
+      metrics_value(out, "latency_trace_buffer_entries", labels, entries[0]);
+    }
+  }
+  metrics_family(out, "latency_trace_buffer_overrun_total", "counter", "Events lost because a cpu's ring buffer was full");
+  for (i = 0; i < ncpus; i++) {
+    if (trace_buffer_stats(TRACING_FS_PATH, i, &entries[0], &entries[1])) {
+      snprintf(labels, sizeof(labels), "cpu=\"%d\"", i);
+      metrics_value(out, "latency_trace_buffer_overrun_total", labels, entries[1]);
+    }
+  }
+
+  stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+  if (stages != NULL && !build_stages(stages)) {
+    metrics_stages(out, "latency", stage_names, NSTAGES, stages);
+  }
+  free(stages);
+
+  total = (struct agg_entry *)malloc(sizeof(struct agg_entry));
+  if (total == NULL || build_view(&view)) {
+    free(total);
+    return;
+  }
+  agg_view_total(&view, total);
+
+  metrics_family(out, "latency_samples_total", "counter", "Latency samples kept");
+  for (dir = 0; dir < 2; dir++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+    metrics_value(out, "latency_samples_total", labels, total->samples[dir]);
+  }
+
+  metrics_family(out, "latency_discarded_total", "counter", "Latency samples discarded as too large");
+  for (dir = 0; dir < 2; dir++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+    metrics_value(out, "latency_discarded_total", labels, total->discarded[dir]);
+  }
+
+  // Per path only where one path starts at the skb's first device, the total counts every skb
+  metrics_family(out, "latency_expired_total", "counter", "Skbs that started a path but did not reach its end within the timeout");
+  for (dir = 0; dir < 2; dir++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+    metrics_value(out, "latency_expired_total", labels, expired[dir]);
+  }
+
+  metrics_family(out, "latency_crossed_total", "counter", "Skbs whose end was traced on another CPU (-P), timed but not output");
+  for (dir = 0; dir < 2; dir++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+    metrics_value(out, "latency_crossed_total", labels, crossed[dir]);
+  }
+
+  metrics_family(out, "latency_untracked_total", "counter", "Skbs not timed because the in-flight table was full");
+  metrics_value(out, "latency_untracked_total", "", untracked);
+
+  metrics_family(out, "latency_kernel_dropped_total", "counter", "Latencies the kernel histograms had no room for (-K)");
+  metrics_value(out, "latency_kernel_dropped_total", "", stat_read(&kernel_dropped));
+
+  metrics_family(out, "latency_kernel_map_dropped_total", "counter", "Skbs the kernel start or end maps had no room for (-K)");
+  metrics_value(out, "latency_kernel_map_dropped_total", "map=\"start\"", stat_read(&kernel_map_dropped[0]));
+  metrics_value(out, "latency_kernel_map_dropped_total", "map=\"end\"", stat_read(&kernel_map_dropped[1]));
+
+  metrics_family(out, "latency_kernel_map_resets_total", "counter", "Kernel legs whose start and end maps were emptied (-K)");
+  metrics_value(out, "latency_kernel_map_resets_total", "", stat_read(&kernel_resets));
+
+  if (flight_on) {
+    for (i = 0; i < nworkers; i++) {
+      flight_triggers += stat_read(&workers[i].flight.triggers);
+      flight_suppressed += stat_read(&workers[i].flight.suppressed);
+    }
+    metrics_family(out, "latency_flight_outliers_total", "counter", "Samples over the flight recorder threshold (-F)");
+    metrics_value(out, "latency_flight_outliers_total", "", flight_triggers);
+    metrics_family(out, "latency_flight_suppressed_total", "counter", "Outliers not dumped, too soon after the last one");
+    metrics_value(out, "latency_flight_suppressed_total", "", flight_suppressed);
+    metrics_family(out, "latency_flight_dumps_total", "counter", "Flight recorder dumps written");
+    metrics_value(out, "latency_flight_dumps_total", "", __atomic_load_n(&flight.dumps, __ATOMIC_RELAXED));
+  }
+
+  metrics_family(out, "latency_seconds", "histogram", "Latency between the outer and inner device events");
+  for (dir = 0; dir < 2; dir++) {
+    snprintf(labels, sizeof(labels), "direction=\"%s\"", dirs[dir]);
+    metrics_hist(out, "latency_seconds", labels, &total->latency[dir]);
+  }
+
+  metrics_family(out, "latency_path_seconds", "histogram", "Latency per path or container");
+  for (i = 0; i < view.nentries; i++) {
+    metrics_path_name(&view.entries[i], name);
+    for (dir = 0; dir < 2; dir++) {
+      snprintf(labels, sizeof(labels), "path=\"%s\",direction=\"%s\"", name, dirs[dir]);
+      metrics_hist(out, "latency_path_seconds", labels, &view.entries[i].latency[dir]);
+    }
+  }
+
+  metrics_family(out, "latency_path_expired_total", "counter", "Skbs lost between the ends of a path");
+  for (i = 0; i < view.nentries; i++) {
+    metrics_path_name(&view.entries[i], name);
+    for (dir = 0; dir < 2; dir++) {
+      snprintf(labels, sizeof(labels), "path=\"%s\",direction=\"%s\"", name, dirs[dir]);
+      metrics_value(out, "latency_path_expired_total", labels, view.entries[i].expired[dir]);
+    }
+  }
+  agg_view_free(&view);
+
+  // A window that can't be built is left out of both families
+  for (w = 0; w < NWINDOWS; w++) {
+    if (window_view_build(&windows, (enum window_span)w, &wviews[w])) {
+      wviews[w].nentries = 0;
+      wviews[w].entries = NULL;
+    }
+  }
+
+  metrics_family(out, "latency_path_window_seconds", "summary",
+                 "Latency per path or container over the last window");
+  for (w = 0; w < NWINDOWS; w++) {
+    for (i = 0; i < wviews[w].nentries; i++) {
+      metrics_path_name(&wviews[w].entries[i], name);
+      for (dir = 0; dir < 2; dir++) {
+        hist = &wviews[w].entries[i].latency[dir];
+        snprintf(labels, sizeof(labels), "path=\"%s\",direction=\"%s\",window=\"%s\"",
+                 name, dirs[dir], window_names[w]);
+        for (q = 0; q < 3; q++) {
+          metrics_printf(out, "latency_path_window_seconds{%s,quantile=\"%g\"} %.9f\n",
+                         labels, quantiles[q], hist->count ? hist_quantile(hist, quantiles[q]) / 1e9 : 0.0);
+        }
+        metrics_printf(out, "latency_path_window_seconds_sum{%s} %.9f\n", labels, hist->sum / 1e9);
+        metrics_printf(out, "latency_path_window_seconds_count{%s} %llu\n", labels,
+                       (unsigned long long)hist->count);
+      }
+    }
+  }
+
+  metrics_family(out, "latency_path_window_max_seconds", "gauge",
+                 "Largest latency per path or container over the last window");
+  for (w = 0; w < NWINDOWS; w++) {
+    for (i = 0; i < wviews[w].nentries; i++) {
+      metrics_path_name(&wviews[w].entries[i], name);
+      for (dir = 0; dir < 2; dir++) {
+        snprintf(labels, sizeof(labels), "path=\"%s\",direction=\"%s\",window=\"%s\"",
+                 name, dirs[dir], window_names[w]);
+        metrics_printf(out, "latency_path_window_max_seconds{%s} %.9f\n", labels,
+                       wviews[w].entries[i].latency[dir].max / 1e9);
+      }
+    }
+    agg_view_free(&wviews[w]);
+  }
+  free(total);
+}
+
+void
+print_stats(long long unsigned int send_sum,
+                 unsigned int send_num,
+                 long long unsigned int recv_sum,
+                 unsigned int recv_num)
+{
+  long long unsigned int send_mean;
+  long long unsigned int recv_mean;
+
+  if (send_num) {
+    send_mean = send_sum / send_num;
+  } else {
+    send_mean = 0;
+  }
+
+  if (recv_num) {
+    recv_mean = recv_sum / recv_num;
+  } else {
+    recv_mean = 0;
+  }
+
+  fprintf(stdout, "\nLatency stats:\n");
+  fprintf(stdout, "send mean: %f ms\n", (float)send_mean / 1000.0);
+  fprintf(stdout, "recv mean: %f ms\n", (float)recv_mean / 1000.0);
+  fprintf(stdout, "rtt  mean: %f ms\n",
+      (float)(send_mean + recv_mean) / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+  char events[EVENT_LIST_SIZE];
+  char line_buf[CONFIG_LINE_BUFFER];
+  struct latency_path *p;
+  struct agg_view view;
+  struct agg_entry *total;
+
+  const char *out_file = NULL;
+  int out_format = WRITER_FORMAT_TEXT;
+  int out_fd = STDOUT_FILENO;
+  unsigned long long dropped;
+  const char *metrics_addr = NULL;
+  struct metrics_server metrics;
+  const char *control_path = NULL;
+  struct control_server control;
+  char summary_addr[SUMMARY_ADDR_SIZE];
+  unsigned int summary_secs = 0;
+  struct summary_agent summary;
+  int watch_fd = -1;
+  pthread_t watch_thread;
+  int stage_secs = 0;
+  const char *recording = NULL;
+  int njobs = 0;
+  struct stage_set *stages;
+  uint64_t stage_items[NSTAGES] = { 0 };
+  uint64_t stage_busy[NSTAGES] = { 0 };
+  uint64_t last_report;
+  uint64_t last_gov;
+  uint64_t last_window;
+  uint64_t now;
+  unsigned long long expired[2] = { 0, 0 };
+  unsigned long long crossed[2] = { 0, 0 };
+  unsigned long long untracked = 0;
+  unsigned long long flight_suppressed = 0;
+  struct flight_recorder *recorders[MAX_WORKERS];
+  int opt;
+  int i;
+
+  sample_gov_init(&gov, 0, 0);
+  window_set_init(&windows);
+
+  while ((opt = getopt(argc, argv, "o:f:M:C:APS:G:E:Kr:j:F:D:U:")) != -1) {
+    switch (opt) {
+      case 'o':
+        out_file = optarg;
+        break;
+      case 'f':
+        out_format = writer_format_parse(optarg);
+        if (out_format < 0) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'M':
+        metrics_addr = optarg;
+        break;
+      case 'C':
+        control_path = optarg;
+        break;
+      case 'A':
+        auto_paths = 1;
+        break;
+      case 'P':
+        per_cpu = 1;
+        break;
+      case 'S':
+        stage_secs = atoi(optarg);
+        if (stage_secs < 1) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'G':
+        if (sample_gov_parse(&gov, optarg)) {
+          usage();
+          return 1;
+        }
+        governed = 1;
+        break;
+      case 'E':
+        if (atol(optarg) <= 0) {
+          usage();
+          return 1;
+        }
+        default_timeout_ns = atol(optarg) * 1000000ULL;
+        break;
+      case 'K':
+        kernel_hist = 1;
+        break;
+      case 'r':
+        recording = optarg;
+        break;
+      case 'j':
+        njobs = atoi(optarg);
+        if (njobs < 1) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'F':
+        if (flight_parse(optarg)) {
+          usage();
+          return 1;
+        }
+        flight_on = 1;
+        break;
+      case 'D':
+        flight_dir = optarg;
+        break;
+      case 'U':
+        if (summary_parse_arg(optarg, summary_addr, sizeof(summary_addr), &summary_secs)) {
+          usage();
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (recording) {
+    if (control_path || auto_paths || per_cpu || governed || kernel_hist || flight_on) {
+      fprintf(stderr, "Warning: ignoring -C, -A, -P, -G, -K and -F when reading a recording\n");
+      control_path = NULL;
+      auto_paths = 0;
+      per_cpu = 0;
+      governed = 0;
+      kernel_hist = 0;
+      flight_on = 0;
+    }
+    offline = 1;
+  } else if (njobs) {
+    fprintf(stderr, "Warning: ignoring -j without -r\n");
+  }
+
+  if (argc - optind < 1 && !control_path && !auto_paths) {
+    usage();
+    return 1;
+  }
+  if (kernel_hist && (per_cpu || governed || flight_on)) {
+    usage();
+    return 1;
+  }
+
+  // Workers exist before any path, which has matching state for each
+  if (per_cpu) {
+    for (i = 0; i < CROSSED_LOCKS; i++) {
+      pthread_mutex_init(&crossed_locks[i], NULL);
+    }
+    nworkers = sysconf(_SC_NPROCESSORS_CONF);
+    if (nworkers < 1) {
+      nworkers = 1;
+    } else if (nworkers > MAX_WORKERS) {
+      fprintf(stderr, "Only reading the first %d CPUs\n", MAX_WORKERS);
+      nworkers = MAX_WORKERS;
+    }
+  } else if (recording) {
+    nworkers = njobs ? njobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+      nworkers = 1;
+    } else if (nworkers > MAX_WORKERS) {
+      nworkers = MAX_WORKERS;
+    }
+  }
+  if (posix_memalign((void **)&workers, 64, nworkers * sizeof(struct worker))) {
+    return 1;
+  }
+  memset(workers, 0, nworkers * sizeof(struct worker));
+  for (i = 0; i < nworkers; i++) {
+    workers[i].id = i;
+    workers[i].cpu = per_cpu ? i : -1;
+    workers[i].fd = -1;
+    workers[i].seen_gen = WORKER_IDLE;
+    workers[i].shard = agg_shard_new();
+    if (workers[i].shard == NULL
+     || pool_init(&workers[i].inflight_pool, sizeof(struct inflight), INFLIGHT_MAX)) {
+      return 1;
+    }
+    wheel_init(&workers[i].wheel);
+    if (flight_on && flight_recorder_init(&workers[i].flight, i)) {
+      fprintf(stderr, "Failed to allocate the flight recorder\n");
+      return 1;
+    }
+  }
+  if (path_pool_init()) {
+    return 1;
+  }
+
+  for (i = optind; i < argc; i++) {
+    p = parse_config_file(argv[i]);
+    if (p == NULL || add_path(p)) {
+      fprintf(stderr, "Failed to add path '%s'\n", argv[i]);
+      return 1;
+    }
+    print_path(stdout, p);
+  }
+
+  // Subscribe before listing links so nothing added in between is missed
+  if (control_path || auto_paths) {
+    watch_fd = discover_watch_open();
+    if (watch_fd < 0) {
+      fprintf(stderr, "Failed to open netlink socket\n");
+      return 1;
+    }
+    if (auto_paths) {
+      discover_links(handle_link_event, NULL);
+    }
+  }
+
+  build_event_list(events, sizeof(events));
+  if (!kernel_hist) {
+    fprintf(stdout, "events: %s\n", events);
+  }
+
+  if (!recording) {
+    fprintf(stdout, "trace_clock: %s\n", TRACE_CLOCK);
+  }
+  
+  signal(SIGINT, do_exit);
+
+  if (out_file) {
+    out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      fprintf(stderr, "Failed to open output file '%s'\n", out_file);
+      return 1;
+    }
+  }
+  if (writer_start(&writer, out_fd, out_format)) {
+    return 1;
+  }
+  for (i = 0; i < nworkers; i++) {
+    workers[i].out = writer_stream_open(&writer, WRITER_STREAM_RECORDS);
+    if (workers[i].out == NULL) {
+      return 1;
+    }
+  }
+
+  if (metrics_addr && metrics_start(&metrics, metrics_addr, collect_metrics, NULL)) {
+    return 1;
+  }
+  if (summary_secs && summary_agent_start(&summary, summary_addr, NULL, summary_secs, build_summary_view, NULL)) {
+    return 1;
+  }
+
+  if (recording) {
+    now = stage_now();
+    if (analyze_recording(recording)) {
+      return 1;
+    }
+    fprintf(stderr, "Analyzed '%s' with %d worker%s in %.1f s\n", recording, nworkers,
+            nworkers == 1 ? "" : "s", (stage_now() - now) / 1e9);
+  } else {
+    // Set up tracefs under the lock so control commands see a consistent state
+    pthread_mutex_lock(&paths_lock);
+    tracing = setup_tracing(TRACING_FS_PATH, kernel_hist ? "" : events, NULL, TRACE_CLOCK);
+    if (tracing && kernel_hist) {
+      for (i = 0; i < npaths && !kernel_path_install(paths[i]); i++) {
+      }
+      if (i < npaths) {
+        while (i-- > 0) {
+          kernel_path_remove(paths[i]);
+        }
+        release_trace_pipe(NULL, TRACING_FS_PATH);
+        tracing = 0;
+      }
+    }
+    pthread_mutex_unlock(&paths_lock);
+
+    if (!tracing) {
+      fprintf(stderr, "Failed to set up tracing\n");
+      return 1;
+    }
+
+    for (i = 0; i < nworkers && !kernel_hist; i++) {
+      workers[i].fd = open_trace_pipe_fd(TRACING_FS_PATH, workers[i].cpu);
+      if (workers[i].fd < 0) {
+        fprintf(stderr, "Failed to open trace pipe\n");
+        release_trace_pipe(NULL, TRACING_FS_PATH);
+        return 1;
+      }
+    }
+
+    if (control_path && control_start(&control, control_path, handle_command, NULL)) {
+      release_trace_pipe(NULL, TRACING_FS_PATH);
+      return 1;
+    }
+
+    if (watch_fd >= 0) {
+      pthread_create(&watch_thread, NULL, watch_links, &watch_fd);
+    }
+
+    if (flight_on) {
+      for (i = 0; i < nworkers; i++) {
+        recorders[i] = &workers[i].flight;
+      }
+      if (flight_start(&flight, flight_dir, "latency", recorders, nworkers)) {
+        release_trace_pipe(NULL, TRACING_FS_PATH);
+        return 1;
+      }
+    }
+
+    for (i = 0; i < nworkers && !kernel_hist; i++) {
+      pthread_create(&workers[i].thread, NULL, trace_worker, &workers[i]);
+    }
+
+    last_report = last_gov = last_window = stage_now();
+    while (running) {
+      sleep(1);
+      now = stage_now();
+      if (kernel_hist) {
+        kernel_poll();
+      }
+      // Whole seconds only, a late tick moves the windows on by more
+      if (now - last_window >= 1000000000ULL && !build_view(&view)) {
+        window_tick(&windows, &view, (now - last_window) / 1000000000ULL);
+        last_window += (now - last_window) / 1000000000ULL * 1000000000ULL;
+        agg_view_free(&view);
+        if (flight_on && flight_q) {
+          flight_update_thresholds();
+        }
+      }
+      if (governed) {
+        govern_sampling(now - last_gov);
+        last_gov = now;
+      }
+      if (stage_secs && now - last_report >= stage_secs * 1000000000ULL) {
+        stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+        if (stages != NULL && !build_stages(stages)) {
+          stage_report(stderr, stage_names, NSTAGES, stages, stage_items, stage_busy,
+                       now - last_report);
+          fprintf(stderr, "output queued %llu bytes, dropped %llu\n",
+                  writer_queued(&writer), writer_dropped(&writer));
+        }
+        free(stages);
+        last_report = now;
+      }
+    }
+
+    if (control_path) {
+      control_stop(&control);
+    }
+    if (watch_fd >= 0) {
+      pthread_join(watch_thread, NULL);
+      close(watch_fd);
+    }
+    for (i = 0; i < nworkers && !kernel_hist; i++) {
+      pthread_join(workers[i].thread, NULL);
+      close(workers[i].fd);
+    }
+    if (flight_on) {
+      flight_stop(&flight);
+    }
+    if (kernel_hist) {
+      pthread_mutex_lock(&paths_lock);
+      for (i = 0; i < npaths; i++) {
+        kernel_path_remove(paths[i]);
+      }
+      pthread_mutex_unlock(&paths_lock);
+    }
+
+    if (sample_shift(&gov)) {
+      trace_filter_set(TRACING_FS_PATH, SAMPLE_EVENTS, "0");
+    }
+    release_trace_pipe(NULL, TRACING_FS_PATH);
+  }
+
+  // Sends what came in since the last summary
+  if (summary_secs) {
+    summary_agent_stop(&summary);
+  }
+  if (metrics_addr) {
+    metrics_stop(&metrics);
+  }
+
+  dropped = writer_stop(&writer);
+  if (out_fd != STDOUT_FILENO) {
+    close(out_fd);
+  }
+  if (dropped) {
+    fprintf(stderr, "Warning: dropped %llu results, output could not keep up\n", dropped);
+  }
+
+  total = (struct agg_entry *)malloc(sizeof(struct agg_entry));
+  if (total != NULL && !build_view(&view)) {
+    if (view.nentries) {
+      fprintf(stdout, "\nPer path latency (us):\n");
+    }
+    for (i = 0; i < view.nentries; i++) {
+      format_path_stats(&view.entries[i], line_buf, sizeof(line_buf));
+      fprintf(stdout, "%s\n", line_buf);
+    }
+    agg_view_total(&view, total);
+    for (i = 0; i < nworkers; i++) {
+      expired[AGG_OUT] += workers[i].expired[AGG_OUT];
+      expired[AGG_IN] += workers[i].expired[AGG_IN];
+      crossed[AGG_OUT] += workers[i].crossed[AGG_OUT];
+      crossed[AGG_IN] += workers[i].crossed[AGG_IN];
+      untracked += workers[i].untracked;
+    }
+    if (expired[AGG_OUT] || expired[AGG_IN] || untracked) {
+      fprintf(stdout, "Lost in flight: send %llu recv %llu, not timed (table full) %llu\n",
+              expired[AGG_OUT], expired[AGG_IN], untracked);
+    }
+    if (crossed[AGG_OUT] || crossed[AGG_IN]) {
+      fprintf(stdout, "Ended on another CPU (timed, not output): send %llu recv %llu\n",
+              crossed[AGG_OUT], crossed[AGG_IN]);
+    }
+    if (kernel_dropped) {
+      fprintf(stdout, "Not counted (kernel histogram full): %llu\n",
+              (unsigned long long)kernel_dropped);
+    }
+    if (kernel_map_dropped[0] || kernel_map_dropped[1]) {
+      fprintf(stdout, "Not timed (kernel map full): start %llu end %llu, maps emptied %llu times\n",
+              (unsigned long long)kernel_map_dropped[0], (unsigned long long)kernel_map_dropped[1],
+              (unsigned long long)kernel_resets);
+    }
+    if (flight_on) {
+      for (i = 0; i < nworkers; i++) {
+        flight_suppressed += workers[i].flight.suppressed;
+      }
+      fprintf(stdout, "Flight recorder: %llu dumps in %s, %llu failed, %llu outliers too soon after one\n",
+              (unsigned long long)flight.dumps, flight_dir, (unsigned long long)flight.failed,
+              flight_suppressed);
+    }
+    // Histogram counts, not samples: sums are weighted by the sampling rate
+    print_stats(total->latency[AGG_OUT].sum / 1000, total->latency[AGG_OUT].count,
+                total->latency[AGG_IN].sum / 1000, total->latency[AGG_IN].count);
+    agg_view_free(&view);
+  }
+  free(total);
+
+  for (i = 0; i < npaths; i++) {
+    free_path(paths[i]);
+  }
+  for (i = 0; i < nretired; i++) {
+    free_path(retired[i]);
+  }
+  pool_destroy(&path_pool);
+  window_set_free(&windows);
+  for (i = 0; i < nworkers; i++) {
+    agg_shard_free(workers[i].shard);
+    pool_destroy(&workers[i].inflight_pool);
+    flight_recorder_free(&workers[i].flight);
+  }
+  free(workers);
 
   fprintf(stdout, "Done.\n");
 
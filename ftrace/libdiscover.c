@@ -0,0 +1,390 @@
+//
+// Discover container network paths through rtnetlink
+//
+// A container's interfaces are found by opening a netlink socket inside
+// its network namespace: each veth there reports the ifindex of its peer
+// in the host namespace (iflink). In the host namespace that peer tells us
+// the bridge it is enslaved to, and the default route tells us the uplink.
+//
+// The same link messages, subscribed to through RTMGRP_LINK, tell us when
+// veths come and go, which is how short-lived containers are tracked.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+
+#include "libdiscover.h"
+
+#define DISCOVER_BUFFER 0x8000
+#define DISCOVER_MAX_LINKS 64
+
+struct discover_links {
+  struct discover_link links[DISCOVER_MAX_LINKS];
+  int nlinks;
+};
+
+static int
+nl_socket(unsigned int groups)
+{
+  struct sockaddr_nl sa;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = groups;
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Send one RTM_GET* request and call cb for every message in the reply
+// With dump set all objects are returned, otherwise just ifindex
+// Returns 0 on success, nonzero on error
+static int
+nl_request(int fd, int type, int dump, int ifindex,
+           void (*cb)(struct nlmsghdr *, void *), void *arg)
+{
+  struct {
+    struct nlmsghdr nh;
+    union {
+      struct ifinfomsg ifi;
+      struct rtmsg rtm;
+    } u;
+  } req;
+  char buf[DISCOVER_BUFFER];
+  struct nlmsghdr *nh;
+  ssize_t len;
+
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_type = type;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | (dump ? NLM_F_DUMP : 0);
+  req.nh.nlmsg_seq = 1;
+  if (type == RTM_GETROUTE) {
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.u.rtm.rtm_family = AF_INET;
+  } else {
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.u.ifi.ifi_family = AF_UNSPEC;
+    req.u.ifi.ifi_index = ifindex;
+  }
+  if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+    return -1;
+  }
+
+  for (;;) {
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_type == NLMSG_DONE) {
+        return 0;
+      }
+      if (nh->nlmsg_type == NLMSG_ERROR) {
+        return ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+      }
+      cb(nh, arg);
+    }
+    if (!dump) {
+      return 0;
+    }
+  }
+}
+
+static void
+parse_link(struct nlmsghdr *nh, struct discover_link *link)
+{
+  struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+  struct rtattr *rta;
+  struct rtattr *info;
+  int len = IFLA_PAYLOAD(nh);
+  int info_len;
+
+  memset(link, 0, sizeof(*link));
+  link->ifindex = ifi->ifi_index;
+  link->peer = ifi->ifi_index;
+
+  for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    switch (rta->rta_type) {
+      case IFLA_IFNAME:
+        strncpy(link->name, (char *)RTA_DATA(rta), IFNAMSIZ - 1);
+        break;
+      case IFLA_LINK:
+        link->peer = *(int *)RTA_DATA(rta);
+        break;
+      case IFLA_MASTER:
+        link->master = *(int *)RTA_DATA(rta);
+        break;
+      case IFLA_LINKINFO:
+        info_len = RTA_PAYLOAD(rta);
+        for (info = (struct rtattr *)RTA_DATA(rta); RTA_OK(info, info_len);
+             info = RTA_NEXT(info, info_len)) {
+          if (info->rta_type == IFLA_INFO_KIND) {
+            strncpy(link->kind, (char *)RTA_DATA(info), sizeof(link->kind) - 1);
+          }
+        }
+        break;
+    }
+  }
+}
+
+static void
+collect_link(struct nlmsghdr *nh, void *arg)
+{
+  struct discover_links *dl = (struct discover_links *)arg;
+
+  if (nh->nlmsg_type == RTM_NEWLINK && dl->nlinks < DISCOVER_MAX_LINKS) {
+    parse_link(nh, &dl->links[dl->nlinks++]);
+  }
+}
+
+static void
+find_default_route(struct nlmsghdr *nh, void *arg)
+{
+  struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(nh);
+  struct rtattr *rta;
+  int len = RTM_PAYLOAD(nh);
+  int *oif = (int *)arg;
+
+  if (nh->nlmsg_type != RTM_NEWROUTE
+   || rtm->rtm_dst_len != 0
+   || rtm->rtm_table != RT_TABLE_MAIN
+   || rtm->rtm_type != RTN_UNICAST
+   || *oif) {
+    return;
+  }
+  for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == RTA_OIF) {
+      *oif = *(int *)RTA_DATA(rta);
+    }
+  }
+}
+
+int
+discover_netns_open(int pid)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/%d/ns/net", pid);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int
+discover_link_get(int ifindex, struct discover_link *link)
+{
+  struct discover_links *dl;
+  int fd;
+  int ret;
+
+  dl = (struct discover_links *)calloc(1, sizeof(struct discover_links));
+  if (dl == NULL) {
+    return -1;
+  }
+  fd = nl_socket(0);
+  if (fd < 0) {
+    free(dl);
+    return -1;
+  }
+  ret = nl_request(fd, RTM_GETLINK, 0, ifindex, collect_link, dl);
+  close(fd);
+  if (!ret && dl->nlinks == 1) {
+    *link = dl->links[0];
+  } else {
+    ret = -1;
+  }
+  free(dl);
+  return ret;
+}
+
+int
+discover_uplink(char *name)
+{
+  struct discover_link link;
+  int oif = 0;
+  int fd;
+
+  fd = nl_socket(0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (nl_request(fd, RTM_GETROUTE, 1, 0, find_default_route, &oif) || !oif) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if (discover_link_get(oif, &link)) {
+    return -1;
+  }
+  strcpy(name, link.name);
+  return 0;
+}
+
+int
+discover_container(int netns_fd, struct discover_path *paths, int max)
+{
+  struct discover_links *dl;
+  struct discover_link host;
+  struct discover_link bridge;
+  char uplink[IFNAMSIZ];
+  int self;
+  int fd;
+  int n = 0;
+  int i;
+
+  // A netlink socket stays in the netns it was created in,
+  // so only the socket() call needs to run inside the container
+  self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (self < 0) {
+    return -1;
+  }
+  if (setns(netns_fd, CLONE_NEWNET)) {
+    fprintf(stderr, "Failed to enter container netns: %s\n", strerror(errno));
+    close(self);
+    return -1;
+  }
+  fd = nl_socket(0);
+  if (setns(self, CLONE_NEWNET)) {
+    fprintf(stderr, "Failed to return to own netns: %s\n", strerror(errno));
+    close(self);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(self);
+  if (fd < 0) {
+    return -1;
+  }
+
+  dl = (struct discover_links *)calloc(1, sizeof(struct discover_links));
+  if (dl == NULL) {
+    close(fd);
+    return -1;
+  }
+  if (nl_request(fd, RTM_GETLINK, 1, 0, collect_link, dl)) {
+    close(fd);
+    free(dl);
+    return -1;
+  }
+  close(fd);
+
+  if (discover_uplink(uplink)) {
+    uplink[0] = '\0';
+  }
+
+  for (i = 0; i < dl->nlinks && n < max; i++) {
+    if (strcmp(dl->links[i].kind, "veth") || dl->links[i].peer == dl->links[i].ifindex) {
+      continue;
+    }
+    if (discover_link_get(dl->links[i].peer, &host)) {
+      continue;
+    }
+    memset(&paths[n], 0, sizeof(paths[n]));
+    strcpy(paths[n].container_dev, dl->links[i].name);
+    strcpy(paths[n].host_dev, host.name);
+    if (host.master && !discover_link_get(host.master, &bridge)) {
+      strcpy(paths[n].bridge, bridge.name);
+    }
+    strcpy(paths[n].uplink, uplink);
+    n++;
+  }
+  free(dl);
+  return n;
+}
+
+void
+discover_write_config(FILE *fp, const struct discover_path *path)
+{
+  fprintf(fp, "in_outer_dev:%s\n", path->uplink);
+  fprintf(fp, "in_outer_func:netif_receive_skb\n");
+  fprintf(fp, "in_inner_dev:%s\n", path->host_dev);
+  fprintf(fp, "in_inner_func:net_dev_start_xmit\n");
+  fprintf(fp, "out_inner_dev:%s\n", path->host_dev);
+  fprintf(fp, "out_inner_func:netif_rx\n");
+  fprintf(fp, "out_outer_dev:%s\n", path->uplink);
+  fprintf(fp, "out_outer_func:net_dev_start_xmit\n");
+}
+
+int
+discover_watch_open(void)
+{
+  return nl_socket(RTMGRP_LINK);
+}
+
+int
+discover_watch_read(int fd,
+                    void (*cb)(const struct discover_link *, int, void *),
+                    void *arg)
+{
+  char buf[DISCOVER_BUFFER];
+  struct nlmsghdr *nh;
+  struct discover_link link;
+  ssize_t len;
+
+  len = recv(fd, buf, sizeof(buf), 0);
+  if (len < 0) {
+    // ENOBUFS means events were lost; the caller may want to resync
+    return errno != EINTR && errno != EAGAIN;
+  }
+  for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+    if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) {
+      parse_link(nh, &link);
+      cb(&link, nh->nlmsg_type == RTM_NEWLINK, arg);
+    }
+  }
+  return 0;
+}
+
+struct discover_each {
+  void (*cb)(const struct discover_link *, int, void *);
+  void *arg;
+};
+
+static void
+each_link(struct nlmsghdr *nh, void *arg)
+{
+  struct discover_each *each = (struct discover_each *)arg;
+  struct discover_link link;
+
+  if (nh->nlmsg_type == RTM_NEWLINK) {
+    parse_link(nh, &link);
+    each->cb(&link, 1, each->arg);
+  }
+}
+
+int
+discover_links(void (*cb)(const struct discover_link *, int, void *), void *arg)
+{
+  struct discover_each each;
+  int fd;
+  int ret;
+
+  each.cb = cb;
+  each.arg = arg;
+  fd = nl_socket(0);
+  if (fd < 0) {
+    return -1;
+  }
+  ret = nl_request(fd, RTM_GETLINK, 1, 0, each_link, &each);
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,70 @@
+//
+// Discover container network paths through rtnetlink
+//
+
+#include <stdio.h>
+#include <net/if.h>
+
+#ifndef LIBDISCOVER_H
+#define LIBDISCOVER_H
+
+#define DISCOVER_MAX_PATHS 16
+
+// One interface as reported by RTM_NEWLINK / RTM_DELLINK
+struct discover_link {
+  int ifindex;
+  char name[IFNAMSIZ];
+  char kind[16];   // rtnl link kind, e.g. "veth", "bridge", or "" if none
+  int peer;        // iflink: the other end of a veth pair, or ifindex itself
+  int master;      // ifindex of the bridge this link is enslaved to, or 0
+};
+
+// One container interface and the host devices its packets cross
+struct discover_path {
+  char container_dev[IFNAMSIZ]; // e.g. eth0 inside the container
+  char host_dev[IFNAMSIZ];      // the veth peer in the host netns
+  char bridge[IFNAMSIZ];        // the bridge host_dev is enslaved to, or ""
+  char uplink[IFNAMSIZ];        // the host's default route interface
+};
+
+// Open the network namespace of a pid, for discover_container
+// Returns an fd or -1 on error
+int discover_netns_open(int pid);
+
+// Resolve every veth inside the given netns to its path through the host.
+// The calling thread briefly enters the netns (needs CAP_SYS_ADMIN).
+// Returns the number of paths filled in, or -1 on error
+int discover_container(int netns_fd, struct discover_path *paths, int max);
+
+// Find the interface of the host's IPv4 default route
+// Returns 0 on success, nonzero on error
+int discover_uplink(char *name);
+
+// Look up a host interface by index
+// Returns 0 on success, nonzero if there is no such interface
+int discover_link_get(int ifindex, struct discover_link *link);
+
+// Write a latency.conf for the path:
+//   inbound:  netif_receive_skb on the uplink -> net_dev_start_xmit on the host veth
+//   outbound: netif_rx on the host veth -> net_dev_start_xmit on the uplink
+// Host-side veth names are unique per container, unlike the container's eth0
+void discover_write_config(FILE *fp, const struct discover_path *path);
+
+// Open a netlink socket that receives link add/delete events
+// Returns an fd or -1 on error
+int discover_watch_open(void);
+
+// Read one batch of link events from the watch socket and call cb for each.
+// added is nonzero for RTM_NEWLINK (which also reports changes such as
+// enslaving to a bridge) and zero for RTM_DELLINK.
+// Returns 0 on success, nonzero on error
+int discover_watch_read(int fd,
+                        void (*cb)(const struct discover_link *link, int added, void *arg),
+                        void *arg);
+
+// Call cb for every link that exists now, as if it had just been added
+// Returns 0 on success, nonzero on error
+int discover_links(void (*cb)(const struct discover_link *link, int added, void *arg),
+                   void *arg);
+
+#endif
@@ -7,29 +7,345 @@
 //
 // 2018, Chris Misa
 //
+// Every control write goes through the process's tracefs (see
+// ../tracefs_common.c), which saves what it changes and puts it back at
+// release_trace_pipe, at exit or on a fatal signal.
+//
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include "libftrace.h"
+#include "../tracefs_common.c"
+
+// Add to a file under debug_fs_path (the shell's >>), which tracefs
+// treats as add-to rather than replace
+// Returns 1 if the write was successful, otherwise 0
+static int
+append_to(const char *debug_fs_path, const char *file, const char *data)
+{
+  struct tracefs *t = tracefs_at(debug_fs_path);
+
+  return t != NULL && !tracefs_append(t, file, data);
+}
+
+// Replace what file holds
+// Returns 1 if the write was successful, otherwise 0
+static int
+write_to(const char *debug_fs_path, const char *file, const char *data)
+{
+  struct tracefs *t = tracefs_at(debug_fs_path);
+
+  return t != NULL && !tracefs_write(t, file, data);
+}
+
+// Open a file under debug_fs_path with stdio
+// Returns NULL on error
+static FILE *
+open_file(const char *debug_fs_path, const char *file)
+{
+  struct tracefs *t = tracefs_at(debug_fs_path);
+  FILE *fp;
+  int fd;
+
+  fd = t == NULL ? -1 : tracefs_openat(t, file, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  fp = fdopen(fd, "r");
+  if (fp == NULL) {
+    close(fd);
+  }
+  return fp;
+}
+
+int
+trace_event_enable(const char *debug_fs_path, const char *event)
+{
+  return append_to(debug_fs_path, "set_event", event);
+}
+
+int
+trace_event_disable(const char *debug_fs_path, const char *event)
+{
+  char buf[256];
+
+  snprintf(buf, sizeof(buf), "!%s", event);
+  return append_to(debug_fs_path, "set_event", buf);
+}
+
+int
+trace_pid_add(const char *debug_fs_path, const char *pid)
+{
+  return append_to(debug_fs_path, "set_event_pid", pid);
+}
+
+int
+trace_pids_set(const char *debug_fs_path, const char *pids)
+{
+  return write_to(debug_fs_path, "set_event_pid", pids);
+}
+
+int
+trace_filter_set(const char *debug_fs_path, const char *subsystem, const char *filter)
+{
+  char file[PATH_MAX];
+
+  snprintf(file, sizeof(file), "events/%s/filter", subsystem);
+  return write_to(debug_fs_path, file, filter);
+}
+
+// Split "subsystem:event" into its parts, the net subsystem by default
+// Returns 1 if successful, otherwise 0
+static int
+hist_event_split(const char *event, char *sys, char *name)
+{
+  const char *colon = strchr(event, ':');
+
+  if (colon == NULL) {
+    snprintf(sys, TRACE_HIST_NAME_SIZE, "net");
+    return snprintf(name, TRACE_HIST_NAME_SIZE, "%s", event) < TRACE_HIST_NAME_SIZE;
+  }
+  if (colon - event >= TRACE_HIST_NAME_SIZE) {
+    return 0;
+  }
+  memcpy(sys, event, colon - event);
+  sys[colon - event] = '\0';
+  return snprintf(name, TRACE_HIST_NAME_SIZE, "%s", colon + 1) < TRACE_HIST_NAME_SIZE;
+}
 
-// Simply write into the given file and close
-// Used for controlling ftrace via tracing filesystem
+// The start trigger keeps ts_<name> per skb until the end trigger reads
+// it, which also clears it, so an skb is matched at most once. The end
+// trigger fires <name>(lat) on a match, which the last trigger counts.
+int
+trace_hist_latency_compile(struct trace_hist_latency *l, const char *name,
+                           const char *start_event, const char *start_dev,
+                           const char *end_event, const char *end_dev)
+{
+  char start_sys[TRACE_HIST_NAME_SIZE];
+  char start_name[TRACE_HIST_NAME_SIZE];
+  char end_sys[TRACE_HIST_NAME_SIZE];
+  char end_name[TRACE_HIST_NAME_SIZE];
+  int ok = 1;
+
+  if (!hist_event_split(start_event, start_sys, start_name)
+   || !hist_event_split(end_event, end_sys, end_name)) {
+    return 0;
+  }
+  ok &= snprintf(l->synth, sizeof(l->synth), "%s", name) < (int)sizeof(l->synth);
+  ok &= snprintf(l->start_file, sizeof(l->start_file), "events/%s/%s/trigger",
+                 start_sys, start_name) < (int)sizeof(l->start_file);
+  ok &= snprintf(l->end_file, sizeof(l->end_file), "events/%s/%s/trigger",
+                 end_sys, end_name) < (int)sizeof(l->end_file);
+  ok &= snprintf(l->synth_def, sizeof(l->synth_def), "%s u64 lat", name) < (int)sizeof(l->synth_def);
+  ok &= snprintf(l->start_trigger, sizeof(l->start_trigger),
+                 "hist:keys=skbaddr:ts_%s=common_timestamp.usecs:size=%d if name==\"%s\"",
+                 name, TRACE_HIST_KEYS, start_dev) < (int)sizeof(l->start_trigger);
+  ok &= snprintf(l->end_trigger, sizeof(l->end_trigger),
+                 "hist:keys=skbaddr:lat_%s=common_timestamp.usecs-$ts_%s:size=%d"
+                 ":onmatch(%s.%s).%s($lat_%s) if name==\"%s\"",
+                 name, name, TRACE_HIST_KEYS, start_sys, start_name, name, name,
+                 end_dev) < (int)sizeof(l->end_trigger);
+  ok &= snprintf(l->hist_trigger, sizeof(l->hist_trigger), "hist:keys=lat:sort=lat")
+        < (int)sizeof(l->hist_trigger);
+  return ok;
+}
+
+// Remove a trigger by writing it again behind a '!'
 // Returns 1 if the write was successful, otherwise 0
+static int
+trigger_remove(const char *debug_fs_path, const char *file, const char *trigger)
+{
+  char buf[TRACE_HIST_DEF_SIZE + 1];
+
+  snprintf(buf, sizeof(buf), "!%s", trigger);
+  return append_to(debug_fs_path, file, buf);
+}
+
 int
-echo_to(const char *file, const char *data)
+trace_hist_latency_install(const char *debug_fs_path, const struct trace_hist_latency *l)
+{
+  char hist_file[TRACE_HIST_DEF_SIZE];
+  char buf[TRACE_HIST_NAME_SIZE + 1];
+
+  snprintf(hist_file, sizeof(hist_file), "events/synthetic/%s/trigger", l->synth);
+  snprintf(buf, sizeof(buf), "!%s", l->synth);
+
+  // Each step needs the ones before it: the end trigger refers to the
+  // start trigger's variable and the synthetic event
+  if (!append_to(debug_fs_path, "synthetic_events", l->synth_def)) {
+    return 0;
+  }
+  if (!append_to(debug_fs_path, l->start_file, l->start_trigger)) {
+    goto fail_start;
+  }
+  if (!append_to(debug_fs_path, l->end_file, l->end_trigger)) {
+    goto fail_end;
+  }
+  if (!append_to(debug_fs_path, hist_file, l->hist_trigger)) {
+    goto fail_hist;
+  }
+  return 1;
+
+fail_hist:
+  trigger_remove(debug_fs_path, l->end_file, l->end_trigger);
+fail_end:
+  trigger_remove(debug_fs_path, l->start_file, l->start_trigger);
+fail_start:
+  append_to(debug_fs_path, "synthetic_events", buf);
+  return 0;
+}
+
+int
+trace_hist_latency_remove(const char *debug_fs_path, const struct trace_hist_latency *l)
+{
+  char hist_file[TRACE_HIST_DEF_SIZE];
+  char buf[TRACE_HIST_NAME_SIZE + 1];
+  int ok = 1;
+
+  snprintf(hist_file, sizeof(hist_file), "events/synthetic/%s/trigger", l->synth);
+  snprintf(buf, sizeof(buf), "!%s", l->synth);
+
+  // A synthetic event can't go while a trigger uses it
+  ok &= trigger_remove(debug_fs_path, hist_file, l->hist_trigger);
+  ok &= trigger_remove(debug_fs_path, l->end_file, l->end_trigger);
+  ok &= trigger_remove(debug_fs_path, l->start_file, l->start_trigger);
+  ok &= append_to(debug_fs_path, "synthetic_events", buf);
+  return ok;
+}
+
+// One trigger's totals from the hist file next to trigger_file, which
+// lists every hist trigger on the event, each behind its definition:
+//   # trigger info: hist:keys=skbaddr:vals=hitcount:ts_<name>=... [active]
+//   ...
+//   Totals:
+//       Hits: 17
+//       Entries: 2
+//       Dropped: 0
+// The trigger is the one whose definition contains var
+// Returns 1 if successful, otherwise 0
+static int
+hist_map_totals(const char *debug_fs_path, const char *trigger_file, const char *var,
+                unsigned long long *entries, unsigned long long *dropped)
 {
-  FILE *fp = fopen(file, "w");
+  char file[TRACE_HIST_DEF_SIZE];
+  char line[TRACE_HIST_DEF_SIZE + 64];
+  const char *slash = strrchr(trigger_file, '/');
+  int mine = 0;
+  FILE *fp;
+
+  if (slash == NULL) {
+    return 0;
+  }
+  snprintf(file, sizeof(file), "%.*s/hist", (int)(slash - trigger_file), trigger_file);
+  fp = open_file(debug_fs_path, file);
   if (fp == NULL) {
     return 0;
   }
-  if (fputs(data, fp) == EOF) {
+  *entries = 0;
+  *dropped = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (!strncmp(line, "# trigger info:", 15)) {
+      mine = strstr(line, var) != NULL;
+    } else if (mine) {
+      sscanf(line, " Entries: %llu", entries);
+      sscanf(line, " Dropped: %llu", dropped);
+    }
+  }
+  fclose(fp);
+  return 1;
+}
+
+int
+trace_hist_latency_maps(const char *debug_fs_path, const struct trace_hist_latency *l,
+                        struct trace_hist_maps *m)
+{
+  char var[TRACE_HIST_NAME_SIZE + 8];
+
+  snprintf(var, sizeof(var), ":ts_%s=", l->synth);
+  if (!hist_map_totals(debug_fs_path, l->start_file, var, &m->entries[0], &m->dropped[0])) {
+    return 0;
+  }
+  snprintf(var, sizeof(var), ":lat_%s=", l->synth);
+  return hist_map_totals(debug_fs_path, l->end_file, var, &m->entries[1], &m->dropped[1]);
+}
+
+int
+trace_hist_latency_reset(const char *debug_fs_path, const struct trace_hist_latency *l)
+{
+  // The end trigger uses the start trigger's variable, so it goes first
+  // and comes back last
+  if (!trigger_remove(debug_fs_path, l->end_file, l->end_trigger)
+   || !trigger_remove(debug_fs_path, l->start_file, l->start_trigger)) {
+    return 0;
+  }
+  return append_to(debug_fs_path, l->start_file, l->start_trigger)
+      && append_to(debug_fs_path, l->end_file, l->end_trigger);
+}
+
+// The hist file has a line per latency and then totals:
+//   { lat:         37 } hitcount:          5
+//   ...
+//   Totals:
+//       Hits: 17
+//       Entries: 2
+//       Dropped: 0
+int
+trace_hist_latency_read(const char *debug_fs_path, const struct trace_hist_latency *l,
+                        void (*fn)(unsigned long long usecs, unsigned long long count, void *arg),
+                        void *arg, unsigned long long *dropped)
+{
+  char file[PATH_MAX];
+  char line[256];
+  unsigned long long usecs;
+  unsigned long long count;
+  FILE *fp;
+
+  snprintf(file, sizeof(file), "events/synthetic/%s/hist", l->synth);
+  fp = open_file(debug_fs_path, file);
+  if (fp == NULL) {
     return 0;
   }
+  *dropped = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, " { lat: %llu } hitcount: %llu", &usecs, &count) == 2) {
+      fn(usecs, count, arg);
+    } else {
+      sscanf(line, " Dropped: %llu", dropped);
+    }
+  }
   fclose(fp);
   return 1;
 }
 
+// Set things up in the tracing filesystem without opening a pipe
+// Returns 1 if successful, otherwise 0
+int
+setup_tracing(const char *debug_fs_path,
+              const char *target_events,
+              const char *pid,
+              const char *trace_clock)
+{
+  struct tracefs *t = tracefs_at(debug_fs_path);
+
+  // If the first write fails, we probably don't have permissions so bail
+  if (t == NULL || tracefs_write(t, "trace", "")) {
+    fprintf(stderr, "Failed to write in tracing fs.\n");
+    return 0;
+  }
+  if (tracefs_write(t, "current_tracer", "nop")
+   || (trace_clock && tracefs_write(t, "trace_clock", trace_clock))
+   || (target_events && tracefs_write(t, "set_event", target_events))
+   || (pid && tracefs_write(t, "set_event_pid", pid))
+   || tracefs_write(t, "tracing_on", "1")) {
+    release_trace_pipe(NULL, debug_fs_path);
+    return 0;
+  }
+  return 1;
+}
+
 // Get an open file pointer to the trace_pipe
 // and set things up in the tracing filesystem
 // If anything goes wrong, returns NULL and resets things
@@ -40,30 +356,12 @@ get_trace_pipe(const char *debug_fs_path,
 	       const char *trace_clock)
 {
   FILE *tp = NULL;
-  if (chdir(debug_fs_path)) {
-    fprintf(stderr, "Failed to get into tracing file path.\n");
-    return NULL;
-  }
-  // If the first write fails, we probably don't have permissions so bail
-  if (!echo_to("trace", "")) {
-    fprintf(stderr, "Failed to write in tracing fs.\n");
+
+  if (!setup_tracing(debug_fs_path, target_events, pid, trace_clock)) {
     return NULL;
   }
-  echo_to("trace", "");
-  echo_to("current_tracer", "nop");
-  if (trace_clock) {
-    echo_to("trace_clock", trace_clock);
-  }
-  if (target_events) {
-    echo_to("set_event", target_events);
-  }
-  if (pid) {
-    echo_to("set_event_pid", pid);
-  }
 
-  echo_to("tracing_on", "1");
-
-  tp = fopen("trace_pipe","r");
+  tp = open_file(debug_fs_path, "trace_pipe");
   
   if (!tp) {
     fprintf(stderr, "Failed to open trace pipe.\n");
@@ -74,20 +372,68 @@ get_trace_pipe(const char *debug_fs_path,
   return tp;
 }
 
-// Closes the pipe and turns things off in tracing filesystem
+// Open a non-blocking trace pipe: the shared one if cpu < 0,
+// otherwise the one for that cpu's buffer
+// Returns an fd or -1 on error
+int
+open_trace_pipe_fd(const char *debug_fs_path, int cpu)
+{
+  struct tracefs *t = tracefs_at(debug_fs_path);
+  char file[PATH_MAX];
+
+  if (t == NULL) {
+    return -1;
+  }
+  if (cpu < 0) {
+    snprintf(file, sizeof(file), "trace_pipe");
+  } else {
+    snprintf(file, sizeof(file), "per_cpu/cpu%d/trace_pipe", cpu);
+  }
+  return tracefs_openat(t, file, O_RDONLY | O_NONBLOCK);
+}
+
+// Read per_cpu/cpuN/stats: events waiting in that cpu's ring buffer
+// and events lost because the buffer was full
+// Returns 1 if successful, otherwise 0
+int
+trace_buffer_stats(const char *debug_fs_path, int cpu,
+                   unsigned long long *entries, unsigned long long *overrun)
+{
+  char file[PATH_MAX];
+  char line[128];
+  FILE *fp;
+  int found = 0;
+
+  snprintf(file, sizeof(file), "per_cpu/cpu%d/stats", cpu);
+  fp = open_file(debug_fs_path, file);
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    found += sscanf(line, "entries: %llu", entries) == 1;
+    found += sscanf(line, "overrun: %llu", overrun) == 1;
+  }
+  fclose(fp);
+  return found == 2;
+}
+
+// Closes the pipe and puts the tracing filesystem back as it was
 void
 release_trace_pipe(FILE *tp, const char *debug_fs_path)
 {
+  struct tracefs *t = tracefs_at(debug_fs_path);
+  int failed;
+
   if (tp) {
     fclose(tp);
   }
-  if (chdir(debug_fs_path)) {
-    fprintf(stderr, "Failed to get into tracing file path.\n");
+  if (t == NULL) {
     return;
   }
-  echo_to("tracing_on", "0");
-  echo_to("set_event_pid", "");
-  echo_to("set_event", "");
+  failed = tracefs_restore(t);
+  if (failed) {
+    fprintf(stderr, "Failed to restore %d tracing settings\n", failed);
+  }
 }
 
 // Skip space characters
@@ -103,7 +449,7 @@ parse_skip_whitespace(char **str)
 void
 parse_skip_nonwhitespace(char **str)
 {
-  while(**str != ' ') {
+  while(**str != ' ' && **str != '\0') {
     (*str)++;
   }
 }
@@ -114,10 +460,17 @@ parse_timestamp(char **str, struct timeval *time)
 {
   char *start = *str;
   time->tv_sec = strtoul(start, str, 10);
+  time->tv_usec = 0;
+  // Lines cut short (as in a recording) end here rather than past the end
+  if (**str == '\0') {
+    return;
+  }
   start = *str + 1;
   time->tv_usec = strtoul(start, str, 10);
   // Skip trailing colon
-  (*str)++;
+  if (**str != '\0') {
+    (*str)++;
+  }
 }
 
 // Parse the given field as a string
@@ -16,9 +16,122 @@ FILE *get_trace_pipe(const char *debug_fs_path,
 		     const char *pid,
 		     const char *trace_clock);
 
+// Set things up in the tracing filesystem without opening a pipe,
+// for readers that use open_trace_pipe_fd instead
+// Returns 1 if successful, otherwise 0
+int setup_tracing(const char *debug_fs_path,
+                  const char *target_events,
+                  const char *pid,
+                  const char *trace_clock);
+
+// Open a non-blocking trace pipe: the shared one if cpu < 0,
+// otherwise the one for that cpu's buffer
+// Returns an fd or -1 on error
+int open_trace_pipe_fd(const char *debug_fs_path, int cpu);
+
+// Read a cpu's ring buffer stats: events waiting to be read (entries)
+// and events lost to a full buffer (overrun)
+// Returns 1 if successful, otherwise 0
+int trace_buffer_stats(const char *debug_fs_path, int cpu,
+                       unsigned long long *entries, unsigned long long *overrun);
+
 // Closes the pipe and turns things off in tracing filesystem
+// (tp may be NULL if setup_tracing was used)
 void release_trace_pipe(FILE *tp, const char *debug_fs_path);
 
+// Incremental updates while the trace pipe is open.
+// Each returns 1 if the write was successful, otherwise 0.
+
+// Add one event to set_event, leaving the others enabled
+int trace_event_enable(const char *debug_fs_path, const char *event);
+
+// Remove one event from set_event, leaving the others enabled
+int trace_event_disable(const char *debug_fs_path, const char *event);
+
+// Add one pid to set_event_pid
+int trace_pid_add(const char *debug_fs_path, const char *pid);
+
+// Replace set_event_pid with a space-separated list (empty traces all pids)
+int trace_pids_set(const char *debug_fs_path, const char *pids);
+
+// Replace the filter of every event in a subsystem (events/<subsystem>/filter),
+// "0" removes it
+int trace_filter_set(const char *debug_fs_path, const char *subsystem, const char *filter);
+
+// In-kernel latency through hist triggers and synthetic events
+//
+// A leg times skbs from one event on one device to another event on
+// another device without any event reaching the ring buffer: a hist
+// trigger on the start event saves common_timestamp per skbaddr, one on
+// the end event subtracts it on a match and fires a synthetic event with
+// the difference, and a hist trigger on the synthetic event counts the
+// latencies by microsecond. Only the histogram is read back.
+//
+// Events are "subsystem:event" or an event of the net subsystem. Events
+// with triggers but not in set_event are soft enabled: the triggers run
+// and nothing is recorded.
+//
+// The start and end triggers keep their entries in a tracing_map of
+// TRACE_HIST_KEYS skbs, which never evicts: an entry stays for every skb
+// address seen, matched or not. Once the map is full, skbs at new
+// addresses are dropped and counted as Dropped in the map's hist file.
+// Readers watch trace_hist_latency_maps and reset the leg before then.
+
+#define TRACE_HIST_NAME_SIZE 64
+#define TRACE_HIST_DEF_SIZE 512
+#define TRACE_HIST_KEYS 16384 // skbs the start trigger can hold at once
+
+struct trace_hist_latency {
+  char synth[TRACE_HIST_NAME_SIZE]; // synthetic event
+  char start_file[TRACE_HIST_DEF_SIZE]; // trigger files under the tracing fs
+  char end_file[TRACE_HIST_DEF_SIZE];
+  char synth_def[TRACE_HIST_DEF_SIZE]; // line for synthetic_events
+  char start_trigger[TRACE_HIST_DEF_SIZE];
+  char end_trigger[TRACE_HIST_DEF_SIZE];
+  char hist_trigger[TRACE_HIST_DEF_SIZE]; // on the synthetic event
+};
+
+// Fill in the definitions of a leg named name, which must be a C
+// identifier and unique among installed legs
+// Returns 1 if successful, otherwise 0 (a name too long)
+int trace_hist_latency_compile(struct trace_hist_latency *l, const char *name,
+                               const char *start_event, const char *start_dev,
+                               const char *end_event, const char *end_dev);
+
+// Install a compiled leg, removing what was done if any step fails
+// Returns 1 if successful, otherwise 0
+int trace_hist_latency_install(const char *debug_fs_path, const struct trace_hist_latency *l);
+
+// Remove an installed leg, in the reverse order
+// Returns 1 if every step was successful, otherwise 0
+int trace_hist_latency_remove(const char *debug_fs_path, const struct trace_hist_latency *l);
+
+// Entries and Dropped of an installed leg's start [0] and end [1] maps
+struct trace_hist_maps {
+  unsigned long long entries[2];
+  unsigned long long dropped[2];
+};
+
+// Read how full a leg's start and end maps are, since it was installed
+// or last reset
+// Returns 1 if successful, otherwise 0
+int trace_hist_latency_maps(const char *debug_fs_path, const struct trace_hist_latency *l,
+                            struct trace_hist_maps *m);
+
+// Empty a leg's start and end maps by removing and adding their triggers
+// again; the latency histogram is kept. Skbs in flight at the time are
+// not timed.
+// Returns 1 if successful, otherwise 0
+int trace_hist_latency_reset(const char *debug_fs_path, const struct trace_hist_latency *l);
+
+// Read an installed leg's histogram so far: fn is called with every
+// latency seen, in microseconds, and how many skbs took it. dropped is
+// set to the latencies the kernel had no room to count.
+// Returns 1 if successful, otherwise 0
+int trace_hist_latency_read(const char *debug_fs_path, const struct trace_hist_latency *l,
+                            void (*fn)(unsigned long long usecs, unsigned long long count, void *arg),
+                            void *arg, unsigned long long *dropped);
+
 // Structure used to hold timestamp and pointers into a parsed buffer
 struct trace_event {
   struct timeval ts;
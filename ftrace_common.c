@@ -6,24 +6,27 @@
 #include <sys/time.h>
 
 #include "time_common.h"
+#include "tracefs_common.c"
 
 #define READ_BUF_SIZE 256
 #define NAME_BUF_SIZE 64
 
-// Simply write into the given file and close
-void echo_to(const char *file, const char *data)
+// Open a file under the tracing directory with stdio
+// Returns NULL on error
+FILE *tracefs_fopen(struct tracefs *t, const char *file)
 {
-  FILE *fp = fopen(file, "w");
-  int res;
-  if (fp == NULL) {
-    printf("Failed to open file: '%s'\n", file);
-    return;
+  FILE *fp;
+  int fd;
+
+  fd = tracefs_openat(t, file, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
   }
-  res = fputs(data, fp);
-  if (res == EOF) {
-    printf("Failed writing to: '%s'\n", file);
+  fp = fdopen(fd, "r");
+  if (fp == NULL) {
+    close(fd);
   }
-  fclose(fp);
+  return fp;
 }
 
 
@@ -109,23 +112,34 @@ void parse_trace_event(char *str, struct trace_event *evt)
 
 FILE *get_trace_pipe(const char *debug_fs_path, const char *pid)
 {
-  chdir(debug_fs_path);
+  struct tracefs *t = tracefs_at(debug_fs_path);
+
+  if (t == NULL) {
+    return NULL;
+  }
   // assume some things are already set from call to
   // get_ftrace_ts_offset!
   // Specifically: trace_clock, tracing_on, current_tracer
-  echo_to("set_event", "syscalls:sys_enter_sendto syscalls:sys_exit_sendto syscalls:sys_enter_recvmsg syscalls:sys_exit_recvmsg");
-  echo_to("set_event_pid", pid);
+  tracefs_write(t, "set_event", "syscalls:sys_enter_sendto syscalls:sys_exit_sendto syscalls:sys_enter_recvmsg syscalls:sys_exit_recvmsg");
+  tracefs_write(t, "set_event_pid", pid);
 
-  return fopen("trace_pipe","r");
+  return tracefs_fopen(t, "trace_pipe");
 }
 
+// Closes the pipe and puts tracing back as it was before we started
 void release_trace_pipe(FILE *tp, const char *debug_fs_path)
 {
+  struct tracefs *t = tracefs_at(debug_fs_path);
+  int failed;
+
   fclose(tp);
-  chdir(debug_fs_path);
-  echo_to("tracing_on", "0");
-  echo_to("set_event_pid", "");
-  echo_to("set_event", "");
+  if (t == NULL) {
+    return;
+  }
+  failed = tracefs_restore(t);
+  if (failed) {
+    fprintf(stderr, "Failed to restore %d tracing settings\n", failed);
+  }
 }
 
 void get_trace_event(FILE *tp, struct trace_event *evt)
@@ -157,6 +171,7 @@ void get_trace_event(FILE *tp, struct trace_event *evt)
 //
 int get_ftrace_ts_offset(const char *debug_fs_path, struct timeval *offset)
 {
+  struct tracefs *t = tracefs_at(debug_fs_path);
   FILE *tp = NULL;
   char pid[128];
   int ntests = 10;
@@ -179,16 +194,17 @@ int get_ftrace_ts_offset(const char *debug_fs_path, struct timeval *offset)
   timeout.tv_usec = 500000;
   
   // Set up ftrace
-  chdir(debug_fs_path);
-  echo_to("trace", "");
-  echo_to("trace_pipe", "");
-  echo_to("current_tracer", "nop");
-  echo_to("set_event", "syscalls:sys_enter_select syscalls:sys_exit_select");
-  echo_to("set_event_pid", pid);
-  echo_to("trace_clock","global");
-  echo_to("tracing_on", "1");
-
-  tp =  fopen("trace_pipe","r");
+  if (t == NULL) {
+    return -1;
+  }
+  tracefs_write(t, "trace", "");
+  tracefs_write(t, "current_tracer", "nop");
+  tracefs_write(t, "set_event", "syscalls:sys_enter_select syscalls:sys_exit_select");
+  tracefs_write(t, "set_event_pid", pid);
+  tracefs_write(t, "trace_clock", "global");
+  tracefs_write(t, "tracing_on", "1");
+
+  tp = tracefs_fopen(t, "trace_pipe");
   if (!tp) {
     return -1;
   }
@@ -233,8 +249,8 @@ int get_ftrace_ts_offset(const char *debug_fs_path, struct timeval *offset)
 
   // Clean up ftrace
   fclose(tp);
-  echo_to("set_event_pid", "");
-  echo_to("set_event", "");
+  tracefs_write(t, "set_event_pid", "");
+  tracefs_write(t, "set_event", "");
   
   return 0;
 }
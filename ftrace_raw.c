@@ -5,6 +5,8 @@
 #include <sys/sysinfo.h>
 #include <pthread.h>
 
+#include "tracefs_common.c"
+
 #define BUF_SIZE 0x1000
 
 static int exiting = 0;
@@ -18,39 +20,29 @@ void stop_running() {
   exiting = 1;
 }
 
-// Simply write into the given file and close
-void echo_to(const char *file, const char *data)
-{
-  FILE *fp = fopen(file, "w");
-  int res;
-  if (fp == NULL) {
-    printf("Failed to open file: '%s'\n", file);
-    return;
-  }
-  res = fputs(data, fp);
-  if (res == EOF) {
-    printf("Failed writing to: '%s'\n", file);
-  }
-  fclose(fp);
-}
-
-// Allocate and open a pipe to each cpu
-void get_pipe_per_cpu(FILE **pipes, int ncpus, fd_set *fds)
+// Open a pipe to each cpu
+// Returns 0 on success, nonzero if any failed to open (pipes[i] is NULL)
+int get_pipe_per_cpu(struct tracefs *t, FILE **pipes, int ncpus, fd_set *fds)
 {
   int i;
+  int fd;
+  int ret = 0;
   char path[128];
 
   FD_ZERO(fds);
   
   for (i=0; i<ncpus; i++) {
     sprintf(path, "per_cpu/cpu%d/trace_pipe_raw", i);
-    pipes[i] = (FILE *)malloc(sizeof(FILE *));
-    pipes[i] = fopen(path, "r");
+    fd = tracefs_openat(t, path, O_RDONLY);
+    pipes[i] = fd < 0 ? NULL : fdopen(fd, "r");
     if (!pipes[i]) {
       fprintf(stderr, "Failed to open %s\n", path);
+      ret = -1;
+      continue;
     }
     FD_SET(fileno(pipes[i]), fds);
   }
+  return ret;
 }
 
 // Close pipes
@@ -80,6 +72,7 @@ void *read_pipe(void *pipe)
 int main(int argc, char *argv[])
 {
   const char *tracefp = "/sys/kernel/debug/tracing";
+  struct tracefs *t;
   FILE **trace_pipes = NULL;
   fd_set tpfds, readfds;
   char buf[BUF_SIZE];
@@ -94,22 +87,29 @@ int main(int argc, char *argv[])
   // Set exit trap
   signal(SIGINT, stop_running);
 
-  // Move into tracing directory
-  chdir(tracefp);
+  // Open the tracing directory, restoring what we change when we exit
+  t = tracefs_at(tracefp);
+  if (t == NULL) {
+    return 1;
+  }
 
   // Enter desired events
-  echo_to("current_tracer", "nop");
-  echo_to("set_event", "syscalls:sys_enter_sendto syscalls:sys_exit_sendto syscalls:sys_enter_recvmsg syscalls:sys_exit_recvmsg");
+  tracefs_write(t, "current_tracer", "nop");
+  tracefs_write(t, "set_event", "syscalls:sys_enter_sendto syscalls:sys_exit_sendto syscalls:sys_enter_recvmsg syscalls:sys_exit_recvmsg");
   if (argc == 2) {
-    echo_to("set_event_pid", argv[1]);
+    tracefs_write(t, "set_event_pid", argv[1]);
   } else {
-    echo_to("set_event_pid", "");
+    tracefs_write(t, "set_event_pid", "");
   }
 
-  echo_to("tracing_on", "1");
-  echo_to("trace", "");
+  tracefs_write(t, "tracing_on", "1");
+  tracefs_write(t, "trace", "");
 
-  get_pipe_per_cpu(trace_pipes, ncpus, &tpfds);
+  if (get_pipe_per_cpu(t, trace_pipes, ncpus, &tpfds)) {
+    release_pipe_per_cpu(trace_pipes, ncpus);
+    tracefs_restore(t);
+    return 1;
+  }
   
   // Spawn threads
   for (i = 0; i < ncpus; i++) {
@@ -131,10 +131,10 @@ int main(int argc, char *argv[])
 
   release_pipe_per_cpu(trace_pipes, ncpus);
 
-  // Reset ftrace state
-  echo_to("tracing_on", "0");
-  echo_to("set_event_pid", "");
-  echo_to("set_event", "");
+  // Put ftrace back as it was
+  if (tracefs_restore(t)) {
+    fprintf(stderr, "Failed to restore tracing settings\n");
+  }
 
 
   printf("Done\n");
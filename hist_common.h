@@ -0,0 +1,168 @@
+#ifndef HIST_COMMON_H
+#define HIST_COMMON_H
+//
+// Latency histograms and counters owned by a single writer thread
+//
+// Values are nanoseconds. Buckets are log-linear: every power of two is
+// split into HIST_SUB equal sub-buckets, so a bucket's width is at most
+// 1/HIST_SUB of its value (12.5%) from 1 ns up to 2^38 ns (about 275 s).
+// Anything longer is counted in the last bucket.
+//
+// Only the owning thread updates a histogram or counter, using plain
+// relaxed atomic stores (no locked instructions). Any other thread may
+// read a snapshot at any time; the snapshot is not an exact instant across
+// buckets but every word in it is a value that was really there.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 36
+#define HIST_BUCKETS (HIST_OCTAVES * HIST_SUB)
+
+struct hist {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+// Bump a counter owned by the calling thread
+static inline void stat_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_read(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline int hist_bucket(uint64_t v)
+{
+  int msb;
+  int octave;
+  int idx;
+
+  if (v < HIST_SUB) {
+    return (int)v;
+  }
+  msb = 63 - __builtin_clzll(v);
+  octave = msb - HIST_SUB_BITS + 1;
+  idx = octave * HIST_SUB + (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// Smallest value that lands in bucket b
+static inline uint64_t hist_bucket_lower(int b)
+{
+  int octave = b / HIST_SUB;
+  int sub = b % HIST_SUB;
+
+  if (octave == 0) {
+    return sub;
+  }
+  return (uint64_t)(HIST_SUB + sub) << (octave - 1);
+}
+
+// First value past bucket b
+static inline uint64_t hist_bucket_upper(int b)
+{
+  return b + 1 < HIST_BUCKETS ? hist_bucket_lower(b + 1) : UINT64_MAX;
+}
+
+static inline void hist_init(struct hist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+// Record one value standing for n, e.g. a sample kept 1 in n, owner thread only
+static inline void hist_add_n(struct hist *h, uint64_t v, uint64_t n)
+{
+  stat_add(&h->counts[hist_bucket(v)], n);
+  stat_add(&h->count, n);
+  stat_add(&h->sum, v * n);
+  if (v > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+  }
+}
+
+// Record one value, owner thread only
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+  hist_add_n(h, v, 1);
+}
+
+// Copy a histogram that another thread may be updating
+static inline void hist_snapshot(const struct hist *h, struct hist *out)
+{
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    out->counts[i] = stat_read(&h->counts[i]);
+  }
+  out->count = stat_read(&h->count);
+  out->sum = stat_read(&h->sum);
+  out->max = stat_read(&h->max);
+}
+
+// into += from, for private copies only
+static inline void hist_merge(struct hist *into, const struct hist *from)
+{
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    into->counts[i] += from->counts[i];
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+// into -= from, for private copies where from is an earlier snapshot of
+// into, leaving what was added in between. max stays the overall max.
+static inline void hist_sub(struct hist *into, const struct hist *from)
+{
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    into->counts[i] -= from->counts[i];
+  }
+  into->count -= from->count;
+  into->sum -= from->sum;
+}
+
+// Value at quantile q (0..1), reported as the middle of its bucket
+static inline uint64_t hist_quantile(const struct hist *h, double q)
+{
+  uint64_t total = 0;
+  uint64_t rank;
+  uint64_t seen = 0;
+  uint64_t lo;
+  uint64_t hi;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    total += h->counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  rank = (uint64_t)(q * (total - 1)) + 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      lo = hist_bucket_lower(i);
+      hi = hist_bucket_upper(i);
+      if (hi == UINT64_MAX || hi - lo <= 1) {
+        return lo;
+      }
+      // The bucket midpoint can overshoot the largest value actually seen
+      return lo + (hi - lo) / 2 < h->max ? lo + (hi - lo) / 2 : h->max;
+    }
+  }
+  return h->max;
+}
+
+#endif
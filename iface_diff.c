@@ -3,6 +3,97 @@
 //
 // Bugs: need to check icmp id field: current version breaks if multiple pings are running
 //
+// With -r the two arguments are pcap/pcapng files instead of devices
+// (e.g. recorded with tcpdump -j adapter --time-stamp-precision=nano).
+// Packets from both files are merged by time stamp into the same
+// callbacks, as fast as the CPU allows, to re-run analyses or benchmark matching.
+//
+// Targets given with -t (or read from a file with -T, re-read on SIGHUP)
+// narrow the kernel filter to just the monitored hosts, icmp ids or flows;
+// see filter_common.c. Each capture thread swaps in a new filter between
+// pcap_loop runs, so targets can change while capturing.
+//
+// Both devices time stamp on one clock, the most precise host clock they
+// both support (see negotiate_tstamp_type); iface_diff won't run if they
+// share none. -A lets them agree on the adapter clock instead, which the
+// lag stage and -G can't compare with the system clock, so neither is used.
+//
+// With -j N each device is captured by N sockets joined in a PACKET_FANOUT
+// group (-F hash or cpu). Worker k on dev1 and worker k on dev2 share
+// shard k of the echo/flow tables, so the tables are never touched by more
+// than the two threads that can see the same packet, and the per-shard
+// counts are merged at exit. This relies on the kernel putting a packet in
+// the same fanout slot on both devices: true for the symmetric flow hash on
+// a bridge/veth path without NAT, and for cpu mode when forwarding stays
+// on one cpu.
+//
+// Results go through writer_common.c: capture threads only append records
+// and a writer thread formats them (-f text, csv, binary or column) to stdout or -o.
+//
+// With -C <socket> targets can also be added and removed at runtime over a
+// control socket (see control_common.c), without restarting the captures:
+//
+//   add <target>   e.g. 'add flow tcp 10.0.0.2:80 10.0.0.3:41234'
+//   del <target>
+//   targets        list the current targets
+//   stats          matched and expired counts and per-address percentiles so far
+//
+// A SIGHUP reload of -T replaces the whole target set, including targets
+// added over the socket.
+//
+// With -M <port|path> current counters and latency histograms are served
+// in Prometheus text format by a metrics thread (see metrics_common.c).
+// Each capture thread keeps its own stats, which the metrics thread reads
+// as snapshots, so scrapes never take a lock on the capture path.
+//
+// In icmp mode the capture threads hand every read of packets to the
+// batch decoder in decode_common.c, which copes with IPv4 options, IPv6
+// (with extension headers) and vlan tags, then match the whole batch
+// under one take of the shard's lock. The kernel filter takes ICMPv6
+// echoes and frames with one or two vlan tags too. Its icmp6 tests only see
+// ICMPv6 right after the fixed IPv6 header, so IPv6 frames that start with
+// an extension header are passed whole for the decoder to test; with
+// targets set they can't be narrowed in the kernel and are not captured.
+//
+// In flow mode (-m flow) any TCP or UDP packet is matched across the two
+// devices by a fingerprint of its invariant fields (see flow_common.c)
+// instead of relying on icmp echo sequence numbers. Its filter takes
+// frames with one or two vlan tags as the echo filter does, but only IPv4:
+// results and the sampling key have no room for IPv6 flows.
+//
+// Latency is also aggregated per container address (see agg_common.h): the
+// echo requester, or the flow endpoint on the dev1 side. Each capture
+// thread owns its shard and the shards are merged when metrics are scraped,
+// on the stats command and at exit. With -N the address of an outbound
+// match is the one seen on dev2, after NAT.
+//
+// With -U <addr>[,<secs>] what each address added is sent every secs
+// seconds as a summary, its counts and the histogram buckets that changed,
+// to a collector (see collector.c and summary_common.c) that merges those
+// of every monitor.
+//
+// Each capture thread also accounts for its own time per packet (see
+// stage_common.h): decode, match and output, with sampled costs and the
+// lag between the capture time stamp and the callback. They are merged
+// into the metrics with the writer's queue, and -S <secs> prints them to
+// stderr periodically.
+//
+// With -G <lag ms>[,<cpu %>] a governor watches kernel drops, dropped
+// results, the lag behind the capture time stamps and the capture threads'
+// CPU time once a second. Under overload it samples 1 in 2^k packets by a
+// hash of the icmp sequence (or in flow mode the IP id), so dev1 and dev2
+// keep the same packets, and pushes the test into the capture filter. See
+// sample_common.h. Latencies are weighted by 2^k and results say what
+// rate they were kept at.
+//
+// An echo whose four packets haven't all been seen within -E ms (1 s by
+// default) of its first is given up on by a timer on its shard's wheel
+// (wheel_common.h), run on capture time, and counted as expired: a lost
+// request or reply, charged to the direction that didn't complete. Its
+// slot is then free for the next sequence number that hashes there,
+// instead of mixing that echo's time stamps with the lost one's. In flow
+// mode -E is the window a fingerprint waits for its other half.
+//
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,13 +101,27 @@
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include "time_common.h"
 #include "libpcap_common.c"
+#include "flow_common.c"
+#include "filter_common.c"
+#include "writer_common.c"
+#include "metrics_common.c"
+#include "control_common.c"
+#include "agg_common.h"
+#include "stage_common.h"
+#include "sample_common.h"
+#include "wheel_common.h"
+#include "summary_common.c"
 
 // #define DEBUG
 
 #define ECHO_EVENT_TABLE_SIZE 128
+#define ECHO_EVENT_TIMEOUT_NSEC 1000000000
 
 #define ECHO_EVENT_DEV1_OUTBOUND_FLAG 1
 #define ECHO_EVENT_DEV2_OUTBOUND_FLAG (1 << 1)
@@ -29,19 +134,65 @@
     | ECHO_EVENT_DEV2_INBOUND_FLAG )
 
 static volatile int running = 1;
+static volatile int reload = 0;
+
+enum match_mode {
+  MATCH_MODE_ICMP,
+  MATCH_MODE_FLOW
+};
+
+
+// Current capture filter, bumped generation tells threads to pick it up
+// targets_lock serializes changes to filter_targets (SIGHUP reload and control socket)
+struct filter_set filter_targets;
+const char *filter_base;
+pthread_mutex_t targets_lock = PTHREAD_MUTEX_INITIALIZER;
+char filter_text[FILTER_TEXT_SIZE];
+unsigned int filter_gen = 0;
+pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Statically allocated table of echo events
+// Sampling under overload (-G), the rate is 1 when off
+struct sample_gov gov;
+int governed = 0;
+const char *sample_key; // filter expression for the 16-bit sampling key
+const char *sample_key6; // the same for IPv6 packets, NULL if not captured
+int filter_vlan = 0; // repeat the filter for vlan tagged frames
+int filter_ip6_ext = 0; // also pass IPv6 with extension headers, untargeted
+int adapter_clock = 0; // -A: live time stamps may come from the adapter
+
+// Time an echo or flow packet may wait for its other halves (-E)
+uint64_t echo_timeout_ns = ECHO_EVENT_TIMEOUT_NSEC;
+
+// Table of echo events
 struct echo_event {
   struct {
-    struct timeval dev[2];
+    struct timespec dev[2];
   } outbound;
   struct {
-    struct timeval dev[2];
+    struct timespec dev[2];
   } inbound;
   int seq;
+  struct in6_addr addr; // source of the echo request on dev1, IPv4 mapped
   unsigned char flags;
-  pthread_mutex_t flags_lock;
-} echo_event_table[ECHO_EVENT_TABLE_SIZE];
+  struct wheel_timer timer; // pending while flags are set
+};
+
+// Matching state owned by one pair of capture workers (one per device)
+struct shard {
+  // echo_lock covers the echo events and their wheel
+  pthread_mutex_t echo_lock;
+  struct echo_event echo_event_table[ECHO_EVENT_TABLE_SIZE];
+  struct wheel echo_wheel;
+  // Window of unmatched flow fingerprints
+  struct flow_table flow_table;
+  unsigned long long echo_finished;
+  unsigned long long echo_expired;
+};
+
+struct shard *shards;
+int nshards = 1;
+
+struct writer writer;
 
 // Get hash index into above array from seq number.
 // Since icmp seq values are a simple increasing sequence,
@@ -52,107 +203,467 @@ static inline int echo_event_hash_seq(int seq) {
 }
 
 // Write some zeros!
-void echo_event_table_init()
+void echo_event_table_init(struct shard *shard)
 {
-  int i;
-  for (i = 0; i < ECHO_EVENT_TABLE_SIZE; i++) {
-    echo_event_table[i].seq = 0;
-    echo_event_table[i].flags = 0;
+  pthread_mutex_init(&shard->echo_lock, NULL);
+  memset(shard->echo_event_table, 0, sizeof(shard->echo_event_table));
+  wheel_init(&shard->echo_wheel);
+  shard->echo_finished = 0;
+  shard->echo_expired = 0;
+}
+
+// Capture pipeline stages, see stage_common.h
+enum cap_stage {
+  STAGE_DECODE, // one packet's headers
+  STAGE_MATCH,  // one packet against the echo or flow table
+  STAGE_OUTPUT, // one match to the writer, histograms and shard
+  NSTAGES
+};
+
+static const char *const stage_names[NSTAGES] = { "decode", "match", "output" };
+
+// Per-capture-thread stats, only written by the owning thread
+struct cap_stats {
+  uint64_t packets;
+  uint64_t matched;
+  struct hist latency[2]; // outbound, inbound
+  struct stage_set stages;
+};
+
+struct dev_cap {
+  pcap_t *hdl;
+  const char *dev_name;
+  int dev_id;
+  int worker;
+  struct shard *shard;
+  struct writer_stream *out;
+  struct cap_stats stats;
+  struct agg_shard *agg; // latency by container address
+  int nano; // nonzero if hdl delivers nanosecond time stamps
+  int offline; // reading a file, time stamps say nothing about lag
+  unsigned int filter_gen; // generation of the filter installed on hdl
+  pcap_handler handler;
+  struct decode_batch *batch; // icmp mode, frames waiting for echo_batch_flush
+  uint64_t cpu_ns; // thread CPU time at the last governor run, main thread only
+};
+
+// Aggregation entry for a container address in this thread's shard
+// Returns NULL if the shard is full
+static inline struct agg_entry *cap_agg_addr(struct dev_cap *dc, struct in_addr addr)
+{
+  struct agg_entry *e;
+  char name[INET_ADDRSTRLEN];
+
+  e = agg_find(dc->agg, addr.s_addr);
+  if (e == NULL) {
+    inet_ntop(AF_INET, &addr, name, sizeof(name));
+    e = agg_get(dc->agg, addr.s_addr, name);
+  }
+  return e;
+}
+
+// The same for a decoded address, IPv6 ones keyed by a hash
+static inline struct agg_entry *cap_agg_addr6(struct dev_cap *dc, const struct in6_addr *addr)
+{
+  struct agg_entry *e;
+  char name[INET6_ADDRSTRLEN];
+  uint64_t key;
+
+  if (decode_addr_is4(addr)) {
+    return cap_agg_addr(dc, decode_addr4(addr));
+  }
+  // The top bit keeps them apart from IPv4 keys
+  key = flow_hash_bytes(0xcbf29ce484222325ULL, addr, sizeof(*addr)) | 1ULL << 63;
+  e = agg_find(dc->agg, key);
+  if (e == NULL) {
+    inet_ntop(AF_INET6, addr, name, sizeof(name));
+    e = agg_get(dc->agg, key, name);
+  }
+  return e;
+}
+
+// Start timing n packets if they are sampled, and note the lag of the
+// first behind its capture time stamp (host time stamps are CLOCK_REALTIME)
+// Returns the start time, or 0 if not sampled
+static inline uint64_t cap_stage_begin_n(struct dev_cap *dc, uint64_t n, uint64_t ts_ns)
+{
+  struct timespec now;
+
+  stage_count(&dc->stats.stages, STAGE_DECODE, n);
+  if (!stage_sample(&dc->stats.stages)) {
+    return 0;
+  }
+  if (!dc->offline && !adapter_clock) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    stage_lag(&dc->stats.stages, now.tv_sec * 1000000000LL + now.tv_nsec - (int64_t)ts_ns);
   }
+  return stage_now();
 }
 
-// Handle finished event
+static inline uint64_t cap_stage_begin(struct dev_cap *dc, const struct pcap_pkthdr *hdr)
+{
+  struct timespec ts;
+
+  tv_to_ts(&hdr->ts, dc->nano, &ts);
+  return cap_stage_begin_n(dc, 1, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// Handle finished event (a copy taken under echo_lock), kept while sampling 1 in 2^shift
 // Assumes that dev1 is closer to ping and dev2 is farther
-void echo_event_finish(struct echo_event *evt)
+void echo_event_finish(struct echo_event *evt, struct dev_cap *dc, unsigned int shift)
 {
+  struct writer_record rec;
+  struct agg_entry *e;
+
+  rec.ts_ns = evt->inbound.dev[0].tv_sec * 1000000000ULL + evt->inbound.dev[0].tv_nsec;
+
   // Compute outbound latency
-  tvsub(&evt->outbound.dev[1], &evt->outbound.dev[0]);
+  tssub(&evt->outbound.dev[1], &evt->outbound.dev[0]);
   // Compute inbound latency
-  tvsub(&evt->inbound.dev[0], &evt->inbound.dev[1]);
+  tssub(&evt->inbound.dev[0], &evt->inbound.dev[1]);
+
+  // Hand off to the writer thread
+  rec.kind = WRITER_KIND_ECHO;
+  rec.key = evt->seq;
+  rec.value_ns[0] = evt->outbound.dev[1].tv_sec * 1000000000LL + evt->outbound.dev[1].tv_nsec;
+  rec.value_ns[1] = evt->inbound.dev[0].tv_sec * 1000000000LL + evt->inbound.dev[0].tv_nsec;
+  rec.addr[0] = rec.addr[1] = 0;
+  rec.port[0] = rec.port[1] = 0;
+  rec.proto = IPPROTO_ICMP;
+  rec.flags = 0;
+  rec.sample_shift = shift;
+  rec.pad = 0;
+  writer_append(dc->out, &rec);
+
+  stat_add(&dc->stats.matched, 1);
+  hist_add_n(&dc->stats.latency[0], rec.value_ns[0] > 0 ? rec.value_ns[0] : 0, 1ULL << shift);
+  hist_add_n(&dc->stats.latency[1], rec.value_ns[1] > 0 ? rec.value_ns[1] : 0, 1ULL << shift);
 
+  e = cap_agg_addr6(dc, &evt->addr);
+  if (e != NULL) {
+    agg_add_n(e, AGG_OUT, rec.value_ns[0] > 0 ? rec.value_ns[0] : 0, 1ULL << shift);
+    agg_add_n(e, AGG_IN, rec.value_ns[1] > 0 ? rec.value_ns[1] : 0, 1ULL << shift);
+  }
+}
 
-  // Dump info to stdout
-  fprintf(stdout, "seq: %d, outbound: %lu.%06lu, inbound: %lu.%06lu\n",
-    evt->seq,
-    evt->outbound.dev[1].tv_sec, evt->outbound.dev[1].tv_usec,
-    evt->inbound.dev[0].tv_sec, evt->inbound.dev[0].tv_usec);
+// Give up on an echo that didn't complete: the request was lost if it
+// never made it across, otherwise the reply was
+// Caller holds echo_lock
+void echo_event_lost(struct echo_event *evt, struct dev_cap *dc)
+{
+  unsigned char out = ECHO_EVENT_DEV1_OUTBOUND_FLAG | ECHO_EVENT_DEV2_OUTBOUND_FLAG;
+  struct agg_entry *e;
 
-  // Reset flags!
+  if (evt->flags & ECHO_EVENT_DEV1_OUTBOUND_FLAG) {
+    e = cap_agg_addr6(dc, &evt->addr);
+    if (e != NULL) {
+      agg_expire(e, (evt->flags & out) == out ? AGG_IN : AGG_OUT);
+    }
+  }
+  __sync_fetch_and_add(&dc->shard->echo_expired, 1);
+  wheel_del(&dc->shard->echo_wheel, &evt->timer);
   evt->flags = 0;
 }
 
-struct dev_cap {
-  pcap_t *hdl;
-  const char *dev_name;
-  int dev_id;
-};
+// Wheel callback, with echo_lock held
+void echo_event_expire(struct wheel_timer *t, void *arg)
+{
+  echo_event_lost(wheel_entry(t, struct echo_event, timer), (struct dev_cap *)arg);
+}
 
-void pcap_callback(u_char *user, const struct pcap_pkthdr *hdr, const u_char *data)
+// Match echo row i of a decoded batch against the echo table
+// Caller holds echo_lock
+// Returns nonzero if it finished an echo, copied into done
+static inline int echo_match(struct dev_cap *dc, const struct decode_batch *b, int i,
+                             struct echo_event *done)
 {
-  struct dev_cap *dc = (struct dev_cap *)user;
-  struct icmp *icmp_hdr;
   struct echo_event *evt;
-  struct timeval *tstamp_target = NULL;
+  struct timespec *tstamp_target = NULL;
   unsigned char flag = 0;
-
-  // Assume the packet filter is only giving us icmp packets and go right for icmp header
-  icmp_hdr = (struct icmp *)(data + sizeof(struct ether_header) + sizeof(struct ip));
+  uint64_t now = b->ts_ns[i];
+  int seq = b->seq[i];
 
   // Get a pointer into the echo event hash table for this sequence number
-  evt = echo_event_table + echo_event_hash_seq(ntohs(icmp_hdr->icmp_hun.ih_idseq.icd_seq));
+  evt = dc->shard->echo_event_table + echo_event_hash_seq(seq);
+
+  // Branch on message type, then on device
+  if (b->type[i] == PACKET_TYPE_ECHO_REQUEST) {
+    tstamp_target = &evt->outbound.dev[dc->dev_id];
+    flag = dc->dev_id == 0 ? ECHO_EVENT_DEV1_OUTBOUND_FLAG : ECHO_EVENT_DEV2_OUTBOUND_FLAG;
+  } else {
+    tstamp_target = &evt->inbound.dev[dc->dev_id];
+    flag = dc->dev_id == 0 ? ECHO_EVENT_DEV1_INBOUND_FLAG : ECHO_EVENT_DEV2_INBOUND_FLAG;
+  }
 
+#ifdef DEBUG
+  // Dump some info to stdout
+  fprintf(stdout, "[%llu.%09llu] id: %d seq: %d dev: %d\n",
+      (unsigned long long)(now / 1000000000ULL), (unsigned long long)(now % 1000000000ULL),
+      b->id[i], seq, dc->dev_id);
+#endif
+
+  wheel_advance(&dc->shard->echo_wheel, now, echo_event_expire, dc);
+  if (evt->flags && evt->seq != seq) {
+    // Still holding an older echo, which can't complete any more
+    echo_event_lost(evt, dc);
+  }
   // Add sequence to table on first access
   if (!evt->flags) {
-    evt->seq = ntohs(icmp_hdr->icmp_hun.ih_idseq.icd_seq);
+    evt->seq = seq;
+    wheel_add(&dc->shard->echo_wheel, &evt->timer, now + echo_timeout_ns);
   }
+  tstamp_target->tv_sec = now / 1000000000ULL;
+  tstamp_target->tv_nsec = now % 1000000000ULL;
+  if (flag == ECHO_EVENT_DEV1_OUTBOUND_FLAG) {
+    evt->addr = b->src[i];
+  }
+  evt->flags |= flag;
+  if (evt->flags != ECHO_EVENT_READY) {
+    return 0;
+  }
+  // Reset flags, the slot is free for the next echo once copied
+  *done = *evt;
+  evt->flags = 0;
+  wheel_del(&dc->shard->echo_wheel, &evt->timer);
+  return 1;
+}
 
-  // Branch on message type
-  switch (icmp_hdr->icmp_type) {
-    case ICMP_ECHO:
-      // Branch on device
-      if (dc->dev_id == 0) {
-        tstamp_target = &evt->outbound.dev[0];
-        flag = ECHO_EVENT_DEV1_OUTBOUND_FLAG;
-      } else {
-        tstamp_target = &evt->outbound.dev[1];
-        flag = ECHO_EVENT_DEV2_OUTBOUND_FLAG;
-      }
-      break;
-    case ICMP_ECHOREPLY:
-      // Branch on device
-      if (dc->dev_id == 0) {
-        tstamp_target = &evt->inbound.dev[0];
-        flag = ECHO_EVENT_DEV1_INBOUND_FLAG;
-      } else {
-        tstamp_target = &evt->inbound.dev[1];
-        flag = ECHO_EVENT_DEV2_INBOUND_FLAG;
-      }
-      break;
-    default:
-      // Bail now if it's not an echo message
-      return;
+// Decode the frames batched for dc and match their echoes in order,
+// taking echo_lock once for the whole batch
+void echo_batch_flush(struct dev_cap *dc)
+{
+  struct decode_batch *b = dc->batch;
+  struct echo_event done[DECODE_BATCH];
+  unsigned int shift;
+  uint64_t start;
+  int nmatched = 0;
+  int ndone = 0;
+  int i;
+
+  if (b->n == 0) {
+    return;
+  }
+  stat_add(&dc->stats.packets, b->n);
+  start = cap_stage_begin_n(dc, b->n, b->ts_ns[0]);
+  decode_batch_run(b);
+  if (start) {
+    start = stage_time_n(&dc->stats.stages, STAGE_DECODE, start, b->n);
   }
-  
+
+  // The filter may predate a rate change, check again so results carry the right rate
+  shift = sample_shift(&gov);
+  pthread_mutex_lock(&dc->shard->echo_lock);
+  for (i = 0; i < b->n; i++) {
+    if (b->type[i] == PACKET_TYPE_NONE || (shift && !sample_keep16(b->seq[i], shift))) {
+      continue;
+    }
+    nmatched++;
+    ndone += echo_match(dc, b, i, &done[ndone]);
+  }
+  pthread_mutex_unlock(&dc->shard->echo_lock);
+  b->n = 0;
+
+  stage_count(&dc->stats.stages, STAGE_MATCH, nmatched);
+  if (start && nmatched) {
+    start = stage_time_n(&dc->stats.stages, STAGE_MATCH, start, nmatched);
+  }
+
+  for (i = 0; i < ndone; i++) {
+    echo_event_finish(&done[i], dc, shift);
+  }
+  __sync_fetch_and_add(&dc->shard->echo_finished, ndone);
+  stage_count(&dc->stats.stages, STAGE_OUTPUT, ndone);
+  if (start && ndone) {
+    stage_time_n(&dc->stats.stages, STAGE_OUTPUT, start, ndone);
+  }
+}
+
+// pcap_dispatch callback for live echo captures, see follow_capture
+void echo_batch_callback(u_char *user, const struct pcap_pkthdr *hdr, const u_char *data)
+{
+  struct dev_cap *dc = (struct dev_cap *)user;
+
+  if (decode_batch_add(dc->batch, hdr, data, dc->nano)) {
+    echo_batch_flush(dc);
+  }
+}
+
+// Match one echo packet right away, a batch of one
+void pcap_callback(u_char *user, const struct pcap_pkthdr *hdr, const u_char *data)
+{
+  struct dev_cap *dc = (struct dev_cap *)user;
+
+  decode_batch_add(dc->batch, hdr, data, dc->nano);
+  echo_batch_flush(dc);
+}
+
+// Match tcp and udp packets by fingerprint
+// Assumes that dev1 is closer to the application and dev2 is farther
+void flow_pcap_callback(u_char *user, const struct pcap_pkthdr *hdr, const u_char *data)
+{
+  struct dev_cap *dc = (struct dev_cap *)user;
+  struct flow_table *flow_table = &dc->shard->flow_table;
+  struct flow_key key;
+  struct timespec ts;
+  struct timespec delta;
+  int first_dev;
+  struct writer_record rec;
+  struct agg_entry *e;
+  unsigned int shift;
+  uint64_t start;
+  int matched;
+
+  stat_add(&dc->stats.packets, 1);
+  start = cap_stage_begin(dc, hdr);
+
+  if (!flow_fingerprint(data, hdr->caplen, flow_table->ignore_addrs, &key)) {
+    return;
+  }
+  shift = sample_shift(&gov);
+  if (shift && !sample_keep16(key.ip_id, shift)) {
+    return;
+  }
+  if (start) {
+    start = stage_time(&dc->stats.stages, STAGE_DECODE, start);
+  }
+
 #ifdef DEBUG
-  // Dump some info to stdout
-  fprintf(stdout, "[%lu.%06lu] id: %d seq: %d dev: %d\n",
+  fprintf(stdout, "[%lu.%06lu] fp: %016llx proto: %d dev: %d\n",
       hdr->ts.tv_sec,
       hdr->ts.tv_usec,
-      ntohs(icmp_hdr->icmp_hun.ih_idseq.icd_id),
-      ntohs(icmp_hdr->icmp_hun.ih_idseq.icd_seq),
+      (unsigned long long)key.fp,
+      key.proto,
       dc->dev_id);
 #endif
 
-  // Atomically update the echo event and check if it is finished
-  pthread_mutex_lock(&evt->flags_lock);
-  *tstamp_target = hdr->ts;
-  evt->flags |= flag;
-  if (evt->flags == ECHO_EVENT_READY) {
-    pthread_mutex_unlock(&evt->flags_lock);
-    echo_event_finish(evt);
-  } else {
-    pthread_mutex_unlock(&evt->flags_lock);
+  tv_to_ts(&hdr->ts, dc->nano, &ts);
+  matched = flow_table_match(flow_table, key.fp, dc->dev_id, &ts, &delta, &first_dev);
+  stage_count(&dc->stats.stages, STAGE_MATCH, 1);
+  if (start) {
+    start = stage_time(&dc->stats.stages, STAGE_MATCH, start);
+  }
+
+  if (matched) {
+    rec.ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec.kind = WRITER_KIND_FLOW;
+    rec.key = 0;
+    rec.value_ns[0] = delta.tv_sec * 1000000000LL + delta.tv_nsec;
+    rec.value_ns[1] = 0;
+    rec.addr[0] = key.src.s_addr;
+    rec.addr[1] = key.dst.s_addr;
+    rec.port[0] = key.sport;
+    rec.port[1] = key.dport;
+    rec.proto = key.proto;
+    rec.flags = first_dev == 0 ? 0 : WRITER_FLAG_INBOUND;
+    rec.sample_shift = shift;
+    rec.pad = 0;
+    writer_append(dc->out, &rec);
+
+    stat_add(&dc->stats.matched, 1);
+    hist_add_n(&dc->stats.latency[first_dev == 0 ? 0 : 1],
+               rec.value_ns[0] > 0 ? rec.value_ns[0] : 0, 1ULL << shift);
+
+    // The container end is the source going out and the destination coming in
+    e = cap_agg_addr(dc, first_dev == 0 ? key.src : key.dst);
+    if (e != NULL) {
+      agg_add_n(e, first_dev == 0 ? AGG_OUT : AGG_IN,
+                rec.value_ns[0] > 0 ? rec.value_ns[0] : 0, 1ULL << shift);
+    }
+
+    stage_count(&dc->stats.stages, STAGE_OUTPUT, 1);
+    if (start) {
+      stage_time(&dc->stats.stages, STAGE_OUTPUT, start);
+    }
+  }
+}
+
+// Install the current filter if it changed since we last looked
+// Only called from the thread that owns dc->hdl
+void update_capture_filter(struct dev_cap *dc)
+{
+  char txt[FILTER_TEXT_SIZE];
+  unsigned int gen;
+
+  pthread_mutex_lock(&filter_lock);
+  gen = filter_gen;
+  if (gen != dc->filter_gen) {
+    memcpy(txt, filter_text, sizeof(txt));
+  }
+  pthread_mutex_unlock(&filter_lock);
+
+  if (gen != dc->filter_gen) {
+    if (!set_capture_filter(dc->hdl, txt)) {
+      fprintf(stdout, "%s: filter now '%s'\n", dc->dev_name, txt);
+    }
+    dc->filter_gen = gen;
+  }
+}
+
+// Filter text for the targets and the current sampling rate
+// Caller holds targets_lock (or no other thread runs yet)
+// Returns 0 on success, nonzero if it doesn't fit
+int capture_filter_text(const char *base, char *buf, size_t len)
+{
+  char txt[FILTER_TEXT_SIZE];
+  char ext[FILTER_TEXT_SIZE];
+  const char *l3 = txt;
+  char clause[128];
+  char clause6[128];
+  unsigned int shift = sample_shift(&gov);
+  size_t off;
+
+  if (filter_set_text(&filter_targets, base, txt, sizeof(txt))
+   || sample_keep16_filter(sample_key, shift, clause, sizeof(clause))
+   || (sample_key6 != NULL && sample_keep16_filter(sample_key6, shift, clause6, sizeof(clause6)))) {
+    return -1;
+  }
+  off = strlen(txt);
+  if (clause[0] != '\0' && sample_key6 != NULL) {
+    off += snprintf(txt + off, sizeof(txt) - off, " and ((icmp and %s) or (icmp6 and %s))", clause, clause6);
+  } else if (clause[0] != '\0') {
+    off += snprintf(txt + off, sizeof(txt) - off, " and (%s)", clause);
+  }
+  if (off >= sizeof(txt)) {
+    return -1;
+  }
+  // The targets' and sampling's icmp6 offsets don't hold past extension
+  // headers, so those frames go to the decoder, which rechecks sampling
+  if (filter_ip6_ext && filter_targets.ntargets == 0) {
+    if (snprintf(ext, sizeof(ext), "(%s) or %s", txt, IP6_EXT_FILTER) >= (int)sizeof(ext)) {
+      return -1;
+    }
+    l3 = ext;
+  }
+  if (!filter_vlan) {
+    return snprintf(buf, len, "%s", l3) >= (int)len;
+  }
+  // Each vlan keyword shifts every offset after it, so test untagged frames
+  // first and nest the QinQ test inside the single tagged one
+  return snprintf(buf, len, "(%s) or (vlan and ((%s) or (vlan and (%s))))", l3, l3, l3) >= (int)len;
+}
+
+// Rebuild the filter text from the targets and kick the capture threads
+// out of pcap_loop so they install it
+// Returns 0 on success, nonzero if the targets don't fit in a filter
+int publish_capture_filter(const char *base, struct dev_cap *caps, int ncaps)
+{
+  char txt[FILTER_TEXT_SIZE];
+  int i;
+
+  if (capture_filter_text(base, txt, sizeof(txt))) {
+    fprintf(stderr, "Filter for %d targets is too long\n", filter_targets.ntargets);
+    return -1;
   }
+
+  pthread_mutex_lock(&filter_lock);
+  memcpy(filter_text, txt, sizeof(txt));
+  filter_gen++;
+  pthread_mutex_unlock(&filter_lock);
+
+  for (i = 0; i < ncaps; i++) {
+    pcap_breakloop(caps[i].hdl);
+  }
+  return 0;
 }
 
 void *follow_capture(void *cap)
@@ -160,67 +671,829 @@ void *follow_capture(void *cap)
   struct dev_cap *dc = (struct dev_cap *)cap;
 
   while (running) {
-    pcap_loop(dc->hdl, -1, pcap_callback, (u_char *)cap);
+    if (dc->batch == NULL) {
+      pcap_loop(dc->hdl, -1, dc->handler, (u_char *)cap);
+    } else {
+      // Echoes are decoded a read at a time, until pcap_breakloop
+      while (running && pcap_dispatch(dc->hdl, -1, echo_batch_callback, (u_char *)cap) >= 0) {
+        echo_batch_flush(dc);
+      }
+      echo_batch_flush(dc);
+    }
+    update_capture_filter(dc);
+  }
+}
+
+// Feed two saved captures through their handlers in time stamp order
+// Returns the number of packets processed
+unsigned long long follow_offline(struct dev_cap *caps, int ncaps)
+{
+  struct pcap_pkthdr *hdrs[2];
+  const u_char *datas[2];
+  struct timespec ts[2];
+  int live[2];
+  unsigned long long npkts = 0;
+  int next;
+  int i;
+
+  // Prime each side with its first packet
+  for (i = 0; i < ncaps; i++) {
+    live[i] = pcap_next_ex(caps[i].hdl, &hdrs[i], &datas[i]) == 1;
+    if (live[i]) {
+      tv_to_ts(&hdrs[i]->ts, caps[i].nano, &ts[i]);
+    }
+  }
+
+  while (running) {
+    // Take whichever pending packet is earliest
+    next = -1;
+    for (i = 0; i < ncaps; i++) {
+      if (live[i] && (next < 0 || tsbefore(&ts[i], &ts[next]))) {
+        next = i;
+      }
+    }
+    if (next < 0) {
+      break;
+    }
+
+    caps[next].handler((u_char *)&caps[next], hdrs[next], datas[next]);
+    npkts++;
+
+    live[next] = pcap_next_ex(caps[next].hdl, &hdrs[next], &datas[next]) == 1;
+    if (live[next]) {
+      tv_to_ts(&hdrs[next]->ts, caps[next].nano, &ts[next]);
+    }
+  }
+
+  return npkts;
+}
+
+// Merge every capture's per-address shard
+// Returns 0 on success, nonzero if out of memory
+int build_addr_view(struct dev_cap *caps, int ncaps, struct agg_view *view)
+{
+  struct agg_shard **aggs;
+  int ret;
+  int i;
+
+  aggs = (struct agg_shard **)malloc(sizeof(struct agg_shard *) * ncaps);
+  if (aggs == NULL) {
+    return -1;
+  }
+  for (i = 0; i < ncaps; i++) {
+    aggs[i] = caps[i].agg;
+  }
+  ret = agg_view_build(view, aggs, ncaps);
+  free(aggs);
+  return ret;
+}
+
+// Merge every capture's stage costs into a zeroed set
+// Returns 0 on success, nonzero if out of memory
+int build_stages(struct dev_cap *caps, int ncaps, struct stage_set *set)
+{
+  struct hist *snap;
+  int i;
+
+  snap = (struct hist *)malloc(sizeof(struct hist));
+  if (snap == NULL) {
+    return -1;
+  }
+  for (i = 0; i < ncaps; i++) {
+    stage_set_merge(set, &caps[i].stats.stages, snap);
+  }
+  free(snap);
+  return 0;
+}
+
+// Main thread, once a second: sample more or less of the packets, see -G
+void govern_sampling(struct dev_cap *caps, int ncaps, const pthread_t *threads, uint64_t interval_ns)
+{
+  struct pcap_stat ps;
+  struct stage_set *stages;
+  uint64_t lost = writer_dropped(&writer);
+  uint64_t lag = 0;
+  uint64_t cpu_ns;
+  double cpu = 0;
+  int i;
+
+  for (i = 0; i < ncaps; i++) {
+    // Packets the kernel dropped on this socket since it was opened
+    if (pcap_stats(caps[i].hdl, &ps) == 0) {
+      lost += ps.ps_drop;
+    }
+    cpu_ns = sample_thread_cpu_ns(threads[i]);
+    if (cpu_ns > caps[i].cpu_ns && (double)(cpu_ns - caps[i].cpu_ns) / interval_ns > cpu) {
+      cpu = (double)(cpu_ns - caps[i].cpu_ns) / interval_ns;
+    }
+    caps[i].cpu_ns = cpu_ns;
   }
+
+  stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+  if (stages != NULL && !build_stages(caps, ncaps, stages)) {
+    lag = sample_gov_lag(&gov, &stages->lag);
+  }
+  free(stages);
+
+  if (!sample_gov_update(&gov, lost, lag, cpu)) {
+    return;
+  }
+  fprintf(stderr, "Sampling 1 in %u packets (lost %llu, lag p99 %.1f us, cpu %.0f%%)\n",
+      1U << sample_shift(&gov), (unsigned long long)lost, lag / 1000.0, cpu * 100);
+  pthread_mutex_lock(&targets_lock);
+  // If the clause doesn't fit, the callbacks still sample
+  publish_capture_filter(filter_base, caps, ncaps);
+  pthread_mutex_unlock(&targets_lock);
+}
+
+// One line of per-address percentiles, in microseconds
+void format_addr_stats(const struct agg_entry *e, char *buf, size_t len)
+{
+  size_t off;
+  int dir;
+
+  off = snprintf(buf, len, "%s", e->name);
+  for (dir = 0; dir < 2 && off < len; dir++) {
+    off += snprintf(buf + off, len - off, " %s n=%llu expired=%llu p50=%.1f p90=%.1f p99=%.1f max=%.1f",
+        dir == AGG_OUT ? "outbound" : "inbound", (unsigned long long)e->samples[dir],
+        (unsigned long long)e->expired[dir],
+        hist_quantile(&e->latency[dir], 0.5) / 1000.0,
+        hist_quantile(&e->latency[dir], 0.9) / 1000.0,
+        hist_quantile(&e->latency[dir], 0.99) / 1000.0,
+        e->latency[dir].max / 1000.0);
+  }
+}
+
+// Summary thread: every capture's per-address shard, for the collector
+int build_summary_view(struct agg_view *view, void *arg)
+{
+  return build_addr_view((struct dev_cap *)arg, 2 * nshards, view);
+}
+
+// Metrics thread: snapshot every capture's stats into one scrape
+void collect_metrics(struct metrics_buf *out, void *arg)
+{
+  struct dev_cap *caps = (struct dev_cap *)arg;
+  int ncaps = 2 * nshards;
+  struct hist *merged;
+  struct hist *snap;
+  struct agg_view view;
+  struct stage_set *stages;
+  unsigned long long evicted = 0;
+  unsigned long long expired = 0;
+  unsigned long long overflow = 0;
+  char labels[128];
+  int dir;
+  int i;
+
+  metrics_family(out, "iface_diff_packets_total", "counter", "Packets seen by each capture worker");
+  for (i = 0; i < ncaps; i++) {
+    snprintf(labels, sizeof(labels), "dev=\"%s\",worker=\"%d\"", caps[i].dev_name, caps[i].worker);
+    metrics_value(out, "iface_diff_packets_total", labels, stat_read(&caps[i].stats.packets));
+  }
+
+  metrics_family(out, "iface_diff_matched_total", "counter", "Packets or echoes matched across both devices, by the worker that completed them");
+  for (i = 0; i < ncaps; i++) {
+    snprintf(labels, sizeof(labels), "dev=\"%s\",worker=\"%d\"", caps[i].dev_name, caps[i].worker);
+    metrics_value(out, "iface_diff_matched_total", labels, stat_read(&caps[i].stats.matched));
+  }
+
+  for (i = 0; i < nshards; i++) {
+    evicted += __atomic_load_n(&shards[i].flow_table.evicted, __ATOMIC_RELAXED);
+    expired += __atomic_load_n(&shards[i].flow_table.expired, __ATOMIC_RELAXED);
+    expired += __atomic_load_n(&shards[i].echo_expired, __ATOMIC_RELAXED);
+  }
+  metrics_family(out, "iface_diff_flow_evicted_total", "counter", "Flow fingerprints pushed out unmatched by newer packets");
+  metrics_value(out, "iface_diff_flow_evicted_total", "", evicted);
+
+  metrics_family(out, "iface_diff_expired_total", "counter", "Echoes or flow packets not seen on both devices within the timeout");
+  metrics_value(out, "iface_diff_expired_total", "", expired);
+
+  metrics_family(out, "iface_diff_output_dropped_total", "counter", "Results dropped because the writer could not keep up");
+  metrics_value(out, "iface_diff_output_dropped_total", "", writer_dropped(&writer));
+
+  metrics_family(out, "iface_diff_output_queued_bytes", "gauge", "Results waiting for the writer thread");
+  metrics_value(out, "iface_diff_output_queued_bytes", "", writer_queued(&writer));
+
+  metrics_family(out, "iface_diff_sample_every", "gauge", "Packets per packet measured, 1 unless sampling under overload");
+  metrics_value(out, "iface_diff_sample_every", "", 1ULL << sample_shift(&gov));
+
+  stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+  if (stages != NULL && !build_stages(caps, ncaps, stages)) {
+    metrics_stages(out, "iface_diff", stage_names, NSTAGES, stages);
+  }
+  free(stages);
+
+  for (i = 0; i < ncaps; i++) {
+    overflow += stat_read(&caps[i].agg->overflow);
+  }
+  metrics_family(out, "iface_diff_agg_overflow_total", "counter", "Matches not aggregated because a shard was full");
+  metrics_value(out, "iface_diff_agg_overflow_total", "", overflow);
+
+  // Histograms are too big for the metrics thread's stack
+  merged = (struct hist *)malloc(2 * sizeof(struct hist));
+  snap = (struct hist *)malloc(sizeof(struct hist));
+  if (merged == NULL || snap == NULL) {
+    free(merged);
+    free(snap);
+    return;
+  }
+  metrics_family(out, "iface_diff_latency_seconds", "histogram", "Latency between dev1 and dev2");
+  for (dir = 0; dir < 2; dir++) {
+    hist_init(&merged[dir]);
+    for (i = 0; i < ncaps; i++) {
+      hist_snapshot(&caps[i].stats.latency[dir], snap);
+      hist_merge(&merged[dir], snap);
+    }
+    metrics_hist(out, "iface_diff_latency_seconds",
+        dir == 0 ? "direction=\"outbound\"" : "direction=\"inbound\"", &merged[dir]);
+  }
+  free(merged);
+  free(snap);
+
+  if (build_addr_view(caps, ncaps, &view)) {
+    return;
+  }
+  metrics_family(out, "iface_diff_addr_latency_seconds", "histogram", "Latency between dev1 and dev2 by container address");
+  for (i = 0; i < view.nentries; i++) {
+    for (dir = 0; dir < 2; dir++) {
+      snprintf(labels, sizeof(labels), "addr=\"%s\",direction=\"%s\"",
+          view.entries[i].name, dir == AGG_OUT ? "outbound" : "inbound");
+      metrics_hist(out, "iface_diff_addr_latency_seconds", labels, &view.entries[i].latency[dir]);
+    }
+  }
+  agg_view_free(&view);
 }
 
+// Control thread: apply one command
+int handle_command(char *line, struct control_reply *reply, void *arg)
+{
+  struct dev_cap *caps = (struct dev_cap *)arg;
+  struct filter_target target;
+  struct agg_view view;
+  char txt[256];
+  unsigned long long matched = 0;
+  unsigned long long expired = 0;
+  char *cmd;
+  char *rest;
+  int ret = 0;
+  int i;
+
+  rest = control_next_word(line, &cmd);
+
+  if (!strcmp(cmd, "add") || !strcmp(cmd, "del")) {
+    if (filter_target_parse(rest, &target)) {
+      control_printf(reply, "bad target '%s'\n", rest);
+      return -1;
+    }
+    pthread_mutex_lock(&targets_lock);
+    if (cmd[0] == 'a') {
+      if (filter_set_add(&filter_targets, &target)) {
+        control_printf(reply, "too many targets\n");
+        ret = -1;
+      } else if (publish_capture_filter(filter_base, caps, 2 * nshards)) {
+        // Doesn't fit in a filter, back it out
+        filter_set_del(&filter_targets, &target);
+        control_printf(reply, "filter too long\n");
+        ret = -1;
+      }
+    } else {
+      if (filter_set_del(&filter_targets, &target)) {
+        control_printf(reply, "no such target\n");
+        ret = -1;
+      } else {
+        publish_capture_filter(filter_base, caps, 2 * nshards);
+      }
+    }
+    pthread_mutex_unlock(&targets_lock);
+    return ret;
+  }
+
+  if (!strcmp(cmd, "targets")) {
+    pthread_mutex_lock(&targets_lock);
+    for (i = 0; i < filter_targets.ntargets; i++) {
+      filter_target_format(&filter_targets.targets[i], txt, sizeof(txt));
+      control_printf(reply, "%s\n", txt);
+    }
+    pthread_mutex_unlock(&targets_lock);
+    return 0;
+  }
+
+  if (!strcmp(cmd, "stats")) {
+    for (i = 0; i < 2 * nshards; i++) {
+      matched += stat_read(&caps[i].stats.matched);
+      control_printf(reply, "%s worker %d: packets %llu\n", caps[i].dev_name, caps[i].worker,
+          (unsigned long long)stat_read(&caps[i].stats.packets));
+    }
+    control_printf(reply, "matched %llu\n", matched);
+    for (i = 0; i < nshards; i++) {
+      expired += __atomic_load_n(&shards[i].flow_table.expired, __ATOMIC_RELAXED);
+      expired += __atomic_load_n(&shards[i].echo_expired, __ATOMIC_RELAXED);
+    }
+    control_printf(reply, "expired %llu\n", expired);
+    if (build_addr_view(caps, 2 * nshards, &view)) {
+      return 0;
+    }
+    for (i = 0; i < view.nentries; i++) {
+      format_addr_stats(&view.entries[i], txt, sizeof(txt));
+      control_printf(reply, "%s\n", txt);
+    }
+    agg_view_free(&view);
+    return 0;
+  }
+
+  control_printf(reply, "commands: add <target>, del <target>, targets, stats\n");
+  return strcmp(cmd, "help") != 0;
+}
 
 void do_exit()
 {
   running = 0;
 }
 
+void do_reload()
+{
+  reload = 1;
+}
+
 void usage()
 {
-  fprintf(stdout, "Usage: iface_diff <dev1> <dev2>\n");
+  fprintf(stdout, "Usage: iface_diff [-m icmp|flow] [-N] [-r] [-A] [-j workers] [-F hash|cpu]\n");
+  fprintf(stdout, "                  [-t target]... [-T file] [-o file] [-f text|csv|binary|column]\n");
+  fprintf(stdout, "                  [-M port|path] [-C socket] [-S secs] [-G lag_ms[,cpu_pct]] [-E ms]\n");
+  fprintf(stdout, "                  [-U addr[,secs]]\n");
+  fprintf(stdout, "                  <dev1> <dev2>\n");
   fprintf(stdout, "  Assumes that dev1 is closer to ping and dev2 is farther\n");
+  fprintf(stdout, "  -r       read dev1 and dev2 as saved pcap/pcapng files\n");
+  fprintf(stdout, "  -A       time stamp on the adapter clock if both devices have one synced to\n");
+  fprintf(stdout, "           the system clock, rather than a host clock; leaves out lag and -G\n");
+  fprintf(stdout, "  -j <n>   capture each device with n PACKET_FANOUT workers (default 1)\n");
+  fprintf(stdout, "  -F <m>   fanout mode: hash (default) or cpu\n");
+  fprintf(stdout, "  -t <target>  only capture this target (repeatable), one of:\n");
+  fprintf(stdout, "               'host <ip>', 'icmp-id <id>', 'flow <tcp|udp> <ip>:<port> <ip>:<port>'\n");
+  fprintf(stdout, "  -T <file>    read targets from file, re-read on SIGHUP\n");
+  fprintf(stdout, "  -o <file>    write results to file instead of stdout\n");
+  fprintf(stdout, "  -f <format>  result format: text (default), csv, binary or column\n");
+  fprintf(stdout, "  -M <addr>    serve Prometheus metrics on a tcp port or unix socket path\n");
+  fprintf(stdout, "  -C <socket>  accept add/del target commands on a unix socket\n");
+  fprintf(stdout, "  -S <secs>    print pipeline stage costs to stderr every secs seconds\n");
+  fprintf(stdout, "  -G <lag>[,<cpu>]  sample packets when behind by more than lag ms (p99), when\n");
+  fprintf(stdout, "               a capture thread uses more than cpu%% (default 50) or drops occur\n");
+  fprintf(stdout, "  -E <ms>      count an echo or packet lost if not seen on both devices within ms\n");
+  fprintf(stdout, "               of its first packet (default %d)\n", ECHO_EVENT_TIMEOUT_NSEC / 1000000);
+  fprintf(stdout, "  -U <addr>[,<secs>]  send a summary every secs seconds (default %d) to the\n",
+          SUMMARY_DEFAULT_SECS);
+  fprintf(stdout, "               collector on a unix socket path or at host:port\n");
+  fprintf(stdout, "  -m icmp  match icmp echo by sequence number (default)\n");
+  fprintf(stdout, "  -m flow  match any IPv4 tcp/udp packet by fingerprint, tagged or not\n");
+  fprintf(stdout, "  -N       leave addresses and ports out of flow fingerprints (NAT between devices)\n");
 }
 
 int main(int argc, char *argv[])
 {
-  pthread_t cap1_thread;
-  pthread_t cap2_thread;
-  struct dev_cap cap1;
-  struct dev_cap cap2;
+  pthread_t *threads;
+  struct dev_cap *caps;
+  int ncaps;
+  enum match_mode mode = MATCH_MODE_ICMP;
+  int ignore_addrs = 0;
+  int offline = 0;
+  int fanout_type = PACKET_FANOUT_HASH;
+  int fanout_group[2] = { -1, -1 };
+  const char *targets_file = NULL;
+  const char *out_file = NULL;
+  int out_format = WRITER_FORMAT_TEXT;
+  int out_fd = STDOUT_FILENO;
+  unsigned long long dropped;
+  const char *metrics_addr = NULL;
+  struct metrics_server metrics;
+  const char *control_path = NULL;
+  struct control_server control;
+  char summary_addr[SUMMARY_ADDR_SIZE];
+  unsigned int summary_secs = 0;
+  struct summary_agent summary;
+  struct filter_target target;
+  int caplen;
+  struct timespec start;
+  struct timespec elapsed;
+  unsigned long long npkts;
+  unsigned long long matched = 0;
+  unsigned long long evicted = 0;
+  unsigned long long expired = 0;
+  struct agg_view view;
+  int stage_secs = 0;
+  struct stage_set *stages;
+  uint64_t stage_items[NSTAGES] = { 0 };
+  uint64_t stage_busy[NSTAGES] = { 0 };
+  uint64_t last_report;
+  uint64_t last_gov;
+  uint64_t now;
+  char txt[256];
+  double secs;
+  const char *dev1;
+  const char *dev2;
+  const char *devs[2];
+  int tstamp_type = -1;
+  int opt;
+  int i;
+
+  filter_set_init(&filter_targets);
+  sample_gov_init(&gov, 0, 0);
 
-  if (argc != 3) {
+  while ((opt = getopt(argc, argv, "m:NrAj:F:t:T:o:f:M:C:S:G:E:U:")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (!strcmp(optarg, "icmp")) {
+          mode = MATCH_MODE_ICMP;
+        } else if (!strcmp(optarg, "flow")) {
+          mode = MATCH_MODE_FLOW;
+        } else {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'N':
+        ignore_addrs = 1;
+        break;
+      case 'r':
+        offline = 1;
+        break;
+      case 'A':
+        adapter_clock = 1;
+        break;
+      case 'j':
+        nshards = atoi(optarg);
+        if (nshards < 1) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'F':
+        if (!strcmp(optarg, "hash")) {
+          fanout_type = PACKET_FANOUT_HASH;
+        } else if (!strcmp(optarg, "cpu")) {
+          fanout_type = PACKET_FANOUT_CPU;
+        } else {
+          usage();
+          exit(1);
+        }
+        break;
+      case 't':
+        if (filter_target_parse(optarg, &target)
+         || filter_set_add(&filter_targets, &target)) {
+          fprintf(stderr, "Bad target: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'T':
+        targets_file = optarg;
+        break;
+      case 'o':
+        out_file = optarg;
+        break;
+      case 'f':
+        out_format = writer_format_parse(optarg);
+        if (out_format < 0) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'M':
+        metrics_addr = optarg;
+        break;
+      case 'C':
+        control_path = optarg;
+        break;
+      case 'S':
+        stage_secs = atoi(optarg);
+        if (stage_secs < 1) {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'G':
+        if (sample_gov_parse(&gov, optarg)) {
+          usage();
+          exit(1);
+        }
+        governed = 1;
+        break;
+      case 'E':
+        if (atol(optarg) <= 0) {
+          usage();
+          exit(1);
+        }
+        echo_timeout_ns = atol(optarg) * 1000000ULL;
+        break;
+      case 'U':
+        if (summary_parse_arg(optarg, summary_addr, sizeof(summary_addr), &summary_secs)) {
+          usage();
+          exit(1);
+        }
+        break;
+      default:
+        usage();
+        exit(1);
+    }
+  }
+
+  if (argc - optind != 2) {
     usage();  
     exit(1);
   }
+  dev1 = argv[optind];
+  dev2 = argv[optind + 1];
+
+  if (offline && nshards > 1) {
+    fprintf(stderr, "Warning: ignoring -j when reading files\n");
+    nshards = 1;
+  }
+  if (offline && governed) {
+    fprintf(stderr, "Warning: ignoring -G when reading files\n");
+    governed = 0;
+  }
+  if (offline && adapter_clock) {
+    fprintf(stderr, "Warning: ignoring -A when reading files\n");
+    adapter_clock = 0;
+  }
+  if (adapter_clock && governed) {
+    fprintf(stderr, "-G holds capture time stamps against the system clock, it can't be used with -A\n");
+    exit(1);
+  }
+  if (ignore_addrs && nshards > 1 && fanout_type == PACKET_FANOUT_HASH) {
+    fprintf(stderr, "Warning: NAT changes the flow hash, "
+                    "fanout may split packets across shards\n");
+  }
 
   signal(SIGINT, do_exit);
+  signal(SIGHUP, do_reload);
+
+  if (targets_file && filter_set_load(&filter_targets, targets_file) < 0) {
+    exit(1);
+  }
 
-  echo_event_table_init();
+  // One shard per worker pair, caps laid out as dev1 workers then dev2 workers
+  ncaps = 2 * nshards;
+  shards = (struct shard *)malloc(sizeof(struct shard) * nshards);
+  caps = (struct dev_cap *)malloc(sizeof(struct dev_cap) * ncaps);
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * ncaps);
+  if (shards == NULL || caps == NULL || threads == NULL) {
+    fprintf(stderr, "Failed to allocate %d capture workers\n", nshards);
+    exit(1);
+  }
 
-  cap1.hdl = get_capture(argv[1]);
-  cap1.dev_name = argv[1];
-  cap1.dev_id = 0;
-  cap2.hdl = get_capture(argv[2]);
-  cap2.dev_name = argv[2];
-  cap2.dev_id = 1;
+  if (mode == MATCH_MODE_FLOW) {
+    filter_base = "ip and (tcp or udp)";
+    sample_key = "ip[4:2]";
+    filter_vlan = 1;
+    caplen = FLOW_CAPLEN;
+  } else {
+    filter_base = "icmp[icmptype] == icmp-echo or icmp[icmptype] == icmp-echoreply"
+                  " or icmp6[0] == 128 or icmp6[0] == 129";
+    sample_key = "icmp[6:2]";
+    sample_key6 = "icmp6[6:2]";
+    filter_vlan = 1;
+    filter_ip6_ext = 1;
+    caplen = ICMP_CAPLEN;
+  }
 
-  fprintf(stdout, "Starting capture between %s and %s\n",
-      argv[1], argv[2]);
+  for (i = 0; i < nshards; i++) {
+    if (mode == MATCH_MODE_FLOW) {
+      flow_table_init(&shards[i].flow_table, ignore_addrs);
+      shards[i].flow_table.window_ns = echo_timeout_ns;
+    } else {
+      echo_event_table_init(&shards[i]);
+    }
+  }
 
-  pthread_create(&cap1_thread, NULL, follow_capture, (void *)&cap1);
-  pthread_create(&cap2_thread, NULL, follow_capture, (void *)&cap2);
+  if (capture_filter_text(filter_base, filter_text, sizeof(filter_text))) {
+    fprintf(stderr, "Filter for %d targets is too long\n", filter_targets.ntargets);
+    exit(1);
+  }
 
-  while (running) {
-    sleep(1);
+  // Latencies subtract dev1's time stamps from dev2's, so both have to come
+  // from one clock
+  if (!offline) {
+    devs[0] = dev1;
+    devs[1] = dev2;
+    tstamp_type = negotiate_tstamp_type(devs, 2, adapter_clock);
+    if (tstamp_type < 0) {
+      fprintf(stderr, "Failed to agree on a time stamp clock for %s and %s\n", dev1, dev2);
+      exit(1);
+    }
   }
 
+  for (i = 0; i < ncaps; i++) {
+    caps[i].dev_id = i / nshards;
+    caps[i].dev_name = caps[i].dev_id == 0 ? dev1 : dev2;
+    caps[i].worker = i % nshards;
+    caps[i].shard = &shards[caps[i].worker];
+    caps[i].filter_gen = filter_gen;
+    caps[i].handler = mode == MATCH_MODE_FLOW ? flow_pcap_callback : pcap_callback;
+    caps[i].batch = NULL;
+    if (mode == MATCH_MODE_ICMP) {
+      caps[i].batch = decode_batch_new();
+      if (caps[i].batch == NULL) {
+        fprintf(stderr, "Failed to allocate decode batches\n");
+        exit(1);
+      }
+    }
+    caps[i].offline = offline;
+    caps[i].cpu_ns = 0;
+    memset(&caps[i].stats, 0, sizeof(caps[i].stats));
+    caps[i].agg = agg_shard_new();
+    if (caps[i].agg == NULL) {
+      fprintf(stderr, "Failed to allocate aggregation shards\n");
+      exit(1);
+    }
+
+    if (offline) {
+      caps[i].hdl = get_offline_capture(caps[i].dev_name, filter_text);
+    } else {
+      caps[i].hdl = get_capture_filter(caps[i].dev_name, filter_text, caplen, tstamp_type);
+    }
+    if (caps[i].hdl == NULL) {
+      fprintf(stderr, "Failed to open captures\n");
+      exit(1);
+    }
+    caps[i].nano = pcap_get_tstamp_precision(caps[i].hdl) == PCAP_TSTAMP_PRECISION_NANO;
 
-  fprintf(stdout, "Cleaning up. . .\n");
+    // Fanout groups are per device: the first worker on each device makes
+    // one under a kernel-picked id, the rest join it
+    if (nshards > 1) {
+      if (join_capture_fanout(caps[i].hdl, &fanout_group[caps[i].dev_id], fanout_type)) {
+        exit(1);
+      }
+    }
+  }
+  if (caps[0].nano != caps[ncaps - 1].nano) {
+    if (!offline) {
+      fprintf(stderr, "%s and %s differ in time stamp precision\n", dev1, dev2);
+      exit(1);
+    }
+    fprintf(stderr, "Warning: %s and %s differ in time stamp precision\n", dev1, dev2);
+  }
 
-  pcap_breakloop(cap1.hdl);
-  pcap_breakloop(cap2.hdl);
-  pthread_kill(cap1_thread, SIGINT);
-  pthread_kill(cap2_thread, SIGINT);
-  pthread_join(cap1_thread, NULL);
-  pthread_join(cap2_thread, NULL);
+  if (out_file) {
+    out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      fprintf(stderr, "Failed to open output file '%s'\n", out_file);
+      exit(1);
+    }
+  }
+  if (writer_start(&writer, out_fd, out_format)) {
+    exit(1);
+  }
+  // One stream per capture, each only appended to by its own thread
+  for (i = 0; i < ncaps; i++) {
+    caps[i].out = writer_stream_open(&writer, WRITER_STREAM_RECORDS);
+    if (caps[i].out == NULL) {
+      fprintf(stderr, "Failed to open result stream\n");
+      exit(1);
+    }
+  }
+
+  if (metrics_addr && metrics_start(&metrics, metrics_addr, collect_metrics, caps)) {
+    exit(1);
+  }
+  if (summary_secs && summary_agent_start(&summary, summary_addr, NULL, summary_secs, build_summary_view, caps)) {
+    exit(1);
+  }
+
+  if (offline) {
+    fprintf(stdout, "Reading %s matches between %s and %s\n",
+        mode == MATCH_MODE_FLOW ? "flow" : "icmp", dev1, dev2);
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    npkts = follow_offline(caps, 2);
+    clock_gettime(CLOCK_MONOTONIC, &elapsed);
+    tssub(&elapsed, &start);
+
+    secs = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.0;
+    fprintf(stdout, "Processed %llu packets in %f s (%.0f packets/s)\n",
+        npkts, secs, secs > 0 ? npkts / secs : 0.0);
+  } else {
+    fprintf(stdout, "Starting %s capture between %s and %s with %d worker%s each\n",
+        mode == MATCH_MODE_FLOW ? "flow" : "icmp", dev1, dev2,
+        nshards, nshards > 1 ? "s" : "");
+    fflush(stdout);
+
+    for (i = 0; i < ncaps; i++) {
+      pthread_create(&threads[i], NULL, follow_capture, (void *)&caps[i]);
+    }
+
+    if (control_path && control_start(&control, control_path, handle_command, caps)) {
+      control_path = NULL;
+      running = 0;
+    }
+
+    last_report = last_gov = stage_now();
+    while (running) {
+      sleep(1);
+      now = stage_now();
+      if (governed) {
+        govern_sampling(caps, ncaps, threads, now - last_gov);
+        last_gov = now;
+      }
+      if (stage_secs && now - last_report >= stage_secs * 1000000000ULL) {
+        stages = (struct stage_set *)calloc(1, sizeof(struct stage_set));
+        if (stages != NULL && !build_stages(caps, ncaps, stages)) {
+          stage_report(stderr, stage_names, NSTAGES, stages, stage_items, stage_busy,
+                       now - last_report);
+          fprintf(stderr, "output queued %llu bytes, dropped %llu\n",
+                  writer_queued(&writer), writer_dropped(&writer));
+        }
+        free(stages);
+        last_report = now;
+      }
+      if (reload && targets_file) {
+        reload = 0;
+        pthread_mutex_lock(&targets_lock);
+        if (filter_set_load(&filter_targets, targets_file) >= 0) {
+          publish_capture_filter(filter_base, caps, ncaps);
+        }
+        pthread_mutex_unlock(&targets_lock);
+      }
+    }
+
+
+    fprintf(stdout, "Cleaning up. . .\n");
+
+    if (control_path) {
+      control_stop(&control);
+    }
+
+    for (i = 0; i < ncaps; i++) {
+      pcap_breakloop(caps[i].hdl);
+      pthread_kill(threads[i], SIGINT);
+    }
+    for (i = 0; i < ncaps; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  // Sends what came in since the last summary
+  if (summary_secs) {
+    summary_agent_stop(&summary);
+  }
+  if (metrics_addr) {
+    metrics_stop(&metrics);
+  }
+
+  for (i = 0; i < ncaps; i++) {
+    release_capture(caps[i].hdl);
+  }
+
+  // All producers are done, flush what's left
+  dropped = writer_stop(&writer);
+  if (out_fd != STDOUT_FILENO) {
+    close(out_fd);
+  }
+  if (dropped) {
+    fprintf(stderr, "Warning: dropped %llu results, output could not keep up\n", dropped);
+  }
+
+  // Merge per-shard results
+  for (i = 0; i < nshards; i++) {
+    if (mode == MATCH_MODE_FLOW) {
+      matched += shards[i].flow_table.matched;
+      evicted += shards[i].flow_table.evicted;
+      expired += shards[i].flow_table.expired;
+    } else {
+      matched += shards[i].echo_finished;
+      expired += shards[i].echo_expired;
+    }
+    if (nshards > 1) {
+      fprintf(stdout, "shard %d: matched %llu\n", i,
+          mode == MATCH_MODE_FLOW ? shards[i].flow_table.matched
+                                  : shards[i].echo_finished);
+    }
+  }
+  if (mode == MATCH_MODE_FLOW) {
+    fprintf(stdout, "Matched %llu flow packets, evicted %llu unmatched, %llu expired\n",
+        matched, evicted, expired);
+  } else {
+    fprintf(stdout, "Matched %llu echo events, %llu expired\n", matched, expired);
+  }
+
+  if (!build_addr_view(caps, ncaps, &view)) {
+    if (view.nentries) {
+      fprintf(stdout, "Per address latency (us):\n");
+    }
+    for (i = 0; i < view.nentries; i++) {
+      format_addr_stats(&view.entries[i], txt, sizeof(txt));
+      fprintf(stdout, "%s\n", txt);
+    }
+    agg_view_free(&view);
+  }
+  for (i = 0; i < ncaps; i++) {
+    agg_shard_free(caps[i].agg);
+    free(caps[i].batch);
+  }
 
-  release_capture(cap1.hdl);
-  release_capture(cap2.hdl);
+  free(threads);
+  free(caps);
+  free(shards);
 
   fprintf(stdout, "Done.\n");
 
@@ -0,0 +1,329 @@
+//
+// Event-time join of ftrace syscall events and pcap packets
+//
+// Both sources are read without blocking and their events are held in a
+// small reorder window. Events are only released once every source has
+// moved past them (the watermark), so they come out in one time-ordered
+// stream no matter which source happened to be read first. A source that
+// has gone quiet holds the watermark back for at most JOIN_MAX_LAG_USEC.
+//
+// Released events are joined as:
+//   enter sendto  ->  echo request (by time)
+//   echo request  ->  echo reply   (by icmp sequence number)
+//   echo reply    ->  exit recvmsg (by time)
+//
+// A missing event only spoils the one echo it belongs to; the next
+// sendto/request pair starts clean.
+//
+// Requires ftrace_common.c and libpcap_common.c to be included first.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define JOIN_QUEUE_SIZE 4096 // Must be a power of two
+#define JOIN_INFLIGHT_SIZE 1024
+#define JOIN_MAX_LAG_USEC 20000
+#define JOIN_LINE_BUFFER 0x4000
+
+enum join_source {
+  JOIN_SOURCE_TRACE,
+  JOIN_SOURCE_PCAP,
+  JOIN_NSOURCES
+};
+
+struct join_event {
+  unsigned long long ts; // usec on the system clock
+  int type;              // enum event_types or enum packet_type by source
+  int seq;
+};
+
+struct join_queue {
+  struct join_event events[JOIN_QUEUE_SIZE];
+  unsigned int head;
+  unsigned int tail;
+  unsigned long long last_ts;
+};
+
+struct join_echo {
+  int valid;
+  int seq;
+  unsigned long long enter_sendto;
+  unsigned long long request;
+  unsigned long long reply;
+};
+
+// A finished echo. Any part whose events were missed is -1.
+struct join_sample {
+  int seq;
+  long long send_usec; // enter sendto -> request on the wire
+  long long rtt_usec;  // request -> reply on the wire
+  long long recv_usec; // reply on the wire -> exit recvmsg
+};
+
+struct join_state {
+  struct join_queue queues[JOIN_NSOURCES];
+  struct join_echo inflight[JOIN_INFLIGHT_SIZE];
+
+  // Syscall events waiting for their packet and vice versa
+  unsigned long long enter_sendto;
+  struct join_echo *reply;
+
+  // Trace pipe reading
+  int trace_fd;
+  char line_buf[JOIN_LINE_BUFFER];
+  size_t line_len;
+  struct timeval trace_offset;
+
+  // Packets waiting to be decoded together, see join_pcap_flush
+  struct decode_batch pcap_batch;
+  int pcap_nano;
+  void (*emit)(const struct join_sample *);
+
+  unsigned long long released;
+  unsigned long long late;
+  unsigned long long overflow;
+  unsigned long long lost;
+};
+
+static inline unsigned long long join_tv_usec(const struct timeval *tv)
+{
+  return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+void join_init(struct join_state *st, int trace_fd, const struct timeval *trace_offset,
+               int pcap_nano, void (*emit)(const struct join_sample *))
+{
+  memset(st, 0, sizeof(*st));
+  st->trace_fd = trace_fd;
+  st->trace_offset = *trace_offset;
+  st->pcap_nano = pcap_nano;
+  st->emit = emit;
+  fcntl(trace_fd, F_SETFL, fcntl(trace_fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Feed one time-ordered event into the join
+static void join_handle(struct join_state *st, int src, const struct join_event *evt)
+{
+  struct join_echo *echo;
+  struct join_sample sample;
+
+  if (src == JOIN_SOURCE_TRACE) {
+    switch (evt->type) {
+      case EVENT_TYPE_ENTER_SENDTO:
+        st->enter_sendto = evt->ts;
+        break;
+      case EVENT_TYPE_EXIT_RECVMSG:
+        // ping polls recvmsg, so only the first exit after a reply counts
+        if (st->reply == NULL) {
+          break;
+        }
+        echo = st->reply;
+        sample.seq = echo->seq;
+        sample.send_usec = echo->enter_sendto ? (long long)(echo->request - echo->enter_sendto) : -1;
+        sample.rtt_usec = echo->request ? (long long)(echo->reply - echo->request) : -1;
+        sample.recv_usec = evt->ts - echo->reply;
+        st->emit(&sample);
+        echo->valid = 0;
+        st->reply = NULL;
+        break;
+    }
+    return;
+  }
+
+  echo = &st->inflight[evt->seq % JOIN_INFLIGHT_SIZE];
+  switch (evt->type) {
+    case PACKET_TYPE_ECHO_REQUEST:
+      if (echo->valid) {
+        st->lost++;
+      }
+      echo->valid = 1;
+      echo->seq = evt->seq;
+      echo->enter_sendto = st->enter_sendto;
+      echo->request = evt->ts;
+      echo->reply = 0;
+      st->enter_sendto = 0;
+      break;
+    case PACKET_TYPE_ECHO_REPLY:
+      if (st->reply != NULL) {
+        // Previous reply never reached recvmsg
+        st->reply->valid = 0;
+        st->lost++;
+      }
+      if (!echo->valid || echo->seq != evt->seq) {
+        // Request was missed, still report the receive side
+        echo->valid = 1;
+        echo->seq = evt->seq;
+        echo->enter_sendto = 0;
+        echo->request = 0;
+      }
+      echo->reply = evt->ts;
+      st->reply = echo;
+      break;
+  }
+}
+
+// Pop the oldest queued event across sources if it is at or below the watermark
+// Returns nonzero if an event was released
+static int join_release_one(struct join_state *st, unsigned long long watermark)
+{
+  struct join_queue *q;
+  struct join_event *evt;
+  int best = -1;
+  int i;
+
+  for (i = 0; i < JOIN_NSOURCES; i++) {
+    q = &st->queues[i];
+    if (q->head == q->tail) {
+      continue;
+    }
+    if (best < 0
+     || q->events[q->head % JOIN_QUEUE_SIZE].ts
+      < st->queues[best].events[st->queues[best].head % JOIN_QUEUE_SIZE].ts) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    return 0;
+  }
+
+  q = &st->queues[best];
+  evt = &q->events[q->head % JOIN_QUEUE_SIZE];
+  if (evt->ts > watermark) {
+    return 0;
+  }
+  join_handle(st, best, evt);
+  q->head++;
+  st->released++;
+  return 1;
+}
+
+static void join_push(struct join_state *st, int src, const struct join_event *evt)
+{
+  struct join_queue *q = &st->queues[src];
+
+  if (evt->ts < q->last_ts) {
+    st->late++;
+  } else {
+    q->last_ts = evt->ts;
+  }
+
+  if (q->tail - q->head == JOIN_QUEUE_SIZE) {
+    // Window is full: force out the oldest event rather than stall the reader
+    st->overflow++;
+    join_release_one(st, ~0ULL);
+  }
+  q->events[q->tail % JOIN_QUEUE_SIZE] = *evt;
+  q->tail++;
+}
+
+// Read whatever the trace pipe has ready and queue the interesting events
+// Returns 0 if the pipe is still usable, nonzero on EOF or error
+int join_read_trace(struct join_state *st)
+{
+  struct trace_event tevt;
+  struct join_event evt;
+  ssize_t nbytes;
+  char *line;
+  char *nl;
+
+  nbytes = read(st->trace_fd, st->line_buf + st->line_len,
+                sizeof(st->line_buf) - st->line_len - 1);
+  if (nbytes < 0) {
+    return errno != EAGAIN && errno != EINTR;
+  }
+  if (nbytes == 0) {
+    return 1;
+  }
+  st->line_len += nbytes;
+  st->line_buf[st->line_len] = '\0';
+
+  line = st->line_buf;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    parse_trace_event(line, &tevt);
+    if (tevt.type == EVENT_TYPE_ENTER_SENDTO || tevt.type == EVENT_TYPE_EXIT_RECVMSG) {
+      tvadd(&tevt.ts, &st->trace_offset);
+      evt.ts = join_tv_usec(&tevt.ts);
+      evt.type = tevt.type;
+      evt.seq = 0;
+      join_push(st, JOIN_SOURCE_TRACE, &evt);
+    }
+    line = nl + 1;
+  }
+
+  // Keep any partial line for next time; drop a line too long to ever finish
+  st->line_len -= line - st->line_buf;
+  if (st->line_len == sizeof(st->line_buf) - 1) {
+    st->line_len = 0;
+  }
+  memmove(st->line_buf, line, st->line_len);
+  return 0;
+}
+
+// Decode the packets batched by join_pcap_callback and queue their events
+void join_pcap_flush(struct join_state *st)
+{
+  struct decode_batch *b = &st->pcap_batch;
+  struct packet_event pevt;
+  struct join_event evt;
+  int i;
+
+  decode_batch_run(b);
+  for (i = 0; i < b->n; i++) {
+    if (!decode_packet_event(b, i, &pevt)) {
+      continue;
+    }
+    evt.ts = join_tv_usec(&pevt.ts);
+    evt.type = pevt.type;
+    evt.seq = pevt.seq;
+    join_push(st, JOIN_SOURCE_PCAP, &evt);
+  }
+  b->n = 0;
+}
+
+// pcap_dispatch callback: user is the join_state
+// Packets are only batched here, call join_pcap_flush once pcap_dispatch returns
+void join_pcap_callback(u_char *user, const struct pcap_pkthdr *hdr, const u_char *data)
+{
+  struct join_state *st = (struct join_state *)user;
+
+  if (decode_batch_add(&st->pcap_batch, hdr, data, st->pcap_nano)) {
+    join_pcap_flush(st);
+  }
+}
+
+// Release everything every source has moved past.
+// A source that has been quiet is assumed to have nothing older than
+// JOIN_MAX_LAG_USEC ago, so one idle source cannot stall the other.
+void join_advance(struct join_state *st)
+{
+  struct timeval now;
+  unsigned long long floor;
+  unsigned long long watermark = ~0ULL;
+  unsigned long long wm;
+  int i;
+
+  gettimeofday(&now, NULL);
+  floor = join_tv_usec(&now) - JOIN_MAX_LAG_USEC;
+
+  for (i = 0; i < JOIN_NSOURCES; i++) {
+    wm = st->queues[i].last_ts > floor ? st->queues[i].last_ts : floor;
+    if (wm < watermark) {
+      watermark = wm;
+    }
+  }
+
+  while (join_release_one(st, watermark)) {
+  }
+}
+
+// Release everything left, e.g. at exit
+void join_flush(struct join_state *st)
+{
+  join_pcap_flush(st);
+  while (join_release_one(st, ~0ULL)) {
+  }
+}
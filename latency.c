@@ -1,19 +1,19 @@
 //
-// First stab at latencies using some absolutely simple heuristics
+// Latencies of ping's echo requests split into send, wire and receive parts
 //
-// Basically a state machine with the following states:
-//   1) Read ftraces for sendto
-//   2) Read echo request packet
-//   3) Read ftraces for recvmsg
-//   4) Read echo reply packet
-//   5) Ignore anything until next sento ftrace
+// Syscall events from ftrace and echo packets from libpcap are read
+// as they become ready (poll on both) and joined by time stamp and icmp
+// sequence number in join_common.c. Neither source waits on the other,
+// and a lost event only costs the sample it belonged to.
 //
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include "time_common.h"
 #include "ftrace_common.c"
 #include "libpcap_common.c"
+#include "join_common.c"
 
 
 static volatile int exiting = 0;
@@ -30,24 +30,24 @@ void do_exit()
   pcap_breakloop(pcap_hdl);
 }
 
+void print_sample(const struct join_sample *sample)
+{
+  printf("seq: %d, send: %lld us, rtt: %lld us, recv: %lld us\n",
+      sample->seq, sample->send_usec, sample->rtt_usec, sample->recv_usec);
+}
 
 int main(int argc, char *argv[])
 {
-  struct packet_event pcap_evt;
-  int res;
+  char err[PCAP_ERRBUF_SIZE];
   const char *ftrace_tracedir = "/sys/kernel/debug/tracing";
   FILE *ftrace_pipe;
-  struct trace_event ftrace_evt;
+  static struct join_state join;
+  struct pollfd fds[2];
 
   struct timeval ftrace_offset;
   ftrace_offset.tv_sec = 0;
   ftrace_offset.tv_usec = 0;
 
-  struct timeval ping_send;
-  struct timeval ping_recv;
-  struct timeval iface_send;
-  struct timeval iface_recv;
-
   if (argc != 3) {
     usage();
     exit(1);
@@ -61,6 +61,11 @@ int main(int argc, char *argv[])
     printf("Failed to open pcap handle\n");
     exit(1);
   }
+  if (pcap_setnonblock(pcap_hdl, 1, err)) {
+    printf("Failed to make pcap handle non-blocking: %s\n", err);
+    release_capture(pcap_hdl);
+    exit(1);
+  }
 
   // Get ftrace offset
   get_ftrace_ts_offset(ftrace_tracedir, &ftrace_offset);
@@ -75,73 +80,37 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
+  join_init(&join, fileno(ftrace_pipe), &ftrace_offset,
+      pcap_get_tstamp_precision(pcap_hdl) == PCAP_TSTAMP_PRECISION_NANO,
+      print_sample);
+
+  fds[0].fd = fileno(ftrace_pipe);
+  fds[0].events = POLLIN;
+  fds[1].fd = pcap_get_selectable_fd(pcap_hdl);
+  fds[1].events = POLLIN;
+
   // main loop
   while (!exiting) {
-    // Read ftrace events until enter sendto 
-    do {
-      get_trace_event(ftrace_pipe, &ftrace_evt);
-    } while (ftrace_evt.type != EVENT_TYPE_ENTER_SENDTO);
-    tvadd(&ftrace_evt.ts, &ftrace_offset);
-    printf("[%10lu.%06lu] enter sendto\n",
-            ftrace_evt.ts.tv_sec,
-            ftrace_evt.ts.tv_usec);
-
-    // Read ftrace events until exit sendto
-    do {
-      get_trace_event(ftrace_pipe, &ftrace_evt);
-    } while (ftrace_evt.type != EVENT_TYPE_EXIT_SENDTO);
-    tvadd(&ftrace_evt.ts, &ftrace_offset);
-    printf("[%10lu.%06lu] exit sendto\n",
-            ftrace_evt.ts.tv_sec,
-            ftrace_evt.ts.tv_usec);
-
-    // Read packets until echo request
-    do {
-      res = get_packet_event(pcap_hdl, &pcap_evt);
-    } while (pcap_evt.type != PACKET_TYPE_ECHO_REQUEST);
-    printf("[%10lu.%06lu] echo request\n",
-            pcap_evt.ts.tv_sec,
-            pcap_evt.ts.tv_usec);
-
-    // Copy interface send time
-    iface_send = pcap_evt.ts;
-    
-
-    // Read ftrace events until enter recvmsg
-    do {
-      get_trace_event(ftrace_pipe, &ftrace_evt);
-    } while (ftrace_evt.type != EVENT_TYPE_ENTER_RECVMSG);
-    tvadd(&ftrace_evt.ts, &ftrace_offset);
-    printf("[%10lu.%06lu] enter recvmsg\n",
-            ftrace_evt.ts.tv_sec,
-            ftrace_evt.ts.tv_usec);
-
-    // Read ftrace events until exit recvmsg
-    do {
-      get_trace_event(ftrace_pipe, &ftrace_evt);
-    } while (ftrace_evt.type != EVENT_TYPE_EXIT_RECVMSG);
-    tvadd(&ftrace_evt.ts, &ftrace_offset);
-    printf("[%10lu.%06lu] exit recvmsg\n",
-            ftrace_evt.ts.tv_sec,
-            ftrace_evt.ts.tv_usec);
-
-    // Read packets until echo reply
-    do {
-      res = get_packet_event(pcap_hdl, &pcap_evt);
-    } while (pcap_evt.type != PACKET_TYPE_ECHO_REPLY);
-    printf("[%10lu.%06lu] echo reply\n",
-            pcap_evt.ts.tv_sec,
-            pcap_evt.ts.tv_usec);
-
-    // Copy interface receive time
-    iface_recv = pcap_evt.ts;
-    
-    // Report actual RTT
-    tvsub(&iface_recv, &iface_send);
-    printf("Actuall RTT: %lu.%06lu\n",
-            iface_recv.tv_sec,
-            iface_recv.tv_usec);
+    // Wake up at least every few ms so the watermark keeps moving
+    if (poll(fds, 2, JOIN_MAX_LAG_USEC / 1000) < 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      if (join_read_trace(&join)) {
+        printf("Trace pipe closed\n");
+        break;
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      pcap_dispatch(pcap_hdl, -1, join_pcap_callback, (u_char *)&join);
+      join_pcap_flush(&join);
+    }
+    join_advance(&join);
   }
+  join_flush(&join);
+
+  printf("Released %llu events (%llu late, %llu forced out), lost %llu echoes\n",
+      join.released, join.late, join.overflow, join.lost);
   
   // Clean up
   release_capture(pcap_hdl);
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
 #include <pcap/pcap.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
@@ -8,18 +10,146 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 
+#include "decode_common.c"
+
+#ifndef PACKET_FANOUT_FLAG_UNIQUEID
+#define PACKET_FANOUT_FLAG_UNIQUEID 0x2000
+#endif
+
 // #define DEBUG
 
-// Returns an active, properly setup capture handle
-pcap_t *get_capture(const char *dev)
+// Snap length through the icmp header, leaving room for two vlan tags and
+// ip options; IPv6 echoes fit with some room for extension headers
+#define ICMP_CAPLEN (sizeof(struct ether_header) + 8 + 60 + sizeof(struct icmp))
+
+// IPv6 whose next header is an extension header (hop-by-hop, routing,
+// fragment, destination options). The icmp6 primitive only looks at the
+// fixed header, so these are passed whole and the decoder follows the chain.
+#define IP6_EXT_FILTER "(ip6 and (ip6[6] == 0 or ip6[6] == 43 or ip6[6] == 44 or ip6[6] == 60))"
+
+// Echo traffic, untagged, single tagged or QinQ. Each vlan keyword shifts
+// the offsets after it, so the double tagged test nests inside the single one.
+#define ICMP_FILTER_L3 "icmp or icmp6 or " IP6_EXT_FILTER
+#define ICMP_FILTER ICMP_FILTER_L3 " or (vlan and (" ICMP_FILTER_L3 " or (vlan and (" ICMP_FILTER_L3 "))))"
+
+// Time stamp types in order of preference, most precise first.
+// Latency is the difference of time stamps taken on different devices and
+// is also held against the system clock, so every handle has to stamp from
+// the same clock domain: host clocks only, unless adapter clocks are asked
+// for. Unsynced adapter clocks are never used, two of them share no domain.
+static const int tstamp_host_prefs[] = {
+  PCAP_TSTAMP_HOST_HIPREC,
+  PCAP_TSTAMP_HOST,
+  PCAP_TSTAMP_HOST_LOWPREC
+};
+static const int tstamp_adapter_prefs[] = {
+  PCAP_TSTAMP_ADAPTER,
+  PCAP_TSTAMP_HOST_HIPREC,
+  PCAP_TSTAMP_HOST,
+  PCAP_TSTAMP_HOST_LOWPREC
+};
+
+// Bit i set if the device supports prefs[i]
+// Returns -1 if the device can't be opened or listed
+static int tstamp_type_mask(const char *dev, const int *prefs, int nprefs)
 {
   char err[PCAP_ERRBUF_SIZE];
   pcap_t *hdl;
-  const char filt_txt[] = "icmp";
+  int *types;
+  int ntypes;
+  int mask = 0;
+  int i, j;
+
+  hdl = pcap_create(dev, err);
+  if (hdl == NULL) {
+    fprintf(stderr, "pcap_create failed for device %s with message: %s\n", dev, err);
+    return -1;
+  }
+  ntypes = pcap_list_tstamp_types(hdl, &types);
+  if (ntypes == PCAP_ERROR) {
+    fprintf(stderr, "Failed to list time stamp types of %s: %s\n", dev, pcap_geterr(hdl));
+    pcap_close(hdl);
+    return -1;
+  }
+  for (i = 0; i < nprefs; i++) {
+    // A device that can't set its clock stamps with the host's
+    if (ntypes == 0 && prefs[i] == PCAP_TSTAMP_HOST) {
+      mask |= 1 << i;
+    }
+    for (j = 0; j < ntypes; j++) {
+      if (types[j] == prefs[i]) {
+        mask |= 1 << i;
+      }
+    }
+  }
+  if (ntypes > 0) {
+    pcap_free_tstamp_types(types);
+  }
+  pcap_close(hdl);
+  return mask;
+}
+
+// Pick the most precise time stamp type that every device supports,
+// PCAP_TSTAMP_ADAPTER (synced to the system clock) only if adapter is set
+// Returns -1 if the devices have no type in common
+int negotiate_tstamp_type(const char *const *devs, int ndevs, int adapter)
+{
+  const int *prefs = adapter ? tstamp_adapter_prefs : tstamp_host_prefs;
+  int nprefs = adapter ? (int)(sizeof(tstamp_adapter_prefs) / sizeof(int))
+                       : (int)(sizeof(tstamp_host_prefs) / sizeof(int));
+  int common = (1 << nprefs) - 1;
+  int mask;
+  int i;
+
+  for (i = 0; i < ndevs; i++) {
+    mask = tstamp_type_mask(devs[i], prefs, nprefs);
+    if (mask < 0) {
+      return -1;
+    }
+    common &= mask;
+  }
+  for (i = 0; i < nprefs; i++) {
+    if (common & (1 << i)) {
+      return prefs[i];
+    }
+  }
+  fprintf(stderr, "No %stime stamp type is supported by every device\n", adapter ? "" : "host ");
+  return -1;
+}
+
+// Compile and install a filter on the handle
+// Returns 0 on success, nonzero on error
+int set_capture_filter(pcap_t *hdl, const char *filt_txt)
+{
   struct bpf_program filt_prg;
+
+  // Compile the filter
+  if (pcap_compile(hdl, &filt_prg, filt_txt, 0, PCAP_NETMASK_UNKNOWN)) {
+    fprintf(stderr, "pcap_compile failed for program %s with message: %s\n", filt_txt, pcap_geterr(hdl));
+    return -1;
+  } 
+
+  // Set the filter
+  if (pcap_setfilter(hdl, &filt_prg)) {
+    fprintf(stderr, "pcap_setfilter failed with message: %s\n", pcap_geterr(hdl));
+    pcap_freecode(&filt_prg);
+    return -1;
+  }
+
+  // Free the filter
+  pcap_freecode(&filt_prg);
+
+  return 0;
+}
+
+// Returns an active capture handle using the given filter and snap length,
+// time stamped with tstamp_type (see negotiate_tstamp_type)
+pcap_t *get_capture_filter(const char *dev, const char *filt_txt, int caplen, int tstamp_type)
+{
+  char err[PCAP_ERRBUF_SIZE];
+  pcap_t *hdl;
   int res;
   int lnk_type;
-  int caplen = sizeof(struct ether_header) + sizeof(struct ip) + sizeof(struct icmp);
   int timeout_ms = 1000;
 
   // Create the handle
@@ -29,9 +159,16 @@ pcap_t *get_capture(const char *dev)
     return NULL;
   }
 
-  // Set time stamp type
-  pcap_set_tstamp_type(hdl, PCAP_TSTAMP_HOST_LOWPREC);
-  // Set snap length to only capture through icmp header
+  // Set the time stamp type all devices agreed on; stamping on any other
+  // clock would put this device in a domain of its own
+  if (pcap_set_tstamp_type(hdl, tstamp_type)) {
+    fprintf(stderr, "Device %s can't time stamp with %s\n", dev, pcap_tstamp_type_val_to_name(tstamp_type));
+    pcap_close(hdl);
+    return NULL;
+  }
+  // Ask for nanoseconds; we fall back to micro if libpcap refuses
+  pcap_set_tstamp_precision(hdl, PCAP_TSTAMP_PRECISION_NANO);
+  // Set snap length to only capture the headers we care about
   pcap_set_snaplen(hdl, caplen);
   // Set timeout
   pcap_set_timeout(hdl, timeout_ms);
@@ -40,7 +177,8 @@ pcap_t *get_capture(const char *dev)
   res = pcap_activate(hdl);
   if (res) {
     fprintf(stderr, "pcap_activate returned nonzero message: %s\n", pcap_statustostr(res));
-    if (res < 0) {
+    if (res < 0 || res == PCAP_WARNING_TSTAMP_TYPE_NOTSUP) {
+      pcap_close(hdl);
       return NULL;
     }
   }
@@ -48,22 +186,14 @@ pcap_t *get_capture(const char *dev)
   fprintf(stdout, "Activated capture on %s with:\n", dev);
   fprintf(stdout, "  snaplen: %d\n", caplen);
   fprintf(stdout, "  timeout: %d ms\n", timeout_ms);
+  fprintf(stdout, "  tstamp type: %s\n", pcap_tstamp_type_val_to_name(tstamp_type));
+  fprintf(stdout, "  tstamp precision: %s\n",
+      pcap_get_tstamp_precision(hdl) == PCAP_TSTAMP_PRECISION_NANO ? "nano" : "micro");
 
-  // Compile the filter
-  if (pcap_compile(hdl, &filt_prg, filt_txt, 0, PCAP_NETMASK_UNKNOWN)) {
-    fprintf(stderr, "pcap_compile failed for program %s with message: %s\n", filt_txt, pcap_geterr(hdl));
-    return NULL;
-  } 
-
-  // Set the filter
-  if (pcap_setfilter(hdl, &filt_prg)) {
-    fprintf(stderr, "pcap_setfilter failed with message: %s\n", pcap_geterr(hdl));
+  if (set_capture_filter(hdl, filt_txt)) {
     return NULL;
   }
 
-  // Free the filter
-  pcap_freecode(&filt_prg);
-
   // Check the data link type
   lnk_type = pcap_datalink(hdl);
   if (lnk_type != DLT_EN10MB) {
@@ -73,32 +203,130 @@ pcap_t *get_capture(const char *dev)
   return hdl;
 }
 
+// Returns an active, properly setup capture handle for icmp
+pcap_t *get_capture(const char *dev)
+{
+  int tstamp_type = negotiate_tstamp_type(&dev, 1, 0);
+
+  if (tstamp_type < 0) {
+    return NULL;
+  }
+  return get_capture_filter(dev, ICMP_FILTER, ICMP_CAPLEN, tstamp_type);
+}
+
+// Join an activated live capture's packet socket to a PACKET_FANOUT group
+// so the kernel spreads packets over every socket in the group.
+// fanout_type is PACKET_FANOUT_HASH or PACKET_FANOUT_CPU.
+// If *group_id is negative a new group is made under an id the kernel picks
+// as unused, so no other process's group can be joined by accident, and
+// the id is stored in *group_id for the other sockets to join.
+// Returns 0 on success, nonzero on error
+int join_capture_fanout(pcap_t *hdl, int *group_id, int fanout_type)
+{
+  int fd = pcap_fileno(hdl);
+  socklen_t len = sizeof(int);
+  int arg;
+
+  arg = fanout_type << 16;
+  if (fanout_type == PACKET_FANOUT_HASH) {
+    // Reassemble fragments first so they hash with the rest of their flow
+    arg |= PACKET_FANOUT_FLAG_DEFRAG << 16;
+  }
+  if (*group_id < 0) {
+    arg |= PACKET_FANOUT_FLAG_UNIQUEID << 16;
+  } else {
+    arg |= *group_id & 0xffff;
+  }
+
+  if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg))) {
+    perror("setsockopt PACKET_FANOUT");
+    return -1;
+  }
+  if (*group_id < 0) {
+    if (getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, &len)) {
+      perror("getsockopt PACKET_FANOUT");
+      return -1;
+    }
+    *group_id = arg & 0xffff;
+  }
+  return 0;
+}
+
+// Returns a handle reading a saved pcap or pcapng file with the given filter
+// Time stamps are always delivered with nanosecond precision
+pcap_t *get_offline_capture(const char *file, const char *filt_txt)
+{
+  char err[PCAP_ERRBUF_SIZE];
+  pcap_t *hdl;
+
+  hdl = pcap_open_offline_with_tstamp_precision(file,
+      PCAP_TSTAMP_PRECISION_NANO, err);
+  if (hdl == NULL) {
+    fprintf(stderr, "pcap_open_offline failed for file %s with message: %s\n", file, err);
+    return NULL;
+  }
+
+  if (set_capture_filter(hdl, filt_txt)) {
+    pcap_close(hdl);
+    return NULL;
+  }
+
+  if (pcap_datalink(hdl) != DLT_EN10MB) {
+    fprintf(stderr, "Warning: non-ethernet data link in %s\n", file);
+  }
+
+  return hdl;
+}
+
 void release_capture(pcap_t *hdl)
 {
   pcap_close(hdl);
 }
 
 // Parse icmp packets and pack relevant info into a struct
-enum packet_type {
-  PACKET_TYPE_NONE,
-  PACKET_TYPE_ECHO_REQUEST,
-  PACKET_TYPE_ECHO_REPLY
-};
-
 struct packet_event {
   struct timeval   ts;
   enum packet_type type;
+  int id;  // icmp echo identifier
+  int seq; // icmp echo sequence number
 };
 
+// Fill evt from row i of a decoded batch, evt->ts in microseconds
+// Returns nonzero if the frame was an icmp echo event
+static inline int decode_packet_event(const struct decode_batch *b, int i, struct packet_event *evt)
+{
+  evt->ts.tv_sec = b->ts_ns[i] / 1000000000ULL;
+  evt->ts.tv_usec = b->ts_ns[i] % 1000000000ULL / 1000;
+  evt->type = (enum packet_type)b->type[i];
+  evt->id = b->id[i];
+  evt->seq = b->seq[i];
+#ifdef DEBUG
+  printf("l3: %X vlan: %u l4: %u icmp id: %d seq: %d type: %d\n",
+      b->l3[i], b->vlan[i], b->l4[i], evt->id, evt->seq, evt->type);
+#endif
+  return evt->type != PACKET_TYPE_NONE;
+}
+
+// Parse a captured frame into evt, decoding it as a batch of one in b
+// nano says whether the handle delivers nanosecond time stamps;
+// evt->ts is always kept in microseconds for callers
+// Returns nonzero if the frame was an icmp echo event
+int parse_packet_event(struct decode_batch *b, const struct pcap_pkthdr *pkt_hdr,
+                       const u_char *data, int nano, struct packet_event *evt)
+{
+  // Callers with many frames at hand fill the batch themselves
+  b->n = 0;
+  decode_batch_add(b, pkt_hdr, data, nano);
+  decode_batch_run(b);
+  return decode_packet_event(b, 0, evt);
+}
+
+// Read the next frame from hdl, decoding it in b
 // Returns nonzero if successfully captured icmp echo event
-int get_packet_event(pcap_t *hdl, struct packet_event *evt)
+int get_packet_event(pcap_t *hdl, struct decode_batch *b, struct packet_event *evt)
 {
   struct pcap_pkthdr pkt_hdr;
   const u_char *data;
-  struct ether_header *eth_hdr;
-  struct ip *ip_hdr;
-  struct icmp *icmp_hdr;
-  int i;
 
   evt->type = PACKET_TYPE_NONE;
 
@@ -109,72 +337,6 @@ int get_packet_event(pcap_t *hdl, struct packet_event *evt)
     return 0;
   }
 
-  // Copy off the time stamp
-  evt->ts = pkt_hdr.ts;
-
-  // Parse ethernet header
-  eth_hdr = (struct ether_header *)data;
-  // Fail if not IP packet
-  if (ntohs(eth_hdr->ether_type) != ETHERTYPE_IP) {
-    return 0;
-  }
-#ifdef DEBUG
-  printf("ethernet src: %s ", ether_ntoa((struct ether_addr *)&eth_hdr->ether_shost));
-  printf("dst: %s ", ether_ntoa((struct ether_addr *)&eth_hdr->ether_dhost));
-  printf("type: %X\n", ntohs(eth_hdr->ether_type));
-#endif
-
-  // Parse ip header
-  ip_hdr = (struct ip *)(data + sizeof(struct ether_header));
-  // Fail if not ICMP packet
-  if (ip_hdr->ip_p != 1) {
-    return 0;
-  }
-#ifdef DEBUG
-  printf("ip proto: %X ", ip_hdr->ip_p);
-  printf("src: %s ", inet_ntoa(ip_hdr->ip_src));
-  printf("dst: %s\n", inet_ntoa(ip_hdr->ip_dst));
-#endif
-
-  // Parse icmp header
-  icmp_hdr = (struct icmp *)(data + sizeof(struct ether_header) + sizeof(struct ip));
-#ifdef DEBUG
-  printf("icmp message type: %d\n", icmp_hdr->icmp_type);
-#endif
-  switch (icmp_hdr->icmp_type) {
-    case ICMP_ECHO:
-      evt->type = PACKET_TYPE_ECHO_REQUEST;
-      break;
-    case ICMP_ECHOREPLY:
-      evt->type = PACKET_TYPE_ECHO_REPLY;
-      break;
-    default:
-      // Fail if not echo request or reply
-      return 0;
-      break;
-  }
-
-  return 1;
-}
-
-// Read an icmp event from the capture and fill in the given header struct and time stamp
-// Returns nonzero on success, zero on failure
-int get_icmp_packet(pcap_t *hdl, struct icmp *icmp_hdr, struct timeval *tstamp)
-{
-  struct pcap_pkthdr pcap_hdr;
-  const u_char *data;
-  
-  // Pull packet off iface
-  data = pcap_next(hdl, &pcap_hdr);
-  if (data == NULL) {
-    return 0;
-  }
-
-  // Write the time stamp
-  *tstamp = pcap_hdr.ts;
-
-  // Assuming the icmp filter is on so we don't bother with other headers, just copy icmp data
-  memcpy(icmp_hdr, data + sizeof(struct ether_header) + sizeof(struct ip), sizeof(struct icmp));
-  
-  return 1;
+  return parse_packet_event(b, &pkt_hdr, data,
+      pcap_get_tstamp_precision(hdl) == PCAP_TSTAMP_PRECISION_NANO, evt);
 }
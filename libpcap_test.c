@@ -28,6 +28,7 @@ void do_exit()
 
 int main(int argc, char *argv[])
 {
+  struct decode_batch *batch;
   struct packet_event evt;
   int res;
 
@@ -39,9 +40,14 @@ int main(int argc, char *argv[])
   signal(SIGINT, do_exit);
 
   pcap_hdl = get_capture(argv[1]);  
+  batch = decode_batch_new();
+  if (batch == NULL) {
+    fprintf(stderr, "Failed to allocate decode batch\n");
+    exit(1);
+  }
    
   while (1) {
-    res = get_packet_event(pcap_hdl, &evt);
+    res = get_packet_event(pcap_hdl, batch, &evt);
     if (running) {
       if (res) {
         printf("[%lu.%06lu] ", evt.ts.tv_sec, evt.ts.tv_usec);
@@ -60,6 +66,7 @@ int main(int argc, char *argv[])
   }
 
   release_capture(pcap_hdl);
+  free(batch);
 
   printf("Done.\n");
 
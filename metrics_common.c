@@ -0,0 +1,305 @@
+//
+// Live metrics in Prometheus text format
+//
+// A dedicated thread listens on a TCP port or a Unix socket path and
+// answers every connection with one HTTP/1.0 response holding the current
+// metrics, so both Prometheus and `curl --unix-socket` can scrape it.
+//
+// The tool supplies a collect callback that runs on the metrics thread
+// and builds the response from snapshots of its per-thread counters and
+// histograms (see hist_common.h), never stopping the threads that own them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "hist_common.h"
+#include "stage_common.h"
+
+#define METRICS_BACKLOG 16
+#define METRICS_REQUEST_BUFFER 1024
+#define METRICS_POLL_MS 500
+#define METRICS_SEND_MS 2000 // a scraper this slow to take the response is given up on
+
+// Growable text buffer for one response
+struct metrics_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct metrics_server {
+  int fd;
+  char path[108]; // unix socket path to unlink at exit, if any
+  void (*collect)(struct metrics_buf *out, void *arg);
+  void *arg;
+  pthread_t thread;
+  volatile int running;
+};
+
+void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+  char *grown;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      return;
+    }
+    if (b->len + n < b->cap) {
+      b->len += n;
+      return;
+    }
+    grown = (char *)realloc(b->data, b->cap * 2 + n);
+    if (grown == NULL) {
+      return;
+    }
+    b->data = grown;
+    b->cap = b->cap * 2 + n;
+  }
+}
+
+// Start a metric family; samples for it must follow before the next family
+void metrics_family(struct metrics_buf *b, const char *name, const char *type, const char *help)
+{
+  metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One counter or gauge sample. labels is either "" or 'k="v",...'
+void metrics_value(struct metrics_buf *b, const char *name, const char *labels, unsigned long long value)
+{
+  if (labels[0]) {
+    metrics_printf(b, "%s{%s} %llu\n", name, labels, value);
+  } else {
+    metrics_printf(b, "%s %llu\n", name, value);
+  }
+}
+
+// All samples of one histogram, in seconds, with a bucket boundary at
+// every power of two from min_ns up
+void metrics_hist_from(struct metrics_buf *b, const char *name, const char *labels,
+                       const struct hist *h, uint64_t min_ns)
+{
+  const char *sep = labels[0] ? "," : "";
+  unsigned long long cum = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    cum += h->counts[i];
+    if (i % HIST_SUB == HIST_SUB - 1 && hist_bucket_upper(i) >= min_ns) {
+      metrics_printf(b, "%s_bucket{%s%sle=\"%.9f\"} %llu\n",
+          name, labels, sep, hist_bucket_upper(i) / 1e9, cum);
+    }
+  }
+  metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, cum);
+  if (labels[0]) {
+    metrics_printf(b, "%s_sum{%s} %.9f\n", name, labels, h->sum / 1e9);
+    metrics_printf(b, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+  } else {
+    metrics_printf(b, "%s_sum %.9f\n", name, h->sum / 1e9);
+    metrics_printf(b, "%s_count %llu\n", name, (unsigned long long)h->count);
+  }
+}
+
+// Buckets are exposed at powers of two from 1 us to keep scrapes small.
+void metrics_hist(struct metrics_buf *b, const char *name, const char *labels, const struct hist *h)
+{
+  metrics_hist_from(b, name, labels, h, 1000);
+}
+
+// Merged stage costs (see stage_common.h) as <prefix>_stage_* families
+// and <prefix>_event_lag_seconds
+void metrics_stages(struct metrics_buf *b, const char *prefix, const char *const *names,
+                    int nstages, const struct stage_set *set)
+{
+  char name[128];
+  char labels[64];
+  int i;
+
+  snprintf(name, sizeof(name), "%s_stage_items_total", prefix);
+  metrics_family(b, name, "counter", "Items through each pipeline stage");
+  for (i = 0; i < nstages; i++) {
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", names[i]);
+    metrics_value(b, name, labels, set->stages[i].items);
+  }
+
+  snprintf(name, sizeof(name), "%s_stage_seconds_total", prefix);
+  metrics_family(b, name, "counter", "Time spent in each stage, estimated from sampled items");
+  for (i = 0; i < nstages; i++) {
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", names[i]);
+    metrics_printf(b, "%s{%s} %.9f\n", name, labels, stage_busy_ns(&set->stages[i]) / 1e9);
+  }
+
+  // Per item costs are well under a microsecond, so start the buckets lower
+  snprintf(name, sizeof(name), "%s_stage_cost_seconds", prefix);
+  metrics_family(b, name, "histogram", "Time per sampled item in each stage");
+  for (i = 0; i < nstages; i++) {
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", names[i]);
+    metrics_hist_from(b, name, labels, &set->stages[i].cost, 16);
+  }
+
+  snprintf(name, sizeof(name), "%s_event_lag_seconds", prefix);
+  metrics_family(b, name, "histogram", "Time from kernel time stamp to handling, sampled events");
+  metrics_hist(b, name, "", &set->lag);
+}
+
+static void metrics_respond(struct metrics_server *ms, int conn)
+{
+  char req[METRICS_REQUEST_BUFFER];
+  char hdr[128];
+  struct metrics_buf b;
+  struct pollfd pfd;
+  struct timeval tv = { METRICS_SEND_MS / 1000, (METRICS_SEND_MS % 1000) * 1000 };
+  size_t off;
+  ssize_t n;
+  int hlen;
+
+  // Read (and ignore) the request; a scraper always sends one first
+  pfd.fd = conn;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 1000) > 0) {
+    n = read(conn, req, sizeof(req));
+    (void)n;
+  }
+
+  b.cap = 0x4000;
+  b.len = 0;
+  b.data = (char *)malloc(b.cap);
+  if (b.data == NULL) {
+    return;
+  }
+  b.data[0] = '\0';
+  ms->collect(&b, ms->arg);
+
+  // A scraper that times out and hangs up mustn't kill the tool with
+  // SIGPIPE, nor one that stops reading stall the metrics thread
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  hlen = snprintf(hdr, sizeof(hdr),
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %zu\r\n\r\n", b.len);
+  if (send(conn, hdr, hlen, MSG_NOSIGNAL) == hlen) {
+    for (off = 0; off < b.len; off += n) {
+      n = send(conn, b.data + off, b.len - off, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+    }
+  }
+  free(b.data);
+}
+
+static void *metrics_thread(void *arg)
+{
+  struct metrics_server *ms = (struct metrics_server *)arg;
+  struct pollfd pfd;
+  int conn;
+
+  pfd.fd = ms->fd;
+  pfd.events = POLLIN;
+  while (ms->running) {
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) {
+      continue;
+    }
+    conn = accept(ms->fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    metrics_respond(ms, conn);
+    close(conn);
+  }
+  return NULL;
+}
+
+// Start serving metrics on addr: a TCP port number, or a Unix socket path
+// Returns 0 on success, nonzero on error
+int metrics_start(struct metrics_server *ms, const char *addr,
+                  void (*collect)(struct metrics_buf *, void *), void *arg)
+{
+  struct sockaddr_in sin;
+  struct sockaddr_un sun;
+  char *end;
+  long port;
+  int one = 1;
+
+  ms->collect = collect;
+  ms->arg = arg;
+  ms->path[0] = '\0';
+
+  port = strtol(addr, &end, 10);
+  if (*end == '\0' && port > 0 && port < 65536) {
+    ms->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ms->fd < 0) {
+      perror("metrics socket");
+      return -1;
+    }
+    setsockopt(ms->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if (bind(ms->fd, (struct sockaddr *)&sin, sizeof(sin))) {
+      fprintf(stderr, "Failed to bind metrics port %ld: %s\n", port, strerror(errno));
+      close(ms->fd);
+      return -1;
+    }
+  } else {
+    if (strlen(addr) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "Metrics socket path too long: %s\n", addr);
+      return -1;
+    }
+    ms->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ms->fd < 0) {
+      perror("metrics socket");
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, addr);
+    unlink(addr);
+    if (bind(ms->fd, (struct sockaddr *)&sun, sizeof(sun))) {
+      fprintf(stderr, "Failed to bind metrics socket %s: %s\n", addr, strerror(errno));
+      close(ms->fd);
+      return -1;
+    }
+    strcpy(ms->path, addr);
+  }
+
+  if (listen(ms->fd, METRICS_BACKLOG)) {
+    perror("metrics listen");
+    close(ms->fd);
+    return -1;
+  }
+
+  ms->running = 1;
+  if (pthread_create(&ms->thread, NULL, metrics_thread, ms)) {
+    fprintf(stderr, "Failed to start metrics thread\n");
+    close(ms->fd);
+    return -1;
+  }
+  return 0;
+}
+
+void metrics_stop(struct metrics_server *ms)
+{
+  ms->running = 0;
+  pthread_join(ms->thread, NULL);
+  close(ms->fd);
+  if (ms->path[0]) {
+    unlink(ms->path);
+  }
+}
@@ -0,0 +1,230 @@
+#!/bin/bash
+
+#
+# Monitoring overhead on one Linux box, in network namespaces
+#
+# Builds a docker-like topology with no docker and no remote host:
+#
+#   ovh-ct (container)        ovh-host                      ovh-remote
+#   ovh-ct0 10.201.0.2 --- ovh-veth [ovh-br 10.201.0.1]
+#                                   ovh-up 10.201.1.1 --- ovh-rm0 10.201.1.2
+#
+# ovh-host forwards between the bridge and the uplink, as the docker host
+# does between docker0 and its NIC. Probes are paced icmp echos (./probe)
+# to 10.201.1.2, sent natively from ovh-host or from the container ovh-ct.
+#
+# Every monitor runs ROUNDS times alternating control (no monitor) and
+# monitored phases of COUNT probes each, so slow drift of the box affects
+# both phases alike. rtt_stats then reports the shift of the RTT mean and
+# percentiles with 95% confidence intervals, in summary.txt and summary.csv.
+#
+# Usage: sudo ./overhead.sh [monitor...]
+#   monitors: iface_diff latency ftrace_test (default all that are built)
+# Tunables from the environment: COUNT, INTERVAL, ROUNDS, SIZE, CASES
+#
+B="----------------"
+
+COUNT=${COUNT:-1000}
+INTERVAL=${INTERVAL:-0.01}
+ROUNDS=${ROUNDS:-3}
+SIZE=${SIZE:-56}
+CASES=${CASES:-"native container"}
+
+NS_CT="ovh-ct"
+NS_HOST="ovh-host"
+NS_REMOTE="ovh-remote"
+TARGET_IPV4="10.201.1.2"
+
+ROOT="$(cd "$(dirname "$0")" && pwd)"
+PROBE_CMD="$ROOT/probe"
+STATS_CMD="$ROOT/rtt_stats"
+# Time for a monitor to attach before the first probe
+ATTACH_DELAY=2
+# Time for a monitor to exit after SIGINT
+STOP_GRACE=5
+
+DATE_TAG=`date +%Y%m%d%H%M%S`
+META_DATA="Metadata"
+
+if [ ! -x "$PROBE_CMD" ] || [ ! -x "$STATS_CMD" ]; then
+  echo "Build probe and rtt_stats first: make probe rtt_stats"
+  exit 1
+fi
+
+#
+# Monitors: command to run in ovh-host, %PID% is replaced by the probe's pid
+#
+monitor_cmd() {
+  case $1 in
+    iface_diff)
+      echo "$ROOT/iface_diff ovh-br ovh-up"
+      ;;
+    latency)
+      echo "$ROOT/ftrace/latency $(pwd)/latency.conf"
+      ;;
+    ftrace_test)
+      echo "$ROOT/ftrace_test %PID%"
+      ;;
+  esac
+}
+
+monitor_bin() {
+  set -- $(monitor_cmd $1)
+  echo $1
+}
+
+if [ $# -gt 0 ]; then
+  MONITORS="$*"
+else
+  MONITORS=""
+  for m in iface_diff latency ftrace_test; do
+    [ -x "$(monitor_bin $m)" ] && MONITORS="$MONITORS $m"
+  done
+fi
+for m in $MONITORS; do
+  if [ -z "$(monitor_cmd $m)" ] || [ ! -x "$(monitor_bin $m)" ]; then
+    echo "Unknown or unbuilt monitor: $m"
+    exit 1
+  fi
+done
+if [ -z "$MONITORS" ]; then
+  echo "No monitors built"
+  exit 1
+fi
+
+#
+# Topology
+#
+teardown() {
+  ip netns del $NS_CT 2> /dev/null
+  ip netns del $NS_HOST 2> /dev/null
+  ip netns del $NS_REMOTE 2> /dev/null
+}
+
+setup() {
+  teardown
+  ip netns add $NS_CT || return 1
+  ip netns add $NS_HOST || return 1
+  ip netns add $NS_REMOTE || return 1
+
+  ip -n $NS_HOST link add ovh-br type bridge
+  ip -n $NS_HOST link add ovh-veth type veth peer name ovh-ct0 netns $NS_CT
+  ip -n $NS_HOST link set ovh-veth master ovh-br
+  ip -n $NS_HOST link add ovh-up type veth peer name ovh-rm0 netns $NS_REMOTE
+
+  ip -n $NS_HOST addr add 10.201.0.1/24 dev ovh-br
+  ip -n $NS_HOST addr add 10.201.1.1/24 dev ovh-up
+  ip -n $NS_CT addr add 10.201.0.2/24 dev ovh-ct0
+  ip -n $NS_REMOTE addr add $TARGET_IPV4/24 dev ovh-rm0
+
+  for l in lo ovh-br ovh-veth ovh-up; do ip -n $NS_HOST link set $l up; done
+  for l in lo ovh-ct0; do ip -n $NS_CT link set $l up; done
+  for l in lo ovh-rm0; do ip -n $NS_REMOTE link set $l up; done
+
+  ip -n $NS_CT route add default via 10.201.0.1
+  ip -n $NS_REMOTE route add 10.201.0.0/24 via 10.201.1.1
+  ip netns exec $NS_HOST sysctl -qw net.ipv4.ip_forward=1
+}
+
+# Path config for ftrace/latency, as ftrace/latency.conf for docker0/eno1d1
+write_latency_conf() {
+  cat > latency.conf << EOF
+in_outer_dev:ovh-up
+in_outer_func:netif_receive_skb
+in_inner_dev:ovh-br
+in_inner_func:net_dev_start_xmit
+out_inner_dev:ovh-ct0
+out_inner_func:net_dev_start_xmit
+out_outer_dev:ovh-up
+out_outer_func:net_dev_start_xmit
+EOF
+}
+
+# SIGINT, then SIGTERM if the monitor is still blocked in a read a while later
+stop_monitor() {
+  local i
+
+  kill -INT $1
+  for i in $(seq 1 $STOP_GRACE); do
+    kill -0 $1 2> /dev/null || break
+    sleep 1
+  done
+  if kill -0 $1 2> /dev/null; then
+    echo "  monitor $1 ignored SIGINT for ${STOP_GRACE}s, terminating"
+    kill -TERM $1
+  fi
+  wait $1
+}
+
+#
+# One phase: COUNT probes from case $1 into file $2, under monitor $3 if given
+#
+run_phase() {
+  local ns=$NS_HOST
+  local probe_pid
+  local monitor_pid
+  local cmd
+
+  [ $1 = container ] && ns=$NS_CT
+
+  ip netns exec $ns $PROBE_CMD -i $INTERVAL -c $COUNT -s $SIZE -d $ATTACH_DELAY $TARGET_IPV4 \
+    > $2 &
+  probe_pid=$!
+
+  if [ -n "$3" ]; then
+    cmd=$(monitor_cmd $3)
+    ip netns exec $NS_HOST ${cmd//%PID%/$probe_pid} > ${2%.ping}.$3 2> ${2%.ping}.$3.err &
+    monitor_pid=$!
+  fi
+
+  wait $probe_pid
+
+  if [ -n "$monitor_pid" ]; then
+    stop_monitor $monitor_pid
+  fi
+}
+
+trap teardown EXIT
+trap "exit 1" INT TERM
+
+echo $B Setting up namespaces $B
+setup || exit 1
+
+mkdir $DATE_TAG
+cd $DATE_TAG
+
+# Get some basic meta-data
+echo "uname -a -> $(uname -a)" >> $META_DATA
+echo "nproc -> $(nproc)" >> $META_DATA
+echo "COUNT=$COUNT INTERVAL=$INTERVAL ROUNDS=$ROUNDS SIZE=$SIZE" >> $META_DATA
+echo "CASES=$CASES MONITORS=$MONITORS" >> $META_DATA
+
+write_latency_conf
+
+for m in $MONITORS; do
+  for c in $CASES; do
+    for r in $(seq 1 $ROUNDS); do
+      echo $B $m $c round $r/$ROUNDS: control $B
+      run_phase $c ${m}_${c}_control_${r}.ping
+
+      echo $B $m $c round $r/$ROUNDS: monitored $B
+      run_phase $c ${m}_${c}_monitored_${r}.ping $m
+    done
+  done
+done
+
+#
+# Report
+#
+rm -f summary.txt summary.csv
+for m in $MONITORS; do
+  for c in $CASES; do
+    $STATS_CMD -l "$m $c" ${m}_${c}_control_*.ping -- ${m}_${c}_monitored_*.ping \
+      >> summary.txt
+    $STATS_CMD -f csv -l "$m $c" ${m}_${c}_control_*.ping -- ${m}_${c}_monitored_*.ping \
+      | { [ -s summary.csv ] && tail -n +2 || cat; } >> summary.csv
+  done
+done
+
+cat summary.txt
+echo Results in $(pwd)
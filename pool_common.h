@@ -0,0 +1,88 @@
+#ifndef POOL_COMMON_H
+#define POOL_COMMON_H
+//
+// Fixed-size object pools sized at startup
+//
+// A pool is one block of count objects allocated when the pool is set up,
+// so taking and returning objects never calls malloc and the memory a tool
+// can use for them is known up front. Objects are handed out zeroed, as
+// calloc would, and returned ones are recycled through a free list.
+//
+// The block is calloc'd, which for large pools maps zero pages on demand:
+// objects never taken cost no resident memory. Never-used objects are
+// handed out in order before any recycled one, so the free list is only
+// built from objects that were really used.
+//
+// A pool has no lock. It belongs to one thread, or its users serialize.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_ALIGN 64
+
+struct pool {
+  void *block; // as allocated
+  char *mem; // block aligned to POOL_ALIGN
+  size_t size; // object size, rounded up to POOL_ALIGN
+  unsigned int count;
+  unsigned int next; // objects below next have been handed out at least once
+  void *free; // recycled objects, linked through their first word
+  unsigned int used;
+  uint64_t exhausted; // pool_get calls that found no object
+};
+
+// Set up a pool of count objects of size bytes
+// Returns 0 on success, nonzero if out of memory
+static inline int pool_init(struct pool *p, size_t size, unsigned int count)
+{
+  memset(p, 0, sizeof(*p));
+  p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+  p->count = count;
+  p->block = calloc(1, (size_t)(count ? count : 1) * p->size + POOL_ALIGN);
+  if (p->block == NULL) {
+    return -1;
+  }
+  p->mem = (char *)(((uintptr_t)p->block + POOL_ALIGN - 1) & ~(uintptr_t)(POOL_ALIGN - 1));
+  return 0;
+}
+
+static inline void pool_destroy(struct pool *p)
+{
+  free(p->block);
+  p->block = NULL;
+  p->mem = NULL;
+}
+
+// A zeroed object, or NULL (counted) if all count are in use
+static inline void *pool_get(struct pool *p)
+{
+  void *obj;
+
+  if (p->free != NULL) {
+    obj = p->free;
+    p->free = *(void **)obj;
+    memset(obj, 0, p->size);
+  } else if (p->next < p->count) {
+    obj = p->mem + (size_t)p->next++ * p->size;
+  } else {
+    p->exhausted++;
+    return NULL;
+  }
+  p->used++;
+  return obj;
+}
+
+// Return an object taken from p, NULL is ignored
+static inline void pool_put(struct pool *p, void *obj)
+{
+  if (obj == NULL) {
+    return;
+  }
+  *(void **)obj = p->free;
+  p->free = obj;
+  p->used--;
+}
+
+#endif
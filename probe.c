@@ -0,0 +1,283 @@
+//
+// Paced icmp echo prober for overhead measurements
+//
+// Sends echo requests on a fixed schedule (open loop: a late reply never
+// delays the next request) and prints one line per reply in the layout of
+// iputils ping -D, so rtt_stats and anything that reads ping output can
+// read either. Replies are time stamped by the kernel (SO_TIMESTAMPNS);
+// requests just before sendto.
+//
+// Run it as root, e.g. inside a namespace: ip netns exec ns ./probe ...
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+
+#include "time_common.h"
+
+#define PROBE_MAX_SIZE 1472
+#define PROBE_SEQS 65536
+
+static volatile int running = 1;
+
+// Send time of every sequence number still in flight
+static struct timespec sent[PROBE_SEQS];
+
+void usage()
+{
+  fprintf(stdout, "Usage: probe [-i interval] [-c count] [-s size] [-d delay] [-W timeout] <target>\n");
+  fprintf(stdout, "  -i <s>   seconds between requests (default 1.0)\n");
+  fprintf(stdout, "  -c <n>   stop after n requests (default until SIGINT)\n");
+  fprintf(stdout, "  -s <n>   payload bytes (default 56)\n");
+  fprintf(stdout, "  -d <s>   seconds to wait before the first request, e.g. for a monitor to attach\n");
+  fprintf(stdout, "  -W <s>   seconds to wait for replies after the last request (default 1.0)\n");
+}
+
+void do_exit()
+{
+  running = 0;
+}
+
+static uint16_t icmp_cksum(const void *data, int len)
+{
+  const uint16_t *p = (const uint16_t *)data;
+  uint32_t sum = 0;
+
+  for (; len > 1; len -= 2) {
+    sum += *p++;
+  }
+  if (len) {
+    sum += *(const uint8_t *)p;
+  }
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += sum >> 16;
+  return ~sum;
+}
+
+static void ts_from_s(double s, struct timespec *ts)
+{
+  ts->tv_sec = (time_t)s;
+  ts->tv_nsec = (long)((s - ts->tv_sec) * 1e9);
+}
+
+// out = out + in
+static void tsadd(struct timespec *out, const struct timespec *in)
+{
+  out->tv_sec += in->tv_sec;
+  if ((out->tv_nsec += in->tv_nsec) >= 1000000000) {
+    ++out->tv_sec;
+    out->tv_nsec -= 1000000000;
+  }
+}
+
+// Milliseconds from now until ts on CLOCK_MONOTONIC, 0 if already past
+static int ms_until(const struct timespec *ts)
+{
+  struct timespec now;
+  struct timespec left = *ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!tsbefore(&now, ts)) {
+    return 0;
+  }
+  tssub(&left, &now);
+  // Round up so poll never returns just short of the deadline
+  return left.tv_sec * 1000 + (left.tv_nsec + 999999) / 1000000;
+}
+
+// Receive one reply and print it if it answers one of our requests
+// Returns 1 if a reply was printed, 0 otherwise
+static int recv_reply(int sock, uint16_t id, int size)
+{
+  unsigned char buf[sizeof(struct ip) + 60 + sizeof(struct icmp) + PROBE_MAX_SIZE];
+  char ctrl[CMSG_SPACE(sizeof(struct timespec))];
+  char addr[INET_ADDRSTRLEN];
+  struct sockaddr_in from;
+  struct iovec iov = { buf, sizeof(buf) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct timespec rx;
+  struct timespec rtt;
+  struct icmp *icmp_hdr;
+  struct ip *ip_hdr;
+  ssize_t n;
+  int hlen;
+  uint16_t seq;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &from;
+  msg.msg_namelen = sizeof(from);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  n = recvmsg(sock, &msg, MSG_DONTWAIT);
+  if (n < (ssize_t)sizeof(struct ip)) {
+    return 0;
+  }
+  clock_gettime(CLOCK_REALTIME, &rx);
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&rx, CMSG_DATA(cmsg), sizeof(rx));
+    }
+  }
+
+  ip_hdr = (struct ip *)buf;
+  hlen = ip_hdr->ip_hl * 4;
+  if (n < hlen + ICMP_MINLEN) {
+    return 0;
+  }
+  icmp_hdr = (struct icmp *)(buf + hlen);
+  if (icmp_hdr->icmp_type != ICMP_ECHOREPLY || ntohs(icmp_hdr->icmp_id) != id) {
+    return 0;
+  }
+  seq = ntohs(icmp_hdr->icmp_seq);
+  if (sent[seq].tv_sec == 0) {
+    return 0; // duplicate or never sent
+  }
+
+  rtt = rx;
+  tssub(&rtt, &sent[seq]);
+  sent[seq].tv_sec = 0;
+  inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr));
+  fprintf(stdout, "[%ld.%06ld] %d bytes from %s: icmp_seq=%u ttl=%d time=%.6f ms\n",
+      (long)rx.tv_sec, rx.tv_nsec / 1000, size + ICMP_MINLEN, addr, seq, ip_hdr->ip_ttl,
+      rtt.tv_sec * 1e3 + rtt.tv_nsec / 1e6);
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char pkt[ICMP_MINLEN + PROBE_MAX_SIZE];
+  struct icmp *icmp_hdr = (struct icmp *)pkt;
+  struct sockaddr_in dst;
+  struct pollfd pfd;
+  struct timespec interval;
+  struct timespec next;
+  struct timespec wait;
+  double interval_s = 1.0;
+  double delay_s = 0.0;
+  double timeout_s = 1.0;
+  long count = -1;
+  long ntx = 0;
+  long nrx = 0;
+  int size = 56;
+  int on = 1;
+  int sock;
+  int opt;
+  uint16_t id;
+
+  while ((opt = getopt(argc, argv, "i:c:s:d:W:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval_s = atof(optarg);
+        break;
+      case 'c':
+        count = atol(optarg);
+        break;
+      case 's':
+        size = atoi(optarg);
+        break;
+      case 'd':
+        delay_s = atof(optarg);
+        break;
+      case 'W':
+        timeout_s = atof(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || interval_s <= 0 || size < 0 || size > PROBE_MAX_SIZE) {
+    usage();
+    return 1;
+  }
+
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  if (inet_pton(AF_INET, argv[optind], &dst.sin_addr) != 1) {
+    fprintf(stderr, "Bad target address: %s\n", argv[optind]);
+    return 1;
+  }
+
+  sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on))) {
+    perror("setsockopt SO_TIMESTAMPNS");
+    return 1;
+  }
+
+  signal(SIGINT, do_exit);
+  signal(SIGTERM, do_exit);
+
+  id = getpid() & 0xffff;
+  memset(pkt, 0, sizeof(pkt));
+  icmp_hdr->icmp_type = ICMP_ECHO;
+  icmp_hdr->icmp_id = htons(id);
+  for (opt = 0; opt < size; opt++) {
+    pkt[ICMP_MINLEN + opt] = opt;
+  }
+
+  fprintf(stdout, "PROBE %s: %d data bytes every %.6f s\n", argv[optind], size, interval_s);
+  fflush(stdout);
+
+  ts_from_s(interval_s, &interval);
+  ts_from_s(delay_s, &wait);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  tsadd(&next, &wait);
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  while (running && (count < 0 || ntx < count)) {
+    // Take replies until the next request is due
+    while (running && poll(&pfd, 1, ms_until(&next)) > 0) {
+      nrx += recv_reply(sock, id, size);
+    }
+    if (!running) {
+      break;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    icmp_hdr->icmp_seq = htons(ntx & 0xffff);
+    icmp_hdr->icmp_cksum = 0;
+    icmp_hdr->icmp_cksum = icmp_cksum(pkt, ICMP_MINLEN + size);
+    clock_gettime(CLOCK_REALTIME, &sent[ntx & 0xffff]);
+    if (sendto(sock, pkt, ICMP_MINLEN + size, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+      if (errno != EINTR) {
+        perror("sendto");
+      }
+      sent[ntx & 0xffff].tv_sec = 0;
+    }
+    ntx++;
+    tsadd(&next, &interval);
+  }
+
+  // Late replies
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  ts_from_s(timeout_s, &wait);
+  tsadd(&next, &wait);
+  while (running && nrx < ntx && poll(&pfd, 1, ms_until(&next)) > 0) {
+    nrx += recv_reply(sock, id, size);
+  }
+
+  fprintf(stdout, "\n--- %s probe statistics ---\n", argv[optind]);
+  fprintf(stdout, "%ld packets transmitted, %ld received\n", ntx, nrx);
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,286 @@
+//
+// Compare RTT distributions of a control and a monitored run
+//
+// Reads the "time=<ms> ms" field of every reply line in ping (or probe)
+// output, one or more files per phase, and reports the mean and
+// percentiles of both phases with the shift (monitored - control) and its
+// 95% confidence interval:
+//   mean        Welch interval, normal approximation
+//   p50/p90/p99 percentile bootstrap, resampling both phases
+//
+// The bootstrap uses a fixed seed so the same inputs give the same report.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define RTT_BOOTSTRAP 1000
+#define RTT_LINE_SIZE 512
+
+enum rtt_format {
+  RTT_FORMAT_TEXT,
+  RTT_FORMAT_CSV
+};
+
+struct rtt_sample {
+  double *v; // RTTs in microseconds, sorted once read
+  size_t n;
+  size_t cap;
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+static const char *quantile_names[] = { "p50", "p90", "p99" };
+#define NQUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+void usage()
+{
+  fprintf(stdout, "Usage: rtt_stats [-f text|csv] [-l label] [-b resamples]\n");
+  fprintf(stdout, "                 <control file>... -- <monitored file>...\n");
+  fprintf(stdout, "  Files are ping/probe output, '-' for stdin\n");
+  fprintf(stdout, "  -l <label>  name for this comparison in the report\n");
+  fprintf(stdout, "  -b <n>      bootstrap resamples (default %d)\n", RTT_BOOTSTRAP);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int sample_push(struct rtt_sample *s, double v)
+{
+  double *nv;
+
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    nv = (double *)realloc(s->v, s->cap * sizeof(double));
+    if (nv == NULL) {
+      return -1;
+    }
+    s->v = nv;
+  }
+  s->v[s->n++] = v;
+  return 0;
+}
+
+// Add every reply time in a ping/probe output file
+// Returns 0 on success, nonzero on error
+int read_rtts(const char *path, struct rtt_sample *s)
+{
+  char line[RTT_LINE_SIZE];
+  FILE *fp;
+  char *t;
+  double ms;
+
+  fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (fp == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    t = strstr(line, "time=");
+    if (t == NULL || sscanf(t + 5, "%lf", &ms) != 1) {
+      continue;
+    }
+    if (sample_push(s, ms * 1000.0)) {
+      fprintf(stderr, "Out of memory reading '%s'\n", path);
+      return -1;
+    }
+  }
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  return 0;
+}
+
+// Quantile q of sorted values, interpolating between neighbours
+static double quantile(const double *v, size_t n, double q)
+{
+  double pos = q * (n - 1);
+  size_t i = (size_t)pos;
+
+  if (i + 1 >= n) {
+    return v[n - 1];
+  }
+  return v[i] + (pos - i) * (v[i + 1] - v[i]);
+}
+
+static void mean_var(const struct rtt_sample *s, double *mean, double *var)
+{
+  double sum = 0;
+  double sq = 0;
+  size_t i;
+
+  for (i = 0; i < s->n; i++) {
+    sum += s->v[i];
+  }
+  *mean = sum / s->n;
+  for (i = 0; i < s->n; i++) {
+    sq += (s->v[i] - *mean) * (s->v[i] - *mean);
+  }
+  *var = s->n > 1 ? sq / (s->n - 1) : 0;
+}
+
+// Small xorshift, enough for resampling
+static inline uint64_t rtt_rand(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Quantiles of a resample (with replacement) of s, sorted into scratch
+static void resample_quantiles(const struct rtt_sample *s, double *scratch, uint64_t *rng, double *out)
+{
+  size_t i;
+
+  for (i = 0; i < s->n; i++) {
+    scratch[i] = s->v[rtt_rand(rng) % s->n];
+  }
+  qsort(scratch, s->n, sizeof(double), cmp_double);
+  for (i = 0; i < NQUANTILES; i++) {
+    out[i] = quantile(scratch, s->n, quantiles[i]);
+  }
+}
+
+// Bootstrap 95% intervals of the quantile shifts
+// Returns 0 on success, nonzero if out of memory
+int bootstrap_shifts(const struct rtt_sample *ctl, const struct rtt_sample *mon, int nboot,
+                     double lo[NQUANTILES], double hi[NQUANTILES])
+{
+  double *scratch;
+  double *shifts;
+  double qc[NQUANTILES];
+  double qm[NQUANTILES];
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  size_t q;
+  int b;
+
+  scratch = (double *)malloc((ctl->n > mon->n ? ctl->n : mon->n) * sizeof(double));
+  shifts = (double *)malloc(NQUANTILES * nboot * sizeof(double));
+  if (scratch == NULL || shifts == NULL) {
+    free(scratch);
+    free(shifts);
+    return -1;
+  }
+
+  for (b = 0; b < nboot; b++) {
+    resample_quantiles(ctl, scratch, &rng, qc);
+    resample_quantiles(mon, scratch, &rng, qm);
+    for (q = 0; q < NQUANTILES; q++) {
+      shifts[q * nboot + b] = qm[q] - qc[q];
+    }
+  }
+  for (q = 0; q < NQUANTILES; q++) {
+    qsort(&shifts[q * nboot], nboot, sizeof(double), cmp_double);
+    lo[q] = quantile(&shifts[q * nboot], nboot, 0.025);
+    hi[q] = quantile(&shifts[q * nboot], nboot, 0.975);
+  }
+
+  free(scratch);
+  free(shifts);
+  return 0;
+}
+
+static void print_row(int format, const char *label, const char *stat, double c, double m,
+                      double lo, double hi)
+{
+  if (format == RTT_FORMAT_CSV) {
+    fprintf(stdout, "%s,%s,%.3f,%.3f,%.3f,%.3f,%.3f\n", label, stat, c, m, m - c, lo, hi);
+  } else {
+    fprintf(stdout, "  %-6s %12.3f %12.3f %+12.3f   [%+.3f, %+.3f]\n", stat, c, m, m - c, lo, hi);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct rtt_sample ctl = { NULL, 0, 0 };
+  struct rtt_sample mon = { NULL, 0, 0 };
+  struct rtt_sample *cur = &ctl;
+  const char *label = "rtt";
+  double lo[NQUANTILES];
+  double hi[NQUANTILES];
+  double mc, vc, mm, vm, se;
+  int format = RTT_FORMAT_TEXT;
+  int nboot = RTT_BOOTSTRAP;
+  size_t q;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "+f:l:b:")) != -1) {
+    switch (opt) {
+      case 'f':
+        if (!strcmp(optarg, "text")) {
+          format = RTT_FORMAT_TEXT;
+        } else if (!strcmp(optarg, "csv")) {
+          format = RTT_FORMAT_CSV;
+        } else {
+          usage();
+          return 1;
+        }
+        break;
+      case 'l':
+        label = optarg;
+        break;
+      case 'b':
+        nboot = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (nboot < 1) {
+    usage();
+    return 1;
+  }
+
+  // Options come first ("+" keeps getopt from permuting), so the "--" between phases is left in argv
+  for (i = optind; i < argc; i++) {
+    if (!strcmp(argv[i], "--") && cur == &ctl) {
+      cur = &mon;
+    } else if (read_rtts(argv[i], cur)) {
+      return 1;
+    }
+  }
+  if (cur != &mon) {
+    usage();
+    return 1;
+  }
+  if (ctl.n < 2 || mon.n < 2) {
+    fprintf(stderr, "%s: need at least 2 replies per phase (got %zu control, %zu monitored)\n",
+        label, ctl.n, mon.n);
+    return 1;
+  }
+
+  qsort(ctl.v, ctl.n, sizeof(double), cmp_double);
+  qsort(mon.v, mon.n, sizeof(double), cmp_double);
+  mean_var(&ctl, &mc, &vc);
+  mean_var(&mon, &mm, &vm);
+  se = sqrt(vc / ctl.n + vm / mon.n);
+  if (bootstrap_shifts(&ctl, &mon, nboot, lo, hi)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  if (format == RTT_FORMAT_CSV) {
+    fprintf(stdout, "label,stat,control_us,monitored_us,shift_us,ci95_lo_us,ci95_hi_us\n");
+  } else {
+    fprintf(stdout, "%s: %zu control, %zu monitored replies (us)\n", label, ctl.n, mon.n);
+    fprintf(stdout, "  %-6s %12s %12s %12s   %s\n", "stat", "control", "monitored", "shift", "95% CI");
+  }
+  print_row(format, label, "mean", mc, mm, mm - mc - 1.96 * se, mm - mc + 1.96 * se);
+  for (q = 0; q < NQUANTILES; q++) {
+    print_row(format, label, quantile_names[q], quantile(ctl.v, ctl.n, quantiles[q]),
+        quantile(mon.v, mon.n, quantiles[q]), lo[q], hi[q]);
+  }
+
+  free(ctl.v);
+  free(mon.v);
+  return 0;
+}
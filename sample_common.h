@@ -0,0 +1,179 @@
+#ifndef SAMPLE_COMMON_H
+#define SAMPLE_COMMON_H
+//
+// Deterministic sampling under overload
+//
+// When a monitor can't keep up, it is better to measure a known fraction
+// of packets well than all of them late with the losses falling wherever
+// the kernel's buffers overflowed. A sampling rate of 1 in 2^shift keeps a
+// packet iff a key that every capture point sees the same (the skb
+// address, the icmp sequence number, the IP id) passes a fixed test, so
+// both ends of a path keep or drop the same packets and matches survive.
+//
+// The tests are chosen so the kernel can apply them before an event is
+// ever copied out (see the *_filter functions) and the tools check them
+// again on what they read, so every sample is tagged with exactly the
+// rate it was kept at. Latency histograms weight each sample by 2^shift,
+// so percentiles over a period with rate changes are not skewed toward
+// the quiet stretches.
+//
+// A governor (sample_gov_update) run once per interval by the tool's main
+// thread halves the rate when events were lost, the p99 lag or the CPU
+// share of the pipeline is over its limit, and doubles it again after
+// SAMPLE_GOV_CALM quiet intervals. Hot threads only ever read the shift.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hist_common.h"
+
+#define SAMPLE_MAX_SHIFT 10 // at most 1 in 1024
+#define SAMPLE_GOV_CALM 5 // quiet intervals before the rate goes back up
+#define SAMPLE_SKB_BIT 8 // lowest skb address bit that differs between skbs
+#define SAMPLE_HASH_MUL 40503 // Fibonacci multiplier for 16-bit keys
+
+struct sample_gov {
+  unsigned int shift; // keep 1 in 2^shift, read by hot threads
+  uint64_t max_lag_ns; // p99 lag over an interval that counts as behind
+  double max_cpu; // share of a CPU per thread, 0..1
+  int calm; // consecutive quiet intervals
+  uint64_t lost; // lost events seen so far, UINT64_MAX before the first interval
+  struct hist lag; // lag histogram at the last interval
+};
+
+static inline unsigned int sample_shift(const struct sample_gov *g)
+{
+  return __atomic_load_n(&g->shift, __ATOMIC_RELAXED);
+}
+
+// skb addresses: sk_buffs come from a slab of 256 byte objects, so the
+// bits just above the object size index the slot in its slab page and
+// are about evenly spread. tracefs filters can test bits but not hash,
+// so keep an skb iff shift of those bits are all set.
+static inline int sample_keep_skb(uint64_t skbaddr, unsigned int shift)
+{
+  uint64_t mask = ((1ULL << shift) - 1) << SAMPLE_SKB_BIT;
+  return (skbaddr & mask) == mask;
+}
+
+// The same test as an ftrace event filter, "0" (no filter) at shift 0
+static inline int sample_skb_filter(unsigned int shift, char *buf, size_t len)
+{
+  size_t off = 0;
+  unsigned int i;
+
+  if (shift == 0) {
+    return snprintf(buf, len, "0") >= (int)len;
+  }
+  buf[0] = '\0';
+  for (i = 0; i < shift && off < len; i++) {
+    off += snprintf(buf + off, len - off, "%sskbaddr & 0x%llx",
+        i ? " && " : "", 1ULL << (SAMPLE_SKB_BIT + i));
+  }
+  return off >= len;
+}
+
+// 16-bit keys (icmp sequence, IP id) may count up one by one, so hash
+// them: keep iff the top shift bits of a multiplicative hash are zero
+static inline int sample_keep16(uint16_t key, unsigned int shift)
+{
+  return (((uint32_t)key * SAMPLE_HASH_MUL) & 0xffff) < (0x10000U >> shift);
+}
+
+// The same test as a pcap filter on the 16-bit field at expr
+// (e.g. "icmp[6:2]" or "ip[4:2]"), "" at shift 0
+static inline int sample_keep16_filter(const char *expr, unsigned int shift, char *buf, size_t len)
+{
+  if (shift == 0) {
+    buf[0] = '\0';
+    return 0;
+  }
+  return snprintf(buf, len, "((%s * %d) & 0xffff) < %u",
+      expr, SAMPLE_HASH_MUL, 0x10000U >> shift) >= (int)len;
+}
+
+static inline void sample_gov_init(struct sample_gov *g, uint64_t max_lag_ns, double max_cpu)
+{
+  g->shift = 0;
+  g->max_lag_ns = max_lag_ns;
+  g->max_cpu = max_cpu;
+  g->calm = 0;
+  g->lost = UINT64_MAX;
+  hist_init(&g->lag);
+}
+
+// p99 of the lag added to a merged lag histogram since the last call
+static inline uint64_t sample_gov_lag(struct sample_gov *g, const struct hist *lag)
+{
+  struct hist delta = *lag;
+
+  hist_sub(&delta, &g->lag);
+  g->lag = *lag;
+  return hist_quantile(&delta, 0.99);
+}
+
+// CPU time a thread has used so far in ns, 0 if unknown
+static inline uint64_t sample_thread_cpu_ns(pthread_t thread)
+{
+  struct timespec ts;
+  clockid_t cid;
+
+  if (pthread_getcpuclockid(thread, &cid) || clock_gettime(cid, &ts)) {
+    return 0;
+  }
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Main thread, once per interval:
+//   lost     events known lost so far (ring overruns, dropped output)
+//   lag_ns   p99 lag of the events handled in the interval, 0 if none
+//   cpu      busiest hot thread's share of a CPU in the interval
+// Returns nonzero if the shift changed
+static inline int sample_gov_update(struct sample_gov *g, uint64_t lost, uint64_t lag_ns, double cpu)
+{
+  unsigned int shift = g->shift;
+  int losing = g->lost != UINT64_MAX && lost > g->lost;
+
+  g->lost = lost;
+  if (losing || lag_ns > g->max_lag_ns || cpu > g->max_cpu) {
+    g->calm = 0;
+    if (shift < SAMPLE_MAX_SHIFT) {
+      shift++;
+    }
+  } else if (lag_ns < g->max_lag_ns / 4 && cpu < g->max_cpu / 2) {
+    // Only well under the limits, so the rate doesn't flap at the edge
+    if (++g->calm >= SAMPLE_GOV_CALM && shift > 0) {
+      shift--;
+      g->calm = 0;
+    }
+  } else {
+    g->calm = 0;
+  }
+
+  if (shift == g->shift) {
+    return 0;
+  }
+  __atomic_store_n(&g->shift, shift, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// Parse "<max lag ms>[,<max cpu %>]" for a governor
+// Returns 0 on success, nonzero if malformed
+static inline int sample_gov_parse(struct sample_gov *g, const char *arg)
+{
+  double lag_ms;
+  double cpu_pct = 50;
+  int n;
+
+  n = sscanf(arg, "%lf,%lf", &lag_ms, &cpu_pct);
+  if (n < 1 || lag_ms <= 0 || cpu_pct <= 0 || cpu_pct > 100) {
+    return -1;
+  }
+  sample_gov_init(g, (uint64_t)(lag_ms * 1e6), cpu_pct / 100);
+  return 0;
+}
+
+#endif
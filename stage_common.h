@@ -0,0 +1,139 @@
+#ifndef STAGE_COMMON_H
+#define STAGE_COMMON_H
+//
+// Always-on cost accounting of pipeline stages
+//
+// Every hot thread owns a stage_set. Per stage (read, parse, match,
+// output... named by the tool) it counts the items that went through, and
+// for one item in STAGE_SAMPLE_EVERY it records how long the stage took
+// into a histogram. Counts are bumped once per batch where the caller has
+// one, and a non-sampled item costs one increment of the set's tick, so the
+// instrumentation stays well under 1% of the time per event. Time spent in
+// a stage overall is estimated as mean sampled cost * items.
+//
+// The set also keeps the lag of sampled events: how long after the kernel
+// stamped an event the thread got to handle it, which grows when the
+// thread falls behind its input.
+//
+// Same ownership rules as hist_common.h: only the owner writes, readers
+// merge snapshots into a private copy with stage_set_merge.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist_common.h"
+
+#define STAGE_MAX 8
+#define STAGE_SAMPLE_EVERY 128 // Must be a power of two
+
+struct stage_stats {
+  uint64_t items;
+  struct hist cost; // ns per sampled item
+};
+
+struct stage_set {
+  uint64_t tick; // owner only
+  struct stage_stats stages[STAGE_MAX];
+  struct hist lag; // ns from kernel time stamp to handling, sampled
+};
+
+static inline uint64_t stage_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Owner thread: nonzero for one call in STAGE_SAMPLE_EVERY, time this item
+static inline int stage_sample(struct stage_set *s)
+{
+  return (s->tick++ & (STAGE_SAMPLE_EVERY - 1)) == 0;
+}
+
+// Owner thread: n more items went through stage
+static inline void stage_count(struct stage_set *s, int stage, uint64_t n)
+{
+  stat_add(&s->stages[stage].items, n);
+}
+
+// Owner thread: a sampled item spent from start until now in stage
+// Returns now, so back to back stages can share one clock read
+static inline uint64_t stage_time(struct stage_set *s, int stage, uint64_t start)
+{
+  uint64_t now = stage_now();
+  hist_add(&s->stages[stage].cost, now - start);
+  return now;
+}
+
+// Owner thread: a sampled batch of n items spent from start until now in
+// stage, recorded as the cost of one item
+// Returns now
+static inline uint64_t stage_time_n(struct stage_set *s, int stage, uint64_t start, uint64_t n)
+{
+  uint64_t now = stage_now();
+  hist_add(&s->stages[stage].cost, (now - start) / (n ? n : 1));
+  return now;
+}
+
+// Owner thread: a sampled event was handled lag ns after it happened
+static inline void stage_lag(struct stage_set *s, int64_t lag)
+{
+  hist_add(&s->lag, lag > 0 ? lag : 0);
+}
+
+// Estimated ns spent in a stage overall
+static inline uint64_t stage_busy_ns(const struct stage_stats *st)
+{
+  if (st->cost.count == 0) {
+    return 0;
+  }
+  return (uint64_t)((double)st->cost.sum / st->cost.count * st->items);
+}
+
+// Reader: into += snapshot of from
+// snap is scratch space, struct hist is too big for some thread stacks
+static inline void stage_set_merge(struct stage_set *into, const struct stage_set *from,
+                                   struct hist *snap)
+{
+  int i;
+
+  for (i = 0; i < STAGE_MAX; i++) {
+    into->stages[i].items += stat_read(&from->stages[i].items);
+    hist_snapshot(&from->stages[i].cost, snap);
+    hist_merge(&into->stages[i].cost, snap);
+  }
+  hist_snapshot(&from->lag, snap);
+  hist_merge(&into->lag, snap);
+}
+
+// Periodic report of merged sets: items/s and share of a CPU over the
+// interval since prev (updated to cur), sampled cost and lag percentiles
+// since start
+static inline void stage_report(FILE *fp, const char *const *names, int nstages,
+                                const struct stage_set *cur, uint64_t *prev_items,
+                                uint64_t *prev_busy, uint64_t interval_ns)
+{
+  const struct stage_stats *st;
+  uint64_t busy;
+  int i;
+
+  for (i = 0; i < nstages; i++) {
+    st = &cur->stages[i];
+    busy = stage_busy_ns(st);
+    fprintf(fp, "stage %-8s %10.0f/s  cpu %5.1f%%  cost p50 %.2f p99 %.2f max %.2f us\n",
+        names[i], (st->items - prev_items[i]) * 1e9 / interval_ns,
+        busy > prev_busy[i] ? (busy - prev_busy[i]) * 100.0 / interval_ns : 0.0,
+        hist_quantile(&st->cost, 0.5) / 1000.0, hist_quantile(&st->cost, 0.99) / 1000.0,
+        st->cost.max / 1000.0);
+    prev_items[i] = st->items;
+    prev_busy[i] = busy;
+  }
+  fprintf(fp, "stage lag      p50 %.1f p99 %.1f max %.1f us\n",
+      hist_quantile(&cur->lag, 0.5) / 1000.0, hist_quantile(&cur->lag, 0.99) / 1000.0,
+      cur->lag.max / 1000.0);
+}
+
+#endif
@@ -0,0 +1,635 @@
+//
+// Latency summaries streamed from monitors to a collector
+//
+// An agent thread in the monitor wakes every interval, has the tool build
+// a cumulative agg_view (agg_common.h) and sends what each key added since
+// the last summary: its counters and the histogram buckets that changed,
+// as window_slot_fill finds them. A summary's size follows the number of
+// keys and buckets touched, not the packet rate.
+//
+// hist buckets are log-linear, so they make a sketch with bounded relative
+// error that merges exactly by adding counts, like a DDSketch with fixed
+// buckets: a percentile of any union of summaries, read back as the middle
+// of its bucket, is within 1/(2*HIST_SUB) (6.25%) of the true value.
+//
+// A summary that isn't written whole is folded into the next one, so a
+// collector going away loses nothing the socket didn't already take, and
+// nothing is counted twice. The collector drops a frame cut short.
+//
+// Wire format, one frame per summary: a 4-byte little-endian length, then
+//   "LSUM" version HIST_SUB_BITS HIST_BUCKETS host seq start_ns end_ns
+// followed by the keys to the end of the frame, each its name and then per
+// direction
+//   samples discarded expired count sum max nbuckets (gap, count)...
+// Numbers are LEB128 varints, strings a varint length and the bytes, and a
+// bucket's gap is its index less the previous one's, less one. Times are
+// CLOCK_REALTIME.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "hist_common.h"
+#include "agg_common.h"
+#include "window_common.h"
+
+#define SUMMARY_VERSION 1
+#define SUMMARY_MAGIC "LSUM"
+#define SUMMARY_HOST_SIZE 64
+#define SUMMARY_ADDR_SIZE 256
+#define SUMMARY_FRAME_MAX (16 << 20) // longer frames are refused
+#define SUMMARY_DEFAULT_SECS 10
+#define SUMMARY_POLL_MS 100
+#define SUMMARY_SEND_MS 1000 // a collector this slow to take a summary is dropped
+
+struct summary_buf {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct summary_header {
+  char host[SUMMARY_HOST_SIZE];
+  uint64_t seq;
+  uint64_t start_ns;
+  uint64_t end_ns;
+};
+
+struct summary_agent {
+  char addr[SUMMARY_ADDR_SIZE];
+  char host[SUMMARY_HOST_SIZE];
+  unsigned int secs;
+  // Returns 0 on success, nonzero on error
+  int (*build)(struct agg_view *v, void *arg);
+  void *arg;
+  int fd; // -1 while not connected
+  int warned; // about the collector being away
+  struct agg_view last; // cumulative when the last summary went out
+  int *index; // key slot to last entry + 1
+  uint64_t seq;
+  uint64_t start_ns; // end of the last summary that went out
+  struct summary_buf buf;
+  pthread_t thread;
+  volatile int running;
+  uint64_t sent;
+  uint64_t bytes;
+};
+
+static inline uint64_t summary_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns 0 on success, nonzero if out of memory
+static int summary_reserve(struct summary_buf *b, size_t n)
+{
+  unsigned char *grown;
+  size_t cap;
+
+  if (b->len + n <= b->cap) {
+    return 0;
+  }
+  cap = b->cap ? b->cap : 0x1000;
+  while (cap < b->len + n) {
+    cap *= 2;
+  }
+  grown = (unsigned char *)realloc(b->data, cap);
+  if (grown == NULL) {
+    return -1;
+  }
+  b->data = grown;
+  b->cap = cap;
+  return 0;
+}
+
+// Returns 0 on success, nonzero if out of memory
+static int summary_put(struct summary_buf *b, uint64_t v)
+{
+  if (summary_reserve(b, 10)) {
+    return -1;
+  }
+  while (v >= 0x80) {
+    b->data[b->len++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  b->data[b->len++] = (unsigned char)v;
+  return 0;
+}
+
+// Returns 0 on success, nonzero if out of memory
+static int summary_put_str(struct summary_buf *b, const char *s)
+{
+  size_t n = strlen(s);
+
+  if (summary_put(b, n) || summary_reserve(b, n)) {
+    return -1;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  return 0;
+}
+
+// Returns 0 on success, nonzero if out of memory
+static int summary_put_slot(struct summary_buf *b, const struct window_slot *slot)
+{
+  int prev = -1;
+  int ret = 0;
+  int i;
+
+  ret |= summary_put(b, slot->samples);
+  ret |= summary_put(b, slot->discarded);
+  ret |= summary_put(b, slot->expired);
+  ret |= summary_put(b, slot->count);
+  ret |= summary_put(b, slot->sum);
+  ret |= summary_put(b, slot->max);
+  ret |= summary_put(b, slot->nbuckets);
+  for (i = 0; i < slot->nbuckets; i++) {
+    ret |= summary_put(b, slot->buckets[i].bucket - prev - 1);
+    ret |= summary_put(b, slot->buckets[i].count);
+    prev = slot->buckets[i].bucket;
+  }
+  return ret;
+}
+
+// Read one varint, advancing *p
+// Returns 0 on success, nonzero if it runs past end
+static int summary_get(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+  int shift;
+
+  *v = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    *v |= (uint64_t)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Read one string into buf, cut to size
+// Returns 0 on success, nonzero if it runs past end
+static int summary_get_str(const unsigned char **p, const unsigned char *end, char *buf, size_t size)
+{
+  uint64_t n;
+
+  if (summary_get(p, end, &n) || n > (uint64_t)(end - *p)) {
+    return -1;
+  }
+  snprintf(buf, size, "%.*s", (int)(n < size ? n : size - 1), (const char *)*p);
+  *p += n;
+  return 0;
+}
+
+// Read one direction into slot, its buckets into the HIST_BUCKETS at buckets
+// Returns 0 on success, nonzero if malformed
+static int summary_get_slot(const unsigned char **p, const unsigned char *end, struct window_slot *slot,
+                            struct window_bucket *buckets)
+{
+  uint64_t n;
+  uint64_t gap;
+  int prev = -1;
+  int i;
+
+  if (summary_get(p, end, &slot->samples) || summary_get(p, end, &slot->discarded)
+   || summary_get(p, end, &slot->expired) || summary_get(p, end, &slot->count)
+   || summary_get(p, end, &slot->sum) || summary_get(p, end, &slot->max)
+   || summary_get(p, end, &n) || n > HIST_BUCKETS) {
+    return -1;
+  }
+  slot->nbuckets = (int)n;
+  slot->buckets = buckets;
+  for (i = 0; i < slot->nbuckets; i++) {
+    if (summary_get(p, end, &gap) || gap >= (uint64_t)(HIST_BUCKETS - prev - 1)
+     || summary_get(p, end, &buckets[i].count)) {
+      return -1;
+    }
+    prev += (int)gap + 1;
+    buckets[i].bucket = prev;
+  }
+  return 0;
+}
+
+// Check one frame's body, then if fn is set call it with every key's
+// directions
+// Returns 0 on success, nonzero if the frame is malformed or from a build
+// with other histogram buckets
+int summary_decode(const unsigned char *p, size_t len, struct summary_header *h,
+                   void (*fn)(const struct summary_header *h, const char *name,
+                              const struct window_slot *slots, void *arg),
+                   void *arg)
+{
+  const unsigned char *start = p;
+  const unsigned char *end = p + len;
+  struct window_bucket buckets[2][HIST_BUCKETS];
+  struct window_slot slots[2];
+  char name[AGG_NAME_SIZE];
+  uint64_t sub_bits;
+  uint64_t nbuckets;
+  int pass;
+  int d;
+
+  if (len < 5 || memcmp(p, SUMMARY_MAGIC, 4) || p[4] != SUMMARY_VERSION) {
+    return -1;
+  }
+  // Applied only once all of it is known to be good
+  for (pass = 0; pass < (fn ? 2 : 1); pass++) {
+    p = start + 5;
+    if (summary_get(&p, end, &sub_bits) || summary_get(&p, end, &nbuckets)
+     || sub_bits != HIST_SUB_BITS || nbuckets != HIST_BUCKETS
+     || summary_get_str(&p, end, h->host, sizeof(h->host)) || summary_get(&p, end, &h->seq)
+     || summary_get(&p, end, &h->start_ns) || summary_get(&p, end, &h->end_ns)) {
+      return -1;
+    }
+    while (p < end) {
+      if (summary_get_str(&p, end, name, sizeof(name))) {
+        return -1;
+      }
+      for (d = 0; d < 2; d++) {
+        if (summary_get_slot(&p, end, &slots[d], buckets[d])) {
+          return -1;
+        }
+      }
+      if (pass) {
+        fn(h, name, slots, arg);
+      }
+    }
+  }
+  return 0;
+}
+
+// Agent: the last summary's entry for key, NULL if it had none
+static struct agg_entry *summary_last(struct summary_agent *a, uint64_t key)
+{
+  unsigned int j = agg_slot(key) & (2 * AGG_TABLE_SIZE - 1);
+
+  while (a->index[j]) {
+    if (a->last.entries[a->index[j] - 1].key == key) {
+      return &a->last.entries[a->index[j] - 1];
+    }
+    j = (j + 1) & (2 * AGG_TABLE_SIZE - 1);
+  }
+  return NULL;
+}
+
+// Agent: make cur the view the next summary is taken against
+static void summary_keep(struct summary_agent *a, struct agg_view *cur)
+{
+  unsigned int j;
+  int i;
+
+  agg_view_free(&a->last);
+  a->last = *cur;
+  cur->entries = NULL;
+  cur->nentries = 0;
+  memset(a->index, 0, 2 * AGG_TABLE_SIZE * sizeof(int));
+  for (i = 0; i < a->last.nentries; i++) {
+    j = agg_slot(a->last.entries[i].key) & (2 * AGG_TABLE_SIZE - 1);
+    while (a->index[j]) {
+      j = (j + 1) & (2 * AGG_TABLE_SIZE - 1);
+    }
+    a->index[j] = i + 1;
+  }
+}
+
+// Agent: frame what cur added since the last summary into a->buf
+// Returns 0 on success, nonzero if out of memory
+static int summary_encode(struct summary_agent *a, const struct agg_view *cur, uint64_t end_ns)
+{
+  struct summary_buf *b = &a->buf;
+  const struct agg_entry *last;
+  struct window_slot slots[2];
+  uint32_t len;
+  int ret = 0;
+  int i;
+  int d;
+
+  b->len = 0;
+  if (summary_reserve(b, 9)) {
+    return -1;
+  }
+  b->len = 4;
+  memcpy(b->data + b->len, SUMMARY_MAGIC, 4);
+  b->data[b->len + 4] = SUMMARY_VERSION;
+  b->len += 5;
+  ret |= summary_put(b, HIST_SUB_BITS);
+  ret |= summary_put(b, HIST_BUCKETS);
+  ret |= summary_put_str(b, a->host);
+  ret |= summary_put(b, a->seq);
+  ret |= summary_put(b, a->start_ns);
+  ret |= summary_put(b, end_ns);
+
+  for (i = 0; i < cur->nentries && !ret; i++) {
+    last = summary_last(a, cur->entries[i].key);
+    // A key the tool dropped and took back starts over
+    if (last == NULL || cur->entries[i].latency[0].count < last->latency[0].count
+     || cur->entries[i].latency[1].count < last->latency[1].count) {
+      last = &window_zero;
+    }
+    for (d = 0; d < 2; d++) {
+      if (window_slot_fill(&slots[d], &cur->entries[i], last, d)) {
+        ret = -1;
+      }
+    }
+    // Keys nothing happened to since the last summary are left out
+    if (!ret && (slots[0].samples || slots[0].discarded || slots[0].expired || slots[0].count
+              || slots[1].samples || slots[1].discarded || slots[1].expired || slots[1].count)) {
+      ret |= summary_put_str(b, cur->entries[i].name);
+      ret |= summary_put_slot(b, &slots[0]);
+      ret |= summary_put_slot(b, &slots[1]);
+    }
+    window_slot_clear(&slots[0]);
+    window_slot_clear(&slots[1]);
+  }
+
+  len = (uint32_t)(b->len - 4);
+  b->data[0] = len & 0xff;
+  b->data[1] = (len >> 8) & 0xff;
+  b->data[2] = (len >> 16) & 0xff;
+  b->data[3] = len >> 24;
+  return ret;
+}
+
+// Connect to addr: a Unix socket path if it has a '/', else host:port
+// Returns an fd or -1 on error, errno set
+static int summary_connect(const char *addr)
+{
+  struct sockaddr_un sun;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  char host[SUMMARY_ADDR_SIZE];
+  const char *port;
+  int fd = -1;
+  int err;
+
+  if (strchr(addr, '/')) {
+    if (strlen(addr) >= sizeof(sun.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, addr);
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+      err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    return fd;
+  }
+
+  port = strrchr(addr, ':');
+  if (port == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &res)) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      break;
+    }
+    err = errno;
+    close(fd);
+    errno = err;
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// Write all of buf, giving up on a peer that takes too long
+// Returns 0 on success, nonzero on error
+static int summary_send(int fd, const unsigned char *buf, size_t len)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  while (len > 0) {
+    if (poll(&pfd, 1, SUMMARY_SEND_MS) <= 0) {
+      return -1;
+    }
+    n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Agent: send everything added since the last summary that went out
+static void summary_push(struct summary_agent *a)
+{
+  struct agg_view cur;
+  uint64_t now = summary_now();
+
+  if (a->fd < 0) {
+    a->fd = summary_connect(a->addr);
+    if (a->fd < 0) {
+      if (!a->warned) {
+        fprintf(stderr, "Failed to connect to collector %s: %s, retrying\n", a->addr, strerror(errno));
+        a->warned = 1;
+      }
+      return;
+    }
+    if (a->warned) {
+      fprintf(stderr, "Connected to collector %s\n", a->addr);
+      a->warned = 0;
+    }
+  }
+  if (a->build(&cur, a->arg)) {
+    return;
+  }
+  if (summary_encode(a, &cur, now)) {
+    agg_view_free(&cur);
+    return;
+  }
+  if (summary_send(a->fd, a->buf.data, a->buf.len)) {
+    // The collector drops what it got of the frame; it all goes in the next one
+    fprintf(stderr, "Lost the connection to collector %s, retrying\n", a->addr);
+    a->warned = 1;
+    close(a->fd);
+    a->fd = -1;
+    agg_view_free(&cur);
+    return;
+  }
+  stat_add(&a->sent, 1);
+  stat_add(&a->bytes, a->buf.len);
+  a->seq++;
+  a->start_ns = now;
+  summary_keep(a, &cur);
+}
+
+static void *summary_thread(void *arg)
+{
+  struct summary_agent *a = (struct summary_agent *)arg;
+  uint64_t next = summary_now() + a->secs * 1000000000ULL;
+
+  while (a->running) {
+    if (summary_now() < next) {
+      poll(NULL, 0, SUMMARY_POLL_MS);
+      continue;
+    }
+    summary_push(a);
+    next += a->secs * 1000000000ULL;
+  }
+  // What came in since the last interval
+  summary_push(a);
+  return NULL;
+}
+
+// Start sending a summary of what build's view adds every secs seconds to
+// the collector at addr, a Unix socket path or host:port, as host (NULL for
+// this machine's name)
+// Returns 0 on success, nonzero on error
+int summary_agent_start(struct summary_agent *a, const char *addr, const char *host, unsigned int secs,
+                        int (*build)(struct agg_view *, void *), void *arg)
+{
+  memset(a, 0, sizeof(*a));
+  snprintf(a->addr, sizeof(a->addr), "%s", addr);
+  if (host != NULL) {
+    snprintf(a->host, sizeof(a->host), "%s", host);
+  } else if (gethostname(a->host, sizeof(a->host) - 1)) {
+    strcpy(a->host, "unknown");
+  }
+  a->secs = secs ? secs : SUMMARY_DEFAULT_SECS;
+  a->build = build;
+  a->arg = arg;
+  a->fd = -1;
+  a->start_ns = summary_now();
+  a->index = (int *)calloc(2 * AGG_TABLE_SIZE, sizeof(int));
+  if (a->index == NULL) {
+    return -1;
+  }
+  a->running = 1;
+  if (pthread_create(&a->thread, NULL, summary_thread, a)) {
+    fprintf(stderr, "Failed to start summary thread\n");
+    free(a->index);
+    return -1;
+  }
+  return 0;
+}
+
+// Send what is left and stop
+void summary_agent_stop(struct summary_agent *a)
+{
+  a->running = 0;
+  pthread_join(a->thread, NULL);
+  if (a->fd >= 0) {
+    close(a->fd);
+  }
+  agg_view_free(&a->last);
+  free(a->index);
+  free(a->buf.data);
+}
+
+// Parse -U's "<addr>[,<secs>]" into addr and secs
+// Returns 0 on success, nonzero if malformed
+int summary_parse_arg(const char *arg, char *addr, size_t size, unsigned int *secs)
+{
+  const char *comma = strrchr(arg, ',');
+  char *end;
+
+  *secs = SUMMARY_DEFAULT_SECS;
+  if (comma == NULL) {
+    return snprintf(addr, size, "%s", arg) >= (int)size;
+  }
+  *secs = strtoul(comma + 1, &end, 10);
+  if (*end != '\0' || *secs == 0) {
+    return -1;
+  }
+  return snprintf(addr, size, "%.*s", (int)(comma - arg), arg) >= (int)size;
+}
+
+// Collector: listen on addr, a TCP port number or a Unix socket path
+// Returns the listening fd or -1 on error
+int summary_listen(const char *addr)
+{
+  struct sockaddr_in sin;
+  struct sockaddr_un sun;
+  char *end;
+  long port;
+  int one = 1;
+  int fd;
+
+  port = strtol(addr, &end, 10);
+  if (*end == '\0' && port > 0 && port < 65536) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("collector socket");
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+      fprintf(stderr, "Failed to bind collector port %ld: %s\n", port, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  } else {
+    if (strlen(addr) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "Collector socket path too long: %s\n", addr);
+      return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror("collector socket");
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, addr);
+    unlink(addr);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+      fprintf(stderr, "Failed to bind collector socket %s: %s\n", addr, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, SOMAXCONN)) {
+    perror("collector listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -1,5 +1,9 @@
 #ifndef TIME_COMMON_H
 #define TIME_COMMON_H
+
+#include <time.h>
+#include <sys/time.h>
+
 /*
  * tvsub --
  *  Subtract 2 timeval structs:  out = out - in.  Out is assumed to
@@ -26,4 +30,30 @@ static inline void tvadd(struct timeval *out, struct timeval *in)
   out->tv_sec += in->tv_sec;
 }
 
+// Same as tvsub for nanosecond timespecs: out = out - in
+static inline void tssub(struct timespec *out, const struct timespec *in)
+{
+  if ((out->tv_nsec -= in->tv_nsec) < 0) {
+    --out->tv_sec;
+    out->tv_nsec += 1000000000;
+  }
+  out->tv_sec -= in->tv_sec;
+}
+
+// Nonzero if a is strictly earlier than b
+static inline int tsbefore(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec
+      || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Widen a pcap style time stamp into a timespec.
+// When the capture was opened with nanosecond precision
+// libpcap stores nanoseconds in tv_usec, so nano says how to read it.
+static inline void tv_to_ts(const struct timeval *tv, int nano, struct timespec *ts)
+{
+  ts->tv_sec = tv->tv_sec;
+  ts->tv_nsec = nano ? tv->tv_usec : tv->tv_usec * 1000;
+}
+
 #endif
@@ -0,0 +1,621 @@
+//
+// Control of the tracing filesystem
+//
+// A tracefs holds an O_PATH fd on a tracing directory, the top one or an
+// instance under instances/, and opens every control file relative to it,
+// so nothing depends on the working directory. Files where a write
+// replaces a value, like tracing_on or a filter, are opened once and
+// written with pwrite. Lists like set_event are cleared by opening them
+// with O_TRUNC, so replacing one takes a fresh open each time; appending
+// to one goes through a cached O_APPEND fd. Failures are reported with
+// the file and errno.
+//
+// The first write to a file that holds state saves what it held first,
+// and tracefs_restore puts it all back, newest first: values, the clock,
+// event and pid lists and filters as they were, and any trigger or
+// synthetic event added and not removed since is removed. A file whose
+// state can't be saved isn't written. What is saved is formatted when it
+// is saved, so restoring takes only openat, write and close and is safe
+// in a signal handler. tracefs_at arms that for the process, at exit and
+// on fatal signals that have no handler of their own.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define TRACEFS_MAX_FDS 32 // cached write fds, more files are opened per write
+#define TRACEFS_MAX_SAVED 1024 // about two legs of four triggers per path, and some state
+#define TRACEFS_NAME_SIZE 256
+#define TRACEFS_LINE_SIZE 576 // a trigger removal, "!" and the trigger
+#define TRACEFS_READ_SIZE 4096
+
+// Only declared with _GNU_SOURCE, which the tools don't all define first
+#ifndef O_PATH
+#define O_PATH 010000000
+#endif
+
+enum tracefs_kind {
+  TRACEFS_OTHER, // nothing to save, like trace
+  TRACEFS_VALUE, // a write replaces the value read back
+  TRACEFS_CLOCK, // the current clock reads back in brackets among the others
+  TRACEFS_LIST, // cleared by opening with O_TRUNC, a write adds to it
+  TRACEFS_FILTER, // event or subsystem filter, "none" if there is none
+  TRACEFS_TRIGGER, // an append adds a trigger, "!" and the trigger removes it
+  TRACEFS_SYNTH // an append defines a synthetic event, "!" and its name removes it
+};
+
+struct tracefs_fd {
+  char file[TRACEFS_NAME_SIZE];
+  int append;
+  int fd;
+};
+
+// Something to write back on restore: a file's saved state, or the
+// removal of a trigger or synthetic event that was added
+struct tracefs_saved {
+  int live; // written back on restore while set
+  int undo; // a removal rather than saved state
+  uint64_t seq; // restored newest first
+  int flags; // to open the file with for writing back
+  char file[TRACEFS_NAME_SIZE];
+  char *data; // saved state, allocated
+  char line[TRACEFS_LINE_SIZE]; // a removal
+};
+
+struct tracefs {
+  char path[PATH_MAX];
+  int dirfd;
+  pthread_mutex_t lock; // writers; restore reads saved without it
+  struct tracefs_fd fds[TRACEFS_MAX_FDS];
+  int nfds;
+  struct tracefs_saved saved[TRACEFS_MAX_SAVED];
+  int nsaved; // slots ever used, published after the slot is filled
+  uint64_t seq;
+  int restoring;
+};
+
+static enum tracefs_kind tracefs_kind(const char *file)
+{
+  const char *base = strrchr(file, '/');
+
+  base = base ? base + 1 : file;
+  if (!strcmp(base, "tracing_on") || !strcmp(base, "current_tracer")
+   || !strcmp(base, "buffer_size_kb")) {
+    return TRACEFS_VALUE;
+  }
+  if (!strcmp(base, "trace_clock")) {
+    return TRACEFS_CLOCK;
+  }
+  if (!strcmp(base, "set_event") || !strcmp(base, "set_event_pid")) {
+    return TRACEFS_LIST;
+  }
+  if (!strcmp(base, "filter")) {
+    return TRACEFS_FILTER;
+  }
+  if (!strcmp(base, "trigger")) {
+    return TRACEFS_TRIGGER;
+  }
+  if (!strcmp(base, "synthetic_events")) {
+    return TRACEFS_SYNTH;
+  }
+  return TRACEFS_OTHER;
+}
+
+// Open the tracing directory at path, or an instance's
+// Returns 0 on success, nonzero on error
+int tracefs_open(struct tracefs *t, const char *path)
+{
+  memset(t, 0, sizeof(*t));
+  snprintf(t->path, sizeof(t->path), "%s", path);
+  t->dirfd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (t->dirfd < 0) {
+    fprintf(stderr, "Failed to open tracing directory %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  return 0;
+}
+
+// Close the fds and forget the saved state, without restoring it
+void tracefs_close(struct tracefs *t)
+{
+  int i;
+
+  for (i = 0; i < t->nfds; i++) {
+    close(t->fds[i].fd);
+  }
+  for (i = 0; i < t->nsaved; i++) {
+    free(t->saved[i].data);
+  }
+  close(t->dirfd);
+  pthread_mutex_destroy(&t->lock);
+  t->nfds = t->nsaved = 0;
+  t->dirfd = -1;
+}
+
+// Open a file under the tracing directory, as openat(2)
+// Returns an fd or -1 with errno set
+int tracefs_openat(struct tracefs *t, const char *file, int flags)
+{
+  return openat(t->dirfd, file, flags | O_CLOEXEC);
+}
+
+// Write all of data, again from where a short write stopped.
+// Control files have no position, and some refuse pwrite as unseekable.
+// Safe in a signal handler
+// Returns 0 on success, -1 with errno set
+static int tracefs_write_fd(int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite(fd, data, len, 0);
+    if (n < 0 && errno == ESPIPE) {
+      n = write(fd, data, len);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Read a whole file
+// Returns it NUL-terminated, to free, or NULL with errno set
+static char *tracefs_read(struct tracefs *t, const char *file)
+{
+  size_t size = TRACEFS_READ_SIZE;
+  size_t len = 0;
+  ssize_t n;
+  char *buf;
+  char *grown;
+  int fd;
+
+  fd = tracefs_openat(t, file, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  buf = (char *)malloc(size);
+  while (buf != NULL && (n = read(fd, buf + len, size - len - 1)) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      free(buf);
+      buf = NULL;
+      break;
+    }
+    len += n;
+    if (len == size - 1) {
+      size *= 2;
+      grown = (char *)realloc(buf, size);
+      if (grown == NULL) {
+        free(buf);
+      }
+      buf = grown;
+    }
+  }
+  close(fd);
+  if (buf != NULL) {
+    buf[len] = '\0';
+  }
+  return buf;
+}
+
+// Take a slot for something to write back, one restore left unused if any
+// Caller holds the lock
+// Returns it, not live yet, or NULL if all are taken
+static struct tracefs_saved *tracefs_slot(struct tracefs *t)
+{
+  struct tracefs_saved *s;
+  int i;
+
+  for (i = 0; i < t->nsaved; i++) {
+    if (!__atomic_load_n(&t->saved[i].live, __ATOMIC_ACQUIRE)) {
+      s = &t->saved[i];
+      free(s->data);
+      s->data = NULL;
+      return s;
+    }
+  }
+  if (t->nsaved == TRACEFS_MAX_SAVED) {
+    return NULL;
+  }
+  return &t->saved[t->nsaved];
+}
+
+// Fill in a slot from tracefs_slot and let restore see it
+// data is taken over, or NULL with line copied in
+static void tracefs_publish(struct tracefs *t, struct tracefs_saved *s, const char *file, int flags,
+                            char *data, const char *line)
+{
+  snprintf(s->file, sizeof(s->file), "%s", file);
+  s->flags = flags;
+  s->undo = data == NULL;
+  s->data = data;
+  if (line != NULL) {
+    snprintf(s->line, sizeof(s->line), "%s", line);
+  }
+  s->seq = t->seq++;
+  __atomic_store_n(&s->live, 1, __ATOMIC_RELEASE);
+  if (s == &t->saved[t->nsaved]) {
+    __atomic_store_n(&t->nsaved, t->nsaved + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Save data to write back to file
+// Caller holds the lock
+// Returns 0 on success, nonzero if there is no room
+static int tracefs_push(struct tracefs *t, const char *file, int flags, char *data)
+{
+  struct tracefs_saved *s = tracefs_slot(t);
+
+  if (s == NULL) {
+    fprintf(stderr, "No room to save %s/%s\n", t->path, file);
+    free(data);
+    return -1;
+  }
+  tracefs_publish(t, s, file, flags, data, NULL);
+  return 0;
+}
+
+// The live saved state of file, NULL if there is none
+static struct tracefs_saved *tracefs_find(struct tracefs *t, const char *file)
+{
+  int i;
+
+  for (i = 0; i < t->nsaved; i++) {
+    if (t->saved[i].live && !t->saved[i].undo && !strcmp(t->saved[i].file, file)) {
+      return &t->saved[i];
+    }
+  }
+  return NULL;
+}
+
+// Cut a read back value at its first line
+static char *tracefs_first_line(char *buf)
+{
+  buf[strcspn(buf, "\n")] = '\0';
+  return buf;
+}
+
+// A subsystem's filter reads back as a comment unless one was set for the
+// whole subsystem, so save the filter of each of its events, to be put
+// back after the subsystem's is cleared
+// Returns 0 on success, nonzero on error
+static int tracefs_save_subsystem(struct tracefs *t, const char *file)
+{
+  char dir[TRACEFS_NAME_SIZE];
+  char event[TRACEFS_NAME_SIZE];
+  struct dirent *d;
+  char *buf;
+  DIR *dp;
+  int fd;
+  int ret = 0;
+
+  snprintf(dir, sizeof(dir), "%.*s", (int)(strrchr(file, '/') - file), file);
+  fd = tracefs_openat(t, dir, O_RDONLY | O_DIRECTORY);
+  dp = fd < 0 ? NULL : fdopendir(fd);
+  if (dp == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  while (!ret && (d = readdir(dp)) != NULL) {
+    if (d->d_name[0] == '.') {
+      continue;
+    }
+    if (snprintf(event, sizeof(event), "%s/%s/filter", dir, d->d_name) >= (int)sizeof(event)) {
+      continue;
+    }
+    buf = tracefs_read(t, event);
+    if (buf == NULL) {
+      // Not an event, like enable and filter themselves
+      continue;
+    }
+    if (!strncmp(buf, "none", 4) || tracefs_find(t, event)) {
+      free(buf);
+      continue;
+    }
+    ret = tracefs_push(t, event, O_WRONLY, tracefs_first_line(buf));
+  }
+  closedir(dp);
+  return ret;
+}
+
+// Save what file holds before its first write
+// Caller holds the lock
+// Returns 0 on success, nonzero on error
+static int tracefs_save(struct tracefs *t, const char *file, enum tracefs_kind kind)
+{
+  char *buf;
+  char *start;
+  size_t len;
+  int flags = O_WRONLY;
+
+  if (kind == TRACEFS_OTHER || kind == TRACEFS_TRIGGER || kind == TRACEFS_SYNTH
+   || tracefs_find(t, file)) {
+    return 0;
+  }
+  buf = tracefs_read(t, file);
+  if (buf == NULL) {
+    fprintf(stderr, "Failed to save %s/%s: %s\n", t->path, file, strerror(errno));
+    return -1;
+  }
+  switch (kind) {
+  case TRACEFS_CLOCK:
+    start = strchr(buf, '[');
+    if (start == NULL) {
+      fprintf(stderr, "Failed to save %s/%s: no clock in use\n", t->path, file);
+      free(buf);
+      return -1;
+    }
+    len = strcspn(start + 1, "]");
+    memmove(buf, start + 1, len);
+    buf[len] = '\0';
+    break;
+  case TRACEFS_LIST:
+    flags |= O_TRUNC;
+    break;
+  case TRACEFS_FILTER:
+    if (buf[0] == '#' && tracefs_save_subsystem(t, file)) {
+      fprintf(stderr, "Failed to save the event filters under %s/%s\n", t->path, file);
+      free(buf);
+      return -1;
+    }
+    if (buf[0] == '#' || !strncmp(buf, "none", 4)) {
+      strcpy(buf, "0");
+    }
+    tracefs_first_line(buf);
+    break;
+  case TRACEFS_VALUE:
+    // buffer_size_kb reads back as "7 (expanded: 1408)" before the buffer
+    // is first grown, which it won't take back
+    buf[strcspn(buf, " \n")] = '\0';
+    break;
+  default:
+    tracefs_first_line(buf);
+    break;
+  }
+  return tracefs_push(t, file, flags, buf);
+}
+
+// After a write to file: keep the removal of what an append added, or
+// drop it again if the write was that removal
+// Caller holds the lock
+// Returns 0 on success, nonzero if the addition can't be undone
+static int tracefs_track(struct tracefs *t, const char *file, enum tracefs_kind kind, const char *data)
+{
+  struct tracefs_saved *s;
+  char line[TRACEFS_LINE_SIZE];
+  int i;
+
+  if (kind != TRACEFS_TRIGGER && kind != TRACEFS_SYNTH) {
+    return 0;
+  }
+  if (data[0] == '!') {
+    for (i = 0; i < t->nsaved; i++) {
+      s = &t->saved[i];
+      if (s->live && s->undo && !strcmp(s->file, file) && !strcmp(s->line, data)) {
+        __atomic_store_n(&s->live, 0, __ATOMIC_RELEASE);
+        break;
+      }
+    }
+    return 0;
+  }
+  // A synthetic event goes by its name, the definition's first word
+  if (kind == TRACEFS_SYNTH) {
+    snprintf(line, sizeof(line), "!%.*s", (int)strcspn(data, " \t\n"), data);
+  } else if (snprintf(line, sizeof(line), "!%s", data) >= (int)sizeof(line)) {
+    return -1;
+  }
+  s = tracefs_slot(t);
+  if (s == NULL) {
+    return -1;
+  }
+  tracefs_publish(t, s, file, O_WRONLY | O_APPEND, NULL, line);
+  return 0;
+}
+
+// A write fd for file, cached if there is room
+// Caller holds the lock
+// Returns the fd, with *cached set if it stays open, or -1 with errno set
+static int tracefs_fd(struct tracefs *t, const char *file, int append, int *cached)
+{
+  struct tracefs_fd *c;
+  int fd;
+  int i;
+
+  *cached = 0;
+  for (i = 0; i < t->nfds; i++) {
+    if (t->fds[i].append == append && !strcmp(t->fds[i].file, file)) {
+      *cached = 1;
+      return t->fds[i].fd;
+    }
+  }
+  fd = tracefs_openat(t, file, append ? O_WRONLY | O_APPEND : O_WRONLY);
+  if (fd >= 0 && t->nfds < TRACEFS_MAX_FDS) {
+    c = &t->fds[t->nfds++];
+    snprintf(c->file, sizeof(c->file), "%s", file);
+    c->append = append;
+    c->fd = fd;
+    *cached = 1;
+  }
+  return fd;
+}
+
+// Save file's state if it is the first write, then write data
+// Returns 0 on success, nonzero on error
+static int tracefs_put(struct tracefs *t, const char *file, const char *data, int append)
+{
+  enum tracefs_kind kind = tracefs_kind(file);
+  int cached = 0;
+  int fd;
+  int ret = -1;
+
+  if (strlen(file) >= TRACEFS_NAME_SIZE) {
+    fprintf(stderr, "Tracing file name too long: %s\n", file);
+    return -1;
+  }
+  pthread_mutex_lock(&t->lock);
+  if (tracefs_save(t, file, kind)) {
+    pthread_mutex_unlock(&t->lock);
+    return -1;
+  }
+  // Replacing a list takes the O_TRUNC of a fresh open
+  if (append || kind == TRACEFS_VALUE || kind == TRACEFS_CLOCK || kind == TRACEFS_FILTER) {
+    fd = tracefs_fd(t, file, append, &cached);
+  } else {
+    fd = tracefs_openat(t, file, O_WRONLY | O_TRUNC);
+  }
+  if (fd >= 0) {
+    ret = tracefs_write_fd(fd, data, strlen(data));
+  }
+  if (ret) {
+    fprintf(stderr, "Failed to write %s/%s: %s\n", t->path, file, strerror(errno));
+  } else if (tracefs_track(t, file, kind, data)) {
+    fprintf(stderr, "No room to undo a write to %s/%s\n", t->path, file);
+  }
+  if (fd >= 0 && !cached) {
+    close(fd);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return ret;
+}
+
+// Replace what file holds with data, as the shell's >
+// Returns 0 on success, nonzero on error
+int tracefs_write(struct tracefs *t, const char *file, const char *data)
+{
+  return tracefs_put(t, file, data, 0);
+}
+
+// Add data to file, as the shell's >>, which tracefs lists take as an
+// addition rather than a replacement
+// Returns 0 on success, nonzero on error
+int tracefs_append(struct tracefs *t, const char *file, const char *data)
+{
+  return tracefs_put(t, file, data, 1);
+}
+
+// Write back everything saved, newest first, and forget it. Safe in a
+// signal handler, and a restore interrupted by one is left to that one.
+// Returns how many writes failed
+int tracefs_restore(struct tracefs *t)
+{
+  struct tracefs_saved *s;
+  const char *data;
+  uint64_t below = UINT64_MAX;
+  int failed = 0;
+  int n;
+  int i;
+  int fd;
+
+  if (__atomic_exchange_n(&t->restoring, 1, __ATOMIC_ACQ_REL)) {
+    return 0;
+  }
+  n = __atomic_load_n(&t->nsaved, __ATOMIC_ACQUIRE);
+  for (;;) {
+    s = NULL;
+    for (i = 0; i < n; i++) {
+      if (__atomic_load_n(&t->saved[i].live, __ATOMIC_ACQUIRE) && t->saved[i].seq < below
+       && (s == NULL || t->saved[i].seq > s->seq)) {
+        s = &t->saved[i];
+      }
+    }
+    if (s == NULL) {
+      break;
+    }
+    below = s->seq;
+    data = s->undo ? s->line : s->data;
+    fd = tracefs_openat(t, s->file, s->flags);
+    if (fd < 0 || tracefs_write_fd(fd, data, strlen(data))) {
+      failed++;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    __atomic_store_n(&s->live, 0, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&t->restoring, 0, __ATOMIC_RELEASE);
+  return failed;
+}
+
+static struct tracefs tracefs_proc;
+static int tracefs_proc_ready;
+static pthread_mutex_t tracefs_proc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tracefs_restore_exit(void)
+{
+  tracefs_restore(&tracefs_proc);
+}
+
+// Restore, then die of the signal as if nothing had caught it
+static void tracefs_restore_signal(int sig)
+{
+  int saved_errno = errno;
+
+  tracefs_restore(&tracefs_proc);
+  raise(sig);
+  errno = saved_errno;
+}
+
+// Restore at exit, and on the fatal signals nothing else handles
+static void tracefs_arm(void)
+{
+  static const int sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGILL, SIGABRT, SIGBUS, SIGFPE,
+                              SIGSEGV };
+  struct sigaction sa;
+  struct sigaction old;
+  int i;
+
+  if (atexit(tracefs_restore_exit)) {
+    fprintf(stderr, "Warning: tracing won't be restored at exit\n");
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = tracefs_restore_signal;
+  sa.sa_flags = SA_RESETHAND;
+  sigemptyset(&sa.sa_mask);
+  for (i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++) {
+    if (!sigaction(sigs[i], NULL, &old) && !(old.sa_flags & SA_SIGINFO) && old.sa_handler == SIG_DFL) {
+      sigaction(sigs[i], &sa, NULL);
+    }
+  }
+}
+
+// The process's tracefs, opened on path and armed to restore on first use
+// Returns NULL on error, or if it is open on another path
+struct tracefs *tracefs_at(const char *path)
+{
+  struct tracefs *t = NULL;
+
+  pthread_mutex_lock(&tracefs_proc_lock);
+  if (!tracefs_proc_ready && !tracefs_open(&tracefs_proc, path)) {
+    tracefs_proc_ready = 1;
+    tracefs_arm();
+  }
+  if (tracefs_proc_ready) {
+    if (strcmp(tracefs_proc.path, path)) {
+      fprintf(stderr, "Tracing is set up in %s already, not %s\n", tracefs_proc.path, path);
+    } else {
+      t = &tracefs_proc;
+    }
+  }
+  pthread_mutex_unlock(&tracefs_proc_lock);
+  return t;
+}
@@ -0,0 +1,192 @@
+#ifndef WHEEL_COMMON_H
+#define WHEEL_COMMON_H
+//
+// Hierarchical timing wheel for expiring in-flight matching state
+//
+// Half-matched state (an skb seen entering a path, an echo request waiting
+// for its reply) needs a deadline so that what never completes is dropped
+// and counted as lost, rather than lingering until a recycled key matches
+// it. The wheel keeps WHEEL_LEVELS rings of WHEEL_SLOTS slots; a slot on
+// level L spans 64^L ticks. A timer goes in the level whose span covers
+// its distance from now and moves down a level when the wheel reaches its
+// slot, so adding, cancelling and expiring a timer are O(1) and each
+// timer is moved at most WHEEL_LEVELS - 1 times in its life. Stretches
+// with nothing due are skipped a level 0 ring at a time.
+//
+// Time is whatever the owner feeds wheel_advance, in ns. The tools use
+// their events' time stamps, so reading a recording expires state as the
+// live run would, and a quiet interface never times out state whose other
+// half is still waiting in a kernel buffer. Ticks are 2^WHEEL_TICK_SHIFT
+// ns (about 1 ms): a timer never fires before its deadline and at most a
+// tick after it. Deadlines beyond WHEEL_SPAN ticks (about 4.9 hours) are
+// cut to that.
+//
+// Timers live in the owner's entries, the wheel allocates nothing. It has
+// no lock: one thread owns it, or its users serialize.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define WHEEL_TICK_SHIFT 20
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1ULL << (WHEEL_LEVEL_BITS * WHEEL_LEVELS))
+
+// The entry a timer is embedded in
+#define wheel_entry(t, type, member) ((type *)((char *)(t) - offsetof(type, member)))
+
+struct wheel_timer {
+  struct wheel_timer *next;
+  struct wheel_timer **pprev; // NULL unless pending
+  uint64_t expires; // tick
+  uint8_t level;
+  uint8_t slot;
+};
+
+struct wheel {
+  uint64_t now; // next tick to run
+  uint64_t pending; // timers
+  int started; // now is set
+  uint64_t occupied[WHEEL_LEVELS]; // non-empty slots, one bit each
+  struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static inline void wheel_init(struct wheel *w)
+{
+  memset(w, 0, sizeof(*w));
+}
+
+static inline int wheel_timer_pending(const struct wheel_timer *t)
+{
+  return t->pprev != NULL;
+}
+
+// Put a timer in the slot for its expiry tick
+static inline void wheel_file(struct wheel *w, struct wheel_timer *t)
+{
+  uint64_t delta;
+  int level = 0;
+
+  if (t->expires < w->now) {
+    t->expires = w->now;
+  }
+  delta = t->expires - w->now;
+  if (delta >= WHEEL_SPAN) {
+    t->expires = w->now + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+  while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_LEVEL_BITS * (level + 1))) {
+    level++;
+  }
+  t->level = level;
+  t->slot = (t->expires >> (WHEEL_LEVEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  t->next = w->slots[level][t->slot];
+  if (t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = &w->slots[level][t->slot];
+  w->slots[level][t->slot] = t;
+  w->occupied[level] |= 1ULL << t->slot;
+}
+
+// Cancel a timer, nothing if it isn't pending
+static inline void wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+  if (t->pprev == NULL) {
+    return;
+  }
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  if (w->slots[t->level][t->slot] == NULL) {
+    w->occupied[t->level] &= ~(1ULL << t->slot);
+  }
+  t->pprev = NULL;
+  w->pending--;
+}
+
+// Fire a timer at deadline_ns, moving it if it is already pending
+// The wheel must have been advanced at least once
+static inline void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t deadline_ns)
+{
+  wheel_del(w, t);
+  t->expires = (deadline_ns + (1ULL << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+  wheel_file(w, t);
+  w->pending++;
+}
+
+// Move the timers of the slots now reaches on the upper levels down
+static inline void wheel_cascade(struct wheel *w)
+{
+  struct wheel_timer *t;
+  struct wheel_timer *next;
+  unsigned int slot;
+  int level;
+
+  for (level = 1; level < WHEEL_LEVELS; level++) {
+    slot = (w->now >> (WHEEL_LEVEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    if (w->occupied[level] & (1ULL << slot)) {
+      t = w->slots[level][slot];
+      w->slots[level][slot] = NULL;
+      w->occupied[level] &= ~(1ULL << slot);
+      for (; t != NULL; t = next) {
+        next = t->next;
+        wheel_file(w, t);
+      }
+    }
+    // Upper levels only turn over when this one wraps
+    if (slot != 0) {
+      break;
+    }
+  }
+}
+
+// Run the wheel up to now_ns, calling expire for every timer whose
+// deadline has passed. A timer is no longer pending when expire is
+// called, which may add it again or free its entry. Going back in
+// time does nothing.
+// Returns the number of timers expired
+static inline unsigned int wheel_advance(struct wheel *w, uint64_t now_ns,
+                                         void (*expire)(struct wheel_timer *, void *), void *arg)
+{
+  uint64_t target = now_ns >> WHEEL_TICK_SHIFT;
+  uint64_t next;
+  struct wheel_timer *t;
+  unsigned int idx;
+  unsigned int n = 0;
+
+  if (!w->started) {
+    w->now = target + 1;
+    w->started = 1;
+    return 0;
+  }
+  while (w->now <= target) {
+    if (w->pending == 0) {
+      w->now = target + 1;
+      break;
+    }
+    idx = w->now & (WHEEL_SLOTS - 1);
+    if (idx == 0) {
+      wheel_cascade(w);
+    }
+    while ((t = w->slots[0][idx]) != NULL) {
+      wheel_del(w, t);
+      expire(t, arg);
+      n++;
+    }
+    w->now++;
+    // Nothing left on level 0 this turn: go straight to the next cascade
+    idx = w->now & (WHEEL_SLOTS - 1);
+    if (idx != 0 && (w->occupied[0] >> idx) == 0) {
+      next = (w->now | (WHEEL_SLOTS - 1)) + 1;
+      w->now = next < target + 1 ? next : target + 1;
+    }
+  }
+  return n;
+}
+
+#endif
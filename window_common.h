@@ -0,0 +1,364 @@
+#ifndef WINDOW_COMMON_H
+#define WINDOW_COMMON_H
+//
+// Rolling latency windows per aggregation key
+//
+// The agg shards (agg_common.h) only count up from the start of a run. To
+// see latency move during a deploy or a noisy neighbour, a reader ticks a
+// window set about once a second with a fresh agg_view. The difference
+// from the previous tick becomes that second's slot: a sparse copy of the
+// histogram buckets that changed. Slots sit in a ring of WINDOW_SECONDS,
+// and every completed minute goes into a ring of WINDOW_MINUTES - 1. Each
+// view keeps a running sum: a tick adds the new slot and subtracts the one
+// that fell out, so the cost per key is one pass over the buckets whatever
+// the window lengths.
+//
+// Workers never see any of this. They keep updating their own shards in
+// O(1), and all rotation happens on the ticking thread.
+//
+// Views: 1 s, 10 s and 60 s slide by a second. 10 min is the last nine
+// whole minutes plus the current one so far, so it covers 9 to 10 minutes.
+// A slot's max is exact when the overall max grew during that second;
+// otherwise it is the top of the highest bucket touched, within 1/HIST_SUB.
+//
+// Everything is under the set's lock, taken by the ticker and by readers
+// building a view.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "agg_common.h"
+
+#define WINDOW_SECONDS 60 // 1 s slots
+#define WINDOW_MINUTES 10 // Span of the longest view in minutes
+#define WINDOW_INDEX_SIZE (2 * AGG_TABLE_SIZE) // Must be a power of two
+
+enum window_span {
+  WINDOW_1S,
+  WINDOW_10S,
+  WINDOW_1M,
+  WINDOW_10M,
+  NWINDOWS
+};
+
+static const char *const window_names[NWINDOWS] = { "1s", "10s", "60s", "10m" };
+static const int window_secs[WINDOW_10M] = { 1, 10, 60 };
+
+struct window_bucket {
+  uint64_t count;
+  int bucket;
+};
+
+// What one direction of a key added in a second or a minute
+struct window_slot {
+  uint64_t samples;
+  uint64_t discarded;
+  uint64_t expired;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  int nbuckets;
+  struct window_bucket *buckets; // NULL if nothing was added
+};
+
+struct window_key {
+  uint64_t tick; // last pushed
+  struct agg_entry last; // cumulative at the last tick
+  struct agg_entry sums[WINDOW_10M]; // of the 1 s, 10 s and 60 s views
+  struct agg_entry minutes; // completed minutes in the ring
+  struct agg_entry partial; // seconds of the current minute
+  struct window_slot seconds[WINDOW_SECONDS][2];
+  struct window_slot minute[WINDOW_MINUTES - 1][2];
+};
+
+struct window_set {
+  pthread_mutex_t lock;
+  uint64_t ticks; // seconds pushed
+  uint64_t nminutes; // minutes pushed
+  int nkeys;
+  struct window_key *keys[AGG_TABLE_SIZE];
+  int index[WINDOW_INDEX_SIZE]; // key position + 1, 0 if free
+};
+
+static const struct agg_entry window_zero;
+
+static inline void window_set_init(struct window_set *ws)
+{
+  memset(ws, 0, sizeof(*ws));
+  pthread_mutex_init(&ws->lock, NULL);
+}
+
+static inline void window_set_free(struct window_set *ws)
+{
+  int i;
+  int s;
+  int d;
+
+  for (i = 0; i < ws->nkeys; i++) {
+    for (d = 0; d < 2; d++) {
+      for (s = 0; s < WINDOW_SECONDS; s++) {
+        free(ws->keys[i]->seconds[s][d].buckets);
+      }
+      for (s = 0; s < WINDOW_MINUTES - 1; s++) {
+        free(ws->keys[i]->minute[s][d].buckets);
+      }
+    }
+    free(ws->keys[i]);
+  }
+  ws->nkeys = 0;
+  pthread_mutex_destroy(&ws->lock);
+}
+
+// Find or add the window state for key
+// Returns NULL if there are too many keys or no memory
+static inline struct window_key *window_key_get(struct window_set *ws, uint64_t key, const char *name)
+{
+  struct window_key *k;
+  unsigned int j = agg_slot(key) & (WINDOW_INDEX_SIZE - 1);
+
+  while (ws->index[j] && ws->keys[ws->index[j] - 1]->last.key != key) {
+    j = (j + 1) & (WINDOW_INDEX_SIZE - 1);
+  }
+  if (ws->index[j]) {
+    return ws->keys[ws->index[j] - 1];
+  }
+  if (ws->nkeys == AGG_TABLE_SIZE) {
+    return NULL;
+  }
+  k = (struct window_key *)calloc(1, sizeof(struct window_key));
+  if (k == NULL) {
+    return NULL;
+  }
+  k->last.key = key;
+  memcpy(k->last.name, name, AGG_NAME_SIZE);
+  ws->keys[ws->nkeys++] = k;
+  ws->index[j] = ws->nkeys;
+  return k;
+}
+
+// Fill slot with what cur added to direction d since last
+// Returns 0 on success, nonzero if out of memory
+static inline int window_slot_fill(struct window_slot *slot, const struct agg_entry *cur,
+                                   const struct agg_entry *last, int d)
+{
+  const struct hist *h = &cur->latency[d];
+  const struct hist *l = &last->latency[d];
+  int top = -1;
+  int n = 0;
+  int i;
+
+  memset(slot, 0, sizeof(*slot));
+  slot->samples = cur->samples[d] - last->samples[d];
+  slot->discarded = cur->discarded[d] - last->discarded[d];
+  slot->expired = cur->expired[d] - last->expired[d];
+  slot->count = h->count - l->count;
+  slot->sum = h->sum - l->sum;
+  if (slot->count == 0) {
+    return 0;
+  }
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (h->counts[i] != l->counts[i]) {
+      n++;
+    }
+  }
+  slot->buckets = (struct window_bucket *)malloc(n * sizeof(struct window_bucket));
+  if (slot->buckets == NULL) {
+    // Lose the second rather than leave the sums inconsistent
+    memset(slot, 0, sizeof(*slot));
+    return -1;
+  }
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (h->counts[i] != l->counts[i]) {
+      slot->buckets[slot->nbuckets].bucket = i;
+      slot->buckets[slot->nbuckets++].count = h->counts[i] - l->counts[i];
+      top = i;
+    }
+  }
+  if (h->max > l->max) {
+    slot->max = h->max;
+  } else if (top >= 0) {
+    slot->max = hist_bucket_upper(top) - 1 < h->max ? hist_bucket_upper(top) - 1 : h->max;
+  }
+  return 0;
+}
+
+static inline void window_slot_clear(struct window_slot *slot)
+{
+  free(slot->buckets);
+  memset(slot, 0, sizeof(*slot));
+}
+
+// sum += slot (sign 1) or sum -= slot (sign -1), max is not kept
+static inline void window_slot_apply(struct agg_entry *sum, int d, const struct window_slot *slot, int sign)
+{
+  struct hist *h = &sum->latency[d];
+  int i;
+
+  sum->samples[d] += sign * slot->samples;
+  sum->discarded[d] += sign * slot->discarded;
+  sum->expired[d] += sign * slot->expired;
+  h->count += sign * slot->count;
+  h->sum += sign * slot->sum;
+  for (i = 0; i < slot->nbuckets; i++) {
+    h->counts[slot->buckets[i].bucket] += sign * slot->buckets[i].count;
+  }
+}
+
+// Push one second, cur being the key's cumulative entry now
+// Returns 0 on success, nonzero if out of memory
+static inline int window_push(struct window_set *ws, struct window_key *k, const struct agg_entry *cur)
+{
+  struct window_slot *slot;
+  struct window_slot *old;
+  unsigned int s = ws->ticks % WINDOW_SECONDS;
+  unsigned int m = ws->nminutes % (WINDOW_MINUTES - 1);
+  int ret = 0;
+  int v;
+  int d;
+
+  for (d = 0; d < 2; d++) {
+    // The new slot takes the place of the one falling out of the 60 s view
+    for (v = 0; v < WINDOW_10M; v++) {
+      if (ws->ticks >= (uint64_t)window_secs[v]) {
+        old = &k->seconds[(ws->ticks - window_secs[v]) % WINDOW_SECONDS][d];
+        window_slot_apply(&k->sums[v], d, old, -1);
+      }
+    }
+    slot = &k->seconds[s][d];
+    window_slot_clear(slot);
+    if (window_slot_fill(slot, cur, &k->last, d)) {
+      ret = -1;
+    }
+    for (v = 0; v < WINDOW_10M; v++) {
+      window_slot_apply(&k->sums[v], d, slot, 1);
+    }
+    window_slot_apply(&k->partial, d, slot, 1);
+    if (slot->max > k->partial.latency[d].max) {
+      k->partial.latency[d].max = slot->max;
+    }
+
+    if ((ws->ticks + 1) % WINDOW_SECONDS == 0) {
+      // A minute is done: move it to the minute ring
+      slot = &k->minute[m][d];
+      if (ws->nminutes >= WINDOW_MINUTES - 1) {
+        window_slot_apply(&k->minutes, d, slot, -1);
+      }
+      window_slot_clear(slot);
+      if (window_slot_fill(slot, &k->partial, &window_zero, d)) {
+        ret = -1;
+      }
+      window_slot_apply(&k->minutes, d, slot, 1);
+    }
+  }
+  if ((ws->ticks + 1) % WINDOW_SECONDS == 0) {
+    memset(&k->partial, 0, sizeof(k->partial));
+  }
+  if (cur != &k->last) {
+    memcpy(&k->last, cur, sizeof(*cur));
+  }
+  k->tick = ws->ticks + 1;
+  return ret;
+}
+
+// Move every key on by nsecs seconds, the last of which has what the
+// cumulative view v added since the previous tick
+// Returns 0 on success, nonzero if a key was left out for lack of memory
+static inline int window_tick(struct window_set *ws, const struct agg_view *v, unsigned int nsecs)
+{
+  struct window_key *k;
+  int ret = 0;
+  int i;
+
+  pthread_mutex_lock(&ws->lock);
+  if (nsecs > WINDOW_SECONDS * WINDOW_MINUTES) {
+    nsecs = WINDOW_SECONDS * WINDOW_MINUTES;
+  }
+  // Seconds the ticker missed were quiet as far as the views go
+  for (; nsecs > 1; nsecs--, ws->ticks++) {
+    for (i = 0; i < ws->nkeys; i++) {
+      window_push(ws, ws->keys[i], &ws->keys[i]->last);
+    }
+    if ((ws->ticks + 1) % WINDOW_SECONDS == 0) {
+      ws->nminutes++;
+    }
+  }
+  for (i = 0; i < v->nentries; i++) {
+    k = window_key_get(ws, v->entries[i].key, v->entries[i].name);
+    if (k == NULL || window_push(ws, k, &v->entries[i])) {
+      ret = -1;
+    }
+  }
+  // Keys not in the view still have to move on
+  for (i = 0; i < ws->nkeys; i++) {
+    if (ws->keys[i]->tick != ws->ticks + 1) {
+      window_push(ws, ws->keys[i], &ws->keys[i]->last);
+    }
+  }
+  if ((ws->ticks + 1) % WINDOW_SECONDS == 0) {
+    ws->nminutes++;
+  }
+  ws->ticks++;
+  pthread_mutex_unlock(&ws->lock);
+  return ret;
+}
+
+// Reader: copy one view of every key into v
+// Returns 0 on success, nonzero if out of memory
+static inline int window_view_build(struct window_set *ws, enum window_span span, struct agg_view *v)
+{
+  struct window_key *k;
+  struct agg_entry *e;
+  uint64_t max;
+  uint64_t n;
+  int i;
+  int s;
+  int d;
+
+  pthread_mutex_lock(&ws->lock);
+  v->nentries = 0;
+  v->entries = (struct agg_entry *)calloc(ws->nkeys ? ws->nkeys : 1, sizeof(struct agg_entry));
+  if (v->entries == NULL) {
+    pthread_mutex_unlock(&ws->lock);
+    return -1;
+  }
+  for (i = 0; i < ws->nkeys; i++) {
+    k = ws->keys[i];
+    e = &v->entries[v->nentries++];
+    if (span == WINDOW_10M) {
+      memcpy(e, &k->minutes, sizeof(*e));
+      for (d = 0; d < 2; d++) {
+        e->samples[d] += k->partial.samples[d];
+        e->discarded[d] += k->partial.discarded[d];
+        e->expired[d] += k->partial.expired[d];
+        hist_merge(&e->latency[d], &k->partial.latency[d]);
+        for (s = 0; s < WINDOW_MINUTES - 1; s++) {
+          if (k->minute[s][d].max > e->latency[d].max) {
+            e->latency[d].max = k->minute[s][d].max;
+          }
+        }
+      }
+    } else {
+      memcpy(e, &k->sums[span], sizeof(*e));
+      for (d = 0; d < 2; d++) {
+        max = 0;
+        for (n = 1; n <= (uint64_t)window_secs[span] && n <= ws->ticks; n++) {
+          s = (ws->ticks - n) % WINDOW_SECONDS;
+          if (k->seconds[s][d].max > max) {
+            max = k->seconds[s][d].max;
+          }
+        }
+        e->latency[d].max = max;
+      }
+    }
+    e->key = k->last.key;
+    memcpy(e->name, k->last.name, AGG_NAME_SIZE);
+  }
+  pthread_mutex_unlock(&ws->lock);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,483 @@
+//
+// Asynchronous result output
+//
+// Hot threads never write to the terminal or disk themselves. Each one
+// opens a stream: a single-producer ring owned by that thread. Appending a
+// sample copies one fixed-size record into the ring and bumps an index,
+// and a full ring drops the record (counted) rather than blocking.
+//
+// A background writer thread drains all streams in large batches and
+// formats them as:
+//   text    the tools' usual human-readable lines
+//   csv     ts_ns,kind,key,value0_ns,value1_ns,src,sport,dst,dport,flags,sample_every
+//   binary  an 8-byte magic ("LATREC01") followed by raw writer_records
+//   column  compressed blocks of records, see column_common.c
+//
+// Byte streams carry pre-formatted text (e.g. raw trace lines) and are
+// copied out unchanged regardless of format.
+//
+// A record kept while sampling 1 in N (sample_common.h) says so: text
+// lines end in "(1 in N)" and csv has N in sample_every, 1 when every
+// packet was kept.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define WRITER_RING_SIZE (1 << 20) // Bytes per stream, must be a power of two
+#define WRITER_MAX_STREAMS 64
+#define WRITER_FORMAT_BUFFER 0x10000
+#define WRITER_IDLE_NSEC 1000000
+#define WRITER_COLUMN_FLUSH_NSEC 1000000000ULL // Longest a partial column block waits
+#define WRITER_MAGIC "LATREC01"
+#define WRITER_CSV_HEADER "ts_ns,kind,key,value0_ns,value1_ns,src,sport,dst,dport,flags,sample_every\n"
+
+enum writer_format {
+  WRITER_FORMAT_TEXT,
+  WRITER_FORMAT_CSV,
+  WRITER_FORMAT_BINARY,
+  WRITER_FORMAT_COLUMN
+};
+
+enum writer_kind {
+  WRITER_KIND_ECHO, // key: icmp seq, value0: outbound, value1: inbound
+  WRITER_KIND_FLOW, // value0: latency, flags: WRITER_FLAG_INBOUND if dev2 saw it first
+  WRITER_KIND_SEND, // key: path id, value0: latency
+  WRITER_KIND_RECV  // key: path id, value0: latency
+};
+
+#define WRITER_FLAG_INBOUND   1
+#define WRITER_FLAG_DISCARDED (1 << 1)
+#define WRITER_FLAG_USEC      (1 << 2) // values only have microsecond resolution
+
+// One sample, fixed size so it can be copied into a ring in one go
+struct writer_record {
+  uint64_t ts_ns;
+  int64_t value_ns[2];
+  uint32_t kind;
+  uint32_t key;
+  uint32_t addr[2]; // ipv4, network order
+  uint16_t port[2];
+  uint8_t proto;
+  uint8_t flags;
+  uint8_t sample_shift; // kept while sampling 1 in 2^sample_shift
+  uint8_t pad;
+};
+
+#include "column_common.c"
+
+enum writer_stream_type {
+  WRITER_STREAM_RECORDS,
+  WRITER_STREAM_BYTES
+};
+
+struct writer_stream {
+  char ring[WRITER_RING_SIZE];
+  // head is only written by the writer thread, tail only by the producer
+  uint64_t head;
+  uint64_t tail;
+  enum writer_stream_type type;
+  unsigned long long dropped;
+};
+
+struct writer {
+  int fd;
+  enum writer_format format;
+  struct writer_stream *streams[WRITER_MAX_STREAMS];
+  int nstreams;
+  pthread_mutex_t streams_lock;
+  pthread_t thread;
+  volatile int running;
+  struct column_block *column; // only for WRITER_FORMAT_COLUMN
+  char fmt_buf[WRITER_FORMAT_BUFFER];
+};
+
+// Parse a format name, returns -1 if unknown
+int writer_format_parse(const char *name)
+{
+  if (!strcmp(name, "text")) {
+    return WRITER_FORMAT_TEXT;
+  } else if (!strcmp(name, "csv")) {
+    return WRITER_FORMAT_CSV;
+  } else if (!strcmp(name, "binary")) {
+    return WRITER_FORMAT_BINARY;
+  } else if (!strcmp(name, "column")) {
+    return WRITER_FORMAT_COLUMN;
+  }
+  return -1;
+}
+
+// Open a stream for the calling thread. Only that thread may append to it.
+// Returns NULL if there are too many streams or no memory.
+struct writer_stream *writer_stream_open(struct writer *w, enum writer_stream_type type)
+{
+  struct writer_stream *s;
+
+  s = (struct writer_stream *)malloc(sizeof(struct writer_stream));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->head = 0;
+  s->tail = 0;
+  s->type = type;
+  s->dropped = 0;
+
+  pthread_mutex_lock(&w->streams_lock);
+  if (w->nstreams == WRITER_MAX_STREAMS) {
+    pthread_mutex_unlock(&w->streams_lock);
+    free(s);
+    return NULL;
+  }
+  w->streams[w->nstreams] = s;
+  __atomic_store_n(&w->nstreams, w->nstreams + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&w->streams_lock);
+
+  return s;
+}
+
+// Copy bytes into the stream's ring
+// Returns 0 on success, nonzero if the ring is full and the data was dropped
+static inline int writer_append_bytes(struct writer_stream *s, const void *data, size_t len)
+{
+  uint64_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = s->tail;
+  size_t off = tail & (WRITER_RING_SIZE - 1);
+  size_t first;
+
+  if (WRITER_RING_SIZE - (tail - head) < len) {
+    s->dropped++;
+    return -1;
+  }
+
+  first = WRITER_RING_SIZE - off;
+  if (first >= len) {
+    memcpy(s->ring + off, data, len);
+  } else {
+    memcpy(s->ring + off, data, first);
+    memcpy(s->ring, (const char *)data + first, len - first);
+  }
+  __atomic_store_n(&s->tail, tail + len, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static inline int writer_append(struct writer_stream *s, const struct writer_record *rec)
+{
+  return writer_append_bytes(s, rec, sizeof(*rec));
+}
+
+// For producers that would rather wait than lose results, e.g. when
+// reading a recording: append once the writer has made room
+static inline void writer_append_wait(struct writer_stream *s, const struct writer_record *rec)
+{
+  while (WRITER_RING_SIZE - (s->tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) < sizeof(*rec)) {
+    usleep(WRITER_IDLE_NSEC / 1000);
+  }
+  writer_append(s, rec);
+}
+
+// Write all of buf, retrying short writes
+static void writer_write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// Print a nanosecond value as seconds with usec or nsec digits
+static int writer_fmt_secs(char *buf, size_t len, int64_t ns, int usec)
+{
+  if (usec) {
+    return snprintf(buf, len, "%lld.%06lld",
+        (long long)(ns / 1000000000), (long long)(ns % 1000000000) / 1000);
+  }
+  return snprintf(buf, len, "%lld.%09lld",
+      (long long)(ns / 1000000000), (long long)(ns % 1000000000));
+}
+
+// Format one record, returns the number of characters written
+static int writer_format_record(struct writer *w, const struct writer_record *r, char *buf, size_t len)
+{
+  char src[INET_ADDRSTRLEN];
+  char dst[INET_ADDRSTRLEN];
+  char v0[32];
+  char v1[32];
+  static const char *kind_names[] = { "echo", "flow", "send", "recv" };
+  int usec = r->flags & WRITER_FLAG_USEC;
+  int n;
+
+  inet_ntop(AF_INET, &r->addr[0], src, sizeof(src));
+  inet_ntop(AF_INET, &r->addr[1], dst, sizeof(dst));
+
+  if (w->format == WRITER_FORMAT_CSV) {
+    return snprintf(buf, len, "%llu,%s,%u,%lld,%lld,%s,%u,%s,%u,%u,%u\n",
+        (unsigned long long)r->ts_ns, kind_names[r->kind & 3], r->key,
+        (long long)r->value_ns[0], (long long)r->value_ns[1],
+        src, r->port[0], dst, r->port[1], r->flags, 1U << r->sample_shift);
+  }
+
+  writer_fmt_secs(v0, sizeof(v0), r->value_ns[0], usec);
+  writer_fmt_secs(v1, sizeof(v1), r->value_ns[1], usec);
+  switch (r->kind) {
+    case WRITER_KIND_ECHO:
+      n = snprintf(buf, len, "seq: %u, outbound: %s, inbound: %s", r->key, v0, v1);
+      break;
+    case WRITER_KIND_FLOW:
+      n = snprintf(buf, len, "flow: %s %s:%u > %s:%u, %s: %s",
+          r->proto == IPPROTO_TCP ? "tcp" : "udp",
+          src, r->port[0], dst, r->port[1],
+          r->flags & WRITER_FLAG_INBOUND ? "inbound" : "outbound", v0);
+      break;
+    case WRITER_KIND_SEND:
+      n = snprintf(buf, len, "%s: %s",
+          r->flags & WRITER_FLAG_DISCARDED ? "discarded send" : "send latency", v0);
+      break;
+    case WRITER_KIND_RECV:
+      n = snprintf(buf, len, "%s: %s",
+          r->flags & WRITER_FLAG_DISCARDED ? "discarded recv" : "recv latency", v0);
+      break;
+    default:
+      return 0;
+  }
+  if (n < 0 || (size_t)n >= len) {
+    return n;
+  }
+  if (r->sample_shift) {
+    return n + snprintf(buf + n, len - n, " (1 in %u)\n", 1U << r->sample_shift);
+  }
+  return n + snprintf(buf + n, len - n, "\n");
+}
+
+static uint64_t writer_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Write out the column block being filled, if it has anything
+static void writer_column_flush(struct writer *w)
+{
+  size_t len;
+
+  if (w->column->n > 0) {
+    len = column_block_encode(w->column);
+    writer_write_all(w->fd, (const char *)w->column->buf, len);
+  }
+}
+
+static void writer_column_add(struct writer *w, const struct writer_record *rec)
+{
+  if (w->column->n == 0) {
+    w->column->started_ns = writer_now_ns();
+  }
+  w->column->recs[w->column->n++] = *rec;
+  if (w->column->n == COLUMN_BLOCK_RECORDS) {
+    writer_column_flush(w);
+  }
+}
+
+// Move everything currently in one stream to the output
+// Returns the number of bytes consumed
+static size_t writer_drain(struct writer *w, struct writer_stream *s)
+{
+  uint64_t head = s->head;
+  uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+  struct writer_record rec;
+  struct iovec iov[2];
+  size_t off;
+  size_t len;
+  size_t used = 0;
+  size_t first;
+  int niov;
+
+  if (s->type == WRITER_STREAM_RECORDS) {
+    // Only ever consume whole records
+    tail -= (tail - head) % sizeof(rec);
+  }
+  len = tail - head;
+  if (len == 0) {
+    return 0;
+  }
+  off = head & (WRITER_RING_SIZE - 1);
+
+  if (s->type == WRITER_STREAM_BYTES || w->format == WRITER_FORMAT_BINARY) {
+    // Straight copy out of the ring, at most two pieces
+    iov[0].iov_base = s->ring + off;
+    iov[0].iov_len = len;
+    niov = 1;
+    if (off + len > WRITER_RING_SIZE) {
+      iov[0].iov_len = WRITER_RING_SIZE - off;
+      iov[1].iov_base = s->ring;
+      iov[1].iov_len = len - iov[0].iov_len;
+      niov = 2;
+    }
+    if (writev(w->fd, iov, niov) < (ssize_t)len) {
+      // Short write, finish it the slow way
+      writer_write_all(w->fd, s->ring + off, iov[0].iov_len);
+      if (niov == 2) {
+        writer_write_all(w->fd, s->ring, iov[1].iov_len);
+      }
+    }
+  } else {
+    while (head < tail) {
+      off = head & (WRITER_RING_SIZE - 1);
+      first = WRITER_RING_SIZE - off;
+      if (first >= sizeof(rec)) {
+        memcpy(&rec, s->ring + off, sizeof(rec));
+      } else {
+        memcpy(&rec, s->ring + off, first);
+        memcpy((char *)&rec + first, s->ring, sizeof(rec) - first);
+      }
+      head += sizeof(rec);
+      if (w->format == WRITER_FORMAT_COLUMN) {
+        writer_column_add(w, &rec);
+        continue;
+      }
+      if (used + 256 > sizeof(w->fmt_buf)) {
+        writer_write_all(w->fd, w->fmt_buf, used);
+        used = 0;
+      }
+      used += writer_format_record(w, &rec, w->fmt_buf + used, sizeof(w->fmt_buf) - used);
+    }
+    writer_write_all(w->fd, w->fmt_buf, used);
+  }
+
+  __atomic_store_n(&s->head, tail, __ATOMIC_RELEASE);
+  return len;
+}
+
+static void *writer_thread(void *arg)
+{
+  struct writer *w = (struct writer *)arg;
+  struct timespec idle = { 0, WRITER_IDLE_NSEC };
+  size_t moved;
+  int n;
+  int i;
+
+  while (w->running) {
+    moved = 0;
+    n = __atomic_load_n(&w->nstreams, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+      moved += writer_drain(w, w->streams[i]);
+    }
+    // A slow trickle of records still shows up in the file every second
+    if (w->column != NULL && w->column->n > 0 &&
+        writer_now_ns() - w->column->started_ns >= WRITER_COLUMN_FLUSH_NSEC) {
+      writer_column_flush(w);
+    }
+    // Let output pile up into bigger batches when things are quiet
+    if (moved < WRITER_FORMAT_BUFFER) {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  // Final drain once producers have stopped
+  n = __atomic_load_n(&w->nstreams, __ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++) {
+    writer_drain(w, w->streams[i]);
+  }
+  if (w->column != NULL) {
+    writer_column_flush(w);
+  }
+  return NULL;
+}
+
+// Start the writer thread on fd
+// Returns 0 on success, nonzero on error
+int writer_start(struct writer *w, int fd, enum writer_format format)
+{
+  w->fd = fd;
+  w->format = format;
+  w->nstreams = 0;
+  w->running = 1;
+  w->column = NULL;
+  pthread_mutex_init(&w->streams_lock, NULL);
+
+  // Anything already printed with stdio has to land before our output
+  fflush(stdout);
+
+  if (format == WRITER_FORMAT_BINARY) {
+    writer_write_all(fd, WRITER_MAGIC, 8);
+  } else if (format == WRITER_FORMAT_COLUMN) {
+    w->column = (struct column_block *)calloc(1, sizeof(struct column_block));
+    if (w->column == NULL) {
+      fprintf(stderr, "Failed to allocate column block\n");
+      return -1;
+    }
+    writer_write_all(fd, COLUMN_MAGIC, 8);
+  } else if (format == WRITER_FORMAT_CSV) {
+    writer_write_all(fd, WRITER_CSV_HEADER, strlen(WRITER_CSV_HEADER));
+  }
+
+  if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+    fprintf(stderr, "Failed to start writer thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Total dropped so far, safe to call from any thread while producers run
+unsigned long long writer_dropped(struct writer *w)
+{
+  unsigned long long dropped = 0;
+  int i;
+
+  pthread_mutex_lock(&w->streams_lock);
+  for (i = 0; i < w->nstreams; i++) {
+    dropped += __atomic_load_n(&w->streams[i]->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&w->streams_lock);
+  return dropped;
+}
+
+// Bytes waiting in all streams for the writer thread, safe to call from
+// any thread while producers run
+unsigned long long writer_queued(struct writer *w)
+{
+  unsigned long long queued = 0;
+  uint64_t head;
+  int i;
+
+  pthread_mutex_lock(&w->streams_lock);
+  for (i = 0; i < w->nstreams; i++) {
+    // head first: it never passes the tail read after it
+    head = __atomic_load_n(&w->streams[i]->head, __ATOMIC_ACQUIRE);
+    queued += __atomic_load_n(&w->streams[i]->tail, __ATOMIC_ACQUIRE) - head;
+  }
+  pthread_mutex_unlock(&w->streams_lock);
+  return queued;
+}
+
+// Drain everything and stop the writer thread. Producers must be stopped first.
+// Returns the number of records or bytes dropped because a ring was full.
+unsigned long long writer_stop(struct writer *w)
+{
+  unsigned long long dropped = 0;
+  int i;
+
+  w->running = 0;
+  pthread_join(w->thread, NULL);
+
+  for (i = 0; i < w->nstreams; i++) {
+    dropped += w->streams[i]->dropped;
+    free(w->streams[i]);
+  }
+  w->nstreams = 0;
+  free(w->column);
+  w->column = NULL;
+  return dropped;
+}